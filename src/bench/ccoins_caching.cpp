@@ -5,6 +5,7 @@
 #include <bench/bench.h>
 #include <coins.h>
 #include <policy/policy.h>
+#include <random.h>
 #include <script/signingprovider.h>
 #include <test/util/transaction_utils.h>
 
@@ -50,3 +51,84 @@ static void CCoinsCaching(benchmark::State& state)
 }
 
 BENCHMARK(CCoinsCaching, 170 * 1000);
+
+/* Outpoints for the cache benchmarks below; hash lookups dominate, so the script contents do not matter. */
+static std::vector<COutPoint> RandomOutpoints(FastRandomContext& rng, size_t count)
+{
+    std::vector<COutPoint> outpoints;
+    outpoints.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        outpoints.emplace_back(rng.rand256(), rng.randrange(4));
+    }
+    return outpoints;
+}
+
+static Coin BenchCoin(FastRandomContext& rng)
+{
+    Coin coin;
+    coin.out.nValue = rng.randrange(50 * COIN);
+    coin.out.scriptPubKey = CScript() << OP_0 << std::vector<unsigned char>(20, 0x42);
+    coin.nHeight = 1;
+    return coin;
+}
+
+// The life of a cache layer during block connection: outputs are added,
+// looked up (including misses on absent outpoints), half of them are spent,
+// and the layer is flushed into its parent.
+static void CCoinsCacheAddFetchSpendFlush(benchmark::State& state)
+{
+    static const size_t COINS = 20000;
+    FastRandomContext rng(true);
+    const std::vector<COutPoint> outpoints = RandomOutpoints(rng, COINS);
+    const std::vector<COutPoint> absent = RandomOutpoints(rng, COINS);
+    const Coin coin = BenchCoin(rng);
+
+    CCoinsView dummy;
+    while (state.KeepRunning()) {
+        CCoinsViewCache base(&dummy);
+        CCoinsViewCache cache(&base);
+        for (const COutPoint& outpoint : outpoints) {
+            cache.AddCoin(outpoint, Coin(coin), false);
+        }
+        for (const COutPoint& outpoint : outpoints) {
+            assert(!cache.AccessCoin(outpoint).IsSpent());
+        }
+        for (const COutPoint& outpoint : absent) {
+            assert(!cache.HaveCoinInCache(outpoint));
+        }
+        for (size_t i = 0; i < COINS; i += 2) {
+            cache.SpendCoin(outpoints[i]);
+        }
+        bool flushed = cache.Flush();
+        assert(flushed);
+        assert(base.GetCacheSize() == COINS / 2);
+    }
+}
+
+// Lookups in a large, warm cache, as for the inputs of a block when the
+// dbcache holds most of the UTXO set.
+static void CCoinsCacheLookupLarge(benchmark::State& state)
+{
+    static const size_t COINS = 500000;
+    static const size_t LOOKUPS = 2000;
+    FastRandomContext rng(true);
+    const std::vector<COutPoint> outpoints = RandomOutpoints(rng, COINS);
+    const Coin coin = BenchCoin(rng);
+
+    CCoinsView dummy;
+    CCoinsViewCache cache(&dummy);
+    for (const COutPoint& outpoint : outpoints) {
+        cache.AddCoin(outpoint, Coin(coin), false);
+    }
+
+    size_t pos = 0;
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < LOOKUPS; ++i) {
+            assert(cache.HaveCoinInCache(outpoints[pos]));
+            pos = (pos + 7919) % COINS;
+        }
+    }
+}
+
+BENCHMARK(CCoinsCacheAddFetchSpendFlush, 75);
+BENCHMARK(CCoinsCacheLookupLarge, 1000);
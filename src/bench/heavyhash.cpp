@@ -0,0 +1,265 @@
+// Copyright (c) 2020-2021 The PoWx Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <bench/data.h>
+
+#include <chain.h>
+#include <chainparams.h>
+#include <consensus/validation.h>
+#include <crypto/heavyhash.h>
+#include <crypto/sha3.h>
+#include <hash.h>
+#include <pow.h>
+#include <primitives/block.h>
+#include <random.h>
+#include <streams.h>
+#include <uint256.h>
+#include <util/matrixchecks.h>
+#include <validation.h>
+
+#include <vector>
+
+/* Each iteration of the batch benchmarks hashes 2000 headers; batch sizes vary how they are grouped. */
+static const size_t HEADERS_PER_ITERATION = 2000;
+
+static std::vector<CBlockHeader> SiblingHeaders(size_t count)
+{
+    FastRandomContext rng(true);
+    CBlockHeader header;
+    header.nVersion = 4;
+    header.hashPrevBlock = rng.rand256();
+    header.hashMerkleRoot = rng.rand256();
+    header.nTime = 1600000000;
+    header.nBits = 0x1d00ffff;
+    std::vector<CBlockHeader> headers(count, header);
+    for (size_t i = 0; i < count; ++i) {
+        headers[i].nNonce = i;
+    }
+    return headers;
+}
+
+/** A chain of headers on top of genesis that satisfies regtest's proof of work and contextual checks. */
+static std::vector<CBlockHeader> RegtestHeaderChain(size_t count)
+{
+    const CBlock& genesis = Params().GenesisBlock();
+    FastRandomContext rng(true);
+    std::vector<CBlockHeader> headers;
+    uint256 prev = genesis.GetHash();
+    for (size_t i = 0; i < count; ++i) {
+        CBlockHeader header;
+        header.nVersion = 4;
+        header.hashPrevBlock = prev;
+        header.hashMerkleRoot = rng.rand256();
+        header.nTime = genesis.nTime + i + 1;
+        header.nBits = genesis.nBits;
+        while (!CheckProofOfWork(header.GetPoWHash(), header.nBits, Params().GetConsensus())) {
+            ++header.nNonce;
+        }
+        prev = header.GetHash();
+        headers.push_back(header);
+    }
+    return headers;
+}
+
+static void SHA3_256(benchmark::State& state)
+{
+    uint8_t hash[CSHA3_256::OUTPUT_SIZE];
+    std::vector<uint8_t> in(1000 * 1000, 0);
+    while (state.KeepRunning())
+        CSHA3_256().Write(in.data(), in.size()).Finalize(hash);
+}
+
+static void SHA3_256_32b(benchmark::State& state)
+{
+    std::vector<uint8_t> in(32, 0);
+    while (state.KeepRunning()) {
+        CSHA3_256()
+            .Write(in.data(), in.size())
+            .Finalize(in.data());
+    }
+}
+
+static void SHA3_256_80_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(80 * 1024, 0);
+    std::vector<uint8_t> out(32 * 1024);
+    while (state.KeepRunning()) {
+        SHA3_256_80(out.data(), in.data(), 1024);
+    }
+}
+
+static void HeavyHashGenerateMatrix(benchmark::State& state)
+{
+    FastRandomContext rng(true);
+    HeavyHashMatrix matrix;
+    while (state.KeepRunning()) {
+        GenerateHeavyHashMatrix(rng.rand256(), matrix);
+    }
+}
+
+static void HeavyHashIsFullRank(benchmark::State& state)
+{
+    HeavyHashMatrix matrix;
+    GenerateHeavyHashMatrix(UINT256_ONE(), matrix);
+    while (state.KeepRunning()) {
+        bool full_rank = heavyhash::checks::IsFullRank(matrix);
+        assert(full_rank);
+    }
+}
+
+static void HeavyHashMultiplyReference(benchmark::State& state)
+{
+    HeavyHashMatrix matrix;
+    GenerateHeavyHashMatrix(UINT256_ONE(), matrix);
+    std::vector<uint64_t> unpacked(64 * 64);
+    matrix.Unpack(unpacked.data());
+    uint256 hash = UINT256_ONE();
+    while (state.KeepRunning()) {
+        hash = MultiplyUsing4bitPrecision(unpacked.data(), hash);
+    }
+}
+
+static void HeavyHashMultiply(benchmark::State& state)
+{
+    HeavyHashMatrix matrix;
+    GenerateHeavyHashMatrix(UINT256_ONE(), matrix);
+    uint256 hash = UINT256_ONE();
+    while (state.KeepRunning()) {
+        hash = MultiplyUsing4bitPrecision(matrix, hash);
+    }
+}
+
+/* Repeated hashing of one header: the matrix comes from the cache. */
+static void HeavyHashPoWCached(benchmark::State& state)
+{
+    CBlockHeader header = SiblingHeaders(1)[0];
+    while (state.KeepRunning()) {
+        ++header.nNonce;
+        header.GetPoWHash();
+    }
+}
+
+/* Headers per second along a chain, where every header needs a new matrix. */
+static void HeavyHashPoWChain(benchmark::State& state)
+{
+    const std::vector<CBlockHeader> headers = RegtestHeaderChain(100);
+    while (state.KeepRunning()) {
+        for (const CBlockHeader& header : headers) {
+            header.GetPoWHash();
+        }
+    }
+}
+
+static void HeavyHashBatchSize(benchmark::State& state, size_t batch_size)
+{
+    const std::vector<CBlockHeader> headers = SiblingHeaders(HEADERS_PER_ITERATION);
+    const auto matrix = headers[0].GetPoWMatrix();
+    std::vector<uint256> hashes(HEADERS_PER_ITERATION);
+    while (state.KeepRunning()) {
+        for (size_t start = 0; start < HEADERS_PER_ITERATION; start += batch_size) {
+            HeavyHashBatch(*matrix, Span<const CBlockHeader>(headers.data() + start, batch_size), Span<uint256>(hashes.data() + start, batch_size));
+        }
+    }
+}
+
+static void HeavyHashSerial(benchmark::State& state)
+{
+    const std::vector<CBlockHeader> headers = SiblingHeaders(HEADERS_PER_ITERATION);
+    std::vector<uint256> hashes(HEADERS_PER_ITERATION);
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < HEADERS_PER_ITERATION; ++i) {
+            hashes[i] = headers[i].GetPoWHash();
+        }
+    }
+}
+
+static void HeavyHashBatch_1(benchmark::State& state) { HeavyHashBatchSize(state, 1); }
+static void HeavyHashBatch_4(benchmark::State& state) { HeavyHashBatchSize(state, 4); }
+static void HeavyHashBatch_16(benchmark::State& state) { HeavyHashBatchSize(state, 16); }
+static void HeavyHashBatch_250(benchmark::State& state) { HeavyHashBatchSize(state, 250); }
+static void HeavyHashBatch_2000(benchmark::State& state) { HeavyHashBatchSize(state, 2000); }
+
+/* A headers message through ProcessNewBlockHeaders. The first iteration connects the
+ * headers, later ones take the duplicate path, which still hashes every header. */
+static void HeavyHashProcessHeaders(benchmark::State& state)
+{
+    const std::vector<CBlockHeader> headers = RegtestHeaderChain(200);
+    while (state.KeepRunning()) {
+        BlockValidationState validation_state;
+        bool processed = ProcessNewBlockHeaders(headers, validation_state, Params());
+        assert(processed);
+    }
+}
+
+/** Writes block413567 to its own block file, adjusted so it passes regtest's proof of work
+ *  and matches an index entry without a parent. */
+static CBlock WriteBenchBlock(FlatFilePos& pos)
+{
+    CDataStream stream(benchmark::data::block413567, SER_NETWORK, PROTOCOL_VERSION);
+    CBlock block;
+    stream >> block;
+    block.hashPrevBlock.SetNull();
+    block.nBits = Params().GenesisBlock().nBits;
+    while (!CheckProofOfWork(block.GetPoWHash(), block.nBits, Params().GetConsensus())) {
+        ++block.nNonce;
+    }
+
+    pos = FlatFilePos(1000, 0);
+    CAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
+    assert(!fileout.IsNull());
+    fileout << block;
+    return block;
+}
+
+/* Blocks per second read through the index, which compares the header instead of rehashing it. */
+static void HeavyHashReadBlockFromDisk(benchmark::State& state)
+{
+    FlatFilePos pos;
+    const CBlock written = WriteBenchBlock(pos);
+    const uint256 hash = written.GetHash();
+    CBlockIndex index(written);
+    index.phashBlock = &hash;
+    index.nFile = pos.nFile;
+    index.nDataPos = pos.nPos;
+    index.nStatus = BLOCK_HAVE_DATA;
+
+    while (state.KeepRunning()) {
+        CBlock block;
+        bool read = ReadBlockFromDisk(block, &index, Params().GetConsensus());
+        assert(read);
+    }
+}
+
+/* Blocks per second read by position, which checks the proof of work of every block. */
+static void HeavyHashReadBlockFromDiskPos(benchmark::State& state)
+{
+    FlatFilePos pos;
+    WriteBenchBlock(pos);
+
+    while (state.KeepRunning()) {
+        CBlock block;
+        bool read = ReadBlockFromDisk(block, pos, Params().GetConsensus());
+        assert(read);
+    }
+}
+
+BENCHMARK(SHA3_256, 320);
+BENCHMARK(SHA3_256_32b, 2400 * 1000);
+BENCHMARK(SHA3_256_80_1024, 5200);
+BENCHMARK(HeavyHashGenerateMatrix, 8500);
+BENCHMARK(HeavyHashIsFullRank, 7000);
+BENCHMARK(HeavyHashMultiplyReference, 130 * 1000);
+BENCHMARK(HeavyHashMultiply, 4000 * 1000);
+BENCHMARK(HeavyHashPoWCached, 600 * 1000);
+BENCHMARK(HeavyHashPoWChain, 85);
+BENCHMARK(HeavyHashSerial, 40);
+BENCHMARK(HeavyHashBatch_1, 60);
+BENCHMARK(HeavyHashBatch_4, 80);
+BENCHMARK(HeavyHashBatch_16, 80);
+BENCHMARK(HeavyHashBatch_250, 80);
+BENCHMARK(HeavyHashBatch_2000, 80);
+BENCHMARK(HeavyHashProcessHeaders, 35);
+BENCHMARK(HeavyHashReadBlockFromDisk, 210);
+BENCHMARK(HeavyHashReadBlockFromDiskPos, 220);
@@ -127,6 +127,10 @@ enum BlockStatus: uint32_t {
     BLOCK_FAILED_MASK        =   BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 
     BLOCK_OPT_WITNESS       =   128, //!< block data in blk*.data was received with a witness-enforcing client
+
+    //! Validity and nTx were taken from a UTXO snapshot (see loadtxoutset); the
+    //! block data was never downloaded, so it cannot be served or disconnected.
+    BLOCK_ASSUMED_VALID     =   256,
 };
 
 /** The block chain is a tree shaped structure starting with the
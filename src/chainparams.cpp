@@ -134,6 +134,9 @@ public:
             }
         };
         chainTxData = {};
+
+        // Snapshots are trusted only once their hash has been reviewed here.
+        m_assumeutxo_data = MapAssumeutxo{};
     }
 };
 
@@ -225,6 +228,8 @@ public:
         };
 
         chainTxData = ChainTxData{};
+
+        m_assumeutxo_data = MapAssumeutxo{};
     }
 };
 
@@ -303,6 +308,8 @@ public:
 
         chainTxData = {};
 
+        UpdateAssumeutxoParametersFromArgs(args);
+
         base58Prefixes[PUBKEY_ADDRESS] = std::vector<unsigned char>(1,111);
         base58Prefixes[SCRIPT_ADDRESS] = std::vector<unsigned char>(1,196);
         base58Prefixes[SECRET_KEY] =     std::vector<unsigned char>(1,239);
@@ -321,6 +328,7 @@ public:
         consensus.vDeployments[d].nTimeout = nTimeout;
     }
     void UpdateActivationParametersFromArgs(const ArgsManager& args);
+    void UpdateAssumeutxoParametersFromArgs(const ArgsManager& args);
 };
 
 void CRegTestParams::UpdateActivationParametersFromArgs(const ArgsManager& args)
@@ -366,6 +374,30 @@ void CRegTestParams::UpdateActivationParametersFromArgs(const ArgsManager& args)
     }
 }
 
+void CRegTestParams::UpdateAssumeutxoParametersFromArgs(const ArgsManager& args)
+{
+    for (const std::string& strSnapshot : args.GetArgs("-assumeutxo")) {
+        std::vector<std::string> vSnapshotParams;
+        boost::split(vSnapshotParams, strSnapshot, boost::is_any_of(":"));
+        if (vSnapshotParams.size() != 3) {
+            throw std::runtime_error("Assumeutxo parameters malformed, expecting height:hash:nchaintx");
+        }
+        int32_t height;
+        uint32_t nChainTx;
+        if (!ParseInt32(vSnapshotParams[0], &height) || height <= 0) {
+            throw std::runtime_error(strprintf("Invalid snapshot height (%s)", vSnapshotParams[0]));
+        }
+        if (!IsHex(vSnapshotParams[1]) || vSnapshotParams[1].size() != 64) {
+            throw std::runtime_error(strprintf("Invalid snapshot hash (%s)", vSnapshotParams[1]));
+        }
+        if (!ParseUInt32(vSnapshotParams[2], &nChainTx) || nChainTx == 0) {
+            throw std::runtime_error(strprintf("Invalid snapshot nChainTx (%s)", vSnapshotParams[2]));
+        }
+        m_assumeutxo_data[height] = AssumeutxoData{uint256S(vSnapshotParams[1]), nChainTx};
+        LogPrintf("Setting assumeutxo parameters for height %d to hash=%s, nChainTx=%u\n", height, vSnapshotParams[1], nChainTx);
+    }
+}
+
 static std::unique_ptr<const CChainParams> globalChainParams;
 
 const CChainParams &Params() {
@@ -11,6 +11,7 @@
 #include <primitives/block.h>
 #include <protocol.h>
 
+#include <map>
 #include <memory>
 #include <vector>
 
@@ -25,6 +26,21 @@ struct CCheckpointData {
     MapCheckpoints mapCheckpoints;
 };
 
+/**
+ * Holds configuration for use during UTXO snapshot load. The contents here are
+ * security critical, since they dictate which UTXO snapshots are recognized as
+ * valid.
+ */
+struct AssumeutxoData {
+    //! The expected hash of the deserialized UTXO set (see CCoinsStats::hashSerialized).
+    uint256 hash_serialized;
+
+    //! Used to populate the nChainTx value of the snapshot base block.
+    unsigned int nChainTx;
+};
+
+typedef std::map<int, AssumeutxoData> MapAssumeutxo;
+
 /**
  * Holds various statistics on transactions within a chain. Used to estimate
  * verification progress during chain sync.
@@ -86,6 +102,12 @@ public:
     const std::vector<SeedSpec6>& FixedSeeds() const { return vFixedSeeds; }
     const CCheckpointData& Checkpoints() const { return checkpointData; }
     const ChainTxData& TxData() const { return chainTxData; }
+    /** Return the UTXO snapshot data trusted at \p height, or nullptr if there is none. */
+    const AssumeutxoData* AssumeutxoForHeight(int height) const
+    {
+        const auto it = m_assumeutxo_data.find(height);
+        return it == m_assumeutxo_data.end() ? nullptr : &it->second;
+    }
 protected:
     CChainParams() {}
 
@@ -107,6 +129,7 @@ protected:
     bool m_is_mockable_chain;
     CCheckpointData checkpointData;
     ChainTxData chainTxData;
+    MapAssumeutxo m_assumeutxo_data;
 };
 
 /**
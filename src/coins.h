@@ -10,6 +10,7 @@
 #include <compressor.h>
 #include <core_memusage.h>
 #include <crypto/siphash.h>
+#include <flatmap.h>
 #include <memusage.h>
 #include <serialize.h>
 #include <uint256.h>
@@ -18,7 +19,6 @@
 #include <stdint.h>
 
 #include <functional>
-#include <unordered_map>
 
 /**
  * A UTXO entry.
@@ -85,24 +85,17 @@ public:
 class SaltedOutpointHasher
 {
 private:
-    /** Salt */
-    const uint64_t k0, k1;
+    /** Salt. Not const, so that maps using the hasher can be swapped. */
+    uint64_t k0, k1;
 
 public:
     SaltedOutpointHasher();
 
     /**
-     * This *must* return size_t. With Boost 1.46 on 32-bit systems the
-     * unordered_map will behave unpredictably if the custom hasher returns a
-     * uint64_t, resulting in failures when syncing the chain (#4634).
-     *
-     * Having the hash noexcept allows libstdc++'s unordered_map to recalculate
-     * the hash during rehash, so it does not have to cache the value. This
-     * reduces node's memory by sizeof(size_t). The required recalculation has
-     * a slight performance penalty (around 1.6%), but this is compensated by
-     * memory savings of about 9% which allow for a larger dbcache setting.
-     *
-     * @see https://gcc.gnu.org/onlinedocs/gcc-9.2.0/libstdc++/manual/manual/unordered_associative.html
+     * CCoinsMap does not store the hash of its elements: it recalculates
+     * it for every element when the table is rehashed, and uses the low 7
+     * bits as the element's control byte. SipHash output is uniform in all
+     * bits, so no further mixing is needed.
      */
     size_t operator()(const COutPoint& id) const noexcept {
         return SipHashUint256Extra(k0, k1, id.hash, id.n);
@@ -128,7 +121,7 @@ struct CCoinsCacheEntry
     explicit CCoinsCacheEntry(Coin&& coin_) : coin(std::move(coin_)), flags(0) {}
 };
 
-typedef std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> CCoinsMap;
+typedef flatmap<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> CCoinsMap;
 
 /** Cursor for iterating over CoinsView state */
 class CCoinsViewCursor
@@ -173,7 +166,9 @@ public:
     virtual std::vector<uint256> GetHeadBlocks() const;
 
     //! Do a bulk modification (multiple Coin changes + BestBlock change).
-    //! The passed mapCoins can be modified.
+    //! The passed mapCoins can be modified: coins may be moved out of it, but
+    //! entries are left in place for the caller to clear, which releases the
+    //! map's node pool and table at once rather than entry by entry.
     virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
 
     //! Get a cursor to iterate over the whole state
@@ -277,6 +272,20 @@ public:
      */
     bool Flush();
 
+    /**
+     * Move all entries of the cache into \p entries, which must be empty.
+     * The cache is left empty as after Flush(), but nothing is written to
+     * the base view.
+     */
+    void MoveEntries(CCoinsMap& entries);
+
+    /**
+     * Add a coin that was read from the base view without going through
+     * this cache, exactly as a lookup here would have added it. Nothing is
+     * done if the outpoint is already cached.
+     */
+    void CacheCoin(const COutPoint &outpoint, Coin&& coin);
+
     /**
      * Removes the UTXO with the given outpoint from the cache, if it is
      * not modified.
@@ -308,6 +317,9 @@ private:
      * memory usage.
      */
     CCoinsMap::iterator FetchCoin(const COutPoint &outpoint) const;
+
+    /** Insert a coin just read from the base view, which must not be cached yet. */
+    CCoinsMap::iterator InsertFetched(const COutPoint &outpoint, Coin&& coin) const;
 };
 
 //! Utility function to add all of a transaction's outputs to a cache.
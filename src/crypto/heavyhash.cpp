@@ -1,34 +1,149 @@
 #include <crypto/heavyhash.h>
-#include <crypto/tiny_sha3/sha3.h>
+#include <crypto/common.h>
+#include <crypto/xoshiro256pp.h>
 
+#include <assert.h>
+#include <string.h>
 #include <random>
 #include <stdexcept>
 
 #include <vector>
 
-CSHA3_256::CSHA3_256() {
-    sha3_init(&context, OUTPUT_SIZE);
+#include <compat/cpuid.h>
+
+namespace heavyhash_sse41
+{
+void MultiplyMatrixVector(const uint8_t* packed, const unsigned char* vector, uint32_t* product);
 }
 
-CSHA3_256& CSHA3_256::Write(const unsigned char* data, size_t len) {
-    sha3_update(&context, data, len);
-    return *this;
+namespace heavyhash_avx2
+{
+void MultiplyMatrixVector(const uint8_t* packed, const unsigned char* vector, uint32_t* product);
 }
 
-void CSHA3_256::Finalize(unsigned char hash[OUTPUT_SIZE]) {
-    sha3_final(hash, &context);
+namespace {
+
+/** Portable kernel on the packed layout; also the fallback when no SIMD kernel is usable. */
+void MultiplyMatrixVectorScalar(const uint8_t* packed, const unsigned char* vector, uint32_t* product)
+{
+    for (int i = 0; i < 64; ++i) {
+        uint32_t sum = 0;
+        for (int k = 0; k < 32; ++k) {
+            const uint8_t m = packed[32*i + k];
+            const uint8_t v = vector[k];
+            sum += (m >> 4) * (v >> 4) + (m & 0xF) * (v & 0xF);
+        }
+        product[i] = sum;
+    }
 }
 
-CSHA3_256& CSHA3_256::Reset() {
-    *this = CSHA3_256();
-    return *this;
+typedef void (*MatrixVectorFn)(const uint8_t* packed, const unsigned char* vector, uint32_t* product);
+MatrixVectorFn MultiplyMatrixVector = MultiplyMatrixVectorScalar;
+
+bool SelfTest()
+{
+    // Compare the selected kernel against the uint64_t reference on pseudorandom inputs,
+    // including the all-0xF extremes that produce the largest dot products.
+    uint256 seed;
+    *seed.begin() = 1;
+    XoShiRo256PlusPlus generator(seed);
+    uint64_t matrix[64*64];
+    for (int round = 0; round < 8; ++round) {
+        for (int i = 0; i < 64*64; ++i) {
+            matrix[i] = round == 0 ? 0xF : generator() & 0xF;
+        }
+        uint256 hash;
+        for (auto& byte : hash) {
+            byte = round == 0 ? 0xFF : generator();
+        }
+        if (MultiplyUsing4bitPrecision(HeavyHashMatrix(matrix), hash) != MultiplyUsing4bitPrecision(matrix, hash)) return false;
+    }
+    return true;
+}
+
+#if defined(USE_ASM) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+/** Check whether the OS has enabled AVX registers. */
+bool AVXEnabled()
+{
+    uint32_t a, d;
+    __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return (a & 6) == 6;
+}
+#endif
+} // namespace
+
+std::string HeavyHashAutoDetect()
+{
+    std::string ret = "standard";
+#if defined(USE_ASM) && defined(HAVE_GETCPUID)
+    bool have_sse41 = false;
+    bool have_xsave = false;
+    bool have_avx = false;
+    bool have_avx2 = false;
+    bool enabled_avx = false;
+
+    (void)AVXEnabled;
+    (void)have_sse41;
+    (void)have_avx;
+    (void)have_xsave;
+    (void)have_avx2;
+    (void)enabled_avx;
+
+    uint32_t eax, ebx, ecx, edx;
+    GetCPUID(1, 0, eax, ebx, ecx, edx);
+    have_sse41 = (ecx >> 19) & 1;
+    have_xsave = (ecx >> 27) & 1;
+    have_avx = (ecx >> 28) & 1;
+    if (have_xsave && have_avx) {
+        enabled_avx = AVXEnabled();
+    }
+    if (have_sse41) {
+        GetCPUID(7, 0, eax, ebx, ecx, edx);
+        have_avx2 = (ebx >> 5) & 1;
+    }
+
+#if defined(ENABLE_SSE41) && !defined(BUILD_BITCOIN_INTERNAL)
+    if (have_sse41) {
+        MultiplyMatrixVector = heavyhash_sse41::MultiplyMatrixVector;
+        ret = "sse41";
+    }
+#endif
+
+#if defined(ENABLE_AVX2) && !defined(BUILD_BITCOIN_INTERNAL)
+    if (have_avx2 && have_avx && enabled_avx) {
+        MultiplyMatrixVector = heavyhash_avx2::MultiplyMatrixVector;
+        ret = "avx2";
+    }
+#endif
+#endif
+
+    assert(SelfTest());
+    return ret;
+}
+
+HeavyHashMatrix::HeavyHashMatrix() {
+    memset(packed, 0, sizeof(packed));
+}
+
+HeavyHashMatrix::HeavyHashMatrix(const uint64_t matrix_[64*64]) {
+    for (size_t i = 0; i < PACKED_SIZE; ++i) {
+        packed[i] = (matrix_[2*i] << 4) | matrix_[2*i + 1];
+    }
+}
+
+void HeavyHashMatrix::Unpack(uint64_t matrix_[64*64]) const {
+    for (size_t i = 0; i < PACKED_SIZE; ++i) {
+        matrix_[2*i] = packed[i] >> 4;
+        matrix_[2*i + 1] = packed[i] & 0xF;
+    }
 }
 
-CHeavyHash::CHeavyHash(uint64_t matrix_[64*64]) {
-    for (int i = 0; i < 64*64; ++i)
-        matrix[i] = matrix_[i];
+bool operator==(const HeavyHashMatrix& a, const HeavyHashMatrix& b) {
+    return memcmp(a.packed, b.packed, HeavyHashMatrix::PACKED_SIZE) == 0;
 }
 
+CHeavyHash::CHeavyHash(const HeavyHashMatrix& matrix_) : matrix(&matrix_) {}
+
 CHeavyHash& CHeavyHash::Write(const unsigned char* data, size_t len) {
     hasher.Write(data, len);
     return *this;
@@ -37,7 +152,7 @@ CHeavyHash& CHeavyHash::Write(const unsigned char* data, size_t len) {
 void CHeavyHash::Finalize(unsigned char hash[OUTPUT_SIZE]) {
     uint256 hash_first;
     hasher.Finalize(hash_first.begin());
-    uint256 product = MultiplyUsing4bitPrecision(matrix, hash_first);
+    uint256 product = MultiplyUsing4bitPrecision(*matrix, hash_first);
 
     uint256 hash_xored;
     for (size_t i = 0; i < OUTPUT_SIZE; ++i) {
@@ -47,12 +162,12 @@ void CHeavyHash::Finalize(unsigned char hash[OUTPUT_SIZE]) {
     CSHA3_256().Write(hash_xored.begin(), OUTPUT_SIZE).Finalize(hash);
 }
 
-CHeavyHash& CHeavyHash::Reset(uint64_t matrix_[64*64]) {
+CHeavyHash& CHeavyHash::Reset(const HeavyHashMatrix& matrix_) {
     *this = CHeavyHash(matrix_);
     return *this;
 }
 
-void MultiplyMatrices(uint64_t matrix[64*64], uint64_t vector[64], uint64_t product[64]){
+void MultiplyMatrices(const uint64_t matrix[64*64], uint64_t vector[64], uint64_t product[64]){
     for (int i = 0; i < 64; ++i) {
         for (int j = 0; j < 64; ++j) {
             product[i] += matrix[64*i + j]*vector[j];
@@ -60,7 +175,7 @@ void MultiplyMatrices(uint64_t matrix[64*64], uint64_t vector[64], uint64_t prod
     }
 }
 
-uint256 MultiplyUsing4bitPrecision(uint64_t matrix[64*64], const uint256& hash) {
+uint256 MultiplyUsing4bitPrecision(const uint64_t matrix[64*64], const uint256& hash) {
     // conversion to matrix with 4 bit values
     uint64_t vector[64] = {0};
     ConvertTo4BitPrecisionVector(hash, vector);
@@ -74,6 +189,16 @@ uint256 MultiplyUsing4bitPrecision(uint64_t matrix[64*64], const uint256& hash)
     return Convert4bitVectorToUint(product);
 }
 
+uint256 MultiplyUsing4bitPrecision(const HeavyHashMatrix& matrix, const uint256& hash) {
+    uint32_t product[64];
+    MultiplyMatrixVector(matrix.data(), hash.begin(), product);
+    uint256 result;
+    for (int k = 0; k < 32; ++k) {
+        result.begin()[k] = ((product[2*k] >> 10) << 4) | (product[2*k + 1] >> 10);
+    }
+    return result;
+}
+
 void ConvertTo4BitPrecisionVector(uint256 bit_sequence, uint64_t vector[64]) {
     int index = 0;
     for (auto byte : bit_sequence) {
@@ -3,40 +3,79 @@
 
 #include <stdint.h>
 #include <stdlib.h>
-#include <crypto/tiny_sha3/sha3.h>
+#include <crypto/sha3.h>
 #include <uint256.h>
 #include <memory>
+#include <string>
 
-/** A hasher class for SHA3-256. */
-class CSHA3_256
+/** A 64x64 HeavyHash matrix of 4-bit values, packed into 2 KB.
+ * Each row takes 32 bytes with two entries per byte, the even column in the high nibble.
+ * This matches the nibble order of the hash it is multiplied with, so the vectorized
+ * kernels can consume both without unpacking.
+ */
+class HeavyHashMatrix
 {
 private:
-    sha3_ctx_t context;
+    uint8_t packed[64*32];
 
 public:
-    static const size_t OUTPUT_SIZE = 32;
+    static const int SIZE = 64;
+    static const size_t PACKED_SIZE = 64*32;
 
-    CSHA3_256();
-    CSHA3_256& Write(const unsigned char* data, size_t len);
-    void Finalize(unsigned char hash[OUTPUT_SIZE]);
-    CSHA3_256& Reset();
+    HeavyHashMatrix();
+    /** @pre every entry of matrix_ is below 16 */
+    explicit HeavyHashMatrix(const uint64_t matrix_[64*64]);
+
+    uint8_t Get(int row, int column) const
+    {
+        const uint8_t byte = packed[32*row + column/2];
+        return (column & 1) ? (byte & 0xF) : (byte >> 4);
+    }
+
+    void Set(int row, int column, uint8_t value)
+    {
+        uint8_t& byte = packed[32*row + column/2];
+        byte = (column & 1) ? ((byte & 0xF0) | (value & 0xF)) : ((byte & 0x0F) | (value << 4));
+    }
+
+    /** Expands the matrix into one uint64_t per entry, the layout of the reference functions. */
+    void Unpack(uint64_t matrix_[64*64]) const;
+
+    const uint8_t* data() const { return packed; }
+
+    friend bool operator==(const HeavyHashMatrix& a, const HeavyHashMatrix& b);
+    friend bool operator!=(const HeavyHashMatrix& a, const HeavyHashMatrix& b) { return !(a == b); }
 };
 
+/** A hasher class for HeavyHash. It only refers to its matrix, which must outlive the hasher,
+ * so a single matrix can be shared between any number of (concurrent) hashers. */
 class CHeavyHash
 {
 private:
-    uint64_t matrix[64*64];
+    const HeavyHashMatrix* matrix;
     CSHA3_256 hasher;
 
 public:
     static const size_t OUTPUT_SIZE = 32;
-    explicit CHeavyHash(uint64_t matrix_[64*64]);
-    CHeavyHash& Reset(uint64_t matrix_[64*64]);
+    explicit CHeavyHash(const HeavyHashMatrix& matrix_);
+    //! A temporary matrix would not outlive the hasher.
+    explicit CHeavyHash(HeavyHashMatrix&&) = delete;
+    CHeavyHash& Reset(const HeavyHashMatrix& matrix_);
+    CHeavyHash& Reset(HeavyHashMatrix&&) = delete;
     CHeavyHash& Write(const unsigned char* data, size_t len);
     void Finalize(unsigned char hash[OUTPUT_SIZE]);
 };
 
-uint256 MultiplyUsing4bitPrecision(uint64_t matrix[64*64], const uint256& hash);
+/** Scalar reference for the HeavyHash matrix-vector product. */
+uint256 MultiplyUsing4bitPrecision(const uint64_t matrix[64*64], const uint256& hash);
+
+/** Same result as the reference above, computed with the kernel selected by HeavyHashAutoDetect. */
+uint256 MultiplyUsing4bitPrecision(const HeavyHashMatrix& matrix, const uint256& hash);
+
+/** Autodetect the best available HeavyHash matrix-vector kernel.
+ *  Returns the name of the implementation.
+ */
+std::string HeavyHashAutoDetect();
 
 void ConvertTo4BitPrecisionVector(uint256 bit_sequence, uint64_t vector[64]);
 
@@ -0,0 +1,42 @@
+// Copyright (c) 2020-2021 The PoWx Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifdef ENABLE_AVX2
+
+#include <stdint.h>
+#include <immintrin.h>
+
+namespace heavyhash_avx2 {
+
+/** Computes the 64 dot products of the packed 4-bit matrix rows with the 4-bit vector,
+ *  one full 32-byte row per register and eight rows per iteration.
+ */
+void MultiplyMatrixVector(const uint8_t* packed, const unsigned char* vector, uint32_t* product)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i v = _mm256_loadu_si256((const __m256i*)vector);
+    const __m256i vhi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+    const __m256i vlo = _mm256_and_si256(v, mask);
+
+    for (int i = 0; i < 64; i += 8) {
+        __m256i rows[8];
+        for (int r = 0; r < 8; ++r) {
+            const __m256i m = _mm256_loadu_si256((const __m256i*)(packed + 32 * (i + r)));
+            __m256i sum = _mm256_maddubs_epi16(_mm256_and_si256(_mm256_srli_epi16(m, 4), mask), vhi);
+            sum = _mm256_add_epi16(sum, _mm256_maddubs_epi16(_mm256_and_si256(m, mask), vlo));
+            rows[r] = _mm256_madd_epi16(sum, ones);
+        }
+        // Each 128-bit lane now holds [r0 r1 r2 r3] and [r4 r5 r6 r7] partial sums.
+        const __m256i s0123 = _mm256_hadd_epi32(_mm256_hadd_epi32(rows[0], rows[1]), _mm256_hadd_epi32(rows[2], rows[3]));
+        const __m256i s4567 = _mm256_hadd_epi32(_mm256_hadd_epi32(rows[4], rows[5]), _mm256_hadd_epi32(rows[6], rows[7]));
+        const __m256i sums = _mm256_add_epi32(_mm256_permute2x128_si256(s0123, s4567, 0x20),
+                                              _mm256_permute2x128_si256(s0123, s4567, 0x31));
+        _mm256_storeu_si256((__m256i*)(product + i), sums);
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,45 @@
+// Copyright (c) 2020-2021 The PoWx Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifdef ENABLE_SSE41
+
+#include <stdint.h>
+#include <immintrin.h>
+
+namespace heavyhash_sse41 {
+
+/** Computes the 64 dot products of the packed 4-bit matrix rows with the 4-bit vector.
+ *  Every entry is at most 15, so the byte products fit the signed operand of
+ *  _mm_maddubs_epi16 and the 16-bit partial sums cannot saturate.
+ */
+void MultiplyMatrixVector(const uint8_t* packed, const unsigned char* vector, uint32_t* product)
+{
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i v0 = _mm_loadu_si128((const __m128i*)vector);
+    const __m128i v1 = _mm_loadu_si128((const __m128i*)(vector + 16));
+    const __m128i vhi0 = _mm_and_si128(_mm_srli_epi16(v0, 4), mask);
+    const __m128i vlo0 = _mm_and_si128(v0, mask);
+    const __m128i vhi1 = _mm_and_si128(_mm_srli_epi16(v1, 4), mask);
+    const __m128i vlo1 = _mm_and_si128(v1, mask);
+
+    for (int i = 0; i < 64; i += 4) {
+        __m128i rows[4];
+        for (int r = 0; r < 4; ++r) {
+            const __m128i m0 = _mm_loadu_si128((const __m128i*)(packed + 32 * (i + r)));
+            const __m128i m1 = _mm_loadu_si128((const __m128i*)(packed + 32 * (i + r) + 16));
+            __m128i sum = _mm_maddubs_epi16(_mm_and_si128(_mm_srli_epi16(m0, 4), mask), vhi0);
+            sum = _mm_add_epi16(sum, _mm_maddubs_epi16(_mm_and_si128(m0, mask), vlo0));
+            sum = _mm_add_epi16(sum, _mm_maddubs_epi16(_mm_and_si128(_mm_srli_epi16(m1, 4), mask), vhi1));
+            sum = _mm_add_epi16(sum, _mm_maddubs_epi16(_mm_and_si128(m1, mask), vlo1));
+            rows[r] = _mm_madd_epi16(sum, ones);
+        }
+        const __m128i sums = _mm_hadd_epi32(_mm_hadd_epi32(rows[0], rows[1]), _mm_hadd_epi32(rows[2], rows[3]));
+        _mm_storeu_si128((__m128i*)(product + i), sums);
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,247 @@
+// Copyright (c) 2020-2021 The PoWx Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <crypto/muhash.h>
+
+#include <crypto/chacha20.h>
+#include <crypto/common.h>
+#include <crypto/sha256.h>
+
+#include <limits>
+
+constexpr int Num3072::LIMBS;
+constexpr int Num3072::LIMB_SIZE;
+constexpr size_t Num3072::BYTE_SIZE;
+
+namespace {
+
+using limb_t = Num3072::limb_t;
+using double_limb_t = Num3072::double_limb_t;
+constexpr int LIMBS = Num3072::LIMBS;
+constexpr int LIMB_SIZE = Num3072::LIMB_SIZE;
+
+/** 2^3072 - 1103717 is the largest 3072-bit safe prime; it is the modulus. */
+constexpr limb_t MAX_PRIME_DIFF = 1103717;
+
+/** The low 21 bits of the inversion exponent p - 2 = (2^3051 - 1) * 2^21 + 993433. */
+constexpr uint32_t INVERSE_EXP_LOW = 993433;
+
+/** in_out = in_out^(2^sq) * mul */
+void SquareNMul(Num3072& in_out, int sq, const Num3072& mul)
+{
+    for (int j = 0; j < sq; ++j) in_out.Square();
+    in_out.Multiply(mul);
+}
+
+} // namespace
+
+Num3072::Num3072(const unsigned char (&data)[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        if (sizeof(limb_t) == 4) {
+            limbs[i] = ReadLE32(data + 4 * i);
+        } else {
+            limbs[i] = ReadLE64(data + 8 * i);
+        }
+    }
+    if (IsOverflow()) FullReduce();
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; ++i) limbs[i] = 0;
+}
+
+bool Num3072::IsOne() const
+{
+    if (limbs[0] != 1) return false;
+    for (int i = 1; i < LIMBS; ++i) {
+        if (limbs[i] != 0) return false;
+    }
+    return true;
+}
+
+bool Num3072::IsOverflow() const
+{
+    if (limbs[0] <= std::numeric_limits<limb_t>::max() - MAX_PRIME_DIFF) return false;
+    for (int i = 1; i < LIMBS; ++i) {
+        if (limbs[i] != std::numeric_limits<limb_t>::max()) return false;
+    }
+    return true;
+}
+
+void Num3072::FullReduce()
+{
+    // Subtracting the modulus is adding MAX_PRIME_DIFF and dropping 2^3072.
+    double_limb_t c = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS; ++i) {
+        c += limbs[i];
+        limbs[i] = (limb_t)c;
+        c >>= LIMB_SIZE;
+    }
+}
+
+void Num3072::Reduce(const limb_t (&product)[2 * LIMBS])
+{
+    // 2^3072 == MAX_PRIME_DIFF (mod p), so fold the high half into the low half.
+    limb_t carry = 0;
+    for (int i = 0; i < LIMBS; ++i) {
+        double_limb_t t = (double_limb_t)product[LIMBS + i] * MAX_PRIME_DIFF + product[i] + carry;
+        limbs[i] = (limb_t)t;
+        carry = (limb_t)(t >> LIMB_SIZE);
+    }
+    double_limb_t c = (double_limb_t)carry * MAX_PRIME_DIFF;
+    while (c != 0) {
+        for (int i = 0; i < LIMBS && c != 0; ++i) {
+            c += limbs[i];
+            limbs[i] = (limb_t)c;
+            c >>= LIMB_SIZE;
+        }
+        // A carry out of the top limb is one more 2^3072. The value is small
+        // after wrapping, so the second round cannot carry out again.
+        if (c != 0) c = MAX_PRIME_DIFF;
+    }
+    if (IsOverflow()) FullReduce();
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    limb_t product[2 * LIMBS] = {};
+    for (int i = 0; i < LIMBS; ++i) {
+        limb_t carry = 0;
+        for (int j = 0; j < LIMBS; ++j) {
+            double_limb_t t = (double_limb_t)limbs[i] * a.limbs[j] + product[i + j] + carry;
+            product[i + j] = (limb_t)t;
+            carry = (limb_t)(t >> LIMB_SIZE);
+        }
+        product[i + LIMBS] = carry;
+    }
+    Reduce(product);
+}
+
+void Num3072::Square()
+{
+    // Compute each cross product once, double them, then add the squares.
+    limb_t product[2 * LIMBS] = {};
+    for (int i = 0; i < LIMBS; ++i) {
+        limb_t carry = 0;
+        for (int j = i + 1; j < LIMBS; ++j) {
+            double_limb_t t = (double_limb_t)limbs[i] * limbs[j] + product[i + j] + carry;
+            product[i + j] = (limb_t)t;
+            carry = (limb_t)(t >> LIMB_SIZE);
+        }
+        product[i + LIMBS] = carry;
+    }
+    for (int i = 2 * LIMBS - 1; i > 0; --i) {
+        product[i] = (product[i] << 1) | (product[i - 1] >> (LIMB_SIZE - 1));
+    }
+    product[0] <<= 1;
+    limb_t carry = 0;
+    for (int i = 0; i < LIMBS; ++i) {
+        double_limb_t sq = (double_limb_t)limbs[i] * limbs[i];
+        double_limb_t t = (double_limb_t)product[2 * i] + (limb_t)sq + carry;
+        product[2 * i] = (limb_t)t;
+        t = (double_limb_t)product[2 * i + 1] + (limb_t)(sq >> LIMB_SIZE) + (limb_t)(t >> LIMB_SIZE);
+        product[2 * i + 1] = (limb_t)t;
+        carry = (limb_t)(t >> LIMB_SIZE);
+    }
+    Reduce(product);
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // Fermat: a^-1 = a^(p - 2). Build p[i] = a^(2^(2^i) - 1) and chain them into
+    // a^(2^3051 - 1), 3051 = 2048 + 512 + 256 + 128 + 64 + 32 + 8 + 2 + 1, then
+    // append the remaining 21 bits of the exponent one at a time.
+    Num3072 p[12];
+    p[0] = *this;
+    for (int i = 0; i < 11; ++i) {
+        p[i + 1] = p[i];
+        SquareNMul(p[i + 1], 1 << i, p[i]);
+    }
+
+    Num3072 out = p[11];
+    SquareNMul(out, 512, p[9]);
+    SquareNMul(out, 256, p[8]);
+    SquareNMul(out, 128, p[7]);
+    SquareNMul(out, 64, p[6]);
+    SquareNMul(out, 32, p[5]);
+    SquareNMul(out, 8, p[3]);
+    SquareNMul(out, 2, p[1]);
+    SquareNMul(out, 1, p[0]);
+    for (int bit = 20; bit >= 0; --bit) {
+        out.Square();
+        if ((INVERSE_EXP_LOW >> bit) & 1) out.Multiply(*this);
+    }
+    return out;
+}
+
+void Num3072::Divide(const Num3072& a)
+{
+    Multiply(a.GetInverse());
+}
+
+void Num3072::ToBytes(unsigned char (&out)[BYTE_SIZE]) const
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        if (sizeof(limb_t) == 4) {
+            WriteLE32(out + i * 4, limbs[i]);
+        } else {
+            WriteLE64(out + i * 8, limbs[i]);
+        }
+    }
+}
+
+Num3072 MuHash3072::ToNum3072(Span<const unsigned char> in)
+{
+    unsigned char hashed_in[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(in.data(), in.size()).Finalize(hashed_in);
+    unsigned char tmp[Num3072::BYTE_SIZE];
+    ChaCha20(hashed_in, sizeof(hashed_in)).Keystream(tmp, sizeof(tmp));
+    return Num3072(tmp);
+}
+
+MuHash3072::MuHash3072(Span<const unsigned char> in) noexcept
+{
+    m_numerator = ToNum3072(in);
+}
+
+MuHash3072& MuHash3072::Insert(Span<const unsigned char> in) noexcept
+{
+    m_numerator.Multiply(ToNum3072(in));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(Span<const unsigned char> in) noexcept
+{
+    m_denominator.Multiply(ToNum3072(in));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& mul) noexcept
+{
+    m_numerator.Multiply(mul.m_numerator);
+    m_denominator.Multiply(mul.m_denominator);
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator/=(const MuHash3072& div) noexcept
+{
+    m_numerator.Multiply(div.m_denominator);
+    m_denominator.Multiply(div.m_numerator);
+    return *this;
+}
+
+void MuHash3072::Finalize(uint256& out) noexcept
+{
+    if (!m_denominator.IsOne()) {
+        m_numerator.Divide(m_denominator);
+        m_denominator.SetToOne();
+    }
+
+    unsigned char data[Num3072::BYTE_SIZE];
+    m_numerator.ToBytes(data);
+    CSHA256().Write(data, sizeof(data)).Finalize(out.begin());
+}
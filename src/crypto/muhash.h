@@ -0,0 +1,114 @@
+// Copyright (c) 2020-2021 The PoWx Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MUHASH_H
+#define BITCOIN_CRYPTO_MUHASH_H
+
+#include <serialize.h>
+#include <span.h>
+#include <uint256.h>
+
+#include <stdint.h>
+
+/** A 3072-bit number modulo the prime 2^3072 - 1103717. */
+class Num3072
+{
+public:
+#ifdef __SIZEOF_INT128__
+    typedef unsigned __int128 double_limb_t;
+    typedef uint64_t limb_t;
+    static constexpr int LIMBS = 48;
+    static constexpr int LIMB_SIZE = 64;
+#else
+    typedef uint64_t double_limb_t;
+    typedef uint32_t limb_t;
+    static constexpr int LIMBS = 96;
+    static constexpr int LIMB_SIZE = 32;
+#endif
+    static constexpr size_t BYTE_SIZE = 384;
+
+    static_assert(LIMB_SIZE * LIMBS == 3072, "Num3072 isn't 3072 bits");
+    static_assert(sizeof(double_limb_t) == sizeof(limb_t) * 2, "bad size for double_limb_t");
+    static_assert(sizeof(limb_t) * 8 == LIMB_SIZE, "LIMB_SIZE is incorrect");
+
+    limb_t limbs[LIMBS];
+
+    Num3072() { SetToOne(); }
+    /** Interpret 384 little-endian bytes; values above the modulus are reduced. */
+    explicit Num3072(const unsigned char (&data)[BYTE_SIZE]);
+
+    void SetToOne();
+    bool IsOne() const;
+    void Multiply(const Num3072& a);
+    void Square();
+    /** Multiply by the modular inverse of a. */
+    void Divide(const Num3072& a);
+    Num3072 GetInverse() const;
+    /** Write the fully reduced value as 384 little-endian bytes. */
+    void ToBytes(unsigned char (&out)[BYTE_SIZE]) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action)
+    {
+        for (int i = 0; i < LIMBS; ++i) READWRITE(limbs[i]);
+    }
+
+private:
+    bool IsOverflow() const;
+    void FullReduce();
+    /** Set this to lo + hi * 2^3072, reduced below 2^3072. */
+    void Reduce(const limb_t (&product)[2 * LIMBS]);
+};
+
+/** A set hash that can be updated one element at a time (MuHash3072).
+ *
+ * Each element is hashed with SHA256, expanded with ChaCha20 into a 3072-bit
+ * number and multiplied into the set; removals multiply into a separate
+ * denominator. The result does not depend on the order of the updates, so a
+ * set hash can be rolled forward and back block by block instead of being
+ * recomputed from the full set.
+ *
+ * The running state is kept as a fraction so that updates stay cheap; the one
+ * modular inversion happens in Finalize.
+ */
+class MuHash3072
+{
+private:
+    Num3072 m_numerator;
+    Num3072 m_denominator;
+
+    static Num3072 ToNum3072(Span<const unsigned char> in);
+
+public:
+    /** The empty set. */
+    MuHash3072() noexcept {}
+
+    /** A set holding the single element \p in. */
+    explicit MuHash3072(Span<const unsigned char> in) noexcept;
+
+    MuHash3072& Insert(Span<const unsigned char> in) noexcept;
+    MuHash3072& Remove(Span<const unsigned char> in) noexcept;
+
+    /** Union of two disjoint sets. */
+    MuHash3072& operator*=(const MuHash3072& mul) noexcept;
+    /** Difference with a subset. */
+    MuHash3072& operator/=(const MuHash3072& div) noexcept;
+
+    /** Write the 32-byte hash of the set to \p out. This normalizes the
+     *  internal fraction but does not change the set. */
+    void Finalize(uint256& out) noexcept;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action)
+    {
+        READWRITE(m_numerator);
+        READWRITE(m_denominator);
+    }
+};
+
+#endif // BITCOIN_CRYPTO_MUHASH_H
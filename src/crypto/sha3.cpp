@@ -0,0 +1,277 @@
+// Copyright (c) 2020-2021 The PoWx Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <crypto/sha3.h>
+#include <crypto/common.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <compat/cpuid.h>
+
+namespace sha3_avx2
+{
+void Transform_4way(unsigned char* out, const unsigned char* in, size_t len);
+}
+
+namespace {
+
+const uint64_t ROUND_CONSTANTS[24] = {
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808aULL,
+    0x8000000080008000ULL, 0x000000000000808bULL, 0x0000000080000001ULL,
+    0x8000000080008081ULL, 0x8000000000008009ULL, 0x000000000000008aULL,
+    0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000aULL,
+    0x000000008000808bULL, 0x800000000000008bULL, 0x8000000000008089ULL,
+    0x8000000000008003ULL, 0x8000000000008002ULL, 0x8000000000000080ULL,
+    0x000000000000800aULL, 0x800000008000000aULL, 0x8000000080008081ULL,
+    0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+uint64_t inline Xor(uint64_t x, uint64_t y) { return x ^ y; }
+uint64_t inline AndNot(uint64_t x, uint64_t y) { return ~x & y; }
+uint64_t inline Rotl(uint64_t x, int n) { return (x << n) | (x >> (64 - n)); }
+uint64_t inline RoundConstant(int round) { return ROUND_CONSTANTS[round]; }
+
+/** Hash 4 messages of len bytes each (len < RATE) with the 4-way kernel, if any. */
+typedef void (*TransformMultiFn)(unsigned char* out, const unsigned char* in, size_t len);
+TransformMultiFn Transform_4way = nullptr;
+
+void SHA3_256Short(unsigned char* output, const unsigned char* input, size_t len, size_t blocks)
+{
+    if (Transform_4way) {
+        while (blocks >= 4) {
+            Transform_4way(output, input, len);
+            output += 4 * CSHA3_256::OUTPUT_SIZE;
+            input += 4 * len;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        CSHA3_256().Write(input, len).Finalize(output);
+        output += CSHA3_256::OUTPUT_SIZE;
+        input += len;
+        --blocks;
+    }
+}
+
+bool SelfTest()
+{
+    // Some random input data to test with
+    static const unsigned char data[320] =
+        "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+        "eiusmod tempor incididunt ut labore et dolore magna aliqua. Et m"
+        "olestie ac feugiat sed lectus vestibulum mattis ullamcorper. Mor"
+        "bi blandit cursus risus at ultrices mi tempus imperdiet nulla. N"
+        "unc congue nisi vita suscipit tellus mauris. Imperdiet proin fe";
+    // SHA3-256 of the empty string
+    static const unsigned char empty[32] = {
+        0xa7, 0xff, 0xc6, 0xf8, 0xbf, 0x1e, 0xd7, 0x66, 0x51, 0xc1, 0x47, 0x56, 0xa0, 0x61, 0xd6, 0x62,
+        0xf5, 0x80, 0xff, 0x4d, 0xe4, 0x3b, 0x49, 0xfa, 0x82, 0xd8, 0x0a, 0x4b, 0x80, 0xf8, 0x43, 0x4a
+    };
+
+    unsigned char out[32];
+    CSHA3_256().Finalize(out);
+    if (memcmp(out, empty, 32)) return false;
+
+    // The multi-way kernels must agree with the single-way hasher.
+    if (Transform_4way) {
+        unsigned char ref[4 * 32], multi[4 * 32];
+        for (size_t len : {32, 80}) {
+            for (int i = 0; i < 4; ++i) {
+                CSHA3_256().Write(data + i * len, len).Finalize(ref + 32 * i);
+            }
+            Transform_4way(multi, data, len);
+            if (memcmp(ref, multi, sizeof(ref))) return false;
+        }
+    }
+    return true;
+}
+
+#if defined(USE_ASM) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+/** Check whether the OS has enabled AVX registers. */
+bool AVXEnabled()
+{
+    uint32_t a, d;
+    __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return (a & 6) == 6;
+}
+#endif
+} // namespace
+
+void KeccakF(uint64_t (&st)[25])
+{
+    uint64_t bc0, bc1, bc2, bc3, bc4, t;
+    for (int round = 0; round < 24; ++round) {
+        // Theta
+        bc0 = Xor(Xor(st[0], st[5]), Xor(Xor(st[10], st[15]), st[20]));
+        bc1 = Xor(Xor(st[1], st[6]), Xor(Xor(st[11], st[16]), st[21]));
+        bc2 = Xor(Xor(st[2], st[7]), Xor(Xor(st[12], st[17]), st[22]));
+        bc3 = Xor(Xor(st[3], st[8]), Xor(Xor(st[13], st[18]), st[23]));
+        bc4 = Xor(Xor(st[4], st[9]), Xor(Xor(st[14], st[19]), st[24]));
+        t = Xor(bc4, Rotl(bc1, 1));
+        st[0] = Xor(st[0], t); st[5] = Xor(st[5], t); st[10] = Xor(st[10], t); st[15] = Xor(st[15], t); st[20] = Xor(st[20], t);
+        t = Xor(bc0, Rotl(bc2, 1));
+        st[1] = Xor(st[1], t); st[6] = Xor(st[6], t); st[11] = Xor(st[11], t); st[16] = Xor(st[16], t); st[21] = Xor(st[21], t);
+        t = Xor(bc1, Rotl(bc3, 1));
+        st[2] = Xor(st[2], t); st[7] = Xor(st[7], t); st[12] = Xor(st[12], t); st[17] = Xor(st[17], t); st[22] = Xor(st[22], t);
+        t = Xor(bc2, Rotl(bc4, 1));
+        st[3] = Xor(st[3], t); st[8] = Xor(st[8], t); st[13] = Xor(st[13], t); st[18] = Xor(st[18], t); st[23] = Xor(st[23], t);
+        t = Xor(bc3, Rotl(bc0, 1));
+        st[4] = Xor(st[4], t); st[9] = Xor(st[9], t); st[14] = Xor(st[14], t); st[19] = Xor(st[19], t); st[24] = Xor(st[24], t);
+        // Rho Pi
+        t = st[1];
+        bc0 = st[10]; st[10] = Rotl(t, 1); t = bc0;
+        bc0 = st[7]; st[7] = Rotl(t, 3); t = bc0;
+        bc0 = st[11]; st[11] = Rotl(t, 6); t = bc0;
+        bc0 = st[17]; st[17] = Rotl(t, 10); t = bc0;
+        bc0 = st[18]; st[18] = Rotl(t, 15); t = bc0;
+        bc0 = st[3]; st[3] = Rotl(t, 21); t = bc0;
+        bc0 = st[5]; st[5] = Rotl(t, 28); t = bc0;
+        bc0 = st[16]; st[16] = Rotl(t, 36); t = bc0;
+        bc0 = st[8]; st[8] = Rotl(t, 45); t = bc0;
+        bc0 = st[21]; st[21] = Rotl(t, 55); t = bc0;
+        bc0 = st[24]; st[24] = Rotl(t, 2); t = bc0;
+        bc0 = st[4]; st[4] = Rotl(t, 14); t = bc0;
+        bc0 = st[15]; st[15] = Rotl(t, 27); t = bc0;
+        bc0 = st[23]; st[23] = Rotl(t, 41); t = bc0;
+        bc0 = st[19]; st[19] = Rotl(t, 56); t = bc0;
+        bc0 = st[13]; st[13] = Rotl(t, 8); t = bc0;
+        bc0 = st[12]; st[12] = Rotl(t, 25); t = bc0;
+        bc0 = st[2]; st[2] = Rotl(t, 43); t = bc0;
+        bc0 = st[20]; st[20] = Rotl(t, 62); t = bc0;
+        bc0 = st[14]; st[14] = Rotl(t, 18); t = bc0;
+        bc0 = st[22]; st[22] = Rotl(t, 39); t = bc0;
+        bc0 = st[9]; st[9] = Rotl(t, 61); t = bc0;
+        bc0 = st[6]; st[6] = Rotl(t, 20); t = bc0;
+        bc0 = st[1]; st[1] = Rotl(t, 44); t = bc0;
+        // Chi
+        bc0 = st[0]; bc1 = st[1]; bc2 = st[2]; bc3 = st[3]; bc4 = st[4];
+        st[0] = Xor(bc0, AndNot(bc1, bc2));
+        st[1] = Xor(bc1, AndNot(bc2, bc3));
+        st[2] = Xor(bc2, AndNot(bc3, bc4));
+        st[3] = Xor(bc3, AndNot(bc4, bc0));
+        st[4] = Xor(bc4, AndNot(bc0, bc1));
+        bc0 = st[5]; bc1 = st[6]; bc2 = st[7]; bc3 = st[8]; bc4 = st[9];
+        st[5] = Xor(bc0, AndNot(bc1, bc2));
+        st[6] = Xor(bc1, AndNot(bc2, bc3));
+        st[7] = Xor(bc2, AndNot(bc3, bc4));
+        st[8] = Xor(bc3, AndNot(bc4, bc0));
+        st[9] = Xor(bc4, AndNot(bc0, bc1));
+        bc0 = st[10]; bc1 = st[11]; bc2 = st[12]; bc3 = st[13]; bc4 = st[14];
+        st[10] = Xor(bc0, AndNot(bc1, bc2));
+        st[11] = Xor(bc1, AndNot(bc2, bc3));
+        st[12] = Xor(bc2, AndNot(bc3, bc4));
+        st[13] = Xor(bc3, AndNot(bc4, bc0));
+        st[14] = Xor(bc4, AndNot(bc0, bc1));
+        bc0 = st[15]; bc1 = st[16]; bc2 = st[17]; bc3 = st[18]; bc4 = st[19];
+        st[15] = Xor(bc0, AndNot(bc1, bc2));
+        st[16] = Xor(bc1, AndNot(bc2, bc3));
+        st[17] = Xor(bc2, AndNot(bc3, bc4));
+        st[18] = Xor(bc3, AndNot(bc4, bc0));
+        st[19] = Xor(bc4, AndNot(bc0, bc1));
+        bc0 = st[20]; bc1 = st[21]; bc2 = st[22]; bc3 = st[23]; bc4 = st[24];
+        st[20] = Xor(bc0, AndNot(bc1, bc2));
+        st[21] = Xor(bc1, AndNot(bc2, bc3));
+        st[22] = Xor(bc2, AndNot(bc3, bc4));
+        st[23] = Xor(bc3, AndNot(bc4, bc0));
+        st[24] = Xor(bc4, AndNot(bc0, bc1));
+        // Iota
+        st[0] = Xor(st[0], RoundConstant(round));
+    }
+}
+
+std::string SHA3AutoDetect()
+{
+    std::string ret = "standard";
+#if defined(USE_ASM) && defined(HAVE_GETCPUID)
+    bool have_xsave = false;
+    bool have_avx = false;
+    bool have_avx2 = false;
+    bool enabled_avx = false;
+
+    (void)AVXEnabled;
+    (void)have_avx;
+    (void)have_xsave;
+    (void)have_avx2;
+    (void)enabled_avx;
+
+    uint32_t eax, ebx, ecx, edx;
+    GetCPUID(1, 0, eax, ebx, ecx, edx);
+    have_xsave = (ecx >> 27) & 1;
+    have_avx = (ecx >> 28) & 1;
+    if (have_xsave && have_avx) {
+        enabled_avx = AVXEnabled();
+    }
+    GetCPUID(7, 0, eax, ebx, ecx, edx);
+    have_avx2 = (ebx >> 5) & 1;
+
+#if defined(ENABLE_AVX2) && !defined(BUILD_BITCOIN_INTERNAL)
+    if (have_avx2 && have_avx && enabled_avx) {
+        Transform_4way = sha3_avx2::Transform_4way;
+        ret += ",avx2(4way)";
+    }
+#endif
+#endif
+
+    assert(SelfTest());
+    return ret;
+}
+
+////// SHA3-256
+
+CSHA3_256::CSHA3_256()
+{
+    Reset();
+}
+
+CSHA3_256& CSHA3_256::Write(const unsigned char* data, size_t len)
+{
+    while (len > 0) {
+        if (pos % 8 == 0 && len >= 8) {
+            // Absorb whole words while aligned
+            state[pos / 8] ^= ReadLE64(data);
+            pos += 8;
+            data += 8;
+            len -= 8;
+        } else {
+            state[pos / 8] ^= uint64_t{*data} << (8 * (pos % 8));
+            ++pos;
+            ++data;
+            --len;
+        }
+        if (pos == RATE) {
+            KeccakF(state);
+            pos = 0;
+        }
+    }
+    return *this;
+}
+
+void CSHA3_256::Finalize(unsigned char hash[OUTPUT_SIZE])
+{
+    // SHA3 domain separation and pad10*1
+    state[pos / 8] ^= uint64_t{0x06} << (8 * (pos % 8));
+    state[RATE / 8 - 1] ^= uint64_t{0x80} << 56;
+    KeccakF(state);
+    for (int i = 0; i < 4; ++i) {
+        WriteLE64(hash + 8 * i, state[i]);
+    }
+}
+
+CSHA3_256& CSHA3_256::Reset()
+{
+    memset(state, 0, sizeof(state));
+    pos = 0;
+    return *this;
+}
+
+void SHA3_256_80(unsigned char* output, const unsigned char* input, size_t blocks)
+{
+    SHA3_256Short(output, input, 80, blocks);
+}
+
+void SHA3_256_32(unsigned char* output, const unsigned char* input, size_t blocks)
+{
+    SHA3_256Short(output, input, 32, blocks);
+}
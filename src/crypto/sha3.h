@@ -0,0 +1,52 @@
+// Copyright (c) 2020-2021 The PoWx Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef OPOW_CRYPTO_SHA3_H
+#define OPOW_CRYPTO_SHA3_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+/** The Keccak-f[1600] permutation. */
+void KeccakF(uint64_t (&st)[25]);
+
+/** A hasher class for SHA3-256. */
+class CSHA3_256
+{
+private:
+    uint64_t state[25];
+    size_t pos;
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+    /** Bytes absorbed per permutation. */
+    static const size_t RATE = 136;
+
+    CSHA3_256();
+    CSHA3_256& Write(const unsigned char* data, size_t len);
+    void Finalize(unsigned char hash[OUTPUT_SIZE]);
+    CSHA3_256& Reset();
+};
+
+/** Autodetect the best available SHA3 implementation.
+ *  Returns the name of the implementation.
+ */
+std::string SHA3AutoDetect();
+
+/** Compute multiple SHA3-256's of 80-byte blobs, such as serialized block headers.
+ *  output:  pointer to a blocks*32 byte output buffer
+ *  input:   pointer to a blocks*80 byte input buffer
+ *  blocks:  the number of hashes to compute.
+ */
+void SHA3_256_80(unsigned char* output, const unsigned char* input, size_t blocks);
+
+/** Compute multiple SHA3-256's of 32-byte blobs.
+ *  output:  pointer to a blocks*32 byte output buffer
+ *  input:   pointer to a blocks*32 byte input buffer
+ *  blocks:  the number of hashes to compute.
+ */
+void SHA3_256_32(unsigned char* output, const unsigned char* input, size_t blocks);
+
+#endif // OPOW_CRYPTO_SHA3_H
@@ -118,15 +118,18 @@ class CDBIterator
 private:
     const CDBWrapper &parent;
     leveldb::Iterator *piter;
+    //! Snapshot the iterator reads from, if any; released after the iterator is deleted.
+    std::shared_ptr<const leveldb::Snapshot> m_snapshot;
 
 public:
 
     /**
      * @param[in] _parent          Parent CDBWrapper instance.
      * @param[in] _piter           The original leveldb iterator.
+     * @param[in] snapshot         Snapshot _piter was created on, kept alive with the iterator.
      */
-    CDBIterator(const CDBWrapper &_parent, leveldb::Iterator *_piter) :
-        parent(_parent), piter(_piter) { };
+    CDBIterator(const CDBWrapper &_parent, leveldb::Iterator *_piter, std::shared_ptr<const leveldb::Snapshot> snapshot = nullptr) :
+        parent(_parent), piter(_piter), m_snapshot(std::move(snapshot)) { };
     ~CDBIterator();
 
     bool Valid() const;
@@ -309,6 +312,23 @@ public:
         return new CDBIterator(*this, pdb->NewIterator(iteroptions));
     }
 
+    /**
+     * Return a snapshot of the current state of the database. Iterators created on
+     * it do not see later writes, so several of them read one consistent state.
+     */
+    std::shared_ptr<const leveldb::Snapshot> GetSnapshot() const
+    {
+        leveldb::DB* db = pdb;
+        return std::shared_ptr<const leveldb::Snapshot>(db->GetSnapshot(), [db](const leveldb::Snapshot* snapshot) { db->ReleaseSnapshot(snapshot); });
+    }
+
+    CDBIterator *NewIterator(std::shared_ptr<const leveldb::Snapshot> snapshot) const
+    {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = snapshot.get();
+        return new CDBIterator(*this, pdb->NewIterator(options), std::move(snapshot));
+    }
+
     /**
      * Return true if the database managed by this class contains no entries.
      */
@@ -10,6 +10,13 @@
 #include <tinyformat.h>
 #include <util/system.h>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 FlatFileSeq::FlatFileSeq(fs::path dir, const char* prefix, size_t chunk_size) :
     m_dir(std::move(dir)),
     m_prefix(prefix),
@@ -96,3 +103,79 @@ bool FlatFileSeq::Flush(const FlatFilePos& pos, bool finalize)
     fclose(file);
     return true;
 }
+
+MappedFile::MappedFile(const fs::path& path) : m_path(path)
+{
+#ifndef WIN32
+    // Block files would soon use up a 32-bit address space.
+    if (sizeof(void*) < 8) return;
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            m_data = static_cast<const uint8_t*>(addr);
+            m_size = st.st_size;
+        }
+    }
+    close(fd);
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifndef WIN32
+    if (m_data) munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif
+}
+
+static bool Covers(const MappedFile& file, const FlatFilePos& pos, size_t size)
+{
+    const size_t mapped = file.Data().size();
+    return pos.nPos <= mapped && size <= mapped - pos.nPos;
+}
+
+void FlatFileMapCache::SetMaxFiles(size_t max_files)
+{
+    LOCK(m_mutex);
+    m_max_files = max_files;
+    while (m_files.size() > m_max_files) m_files.pop_back();
+}
+
+void FlatFileMapCache::Clear()
+{
+    LOCK(m_mutex);
+    m_files.clear();
+}
+
+std::shared_ptr<const MappedFile> FlatFileMapCache::Map(const FlatFileSeq& seq, const FlatFilePos& pos, size_t size)
+{
+    if (pos.IsNull()) return nullptr;
+
+    const fs::path path = seq.FileName(pos);
+    LOCK(m_mutex);
+    if (m_max_files == 0) return nullptr;
+    for (auto it = m_files.begin(); it != m_files.end(); ++it) {
+        if ((*it)->Path() != path) continue;
+        if (Covers(**it, pos, size)) {
+            m_files.splice(m_files.begin(), m_files, it);
+            return m_files.front();
+        }
+        // The file has grown since it was mapped.
+        m_files.erase(it);
+        break;
+    }
+
+    std::shared_ptr<const MappedFile> file = std::make_shared<const MappedFile>(path);
+    if (file->IsNull() || !Covers(*file, pos, size)) return nullptr;
+    m_files.push_front(file);
+    if (m_files.size() > m_max_files) m_files.pop_back();
+    return file;
+}
+
+void FlatFileMapCache::Release(const fs::path& path)
+{
+    LOCK(m_mutex);
+    m_files.remove_if([&path](const std::shared_ptr<const MappedFile>& file) { return file->Path() == path; });
+}
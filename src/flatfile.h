@@ -6,10 +6,14 @@
 #ifndef BITCOIN_FLATFILE_H
 #define BITCOIN_FLATFILE_H
 
+#include <list>
+#include <memory>
 #include <string>
 
 #include <fs.h>
 #include <serialize.h>
+#include <span.h>
+#include <sync.h>
 
 struct FlatFilePos
 {
@@ -93,4 +97,68 @@ public:
     bool Flush(const FlatFilePos& pos, bool finalize = false);
 };
 
+/**
+ * A read-only memory mapping of a whole file.
+ *
+ * An I/O error while reading a mapped page, or the file being truncated underneath the
+ * mapping by another process, is raised as SIGBUS rather than reported as a read error,
+ * and terminates the process.
+ */
+class MappedFile
+{
+private:
+    const fs::path m_path;
+    const uint8_t* m_data{nullptr};
+    size_t m_size{0};
+
+public:
+    /** Map the file at path. The mapping is null if that is not possible. */
+    explicit MappedFile(const fs::path& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool IsNull() const { return m_data == nullptr; }
+    const fs::path& Path() const { return m_path; }
+    Span<const uint8_t> Data() const { return Span<const uint8_t>(m_data, m_size); }
+};
+
+/**
+ * Keeps read-only memory mappings of recently read files, up to a maximum number of
+ * files, dropping the least recently used mapping first. Mappings are looked up by file
+ * path, so files of another directory are never served from an older mapping. A mapping
+ * stays valid for as long as a reader holds on to it.
+ *
+ * Files are only mapped on 64-bit POSIX systems. Elsewhere Map always returns nullptr,
+ * and the file should be read through FlatFileSeq::Open instead.
+ */
+class FlatFileMapCache
+{
+private:
+    Mutex m_mutex;
+    size_t m_max_files GUARDED_BY(m_mutex);
+    //! Most recently used first
+    std::list<std::shared_ptr<const MappedFile>> m_files GUARDED_BY(m_mutex);
+
+public:
+    explicit FlatFileMapCache(size_t max_files) : m_max_files(max_files) {}
+
+    /** Change the number of files kept mapped. 0 disables mapping. */
+    void SetMaxFiles(size_t max_files);
+
+    /**
+     * Get a mapping of the file in seq at pos that covers size bytes from pos, mapping the
+     * file again if it has grown since. Returns nullptr if the file cannot be mapped or is
+     * too short.
+     */
+    std::shared_ptr<const MappedFile> Map(const FlatFileSeq& seq, const FlatFilePos& pos, size_t size);
+
+    /** Drop the mapping of the file at path, before the file is truncated or removed. */
+    void Release(const fs::path& path);
+
+    /** Drop all mappings, e.g. when the files are about to be opened from another directory. */
+    void Clear();
+};
+
 #endif // BITCOIN_FLATFILE_H
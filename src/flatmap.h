@@ -0,0 +1,463 @@
+// Copyright (c) 2020-2021 The PoWx Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATMAP_H
+#define BITCOIN_FLATMAP_H
+
+#include <crypto/common.h>
+
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace flatmap_detail {
+
+/** Number of control bytes that are probed together. */
+static constexpr size_t GROUP_WIDTH = 8;
+
+static constexpr uint64_t LSBS = 0x0101010101010101ULL;
+static constexpr uint64_t MSBS = 0x8080808080808080ULL;
+
+/** Control byte of a slot that never held an element since the last rehash. */
+static constexpr int8_t CTRL_EMPTY = -128;
+/** Control byte of a slot whose element was erased (a tombstone). */
+static constexpr int8_t CTRL_DELETED = -2;
+// Full slots hold the low 7 bits of the element's hash, so they are never negative.
+
+/** Index of the first byte flagged in a group mask. The mask must not be zero. */
+static inline size_t LowestByte(uint64_t mask) { return (CountBits(mask & (~mask + 1)) - 1) / 8; }
+/** Number of unflagged bytes above the last flagged one. */
+static inline size_t LeadingBytes(uint64_t mask) { return (64 - CountBits(mask)) / 8; }
+
+/**
+ * GROUP_WIDTH control bytes loaded into one word. Each Match function returns
+ * a mask with the high bit of every matching byte set, so a whole group is
+ * tested with a handful of integer instructions.
+ */
+class Group
+{
+private:
+    uint64_t m_ctrl;
+
+public:
+    explicit Group(const int8_t* ctrl) : m_ctrl(ReadLE64(reinterpret_cast<const unsigned char*>(ctrl))) {}
+
+    /** Full slots whose control byte is h2. May report a false positive, but only on a full slot. */
+    uint64_t Match(int8_t h2) const
+    {
+        const uint64_t x = m_ctrl ^ (LSBS * (uint8_t)h2);
+        return (x - LSBS) & ~x & MSBS;
+    }
+
+    uint64_t MatchEmpty() const { return m_ctrl & (~m_ctrl << 6) & MSBS; }
+
+    uint64_t MatchEmptyOrDeleted() const { return m_ctrl & (~m_ctrl << 7) & MSBS; }
+};
+
+/**
+ * Storage for objects of type T, carved from chunks of growing size and
+ * recycled through a free list. Chunks are only returned to the system by
+ * Clear(), which turns the release of a large map into a few thousand frees
+ * instead of one per element. Construction and destruction of the objects is
+ * left to the caller.
+ */
+template <typename T>
+class NodePool
+{
+private:
+    union Node {
+        Node* next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    struct Chunk {
+        std::unique_ptr<Node[]> nodes;
+        size_t count;
+    };
+
+    static constexpr size_t MIN_CHUNK_NODES = 16;
+    static constexpr size_t MAX_CHUNK_NODES = 4096;
+
+    std::vector<Chunk> m_chunks;
+    Node* m_free{nullptr};
+    //! Never used nodes at the end of the newest chunk.
+    Node* m_untouched{nullptr};
+    Node* m_untouched_end{nullptr};
+
+public:
+    NodePool() = default;
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    void* Allocate()
+    {
+        if (m_free) {
+            Node* node = m_free;
+            m_free = node->next;
+            return node;
+        }
+        if (m_untouched == m_untouched_end) {
+            size_t count = MIN_CHUNK_NODES;
+            if (!m_chunks.empty()) {
+                count = 2 * m_chunks.back().count;
+                if (count > MAX_CHUNK_NODES) count = MAX_CHUNK_NODES;
+            }
+            m_chunks.push_back(Chunk{std::unique_ptr<Node[]>(new Node[count]), count});
+            m_untouched = m_chunks.back().nodes.get();
+            m_untouched_end = m_untouched + count;
+        }
+        return m_untouched++;
+    }
+
+    void Deallocate(void* p)
+    {
+        Node* node = static_cast<Node*>(p);
+        node->next = m_free;
+        m_free = node;
+    }
+
+    /** Release all chunks. Every object must have been destroyed. */
+    void Clear()
+    {
+        m_chunks.clear();
+        m_free = m_untouched = m_untouched_end = nullptr;
+    }
+
+    void Swap(NodePool& other)
+    {
+        m_chunks.swap(other.m_chunks);
+        std::swap(m_free, other.m_free);
+        std::swap(m_untouched, other.m_untouched);
+        std::swap(m_untouched_end, other.m_untouched_end);
+    }
+
+    /** Call f(bytes) for every chunk allocation. */
+    template <typename F>
+    void ForEachChunk(F&& f) const
+    {
+        for (const Chunk& chunk : m_chunks) {
+            f(chunk.count * sizeof(Node));
+        }
+        if (!m_chunks.empty()) f(m_chunks.capacity() * sizeof(Chunk));
+    }
+};
+
+} // namespace flatmap_detail
+
+/**
+ * Hash map with open addressing, for maps that are large and lookup-heavy,
+ * such as the coins cache.
+ *
+ * The table is a flat array of pointers to the elements, with one control
+ * byte per slot that is either empty, deleted or holds 7 bits of the
+ * element's hash. Lookups test eight control bytes at a time and only touch
+ * an element whose control byte matches, so a miss rarely leaves the control
+ * array and a hit usually costs a single element access. Probing visits the
+ * groups of the table in triangular steps. The table is rehashed at a load of
+ * 7/8, counting tombstones.
+ *
+ * Elements live in a per-map node pool rather than being allocated one by
+ * one, and are never moved: references and pointers to elements stay valid
+ * until the element is erased, across inserts and rehashes. Iterators are
+ * invalidated by inserts that rehash, but erase() leaves every other element
+ * in place, so a map can be drained while iterating over it.
+ *
+ * The interface is the subset of std::unordered_map that is used on these
+ * maps. memusage::DynamicUsage accounts for every allocation of the map.
+ */
+template <typename K, typename T, typename Hash>
+class flatmap
+{
+public:
+    typedef K key_type;
+    typedef T mapped_type;
+    typedef std::pair<const K, T> value_type;
+    typedef size_t size_type;
+    typedef Hash hasher;
+
+private:
+    template <bool Const>
+    class iterator_impl
+    {
+    private:
+        friend class flatmap;
+        friend class iterator_impl<!Const>;
+        typedef typename std::conditional<Const, const flatmap, flatmap>::type map_type;
+
+        map_type* m_map{nullptr};
+        size_t m_index{0};
+
+        iterator_impl(map_type* map, size_t index) : m_map(map), m_index(index) {}
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef typename flatmap::value_type value_type;
+        typedef ptrdiff_t difference_type;
+        typedef typename std::conditional<Const, const value_type*, value_type*>::type pointer;
+        typedef typename std::conditional<Const, const value_type&, value_type&>::type reference;
+
+        iterator_impl() = default;
+        template <bool C = Const, typename = typename std::enable_if<C>::type>
+        iterator_impl(const iterator_impl<false>& it) : m_map(it.m_map), m_index(it.m_index) {}
+
+        reference operator*() const { return *m_map->m_slots[m_index]; }
+        pointer operator->() const { return m_map->m_slots[m_index]; }
+        iterator_impl& operator++()
+        {
+            m_index = m_map->FirstFull(m_index + 1);
+            return *this;
+        }
+        iterator_impl operator++(int)
+        {
+            iterator_impl copy(*this);
+            ++*this;
+            return copy;
+        }
+        friend bool operator==(const iterator_impl& a, const iterator_impl& b) { return a.m_index == b.m_index; }
+        friend bool operator!=(const iterator_impl& a, const iterator_impl& b) { return a.m_index != b.m_index; }
+    };
+
+public:
+    typedef iterator_impl<false> iterator;
+    typedef iterator_impl<true> const_iterator;
+
+private:
+    static constexpr size_t MIN_CAPACITY = 2 * flatmap_detail::GROUP_WIDTH;
+
+    Hash m_hash;
+    //! One allocation holding the slot pointers followed by the control bytes.
+    std::unique_ptr<unsigned char[]> m_table;
+    value_type** m_slots{nullptr};
+    //! m_capacity control bytes, then a copy of the first GROUP_WIDTH ones so
+    //! that a group can be loaded at any slot without wrapping around.
+    int8_t* m_ctrl{nullptr};
+    //! Number of slots: zero, or a power of two of at least MIN_CAPACITY.
+    size_t m_capacity{0};
+    size_t m_size{0};
+    //! Inserts into empty slots that are left before the table must be rehashed.
+    size_t m_growth_left{0};
+    flatmap_detail::NodePool<value_type> m_pool;
+
+    static int8_t H2(size_t hash) { return hash & 0x7f; }
+    static size_t MaxLoad(size_t capacity) { return capacity - capacity / 8; }
+    static size_t TableBytes(size_t capacity) { return capacity * (sizeof(value_type*) + 1) + flatmap_detail::GROUP_WIDTH; }
+
+    size_t FirstFull(size_t index) const
+    {
+        while (index < m_capacity && m_ctrl[index] < 0) ++index;
+        return index;
+    }
+
+    void SetCtrl(size_t index, int8_t ctrl)
+    {
+        m_ctrl[index] = ctrl;
+        if (index < flatmap_detail::GROUP_WIDTH) m_ctrl[m_capacity + index] = ctrl;
+    }
+
+    /** Slot of the element with the given key, or m_capacity if there is none. */
+    size_t FindIndex(const K& key, size_t hash) const
+    {
+        if (m_capacity == 0) return m_capacity;
+        const size_t mask = m_capacity - 1;
+        size_t pos = (hash >> 7) & mask;
+        for (size_t step = flatmap_detail::GROUP_WIDTH;; step += flatmap_detail::GROUP_WIDTH) {
+            const flatmap_detail::Group group(m_ctrl + pos);
+            for (uint64_t match = group.Match(H2(hash)); match; match &= match - 1) {
+                const size_t index = (pos + flatmap_detail::LowestByte(match)) & mask;
+                if (m_slots[index]->first == key) return index;
+            }
+            if (group.MatchEmpty()) return m_capacity;
+            pos = (pos + step) & mask;
+        }
+    }
+
+    /** First slot on the probe sequence of hash that is empty or deleted. */
+    size_t FindFirstNonFull(size_t hash) const
+    {
+        const size_t mask = m_capacity - 1;
+        size_t pos = (hash >> 7) & mask;
+        for (size_t step = flatmap_detail::GROUP_WIDTH;; step += flatmap_detail::GROUP_WIDTH) {
+            const uint64_t match = flatmap_detail::Group(m_ctrl + pos).MatchEmptyOrDeleted();
+            if (match) return (pos + flatmap_detail::LowestByte(match)) & mask;
+            pos = (pos + step) & mask;
+        }
+    }
+
+    /** Move the element pointers into a new table. Elements stay where they are. */
+    void Resize(size_t capacity)
+    {
+        std::unique_ptr<unsigned char[]> old_table(new unsigned char[TableBytes(capacity)]);
+        m_table.swap(old_table);
+        value_type** const old_slots = m_slots;
+        const int8_t* const old_ctrl = m_ctrl;
+        const size_t old_capacity = m_capacity;
+
+        m_slots = reinterpret_cast<value_type**>(m_table.get());
+        m_ctrl = reinterpret_cast<int8_t*>(m_table.get() + capacity * sizeof(value_type*));
+        std::memset(m_ctrl, (unsigned char)flatmap_detail::CTRL_EMPTY, capacity + flatmap_detail::GROUP_WIDTH);
+        m_capacity = capacity;
+        m_growth_left = MaxLoad(capacity) - m_size;
+
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old_ctrl[i] < 0) continue;
+            const size_t hash = m_hash(old_slots[i]->first);
+            const size_t index = FindFirstNonFull(hash);
+            SetCtrl(index, H2(hash));
+            m_slots[index] = old_slots[i];
+        }
+    }
+
+    /** Slot for a new element with the given hash, rehashing the table if it is out of room. */
+    size_t PrepareInsert(size_t hash)
+    {
+        if (m_capacity > 0) {
+            const size_t index = FindFirstNonFull(hash);
+            if (m_growth_left > 0 || m_ctrl[index] == flatmap_detail::CTRL_DELETED) return index;
+        }
+        if (m_capacity == 0) {
+            Resize(MIN_CAPACITY);
+        } else if (m_size * 2 <= MaxLoad(m_capacity)) {
+            // Mostly tombstones: rebuild at the same size to reclaim them.
+            Resize(m_capacity);
+        } else {
+            Resize(m_capacity * 2);
+        }
+        return FindFirstNonFull(hash);
+    }
+
+    void DestroyElements()
+    {
+        if (std::is_trivially_destructible<value_type>::value) return;
+        for (size_t i = 0; i < m_capacity; ++i) {
+            if (m_ctrl[i] >= 0) m_slots[i]->~value_type();
+        }
+    }
+
+public:
+    flatmap() = default;
+    explicit flatmap(const Hash& hash) : m_hash(hash) {}
+    flatmap(const flatmap&) = delete;
+    flatmap& operator=(const flatmap&) = delete;
+    ~flatmap() { DestroyElements(); }
+
+    iterator begin() { return iterator(this, FirstFull(0)); }
+    const_iterator begin() const { return const_iterator(this, FirstFull(0)); }
+    iterator end() { return iterator(this, m_capacity); }
+    const_iterator end() const { return const_iterator(this, m_capacity); }
+
+    bool empty() const { return m_size == 0; }
+    size_t size() const { return m_size; }
+    /** Number of slots in the table. */
+    size_t capacity() const { return m_capacity; }
+
+    iterator find(const K& key) { return iterator(this, FindIndex(key, m_hash(key))); }
+    const_iterator find(const K& key) const { return const_iterator(this, FindIndex(key, m_hash(key))); }
+    size_t count(const K& key) const { return FindIndex(key, m_hash(key)) != m_capacity; }
+
+    /** Insert an element constructed from args unless the key is already present. */
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(const K& key, Args&&... args)
+    {
+        const size_t hash = m_hash(key);
+        size_t index = FindIndex(key, hash);
+        if (index != m_capacity) return {iterator(this, index), false};
+
+        index = PrepareInsert(hash);
+        void* node = m_pool.Allocate();
+        value_type* value;
+        try {
+            value = ::new (node) value_type(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+        } catch (...) {
+            m_pool.Deallocate(node);
+            throw;
+        }
+        if (m_ctrl[index] == flatmap_detail::CTRL_EMPTY) --m_growth_left;
+        SetCtrl(index, H2(hash));
+        m_slots[index] = value;
+        ++m_size;
+        return {iterator(this, index), true};
+    }
+
+    template <typename M>
+    std::pair<iterator, bool> emplace(const K& key, M&& obj) { return try_emplace(key, std::forward<M>(obj)); }
+
+    T& operator[](const K& key) { return try_emplace(key).first->second; }
+
+    /** Erase an element and return the iterator to the next one. No other element moves. */
+    iterator erase(const_iterator it)
+    {
+        using namespace flatmap_detail;
+        const size_t index = it.m_index;
+        value_type* value = m_slots[index];
+        value->~value_type();
+        m_pool.Deallocate(value);
+        --m_size;
+
+        // The slot can go back to empty if no probe window that covers it
+        // was ever without an empty slot, as then no lookup continued past
+        // it. Otherwise it has to stay a tombstone.
+        const size_t mask = m_capacity - 1;
+        const uint64_t empty_before = Group(m_ctrl + ((index - GROUP_WIDTH) & mask)).MatchEmpty();
+        const uint64_t empty_after = Group(m_ctrl + index).MatchEmpty();
+        const bool was_never_full = empty_before && empty_after &&
+                                    LowestByte(empty_after) + LeadingBytes(empty_before) < GROUP_WIDTH;
+        SetCtrl(index, was_never_full ? CTRL_EMPTY : CTRL_DELETED);
+        if (was_never_full) ++m_growth_left;
+
+        return iterator(this, FirstFull(index));
+    }
+
+    size_t erase(const K& key)
+    {
+        const_iterator it = find(key);
+        if (it == end()) return 0;
+        erase(it);
+        return 1;
+    }
+
+    /** Erase all elements and release the table and the node pool. */
+    void clear()
+    {
+        DestroyElements();
+        m_pool.Clear();
+        m_table.reset();
+        m_slots = nullptr;
+        m_ctrl = nullptr;
+        m_capacity = m_size = m_growth_left = 0;
+    }
+
+    /** Exchange the contents, hashers included, with another map. Element
+     *  references stay valid and now refer into the other map. */
+    void swap(flatmap& other)
+    {
+        using std::swap;
+        swap(m_hash, other.m_hash);
+        m_table.swap(other.m_table);
+        swap(m_slots, other.m_slots);
+        swap(m_ctrl, other.m_ctrl);
+        swap(m_capacity, other.m_capacity);
+        swap(m_size, other.m_size);
+        swap(m_growth_left, other.m_growth_left);
+        m_pool.Swap(other.m_pool);
+    }
+
+    /** Call f(bytes) for every heap allocation owned by the map, not counting
+     *  allocations owned by the elements themselves. */
+    template <typename F>
+    void for_each_allocation(F&& f) const
+    {
+        if (m_table) f(TableBytes(m_capacity));
+        m_pool.ForEachChunk(f);
+    }
+};
+
+#endif // BITCOIN_FLATMAP_H
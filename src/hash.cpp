@@ -8,6 +8,10 @@
 #include <crypto/xoshiro256pp.h>
 #include <util/matrixchecks.h>
 
+#include <list>
+#include <map>
+#include <mutex>
+
 
 inline uint32_t ROTL32(uint32_t x, int8_t r)
 {
@@ -80,7 +84,7 @@ void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char he
     CHMAC_SHA512(chainCode.begin(), chainCode.size()).Write(&header, 1).Write(data, 32).Write(num, 4).Finalize(output);
 }
 
-void GenerateHeavyHashMatrix(uint256 matrix_seed, uint64_t matrix[64*64]) {
+void GenerateHeavyHashMatrix(uint256 matrix_seed, HeavyHashMatrix& matrix) {
     XoShiRo256PlusPlus generator(matrix_seed);
     do {
         for (int i = 0; i < 64; ++i) {
@@ -88,10 +92,92 @@ void GenerateHeavyHashMatrix(uint256 matrix_seed, uint64_t matrix[64*64]) {
                 uint64_t value = generator();
                 // fills 16 4-bit integers, lower bits first
                 for (int shift = 0; shift < 16; ++shift) {
-                    matrix[64*i + j + shift] =  (value >> (4 * shift)) & 0xF;
+                    matrix.Set(i, j + shift, (value >> (4 * shift)) & 0xF);
                 }
             }
         }
-    } while (!heavyhash::checks::Is4BitPrecision(matrix) || !heavyhash::checks::IsFullRank(matrix));
+    } while (!heavyhash::checks::IsFullRank(matrix));
+}
+
+
+namespace {
+
+/** Bounded LRU cache of HeavyHash matrices keyed by their seed. */
+class HeavyHashMatrixCache
+{
+public:
+    typedef std::shared_ptr<const HeavyHashMatrix> MatrixRef;
+
+    explicit HeavyHashMatrixCache(size_t capacity) : m_capacity(capacity) {}
+
+    MatrixRef Get(const uint256& matrix_seed)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_index.find(matrix_seed);
+            if (it != m_index.end()) {
+                ++m_hits;
+                m_lru.splice(m_lru.begin(), m_lru, it->second);
+                return it->second->second;
+            }
+            ++m_misses;
+        }
+
+        // Generate outside the lock so that concurrent misses on different seeds do
+        // not serialize behind each other. Two threads racing on the same seed both
+        // generate it; the second insertion is simply dropped.
+        auto matrix = std::make_shared<HeavyHashMatrix>();
+        GenerateHeavyHashMatrix(matrix_seed, *matrix);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_index.count(matrix_seed) == 0) {
+            m_lru.emplace_front(matrix_seed, matrix);
+            m_index.emplace(matrix_seed, m_lru.begin());
+            if (m_lru.size() > m_capacity) {
+                m_index.erase(m_lru.back().first);
+                m_lru.pop_back();
+            }
+        }
+        return matrix;
+    }
+
+    HeavyHashMatrixCacheStats GetStats()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        HeavyHashMatrixCacheStats stats;
+        stats.hits = m_hits;
+        stats.misses = m_misses;
+        stats.entries = m_lru.size();
+        stats.capacity = m_capacity;
+        return stats;
+    }
+
+private:
+    typedef std::list<std::pair<uint256, MatrixRef>> LruList;
+
+    std::mutex m_mutex;
+    const size_t m_capacity;
+    //! Most recently used entry first.
+    LruList m_lru;
+    std::map<uint256, LruList::iterator> m_index;
+    uint64_t m_hits{0};
+    uint64_t m_misses{0};
+};
+
+HeavyHashMatrixCache& GetMatrixCache()
+{
+    static HeavyHashMatrixCache cache(DEFAULT_HEAVYHASH_MATRIX_CACHE_SIZE);
+    return cache;
 }
 
+} // namespace
+
+std::shared_ptr<const HeavyHashMatrix> GetHeavyHashMatrix(const uint256& matrix_seed)
+{
+    return GetMatrixCache().Get(matrix_seed);
+}
+
+HeavyHashMatrixCacheStats GetHeavyHashMatrixCacheStats()
+{
+    return GetMatrixCache().GetStats();
+}
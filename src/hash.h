@@ -167,8 +167,9 @@ private:
     const int nVersion;
 public:
 
-    CHeavyHashWriter(uint64_t heavyhash_matrix[64*64],
+    CHeavyHashWriter(const HeavyHashMatrix& heavyhash_matrix,
                      int nTypeIn, int nVersionIn) : ctx(heavyhash_matrix), nType(nTypeIn), nVersion(nVersionIn) {};
+    CHeavyHashWriter(HeavyHashMatrix&&, int, int) = delete;
 
     int GetType() const { return nType; }
     int GetVersion() const { return nVersion; }
@@ -247,7 +248,7 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
 
 /** Compute the 256-bit HeavyHash of an object's serialization*/
 template<typename T>
-uint256 SerializeHeavyHash(const T& obj, uint64_t heavyhash_matrix[64*64],
+uint256 SerializeHeavyHash(const T& obj, const HeavyHashMatrix& heavyhash_matrix,
                            const int nType=SER_GETHASH, int nVersion=PROTOCOL_VERSION)
 {
     CHeavyHashWriter ss(heavyhash_matrix, nType, nVersion);
@@ -259,7 +260,29 @@ uint256 SerializeHeavyHash(const T& obj, uint64_t heavyhash_matrix[64*64],
  * @pre matrix_seed must be non-zero
  * */
 
-void GenerateHeavyHashMatrix(uint256 matrix_seed, uint64_t matrix[64*64]);
+void GenerateHeavyHashMatrix(uint256 matrix_seed, HeavyHashMatrix& matrix);
+
+/** Default number of HeavyHash matrices kept by the matrix cache. */
+static const size_t DEFAULT_HEAVYHASH_MATRIX_CACHE_SIZE = 64;
+
+/** Returns the HeavyHash matrix for \p matrix_seed, generating it only on a cache miss.
+ * Headers sharing a parent share a seed, so siblings, nonce iterations and repeated
+ * GetHash() calls reuse one matrix instead of re-running the full-rank check.
+ * Thread-safe; the cache holds at most DEFAULT_HEAVYHASH_MATRIX_CACHE_SIZE entries
+ * and evicts the least recently used one.
+ */
+std::shared_ptr<const HeavyHashMatrix> GetHeavyHashMatrix(const uint256& matrix_seed);
+
+struct HeavyHashMatrixCacheStats
+{
+    uint64_t hits{0};
+    uint64_t misses{0};
+    size_t entries{0};
+    size_t capacity{0};
+};
+
+/** Returns a snapshot of the matrix cache counters. */
+HeavyHashMatrixCacheStats GetHeavyHashMatrixCacheStats();
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
@@ -5,6 +5,7 @@
 #ifndef BITCOIN_MEMUSAGE_H
 #define BITCOIN_MEMUSAGE_H
 
+#include <flatmap.h>
 #include <indirectmap.h>
 #include <prevector.h>
 
@@ -167,6 +168,14 @@ static inline size_t DynamicUsage(const std::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const flatmap<X, Y, Z>& m)
+{
+    size_t usage = 0;
+    m.for_each_allocation([&usage](size_t alloc) { usage += MallocUsage(alloc); });
+    return usage;
+}
+
 }
 
 #endif // BITCOIN_MEMUSAGE_H
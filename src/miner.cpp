@@ -6,6 +6,7 @@
 #include <miner.h>
 
 #include <amount.h>
+#include <arith_uint256.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <coins.h>
@@ -17,11 +18,16 @@
 #include <policy/policy.h>
 #include <pow.h>
 #include <primitives/transaction.h>
+#include <shutdown.h>
 #include <timedata.h>
 #include <util/moneystr.h>
 #include <util/system.h>
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <thread>
 #include <utility>
 
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
@@ -83,12 +89,25 @@ void BlockAssembler::resetBlock()
     // These counters do not include coinbase tx
     nBlockTx = 0;
     nFees = 0;
+    fPackagesLeftOut = false;
+    m_min_package_feerate = nullopt;
+    m_better_package_left_out = false;
 }
 
 Optional<int64_t> BlockAssembler::m_last_block_num_txs{nullopt};
 Optional<int64_t> BlockAssembler::m_last_block_weight{nullopt};
 
 std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    return AssembleBlock(scriptPubKeyIn, nullptr, nullptr);
+}
+
+std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn, TemplateSelection& selection, const std::vector<uint256>& candidates)
+{
+    return AssembleBlock(scriptPubKeyIn, &selection, &candidates);
+}
+
+std::unique_ptr<CBlockTemplate> BlockAssembler::AssembleBlock(const CScript& scriptPubKeyIn, TemplateSelection* selection, const std::vector<uint256>* candidates)
 {
     int64_t nTimeStart = GetTimeMicros();
 
@@ -136,7 +155,44 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
 
     int nPackagesSelected = 0;
     int nDescendantsUpdated = 0;
-    addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    // A selection that left no package out only misses transactions that entered
+    // the mempool since, as long as the tip (and so the finality of every
+    // transaction) is the same. Fee changes from prioritisetransaction are picked
+    // up by selecting from the whole mempool every MAX_TEMPLATE_SELECTION_AGE.
+    bool fIncremental = selection && selection->complete &&
+                        selection->hashPrevBlock == pindexPrev->GetBlockHash() &&
+                        GetTime() - selection->nTimeFullSelection < MAX_TEMPLATE_SELECTION_AGE;
+    if (selection) selection->complete = false;
+    if (fIncremental) {
+        for (const uint256& txid : selection->txids) {
+            // Transactions leave the mempool together with their descendants, so
+            // the remaining ones are still in a valid order.
+            CTxMemPool::txiter it = m_mempool.mapTx.find(txid);
+            if (it != m_mempool.mapTx.end()) AddToBlock(it);
+        }
+        m_min_package_feerate = selection->minPackageFeeRate;
+        std::vector<CTxMemPool::txiter> vNew;
+        for (const uint256& txid : *candidates) {
+            CTxMemPool::txiter it = m_mempool.mapTx.find(txid);
+            if (it != m_mempool.mapTx.end() && !inBlock.count(it)) vNew.push_back(it);
+        }
+        addPackageTxs(nPackagesSelected, nDescendantsUpdated, vNew);
+        if (m_better_package_left_out) {
+            // The block is full of kept transactions that pay less than a new
+            // package, so start over from the whole mempool.
+            resetBlock();
+            fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus());
+            pblock->vtx.resize(1);
+            pblocktemplate->vTxFees.resize(1);
+            pblocktemplate->vTxSigOpsCost.resize(1);
+            nPackagesSelected = 0;
+            nDescendantsUpdated = 0;
+            fIncremental = false;
+        }
+    }
+    if (!fIncremental) {
+        addClusterChunks(nPackagesSelected);
+    }
 
     int64_t nTime1 = GetTimeMicros();
 
@@ -170,7 +226,18 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     }
     int64_t nTime2 = GetTimeMicros();
 
-    LogPrint(BCLog::BENCH, "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nDescendantsUpdated, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
+    LogPrint(BCLog::BENCH, "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants%s), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nDescendantsUpdated, fIncremental ? ", incremental" : "", 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
+
+    if (selection) {
+        selection->hashPrevBlock = pindexPrev->GetBlockHash();
+        selection->txids.clear();
+        for (size_t i = 1; i < pblock->vtx.size(); ++i) {
+            selection->txids.push_back(pblock->vtx[i]->GetHash());
+        }
+        selection->complete = !fPackagesLeftOut;
+        selection->minPackageFeeRate = m_min_package_feerate;
+        if (!fIncremental) selection->nTimeFullSelection = GetTime();
+    }
 
     return std::move(pblocktemplate);
 }
@@ -202,7 +269,7 @@ bool BlockAssembler::TestPackage(uint64_t packageSize, int64_t packageSigOpsCost
 // - transaction finality (locktime)
 // - premature witness (in case segwit transactions are added to mempool before
 //   segwit activation)
-bool BlockAssembler::TestPackageTransactions(const CTxMemPool::setEntries& package)
+bool BlockAssembler::TestPackageTransactions(const std::vector<CTxMemPool::txiter>& package)
 {
     for (CTxMemPool::txiter it : package) {
         if (!IsFinalTx(it->GetTx(), nHeight, nLockTimeCutoff))
@@ -232,6 +299,20 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
     }
 }
 
+void BlockAssembler::AddedPackage(CAmount packageFees, uint64_t packageSize)
+{
+    const CFeeRate feerate(packageFees, packageSize);
+    if (!m_min_package_feerate || feerate < *m_min_package_feerate) m_min_package_feerate = feerate;
+}
+
+void BlockAssembler::LeftOutPackage(CAmount packageFees, uint64_t packageSize)
+{
+    fPackagesLeftOut = true;
+    if (m_min_package_feerate && CFeeRate(packageFees, packageSize) > *m_min_package_feerate) {
+        m_better_package_left_out = true;
+    }
+}
+
 int BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
         indexed_modified_transaction_set &mapModifiedTx)
 {
@@ -259,21 +340,6 @@ int BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& already
     return nDescendantsUpdated;
 }
 
-// Skip entries in mapTx that are already in a block or are present
-// in mapModifiedTx (which implies that the mapTx ancestor state is
-// stale due to ancestor inclusion in the block)
-// Also skip transactions that we've already failed to add. This can happen if
-// we consider a transaction in mapModifiedTx and it fails: we can then
-// potentially consider it again while walking mapTx.  It's currently
-// guaranteed to fail again, but as a belt-and-suspenders check we put it in
-// failedTx and avoid re-evaluation, since the re-evaluation would be using
-// cached size/sigops/fee values that are not actually correct.
-bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx)
-{
-    assert(it != m_mempool.mapTx.end());
-    return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
-}
-
 void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, std::vector<CTxMemPool::txiter>& sortedEntries)
 {
     // Sort package by ancestor count
@@ -285,30 +351,38 @@ void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, std::ve
     std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
 }
 
-// This transaction selection algorithm orders the mempool based
-// on feerate of a transaction including all unconfirmed ancestors.
+// This transaction selection algorithm adds the candidates to a block that
+// already holds part of the mempool, ordered by feerate including their
+// unconfirmed ancestors that are not in the block yet.
 // Since we don't remove transactions from the mempool as we select them
 // for block inclusion, we need an alternate method of updating the feerate
 // of a transaction with its not-yet-selected ancestors as we go.
 // This is accomplished by walking the in-mempool descendants of selected
 // transactions and storing a temporary modified state in mapModifiedTxs.
-// Each time through the loop, we compare the best transaction in
-// mapModifiedTxs with the next transaction in the mempool to decide what
-// transaction package to work on next.
-void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated)
+// Each time through the loop, we take the best transaction in
+// mapModifiedTxs and add it to the block with its ancestors.
+void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated, const std::vector<CTxMemPool::txiter>& candidates)
 {
-    // mapModifiedTx will store sorted packages after they are modified
-    // because some of their txs are already in the block
+    // mapModifiedTx will store sorted packages, with their ancestor state
+    // reduced by the ancestors that are already in the block
     indexed_modified_transaction_set mapModifiedTx;
-    // Keep track of entries that failed inclusion, to avoid duplicate work
-    CTxMemPool::setEntries failedTx;
 
-    // Start by adding all descendants of previously added txs to mapModifiedTx
-    // and modifying them for their already included ancestors
-    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
 
-    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = m_mempool.mapTx.get<ancestor_score>().begin();
-    CTxMemPool::txiter iter;
+    for (CTxMemPool::txiter it : candidates) {
+        if (inBlock.count(it) || mapModifiedTx.count(it)) continue;
+        CTxMemPoolModifiedEntry modEntry(it);
+        CTxMemPool::setEntries ancestors;
+        m_mempool.CalculateMemPoolAncestors(*it, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        for (CTxMemPool::txiter anc : ancestors) {
+            if (!inBlock.count(anc)) continue;
+            modEntry.nSizeWithAncestors -= anc->GetTxSize();
+            modEntry.nModFeesWithAncestors -= anc->GetModifiedFee();
+            modEntry.nSigOpCostWithAncestors -= anc->GetSigOpCost();
+        }
+        mapModifiedTx.insert(modEntry);
+    }
 
     // Limit the number of attempts to add transactions to the block when it is
     // close to full; this is just a simple heuristic to finish quickly if the
@@ -316,52 +390,16 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
     const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
     int64_t nConsecutiveFailed = 0;
 
-    while (mi != m_mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty()) {
-        // First try to find a new transaction in mapTx to evaluate.
-        if (mi != m_mempool.mapTx.get<ancestor_score>().end() &&
-            SkipMapTxEntry(m_mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
-            ++mi;
-            continue;
-        }
-
-        // Now that mi is not stale, determine which transaction to evaluate:
-        // the next entry from mapTx, or the best from mapModifiedTx?
-        bool fUsingModified = false;
-
+    while (!mapModifiedTx.empty()) {
         modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
-        if (mi == m_mempool.mapTx.get<ancestor_score>().end()) {
-            // We're out of entries in mapTx; use the entry from mapModifiedTx
-            iter = modit->iter;
-            fUsingModified = true;
-        } else {
-            // Try to compare the mapTx entry to the mapModifiedTx entry
-            iter = m_mempool.mapTx.project<0>(mi);
-            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
-                    CompareTxMemPoolEntryByAncestorFee()(*modit, CTxMemPoolModifiedEntry(iter))) {
-                // The best entry in mapModifiedTx has higher score
-                // than the one from mapTx.
-                // Switch which transaction (package) to consider
-                iter = modit->iter;
-                fUsingModified = true;
-            } else {
-                // Either no entry in mapModifiedTx, or it's worse than mapTx.
-                // Increment mi for the next loop iteration.
-                ++mi;
-            }
-        }
+        CTxMemPool::txiter iter = modit->iter;
 
-        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
-        // contain anything that is inBlock.
+        // mapModifiedTx shouldn't contain anything that is inBlock.
         assert(!inBlock.count(iter));
 
-        uint64_t packageSize = iter->GetSizeWithAncestors();
-        CAmount packageFees = iter->GetModFeesWithAncestors();
-        int64_t packageSigOpsCost = iter->GetSigOpCostWithAncestors();
-        if (fUsingModified) {
-            packageSize = modit->nSizeWithAncestors;
-            packageFees = modit->nModFeesWithAncestors;
-            packageSigOpsCost = modit->nSigOpCostWithAncestors;
-        }
+        uint64_t packageSize = modit->nSizeWithAncestors;
+        CAmount packageFees = modit->nModFeesWithAncestors;
+        int64_t packageSigOpsCost = modit->nSigOpCostWithAncestors;
 
         if (packageFees < blockMinFeeRate.GetFee(packageSize)) {
             // Everything else we might consider has a lower fee rate
@@ -369,13 +407,11 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
         }
 
         if (!TestPackage(packageSize, packageSigOpsCost)) {
-            if (fUsingModified) {
-                // Since we always look at the best entry in mapModifiedTx,
-                // we must erase failed entries so that we can consider the
-                // next best entry on the next loop iteration
-                mapModifiedTx.get<ancestor_score>().erase(modit);
-                failedTx.insert(iter);
-            }
+            LeftOutPackage(packageFees, packageSize);
+            // Since we always look at the best entry in mapModifiedTx,
+            // we must erase failed entries so that we can consider the
+            // next best entry on the next loop iteration
+            mapModifiedTx.get<ancestor_score>().erase(modit);
 
             ++nConsecutiveFailed;
 
@@ -388,34 +424,30 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
         }
 
         CTxMemPool::setEntries ancestors;
-        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
-        std::string dummy;
         m_mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
 
         onlyUnconfirmed(ancestors);
         ancestors.insert(iter);
 
+        // Sort the entries in a valid order.
+        std::vector<CTxMemPool::txiter> sortedEntries;
+        SortForBlock(ancestors, sortedEntries);
+
         // Test if all tx's are Final
-        if (!TestPackageTransactions(ancestors)) {
-            if (fUsingModified) {
-                mapModifiedTx.get<ancestor_score>().erase(modit);
-                failedTx.insert(iter);
-            }
+        if (!TestPackageTransactions(sortedEntries)) {
+            mapModifiedTx.get<ancestor_score>().erase(modit);
             continue;
         }
 
         // This transaction will make it in; reset the failed counter.
         nConsecutiveFailed = 0;
 
-        // Package can be added. Sort the entries in a valid order.
-        std::vector<CTxMemPool::txiter> sortedEntries;
-        SortForBlock(ancestors, sortedEntries);
-
         for (size_t i=0; i<sortedEntries.size(); ++i) {
             AddToBlock(sortedEntries[i]);
             // Erase from the modified set, if present
             mapModifiedTx.erase(sortedEntries[i]);
         }
+        AddedPackage(packageFees, packageSize);
 
         ++nPackagesSelected;
 
@@ -424,6 +456,224 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
     }
 }
 
+namespace {
+//! The next chunk of a cluster to consider for the block
+struct ClusterChunkCursor
+{
+    const TxMemPoolCluster* cluster;
+    size_t chunk;
+
+    const TxMemPoolChunk& GetChunk() const { return cluster->chunks[chunk]; }
+};
+
+//! Orders a heap of cursors by chunk feerate, highest first
+struct CompareClusterChunkCursor
+{
+    bool operator()(const ClusterChunkCursor& a, const ClusterChunkCursor& b) const
+    {
+        const TxMemPoolChunk& a_chunk = a.GetChunk();
+        const TxMemPoolChunk& b_chunk = b.GetChunk();
+        return (double)a_chunk.fee * b_chunk.size < (double)b_chunk.fee * a_chunk.size;
+    }
+};
+} // namespace
+
+// Every cluster of the mempool is kept linearized in chunks of non-increasing
+// feerate, each of which can be added to a block once the chunks before it are.
+// Selecting transactions is then a merge of these sorted lists by feerate,
+// without having to update the ancestor state of what is left in the mempool
+// as transactions are selected.
+void BlockAssembler::addClusterChunks(int& nPackagesSelected)
+{
+    m_mempool.LinearizeClusters();
+
+    CompareClusterChunkCursor compare;
+    std::vector<ClusterChunkCursor> heap;
+    heap.reserve(m_mempool.GetClusters().size());
+    for (const auto& cluster : m_mempool.GetClusters()) {
+        heap.push_back(ClusterChunkCursor{cluster.get(), 0});
+    }
+    std::make_heap(heap.begin(), heap.end(), compare);
+
+    // Limit the number of attempts to add transactions to the block when it is
+    // close to full; this is just a simple heuristic to finish quickly if the
+    // mempool has a lot of entries.
+    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+
+    std::vector<CTxMemPool::txiter> package;
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), compare);
+        const ClusterChunkCursor cursor = heap.back();
+        heap.pop_back();
+        const TxMemPoolChunk& chunk = cursor.GetChunk();
+
+        if (chunk.fee < blockMinFeeRate.GetFee(chunk.size)) {
+            // Everything else we might consider has a lower fee rate
+            return;
+        }
+
+        // A chunk that cannot be added leaves the rest of its cluster out, as
+        // the chunks after it may depend on it.
+        if (!TestPackage(chunk.size, chunk.sigops)) {
+            LeftOutPackage(chunk.fee, chunk.size);
+
+            ++nConsecutiveFailed;
+
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockWeight >
+                    nBlockMaxWeight - 4000) {
+                // Give up if we're close to full and haven't succeeded in a while
+                break;
+            }
+            continue;
+        }
+
+        const size_t begin = cursor.chunk == 0 ? 0 : cursor.cluster->chunks[cursor.chunk - 1].end;
+        package.assign(cursor.cluster->txs.begin() + begin, cursor.cluster->txs.begin() + chunk.end);
+
+        // Test if all tx's are Final
+        if (!TestPackageTransactions(package)) {
+            continue;
+        }
+
+        // This chunk will make it in; reset the failed counter.
+        nConsecutiveFailed = 0;
+
+        for (CTxMemPool::txiter it : package) {
+            AddToBlock(it);
+        }
+        AddedPackage(chunk.fee, chunk.size);
+
+        ++nPackagesSelected;
+
+        if (cursor.chunk + 1 < cursor.cluster->chunks.size()) {
+            heap.push_back(ClusterChunkCursor{cursor.cluster, cursor.chunk + 1});
+            std::push_heap(heap.begin(), heap.end(), compare);
+        }
+    }
+}
+
+BlockTemplateBuilder::BlockTemplateBuilder(const CTxMemPool& mempool, const CChainParams& params)
+    : m_mempool(mempool), m_chainparams(params) {}
+
+BlockTemplateBuilder::~BlockTemplateBuilder()
+{
+    Stop();
+}
+
+std::unique_ptr<CBlockTemplate> BlockTemplateBuilder::CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    m_last_request = GetTime();
+    return BuildTemplate(scriptPubKeyIn);
+}
+
+std::unique_ptr<CBlockTemplate> BlockTemplateBuilder::BuildTemplate(const CScript& scriptPubKeyIn)
+{
+    LOCK(cs_main);
+    // Hand out the last template again if nothing it depends on has changed,
+    // which is the common case for the template prebuilt at a tip change.
+    if (m_last_template && m_last_template->block.hashPrevBlock == ::ChainActive().Tip()->GetBlockHash() &&
+        m_last_script == scriptPubKeyIn && m_last_transactions_updated == m_mempool.GetTransactionsUpdated()) {
+        return MakeUnique<CBlockTemplate>(*m_last_template);
+    }
+    m_last_template.reset();
+
+    std::vector<uint256> candidates;
+    {
+        LOCK(m_pending_mutex);
+        candidates.assign(m_pending.begin(), m_pending.end());
+        m_pending.clear();
+        if (m_pending_overflow) {
+            m_selection.complete = false;
+            m_pending_overflow = false;
+        }
+    }
+    const unsigned int nTransactionsUpdated = m_mempool.GetTransactionsUpdated();
+    std::unique_ptr<CBlockTemplate> pblocktemplate = BlockAssembler(m_mempool, m_chainparams).CreateNewBlock(scriptPubKeyIn, m_selection, candidates);
+    m_last_template = MakeUnique<const CBlockTemplate>(*pblocktemplate);
+    m_last_script = scriptPubKeyIn;
+    m_last_transactions_updated = nTransactionsUpdated;
+    return pblocktemplate;
+}
+
+void BlockTemplateBuilder::Start()
+{
+    LOCK(m_prebuild_mutex);
+    m_prebuild_stop = false;
+    m_prebuild_thread = std::thread(&TraceThread<std::function<void()>>, "tmplbuild", std::bind(&BlockTemplateBuilder::ThreadPrebuild, this));
+}
+
+void BlockTemplateBuilder::Stop()
+{
+    {
+        LOCK(m_prebuild_mutex);
+        m_prebuild_stop = true;
+    }
+    m_prebuild_cv.notify_all();
+    if (m_prebuild_thread.joinable()) m_prebuild_thread.join();
+}
+
+void BlockTemplateBuilder::ThreadPrebuild()
+{
+    while (true) {
+        {
+            WAIT_LOCK(m_prebuild_mutex, lock);
+            while (!m_prebuild_requested && !m_prebuild_stop) {
+                m_prebuild_cv.wait(lock);
+            }
+            if (m_prebuild_stop) return;
+            m_prebuild_requested = false;
+        }
+
+        int64_t nTimeStart = GetTimeMicros();
+        std::unique_ptr<CBlockTemplate> pblocktemplate;
+        try {
+            // Same placeholder coinbase as getblocktemplate, so that it can hand this template out.
+            pblocktemplate = BuildTemplate(CScript() << OP_TRUE);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+            continue;
+        } catch (...) {
+            LogPrintf("%s: unknown exception\n", __func__);
+            continue;
+        }
+        // The HeavyHash matrix of the next block only depends on the tip, so
+        // it can be generated (and cached) before any miner hashes a header.
+        pblocktemplate->block.GetPoWMatrix();
+        LogPrint(BCLog::BENCH, "Prebuilt block template on %s: %.2fms\n", pblocktemplate->block.hashPrevBlock.ToString(), 0.001 * (GetTimeMicros() - nTimeStart));
+
+        GetMainSignals().NewBlockTemplate(std::make_shared<const CBlock>(pblocktemplate->block));
+    }
+}
+
+void BlockTemplateBuilder::UpdatedBlockTip(const CBlockIndex* pindexNew, const CBlockIndex* pindexFork, bool fInitialDownload)
+{
+    if (fInitialDownload || pindexNew == pindexFork) return;
+    if (GetTime() - m_last_request > TEMPLATE_PREBUILD_IDLE_TIMEOUT) return;
+    {
+        LOCK(m_prebuild_mutex);
+        m_prebuild_requested = true;
+    }
+    m_prebuild_cv.notify_one();
+}
+
+void BlockTemplateBuilder::TransactionAddedToMempool(const CTransactionRef& tx)
+{
+    LOCK(m_pending_mutex);
+    if (m_pending.size() >= MAX_TEMPLATE_PENDING_TXS) {
+        // Nobody is asking for templates; the next one selects from the whole mempool.
+        m_pending.clear();
+        m_pending_overflow = true;
+    }
+    m_pending.insert(tx->GetHash());
+}
+
+void BlockTemplateBuilder::TransactionRemovedFromMempool(const CTransactionRef& tx, MemPoolRemovalReason reason)
+{
+    LOCK(m_pending_mutex);
+    m_pending.erase(tx->GetHash());
+}
+
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -442,3 +692,157 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
     pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
     pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 }
+
+namespace {
+class submitblock_StateCatcher final : public CValidationInterface
+{
+public:
+    uint256 hash;
+    bool found;
+    BlockValidationState state;
+
+    explicit submitblock_StateCatcher(const uint256 &hashIn) : hash(hashIn), found(false), state() {}
+
+protected:
+    void BlockChecked(const CBlock& block, const BlockValidationState& stateIn) override {
+        if (block.GetPoWHash() != hash)
+            return;
+        found = true;
+        state = stateIn;
+    }
+};
+} // namespace
+
+std::string SubmitBlock(const std::shared_ptr<CBlock>& blockptr, BlockValidationState& state)
+{
+    CBlock& block = *blockptr;
+    uint256 hash = block.GetPoWHash();
+    {
+        LOCK(cs_main);
+        const CBlockIndex* pindex = LookupBlockIndex(hash);
+        if (pindex) {
+            if (pindex->IsValid(BLOCK_VALID_SCRIPTS)) {
+                return "duplicate";
+            }
+            if (pindex->nStatus & BLOCK_FAILED_MASK) {
+                return "duplicate-invalid";
+            }
+        }
+    }
+
+    {
+        LOCK(cs_main);
+        const CBlockIndex* pindex = LookupBlockIndex(block.hashPrevBlock);
+        if (pindex) {
+            UpdateUncommittedBlockStructures(block, pindex, Params().GetConsensus());
+        }
+    }
+
+    bool new_block;
+    auto sc = std::make_shared<submitblock_StateCatcher>(hash);
+    RegisterSharedValidationInterface(sc);
+    bool accepted = ProcessNewBlock(Params(), blockptr, /* fForceProcessing */ true, /* fNewBlock */ &new_block);
+    UnregisterSharedValidationInterface(sc);
+    if (!new_block && accepted) {
+        return "duplicate";
+    }
+    if (!sc->found) {
+        return "inconclusive";
+    }
+    state = sc->state;
+    return "";
+}
+
+int GetMinerThreads()
+{
+    int n_threads = gArgs.GetArg("-minerthreads", DEFAULT_MINER_THREADS);
+    if (n_threads <= 0) {
+        n_threads += GetNumCores();
+    }
+    return std::max(1, std::min(n_threads, MAX_MINER_THREADS));
+}
+
+namespace {
+
+/** Targets expected to need fewer hashes than this are searched without worker threads. */
+const uint64_t MIN_THREADED_SEARCH_WORK = 1 << 14;
+/** Largest number of nonces a worker claims at once. */
+const uint64_t MAX_NONCE_CHUNK = 64;
+
+/** State shared by the workers of one SearchNonce call. */
+struct NonceSearch
+{
+    const CBlockHeader& header;
+    const HeavyHashMatrix& matrix;
+    const Consensus::Params& params;
+    //! Next unclaimed nonce.
+    std::atomic<uint64_t> next;
+    //! One past the last nonce worth trying; lowered to the best solution found so far.
+    std::atomic<uint64_t> limit;
+
+    NonceSearch(const CBlockHeader& header_, const HeavyHashMatrix& matrix_, const Consensus::Params& params_, uint64_t begin, uint64_t end)
+        : header(header_), matrix(matrix_), params(params_), next(begin), limit(end) {}
+
+    void Work()
+    {
+        std::vector<CBlockHeader> batch;
+        std::vector<uint256> hashes;
+        // Chunks start at one nonce and double, so trivial targets waste no hashes.
+        uint64_t chunk = 1;
+        while (!ShutdownRequested()) {
+            const uint64_t begin = next.fetch_add(chunk);
+            const uint64_t end = std::min(begin + chunk, limit.load());
+            if (begin >= end) break;
+            batch.assign(end - begin, header);
+            for (uint64_t i = 0; i < end - begin; ++i) {
+                batch[i].nNonce = begin + i;
+            }
+            hashes.resize(batch.size());
+            HeavyHashBatch(matrix, MakeSpan(static_cast<const std::vector<CBlockHeader>&>(batch)), MakeSpan(hashes));
+            for (uint64_t i = 0; i < end - begin; ++i) {
+                if (CheckProofOfWork(hashes[i], header.nBits, params)) {
+                    uint64_t best = limit.load();
+                    while (begin + i < best && !limit.compare_exchange_weak(best, begin + i)) {}
+                    break;
+                }
+            }
+            chunk = std::min(chunk * 2, MAX_NONCE_CHUNK);
+        }
+    }
+};
+
+} // namespace
+
+bool SearchNonce(CBlockHeader& block, const Consensus::Params& consensusParams, int n_threads, uint64_t& max_tries)
+{
+    const uint64_t begin = block.nNonce;
+    // The last nonce is never tried, which leaves room to detect exhaustion.
+    const uint64_t end = begin + std::min<uint64_t>(max_tries, std::numeric_limits<uint32_t>::max() - begin);
+    const auto matrix = block.GetPoWMatrix();
+    NonceSearch search(block, *matrix, consensusParams, begin, end);
+
+    bool negative, overflow;
+    arith_uint256 target;
+    target.SetCompact(block.nBits, &negative, &overflow);
+    const bool easy = negative || overflow || target == 0 || ((~target / (target + 1)) + 1) < MIN_THREADED_SEARCH_WORK;
+
+    if (n_threads <= 1 || easy) {
+        search.Work();
+    } else {
+        std::vector<std::thread> workers;
+        for (int i = 0; i < n_threads; ++i) {
+            workers.emplace_back(&NonceSearch::Work, &search);
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+    if (ShutdownRequested()) return false;
+
+    // Every nonce below the final limit has been tried, so the limit is either the lowest
+    // solution or the end of the range.
+    const uint64_t result = search.limit.load();
+    max_tries -= result - begin;
+    block.nNonce = result;
+    return result < end;
+}
@@ -8,11 +8,18 @@
 
 #include <optional.h>
 #include <primitives/block.h>
+#include <sync.h>
 #include <txmempool.h>
 #include <validation.h>
+#include <validationinterface.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <memory>
 #include <stdint.h>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
@@ -24,6 +31,16 @@ class CScript;
 namespace Consensus { struct Params; };
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Default for -minerthreads */
+static const int DEFAULT_MINER_THREADS = 1;
+/** Maximum number of nonce search threads */
+static const int MAX_MINER_THREADS = 64;
+/** Seconds after which a block template is selected from the whole mempool again */
+static const int64_t MAX_TEMPLATE_SELECTION_AGE = 60;
+/** Maximum number of announced transactions queued for the next block template */
+static const size_t MAX_TEMPLATE_PENDING_TXS = 100000;
+/** Seconds without a template request after which templates are no longer built ahead of time */
+static const int64_t TEMPLATE_PREBUILD_IDLE_TIMEOUT = 600;
 
 struct CBlockTemplate
 {
@@ -33,6 +50,22 @@ struct CBlockTemplate
     std::vector<unsigned char> vchCoinbaseCommitment;
 };
 
+/** The transactions picked for a block template, kept so that the next template
+ *  on the same tip can start from them. */
+struct TemplateSelection
+{
+    //! Block the template was built on
+    uint256 hashPrevBlock;
+    //! Selected transactions, in block order
+    std::vector<uint256> txids;
+    //! Whether every package paying the minimum fee rate made it into the block
+    bool complete{false};
+    //! Lowest feerate of the packages selected, if any
+    Optional<CFeeRate> minPackageFeeRate;
+    //! Time the selection was last made from the whole mempool
+    int64_t nTimeFullSelection{0};
+};
+
 // Container for tracking updates to ancestor feerate as we include (parent)
 // transactions in a block
 struct CTxMemPoolModifiedEntry {
@@ -142,6 +175,11 @@ private:
     uint64_t nBlockSigOpsCost;
     CAmount nFees;
     CTxMemPool::setEntries inBlock;
+    bool fPackagesLeftOut;
+    // Lowest feerate of the packages added so far
+    Optional<CFeeRate> m_min_package_feerate;
+    // Whether a package paying more than m_min_package_feerate did not fit
+    bool m_better_package_left_out;
 
     // Chain context for the block
     int nHeight;
@@ -162,6 +200,14 @@ public:
     /** Construct a new block template with coinbase to scriptPubKeyIn */
     std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn);
 
+    /** Construct a new block template like CreateNewBlock, reusing selection if it
+     *  was made on the current tip and left no package out: its transactions that
+     *  are still in the mempool are kept, and only candidates are considered for
+     *  the rest of the block. If a candidate that pays more than the cheapest kept
+     *  package does not fit, the block is selected from the whole mempool instead.
+     *  selection is updated to describe the new template. */
+    std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn, TemplateSelection& selection, const std::vector<uint256>& candidates);
+
     static Optional<int64_t> m_last_block_num_txs;
     static Optional<int64_t> m_last_block_weight;
 
@@ -169,14 +215,25 @@ private:
     // utility functions
     /** Clear the block's state and prepare for assembling a new block */
     void resetBlock();
+    /** Assemble the block, extending selection with candidates when possible */
+    std::unique_ptr<CBlockTemplate> AssembleBlock(const CScript& scriptPubKeyIn, TemplateSelection* selection, const std::vector<uint256>* candidates);
     /** Add a tx to the block */
     void AddToBlock(CTxMemPool::txiter iter);
+    /** Record that a package of the given fee and size was added to the block */
+    void AddedPackage(CAmount packageFees, uint64_t packageSize);
+    /** Record that a package of the given fee and size did not fit in the block */
+    void LeftOutPackage(CAmount packageFees, uint64_t packageSize);
 
     // Methods for how to add transactions to a block.
-    /** Add transactions based on feerate including unconfirmed ancestors
+    /** Add candidates (with their ancestors) to the block based on feerate
+      * including unconfirmed ancestors.
       * Increments nPackagesSelected / nDescendantsUpdated with corresponding
       * statistics from the package selection (for logging statistics). */
-    void addPackageTxs(int& nPackagesSelected, int& nDescendantsUpdated) EXCLUSIVE_LOCKS_REQUIRED(m_mempool.cs);
+    void addPackageTxs(int& nPackagesSelected, int& nDescendantsUpdated, const std::vector<CTxMemPool::txiter>& candidates) EXCLUSIVE_LOCKS_REQUIRED(m_mempool.cs);
+    /** Add the chunks of the mempool's linearized clusters in order of feerate.
+      * A chunk that does not fit leaves the rest of its cluster out.
+      * Increments nPackagesSelected by the number of chunks added. */
+    void addClusterChunks(int& nPackagesSelected) EXCLUSIVE_LOCKS_REQUIRED(m_mempool.cs);
 
     // helper functions for addPackageTxs()
     /** Remove confirmed (inBlock) entries from given set */
@@ -187,10 +244,7 @@ private:
       * locktime, premature-witness, serialized size (if necessary)
       * These checks should always succeed, and they're here
       * only as an extra check in case of suboptimal node configuration */
-    bool TestPackageTransactions(const CTxMemPool::setEntries& package);
-    /** Return true if given transaction from mapTx has already been evaluated,
-      * or if the transaction's cached data in mapTx is incorrect. */
-    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx) EXCLUSIVE_LOCKS_REQUIRED(m_mempool.cs);
+    bool TestPackageTransactions(const std::vector<CTxMemPool::txiter>& package);
     /** Sort the package in an order that is valid to appear in a block */
     void SortForBlock(const CTxMemPool::setEntries& package, std::vector<CTxMemPool::txiter>& sortedEntries);
     /** Add descendants of given transactions to mapModifiedTx with ancestor
@@ -199,8 +253,87 @@ private:
     int UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx) EXCLUSIVE_LOCKS_REQUIRED(m_mempool.cs);
 };
 
+/**
+ * Builds block templates for getblocktemplate, keeping the transaction selection
+ * of the last template. Transactions are queued as they enter the mempool, and
+ * while the tip stays the same and the last block had room for every package,
+ * the next template only considers the queued transactions instead of selecting
+ * packages from the whole mempool again.
+ *
+ * Once started, and while templates are being requested, the template for the
+ * next block is also built on a background thread as soon as the tip changes,
+ * so that it is ready (and announced through NewBlockTemplate) by the time
+ * miners ask for it.
+ */
+class BlockTemplateBuilder final : public CValidationInterface
+{
+public:
+    BlockTemplateBuilder(const CTxMemPool& mempool, const CChainParams& params);
+    ~BlockTemplateBuilder();
+
+    /** Construct a new block template with coinbase to scriptPubKeyIn */
+    std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn);
+
+    /** Start building templates in the background on tip changes */
+    void Start();
+    /** Stop the background thread */
+    void Stop();
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex* pindexNew, const CBlockIndex* pindexFork, bool fInitialDownload) override;
+    void TransactionAddedToMempool(const CTransactionRef& tx) override;
+    void TransactionRemovedFromMempool(const CTransactionRef& tx, MemPoolRemovalReason reason) override;
+
+private:
+    const CTxMemPool& m_mempool;
+    const CChainParams& m_chainparams;
+    TemplateSelection m_selection GUARDED_BY(cs_main);
+    //! The last template built, with the coinbase script and mempool state it was built from
+    std::unique_ptr<const CBlockTemplate> m_last_template GUARDED_BY(cs_main);
+    CScript m_last_script GUARDED_BY(cs_main);
+    unsigned int m_last_transactions_updated GUARDED_BY(cs_main){0};
+    //! Time of the last CreateNewBlock call
+    std::atomic<int64_t> m_last_request{0};
+
+    Mutex m_pending_mutex;
+    //! Transactions that entered the mempool since the last template
+    std::unordered_set<uint256, SaltedTxidHasher> m_pending GUARDED_BY(m_pending_mutex);
+    //! Set when m_pending grew too large and was dropped
+    bool m_pending_overflow GUARDED_BY(m_pending_mutex){false};
+
+    Mutex m_prebuild_mutex;
+    std::condition_variable m_prebuild_cv;
+    bool m_prebuild_requested GUARDED_BY(m_prebuild_mutex){false};
+    bool m_prebuild_stop GUARDED_BY(m_prebuild_mutex){false};
+    std::thread m_prebuild_thread;
+
+    std::unique_ptr<CBlockTemplate> BuildTemplate(const CScript& scriptPubKeyIn);
+    void ThreadPrebuild();
+};
+
+/**
+ * Process a block found by a miner, as the submitblock RPC does.
+ * @returns an empty string if the block was checked, with the result in state;
+ *          otherwise the BIP22 result ("duplicate", "duplicate-invalid" or "inconclusive").
+ */
+std::string SubmitBlock(const std::shared_ptr<CBlock>& blockptr, BlockValidationState& state);
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
 
+/** Returns the number of nonce search threads selected by -minerthreads. */
+int GetMinerThreads();
+
+/**
+ * Search the nonce space of pblock, starting at pblock->nNonce, for a proof of work.
+ * Up to n_threads workers split the space, all sharing the header's matrix; easy targets
+ * are searched on the calling thread only. The lowest solving nonce is returned, so
+ * the result does not depend on n_threads.
+ * max_tries is decreased by the number of nonces tried before the solution.
+ * @returns true with pblock->nNonce set on success; false if max_tries ran out, the
+ *          nonce space was exhausted or a shutdown was requested.
+ */
+bool SearchNonce(CBlockHeader& block, const Consensus::Params& consensusParams, int n_threads, uint64_t& max_tries);
+
 #endif // BITCOIN_MINER_H
@@ -2683,6 +2683,11 @@ ServiceFlags CConnman::GetLocalServices() const
     return nLocalServices;
 }
 
+void CConnman::RemoveLocalServices(ServiceFlags services)
+{
+    nLocalServices = ServiceFlags(nLocalServices & ~services);
+}
+
 void CConnman::SetBestHeight(int height)
 {
     nBestHeight.store(height, std::memory_order_release);
@@ -288,6 +288,10 @@ public:
     //! that peer during `net_processing.cpp:PushNodeVersion()`.
     ServiceFlags GetLocalServices() const;
 
+    //! Stop offering services to peers that connect from now on, e.g. when
+    //! the node stops having the block data that NODE_NETWORK promises.
+    void RemoveLocalServices(ServiceFlags services);
+
     //!set the max outbound target in bytes
     void SetMaxOutboundTarget(uint64_t limit);
     uint64_t GetMaxOutboundTarget();
@@ -426,12 +430,13 @@ private:
      * connection (in ConnectNode()) under a member also called
      * nLocalServices.
      *
-     * This data is not marked const, but after being set it should not
-     * change. See the note in CNode::nLocalServices documentation.
+     * After being set, it only changes through RemoveLocalServices(), which
+     * does not affect connections that already exist. See the note in
+     * CNode::nLocalServices documentation.
      *
      * \sa CNode::nLocalServices
      */
-    ServiceFlags nLocalServices;
+    std::atomic<ServiceFlags> nLocalServices;
 
     std::unique_ptr<CSemaphore> semOutbound;
     std::unique_ptr<CSemaphore> semAddnode;
@@ -1256,13 +1256,19 @@ void PeerLogicValidation::UpdatedBlockTip(const CBlockIndex *pindexNew, const CB
         // Find the hashes of all blocks that weren't previously in the best chain.
         std::vector<uint256> vHashes;
         const CBlockIndex *pindexToAnnounce = pindexNew;
-        while (pindexToAnnounce != pindexFork) {
-            vHashes.push_back(pindexToAnnounce->GetBlockHash());
-            pindexToAnnounce = pindexToAnnounce->pprev;
-            if (vHashes.size() == MAX_BLOCKS_TO_ANNOUNCE) {
-                // Limit announcements in case of a huge reorganization.
-                // Rely on the peer's synchronization mechanism in that case.
-                break;
+        {
+            LOCK(cs_main);
+            while (pindexToAnnounce != pindexFork) {
+                // Blocks up to a loaded UTXO snapshot were never downloaded,
+                // so they can not be served and are not announced.
+                if (!(pindexToAnnounce->nStatus & BLOCK_HAVE_DATA)) break;
+                vHashes.push_back(pindexToAnnounce->GetBlockHash());
+                pindexToAnnounce = pindexToAnnounce->pprev;
+                if (vHashes.size() == MAX_BLOCKS_TO_ANNOUNCE) {
+                    // Limit announcements in case of a huge reorganization.
+                    // Rely on the peer's synchronization mechanism in that case.
+                    break;
+                }
             }
         }
         // Relay inventory, but don't relay old inventory during initial block download.
@@ -1476,12 +1482,18 @@ void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, c
             pblock = a_recent_block;
         } else if (inv.type == MSG_WITNESS_BLOCK) {
             // Fast-path: in this case it is possible to serve the block directly from disk,
-            // as the network format matches the format on disk
-            std::vector<uint8_t> block_data;
-            if (!ReadRawBlockFromDisk(block_data, pindex, chainparams.MessageStart())) {
-                assert(!"cannot load block from disk");
+            // as the network format matches the format on disk. Prefer the mapped block
+            // file, which saves reading the block into a buffer of its own.
+            std::shared_ptr<const MappedFile> block_file;
+            Span<const uint8_t> block_data = MapRawBlockFromDisk(block_file, pindex, chainparams.MessageStart());
+            std::vector<uint8_t> block_buffer;
+            if (block_data.size() == 0) {
+                if (!ReadRawBlockFromDisk(block_buffer, pindex, chainparams.MessageStart())) {
+                    assert(!"cannot load block from disk");
+                }
+                block_data = Span<const uint8_t>(block_buffer.data(), block_buffer.size());
             }
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, MakeSpan(block_data)));
+            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, block_data));
             // Don't set pblock as we've sent the block
         } else {
             // Send block from disk
@@ -2382,6 +2394,10 @@ bool ProcessMessage(CNode* pfrom, const std::string& msg_type, CDataStream& vRec
                 LogPrint(BCLog::NET, " getblocks stopping, pruned or too old block at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
                 break;
             }
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA)) {
+                LogPrint(BCLog::NET, " getblocks stopping, no data for block at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0)
             {
@@ -8,66 +8,319 @@
 #include <coins.h>
 #include <hash.h>
 #include <serialize.h>
+#include <streams.h>
+#include <sync.h>
+#include <txdb.h>
 #include <validation.h>
 #include <uint256.h>
 #include <util/system.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <map>
+#include <thread>
 
-static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
+uint64_t GetBogoSize(const CScript& scriptPubKey)
+{
+    return 32 /* txid */ + 4 /* vout index */ + 4 /* height + coinbase */ + 8 /* amount */ +
+           2 /* scriptPubKey len */ + scriptPubKey.size() /* scriptPubKey */;
+}
+
+std::vector<unsigned char> TxOutSer(const COutPoint& outpoint, const Coin& coin)
+{
+    std::vector<unsigned char> ser;
+    CVectorWriter ss(SER_DISK, PROTOCOL_VERSION, ser, 0);
+    ss << outpoint;
+    ss << static_cast<uint32_t>(coin.nHeight * 2 + coin.fCoinBase);
+    ss << coin.out;
+    return ser;
+}
+
+template <typename Stream>
+static void ApplyStats(CCoinsStats &stats, CoinStatsHashType hash_type, Stream& ss, MuHash3072& muhash, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
 {
     assert(!outputs.empty());
-    ss << hash;
-    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase ? 1u : 0u);
+    if (hash_type == CoinStatsHashType::HASH_SERIALIZED) {
+        ss << hash;
+        ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase ? 1u : 0u);
+    }
     stats.nTransactions++;
     for (const auto& output : outputs) {
-        ss << VARINT(output.first + 1);
-        ss << output.second.out.scriptPubKey;
-        ss << VARINT_MODE(output.second.out.nValue, VarIntMode::NONNEGATIVE_SIGNED);
+        if (hash_type == CoinStatsHashType::HASH_SERIALIZED) {
+            ss << VARINT(output.first + 1);
+            ss << output.second.out.scriptPubKey;
+            ss << VARINT_MODE(output.second.out.nValue, VarIntMode::NONNEGATIVE_SIGNED);
+        } else if (hash_type == CoinStatsHashType::MUHASH) {
+            const std::vector<unsigned char> ser = TxOutSer(COutPoint(hash, output.first), output.second);
+            muhash.Insert(MakeSpan(ser));
+        }
         stats.nTransactionOutputs++;
         stats.nTotalAmount += output.second.out.nValue;
-        stats.nBogoSize += 32 /* txid */ + 4 /* vout index */ + 4 /* height + coinbase */ + 8 /* amount */ +
-                           2 /* scriptPubKey len */ + output.second.out.scriptPubKey.size() /* scriptPubKey */;
+        stats.nBogoSize += GetBogoSize(output.second.out.scriptPubKey);
+    }
+    if (hash_type == CoinStatsHashType::HASH_SERIALIZED) {
+        ss << VARINT(0u);
+    }
+}
+
+CoinsStatsHasher::CoinsStatsHasher(const uint256& hashBlock, CoinStatsHashType hash_type)
+    : m_hash_type(hash_type), m_ss(SER_GETHASH, PROTOCOL_VERSION), m_range(false), m_serialized(SER_GETHASH, PROTOCOL_VERSION)
+{
+    m_stats.hashBlock = hashBlock;
+    m_ss << hashBlock;
+}
+
+CoinsStatsHasher::CoinsStatsHasher(CoinStatsHashType hash_type)
+    : m_hash_type(hash_type), m_ss(SER_GETHASH, PROTOCOL_VERSION), m_range(true), m_serialized(SER_GETHASH, PROTOCOL_VERSION)
+{
+}
+
+CoinsStatsHasher CoinsStatsHasher::ForRange(CoinStatsHashType hash_type)
+{
+    return CoinsStatsHasher(hash_type);
+}
+
+void CoinsStatsHasher::ApplyOutputs()
+{
+    if (m_range) {
+        ApplyStats(m_stats, m_hash_type, m_serialized, m_muhash, m_prevkey, m_outputs);
+    } else {
+        ApplyStats(m_stats, m_hash_type, m_ss, m_muhash, m_prevkey, m_outputs);
+    }
+    m_outputs.clear();
+}
+
+void CoinsStatsHasher::Add(const COutPoint& outpoint, Coin&& coin)
+{
+    if (!m_outputs.empty() && outpoint.hash != m_prevkey) {
+        ApplyOutputs();
+    }
+    m_prevkey = outpoint.hash;
+    m_outputs[outpoint.n] = std::move(coin);
+    m_stats.coins_count++;
+}
+
+void CoinsStatsHasher::TakeSerialized(CDataStream& out, bool last)
+{
+    assert(m_range);
+    if (last && !m_outputs.empty()) {
+        ApplyOutputs();
+    }
+    out = std::move(m_serialized);
+    m_serialized = CDataStream(SER_GETHASH, PROTOCOL_VERSION);
+}
+
+void CoinsStatsHasher::AddSerialized(const CDataStream& data)
+{
+    assert(!m_range);
+    m_ss.write(data.data(), data.size());
+}
+
+void CoinsStatsHasher::Merge(const CoinsStatsHasher& range)
+{
+    assert(range.m_range && range.m_outputs.empty() && range.m_serialized.empty());
+    m_stats.nTransactions += range.m_stats.nTransactions;
+    m_stats.nTransactionOutputs += range.m_stats.nTransactionOutputs;
+    m_stats.nBogoSize += range.m_stats.nBogoSize;
+    m_stats.nTotalAmount += range.m_stats.nTotalAmount;
+    m_stats.coins_count += range.m_stats.coins_count;
+    m_muhash *= range.m_muhash;
+}
+
+void CoinsStatsHasher::Finalize(CCoinsStats& stats)
+{
+    assert(!m_range);
+    if (!m_outputs.empty()) {
+        ApplyOutputs();
+    }
+    switch (m_hash_type) {
+    case CoinStatsHashType::HASH_SERIALIZED:
+        m_stats.hashSerialized = m_ss.GetHash();
+        break;
+    case CoinStatsHashType::MUHASH:
+        m_muhash.Finalize(m_stats.hashSerialized);
+        break;
+    case CoinStatsHashType::NONE:
+        break;
+    }
+    stats = m_stats;
+}
+
+int GetCoinsScanThreads(int n_threads)
+{
+    if (n_threads <= 0) {
+        n_threads += GetNumCores();
     }
-    ss << VARINT(0u);
+    return std::max(1, std::min(n_threads, MAX_COINS_SCAN_THREADS));
+}
+
+CCoinsViewDBRanges GetCoinsScanRanges(const CCoinsViewDB& view, int n_threads)
+{
+    return view.Ranges(n_threads > 1 ? COINS_SCAN_RANGES : 1);
+}
+
+bool ReadCoinsInOrder(const CCoinsViewDBRanges& ranges, int n_threads, const CoinsRangeReader& read, const CoinsChunkConsumer& consume)
+{
+    const CoinsChunkSink consume_now = [&consume](CDataStream&& chunk) { return consume(chunk); };
+    if (n_threads <= 1) {
+        for (size_t i = 0; i < ranges.Count(); ++i) {
+            if (!read(i, *ranges.Cursor(i), consume_now)) return false;
+        }
+        return true;
+    }
+
+    struct Range {
+        std::deque<CDataStream> chunks;
+        bool done{false};
+        bool ok{false};
+        std::exception_ptr exception;
+    };
+
+    Mutex mutex;
+    std::condition_variable cond;
+    std::vector<Range> state(ranges.Count());
+    //! Next range a reader may claim.
+    size_t next_range = 0;
+    //! Range whose chunks the calling thread is consuming.
+    size_t consuming = 0;
+    bool abort = false;
+    // Readers stay at most this many ranges ahead of the consumer, which bounds
+    // the output waiting in memory.
+    const size_t window = 2 * n_threads;
+
+    std::vector<std::thread> readers;
+    for (int t = 0; t < n_threads; ++t) {
+        readers.emplace_back([&] {
+            while (true) {
+                size_t i;
+                {
+                    WAIT_LOCK(mutex, lock);
+                    cond.wait(lock, [&] { return abort || next_range >= state.size() || next_range < consuming + window; });
+                    if (abort || next_range >= state.size()) return;
+                    i = next_range++;
+                }
+                const CoinsChunkSink emit = [&, i](CDataStream&& chunk) {
+                    LOCK(mutex);
+                    if (abort) return false;
+                    state[i].chunks.push_back(std::move(chunk));
+                    cond.notify_all();
+                    return true;
+                };
+                bool ok = false;
+                std::exception_ptr exception;
+                try {
+                    ok = read(i, *ranges.Cursor(i), emit);
+                } catch (...) {
+                    exception = std::current_exception();
+                }
+                LOCK(mutex);
+                state[i].done = true;
+                state[i].ok = ok;
+                state[i].exception = exception;
+                cond.notify_all();
+            }
+        });
+    }
+
+    bool ok = true;
+    std::exception_ptr consume_exception;
+    for (size_t i = 0; i < state.size() && ok; ++i) {
+        {
+            LOCK(mutex);
+            consuming = i;
+            cond.notify_all();
+        }
+        while (true) {
+            CDataStream chunk(SER_DISK, CLIENT_VERSION);
+            {
+                WAIT_LOCK(mutex, lock);
+                cond.wait(lock, [&] { return !state[i].chunks.empty() || state[i].done; });
+                if (state[i].chunks.empty()) {
+                    ok = state[i].ok;
+                    break;
+                }
+                chunk = std::move(state[i].chunks.front());
+                state[i].chunks.pop_front();
+            }
+            try {
+                ok = consume(chunk);
+            } catch (...) {
+                consume_exception = std::current_exception();
+                ok = false;
+            }
+            if (!ok) break;
+        }
+    }
+
+    {
+        // Stop the readers if the scan failed before the last range.
+        LOCK(mutex);
+        abort = true;
+        cond.notify_all();
+    }
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    if (consume_exception) std::rethrow_exception(consume_exception);
+    for (const Range& range : state) {
+        if (range.exception) std::rethrow_exception(range.exception);
+    }
+    return ok;
 }
 
 //! Calculate statistics about the unspent transaction output set
-bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
+bool GetUTXOStats(CCoinsViewDB* view, CCoinsStats& stats, CoinStatsHashType hash_type, int n_threads)
+{
+    n_threads = GetCoinsScanThreads(n_threads);
+    return GetUTXOStats(view, GetCoinsScanRanges(*view, n_threads), stats, hash_type, n_threads);
+}
+
+bool GetUTXOStats(CCoinsViewDB* view, const CCoinsViewDBRanges& ranges, CCoinsStats& stats, CoinStatsHashType hash_type, int n_threads)
 {
     stats = CCoinsStats();
-    std::unique_ptr<CCoinsViewCursor> pcursor(view->Cursor());
-    assert(pcursor);
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = pcursor->GetBestBlock();
-    {
-        LOCK(cs_main);
-        stats.nHeight = LookupBlockIndex(stats.hashBlock)->nHeight;
-    }
-    ss << stats.hashBlock;
-    uint256 prevkey;
-    std::map<uint32_t, Coin> outputs;
-    while (pcursor->Valid()) {
-        COutPoint key;
-        Coin coin;
-        if (pcursor->GetKey(key) && pcursor->GetValue(coin)) {
-            if (!outputs.empty() && key.hash != prevkey) {
-                ApplyStats(stats, ss, prevkey, outputs);
-                outputs.clear();
+    // Each range is accounted separately, so ranges can be read in parallel.
+    // Only the hash_serialized_2 data has to be hashed in key order, which is
+    // the order ReadCoinsInOrder() hands it over in.
+    CoinsStatsHasher hasher(ranges.GetBestBlock(), hash_type);
+    std::vector<CoinsStatsHasher> range_hashers(ranges.Count(), CoinsStatsHasher::ForRange(hash_type));
+    const bool ok = ReadCoinsInOrder(ranges, n_threads,
+        [&range_hashers](size_t range, CCoinsViewCursor& cursor, const CoinsChunkSink& emit) {
+            CoinsStatsHasher& range_hasher = range_hashers[range];
+            CDataStream chunk(SER_GETHASH, PROTOCOL_VERSION);
+            COutPoint key;
+            Coin coin;
+            for (size_t n_coins = 1; cursor.Valid(); cursor.Next(), ++n_coins) {
+                if (!cursor.GetKey(key) || !cursor.GetValue(coin)) {
+                    return error("GetUTXOStats: unable to read value");
+                }
+                range_hasher.Add(key, std::move(coin));
+                if (n_coins % COINS_SCAN_CHUNK_COINS == 0) {
+                    range_hasher.TakeSerialized(chunk, /* last */ false);
+                    if (!chunk.empty() && !emit(std::move(chunk))) return false;
+                }
             }
-            prevkey = key.hash;
-            outputs[key.n] = std::move(coin);
-            stats.coins_count++;
-        } else {
-            return error("%s: unable to read value", __func__);
-        }
-        pcursor->Next();
+            range_hasher.TakeSerialized(chunk, /* last */ true);
+            return chunk.empty() || emit(std::move(chunk));
+        },
+        [&hasher](const CDataStream& chunk) {
+            hasher.AddSerialized(chunk);
+            return true;
+        });
+    if (!ok) return false;
+
+    for (const CoinsStatsHasher& range_hasher : range_hashers) {
+        hasher.Merge(range_hasher);
     }
-    if (!outputs.empty()) {
-        ApplyStats(stats, ss, prevkey, outputs);
+    hasher.Finalize(stats);
+    {
+        LOCK(cs_main);
+        const CBlockIndex* pindex = LookupBlockIndex(stats.hashBlock);
+        if (!pindex) return error("GetUTXOStats: unknown best block %s", stats.hashBlock.ToString());
+        stats.nHeight = pindex->nHeight;
     }
-    stats.hashSerialized = ss.GetHash();
     stats.nDiskSize = view->EstimateSize();
     return true;
 }
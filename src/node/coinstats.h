@@ -7,11 +7,25 @@
 #define BITCOIN_NODE_COINSTATS_H
 
 #include <amount.h>
+#include <coins.h>
+#include <crypto/muhash.h>
+#include <hash.h>
+#include <streams.h>
 #include <uint256.h>
 
 #include <cstdint>
+#include <functional>
+#include <map>
+#include <vector>
 
-class CCoinsView;
+class CCoinsViewDB;
+class CCoinsViewDBRanges;
+
+enum class CoinStatsHashType {
+    HASH_SERIALIZED, //!< hash_serialized_2: SHA256d over the set in key order
+    MUHASH,          //!< MuHash3072 of every coin, maintainable per block
+    NONE,
+};
 
 struct CCoinsStats
 {
@@ -20,6 +34,7 @@ struct CCoinsStats
     uint64_t nTransactions{0};
     uint64_t nTransactionOutputs{0};
     uint64_t nBogoSize{0};
+    //! Set hash of the kind requested from GetUTXOStats (null for NONE).
     uint256 hashSerialized{};
     uint64_t nDiskSize{0};
     CAmount nTotalAmount{0};
@@ -28,7 +43,108 @@ struct CCoinsStats
     uint64_t coins_count{0};
 };
 
-//! Calculate statistics about the unspent transaction output set
-bool GetUTXOStats(CCoinsView* view, CCoinsStats& stats);
+//! Size a coin with this scriptPubKey contributes to CCoinsStats::nBogoSize.
+uint64_t GetBogoSize(const CScript& scriptPubKey);
+
+//! Serialization of a coin as it enters the MUHASH set hash.
+std::vector<unsigned char> TxOutSer(const COutPoint& outpoint, const Coin& coin);
+
+/**
+ * Accumulates CCoinsStats over coins fed in the coins database key order, as
+ * a CCoinsViewCursor or a dumptxoutset snapshot yields them, so the same
+ * hashSerialized can be computed without a CCoinsView.
+ */
+class CoinsStatsHasher
+{
+public:
+    explicit CoinsStatsHasher(const uint256& hashBlock, CoinStatsHashType hash_type = CoinStatsHashType::HASH_SERIALIZED);
+
+    void Add(const COutPoint& outpoint, Coin&& coin);
+
+    //! Fill in the accumulated statistics. Invalidates the object.
+    void Finalize(CCoinsStats& stats);
+
+    /**
+     * A hasher for one range of a set that is scanned in parallel. Since
+     * hash_serialized_2 covers the whole set in key order, it does not hash its
+     * data itself but hands it out through TakeSerialized().
+     */
+    static CoinsStatsHasher ForRange(CoinStatsHashType hash_type);
+
+    //! Move the data of the transactions completed so far to out; with last, of all coins added.
+    void TakeSerialized(CDataStream& out, bool last);
+
+    //! Hash data taken from a range hasher. Ranges must be added in key order.
+    void AddSerialized(const CDataStream& data);
+
+    //! Add the rest of the statistics of a range hasher whose data has all been taken.
+    void Merge(const CoinsStatsHasher& range);
+
+private:
+    explicit CoinsStatsHasher(CoinStatsHashType hash_type);
+
+    void ApplyOutputs();
+
+    CCoinsStats m_stats;
+    const CoinStatsHashType m_hash_type;
+    CHashWriter m_ss;
+    MuHash3072 m_muhash;
+    uint256 m_prevkey;
+    std::map<uint32_t, Coin> m_outputs;
+    //! Whether this is a range hasher, which collects its data in m_serialized.
+    const bool m_range;
+    CDataStream m_serialized;
+};
+
+/** Maximum number of threads reading the coins database in a full scan */
+static const int MAX_COINS_SCAN_THREADS = 16;
+/** Number of ranges a parallel scan splits the coins database into */
+static const size_t COINS_SCAN_RANGES = 4096;
+/** Coins a reader accounts before handing over its output */
+static const size_t COINS_SCAN_CHUNK_COINS = 4096;
+
+/** Number of threads for a full scan: 0 means one per core, and a negative value leaves that many cores free. */
+int GetCoinsScanThreads(int n_threads);
+
+/** Split view into ranges for a scan on n_threads threads, taking a snapshot of it. */
+CCoinsViewDBRanges GetCoinsScanRanges(const CCoinsViewDB& view, int n_threads);
+
+//! Passes a chunk of a range's output to the consumer; false once the scan is stopped.
+using CoinsChunkSink = std::function<bool(CDataStream&&)>;
+//! Reads one range of coins and passes its output on in chunks; false on failure.
+using CoinsRangeReader = std::function<bool(size_t range, CCoinsViewCursor& cursor, const CoinsChunkSink& emit)>;
+//! Takes a chunk of output; false to stop the scan.
+using CoinsChunkConsumer = std::function<bool(const CDataStream& chunk)>;
+
+/**
+ * Read the coins of all ranges on n_threads threads, and hand what the reads
+ * produce to the calling thread in key order.
+ *
+ * read is called once for each range, on a worker thread. It may pass chunks of
+ * output to emit. consume is called on the calling thread with the chunks of
+ * the first range, then of the second range, and so on. So the output is the
+ * same as a single reader over the whole set would give, whatever the number
+ * of threads. Workers claim ranges in order and stay a few ranges ahead of
+ * the consumer, which bounds the output held in memory.
+ *
+ * With one thread, everything runs on the calling thread. An exception thrown
+ * by read is rethrown on the calling thread.
+ * @returns false if read or consume returned false.
+ */
+bool ReadCoinsInOrder(const CCoinsViewDBRanges& ranges, int n_threads, const CoinsRangeReader& read, const CoinsChunkConsumer& consume);
+
+/**
+ * Calculate statistics about the unspent transaction output set.
+ * The coins are read on GetCoinsScanThreads(n_threads) threads; the result
+ * does not depend on the number of threads.
+ */
+bool GetUTXOStats(CCoinsViewDB* view, CCoinsStats& stats, CoinStatsHashType hash_type = CoinStatsHashType::HASH_SERIALIZED, int n_threads = 0);
+
+/**
+ * Calculate statistics about the unspent transaction output set from ranges
+ * that GetCoinsScanRanges() took of view earlier, for callers that have to
+ * take the snapshot while holding a lock.
+ */
+bool GetUTXOStats(CCoinsViewDB* view, const CCoinsViewDBRanges& ranges, CCoinsStats& stats, CoinStatsHashType hash_type, int n_threads);
 
 #endif // BITCOIN_NODE_COINSTATS_H
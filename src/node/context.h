@@ -9,6 +9,7 @@
 #include <vector>
 
 class BanMan;
+class BlockTemplateBuilder;
 class CConnman;
 class CScheduler;
 class CTxMemPool;
@@ -32,6 +33,7 @@ struct NodeContext {
     std::unique_ptr<CConnman> connman;
     CTxMemPool* mempool{nullptr}; // Currently a raw pointer because the memory is not managed by this struct
     std::unique_ptr<PeerLogicValidation> peer_logic;
+    std::unique_ptr<BlockTemplateBuilder> template_builder;
     std::unique_ptr<BanMan> banman;
     std::unique_ptr<interfaces::Chain> chain;
     std::vector<std::unique_ptr<interfaces::ChainClient>> chain_clients;
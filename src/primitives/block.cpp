@@ -4,21 +4,66 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <primitives/block.h>
+#include <crypto/sha3.h>
 #include <hash.h>
+#include <streams.h>
 #include <tinyformat.h>
 
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
 uint256 CBlockHeader::GetHash() const
 {
     return GetPoWHash();
 }
 
 uint256 CBlockHeader::GetPoWHash() const
+{
+    return SerializeHeavyHash(*this, *GetPoWMatrix());
+}
+
+std::shared_ptr<const HeavyHashMatrix> CBlockHeader::GetPoWMatrix() const
 {
     uint256 seed;
     CSHA3_256().Write(hashPrevBlock.begin(), 32).Finalize(seed.begin());
-    uint64_t matrix[64*64];
-    GenerateHeavyHashMatrix(seed, matrix);
-    return SerializeHeavyHash(*this, matrix);
+    return GetHeavyHashMatrix(seed);
+}
+
+void HeavyHashBatch(const HeavyHashMatrix& matrix, Span<const CBlockHeader> headers, Span<uint256> out)
+{
+    assert(headers.size() == out.size());
+
+    // Headers are processed in fixed-size chunks so the scratch buffers stay in L1.
+    static const size_t CHUNK = 16;
+    static const size_t HEADER_SIZE = 80;
+    std::vector<unsigned char> serialized(CHUNK * HEADER_SIZE);
+    unsigned char first[CHUNK * 32];
+    unsigned char xored[CHUNK * 32];
+    unsigned char result[CHUNK * 32];
+
+    for (std::ptrdiff_t start = 0; start < headers.size(); start += CHUNK) {
+        const size_t count = std::min<std::ptrdiff_t>(CHUNK, headers.size() - start);
+        for (size_t i = 0; i < count; ++i) {
+            CVectorWriter(SER_GETHASH, PROTOCOL_VERSION, serialized, i * HEADER_SIZE, headers[start + i]);
+        }
+        assert(serialized.size() == CHUNK * HEADER_SIZE);
+
+        SHA3_256_80(first, serialized.data(), count);
+        for (size_t i = 0; i < count; ++i) {
+            uint256 hash_first;
+            memcpy(hash_first.begin(), first + 32 * i, 32);
+            const uint256 product = MultiplyUsing4bitPrecision(matrix, hash_first);
+            for (size_t j = 0; j < 32; ++j) {
+                xored[32 * i + j] = hash_first.begin()[j] ^ product.begin()[j];
+            }
+        }
+        SHA3_256_32(result, xored, count);
+
+        for (size_t i = 0; i < count; ++i) {
+            memcpy(out[start + i].begin(), result + 32 * i, 32);
+        }
+    }
 }
 
 std::string CBlock::ToString() const
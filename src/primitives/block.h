@@ -8,8 +8,13 @@
 
 #include <primitives/transaction.h>
 #include <serialize.h>
+#include <span.h>
 #include <uint256.h>
 
+#include <memory>
+
+class HeavyHashMatrix;
+
 /** Nodes collect new transactions into a block, hash them into a hash tree,
  * and scan through nonce values to make the block's hash satisfy proof-of-work
  * requirements.  When they solve the proof-of-work, they broadcast the block
@@ -62,6 +67,8 @@ public:
 
     uint256 GetHash() const;
     uint256 GetPoWHash() const;
+    /** The HeavyHash matrix this header is hashed with; shared by all children of hashPrevBlock. */
+    std::shared_ptr<const HeavyHashMatrix> GetPoWMatrix() const;
 
     int64_t GetBlockTime() const
     {
@@ -69,6 +76,13 @@ public:
     }
 };
 
+/** Computes the proof-of-work hash of every header in \p headers into \p out.
+ * All headers must share one hashPrevBlock, whose matrix is passed in, so the matrix is
+ * looked up once. The SHA3 stages run several headers at a time through the multi-way
+ * kernels, which makes this faster than calling GetPoWHash() per header.
+ * @pre headers.size() == out.size()
+ */
+void HeavyHashBatch(const HeavyHashMatrix& matrix, Span<const CBlockHeader> headers, Span<uint256> out);
 
 class CBlock : public CBlockHeader
 {
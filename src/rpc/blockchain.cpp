@@ -14,6 +14,9 @@
 #include <core_io.h>
 #include <hash.h>
 #include <index/blockfilterindex.h>
+#include <index/coinstatsindex.h>
+#include <index/txindex.h>
+#include <net.h>
 #include <node/coinstats.h>
 #include <node/context.h>
 #include <node/utxo_snapshot.h>
@@ -952,48 +955,139 @@ static UniValue pruneblockchain(const JSONRPCRequest& request)
     return uint64_t(block->nHeight);
 }
 
+static CBlockIndex* ParseHashOrHeight(const UniValue& param) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    CBlockIndex* pindex;
+    if (param.isNum()) {
+        const int height = param.get_int();
+        const int current_tip = ::ChainActive().Height();
+        if (height < 0) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Target block height %d is negative", height));
+        }
+        if (height > current_tip) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Target block height %d after current tip %d", height, current_tip));
+        }
+
+        pindex = ::ChainActive()[height];
+    } else {
+        const uint256 hash(ParseHashV(param, "hash_or_height"));
+        pindex = LookupBlockIndex(hash);
+        if (!pindex) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        }
+        if (!::ChainActive().Contains(pindex)) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Block is not in chain %s", Params().NetworkIDString()));
+        }
+    }
+    return pindex;
+}
+
+static CoinStatsHashType ParseHashType(const std::string& hash_type_input)
+{
+    if (hash_type_input == "hash_serialized_2") {
+        return CoinStatsHashType::HASH_SERIALIZED;
+    } else if (hash_type_input == "muhash") {
+        return CoinStatsHashType::MUHASH;
+    } else if (hash_type_input == "none") {
+        return CoinStatsHashType::NONE;
+    } else {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("%s is not a valid hash_type", hash_type_input));
+    }
+}
+
 static UniValue gettxoutsetinfo(const JSONRPCRequest& request)
 {
             RPCHelpMan{"gettxoutsetinfo",
                 "\nReturns statistics about the unspent transaction output set.\n"
-                "Note this call may take some time.\n",
-                {},
+                "Note this call may take some time unless -coinstatsindex is enabled and hash_type is not hash_serialized_2.\n",
+                {
+                    {"hash_type", RPCArg::Type::STR, /* default */ "hash_serialized_2", "Which UTXO set hash should be calculated. Options: 'hash_serialized_2' (the legacy algorithm), 'muhash', 'none'."},
+                    {"hash_or_height", RPCArg::Type::NUM, /* default */ "the current best block", "The block hash or height of the target height (only available with coinstatsindex).", "", {"", "string or numeric"}},
+                },
                 RPCResult{
                     RPCResult::Type::OBJ, "", "",
                     {
-                        {RPCResult::Type::NUM, "height", "The current block height (index)"},
-                        {RPCResult::Type::STR_HEX, "bestblock", "The hash of the block at the tip of the chain"},
-                        {RPCResult::Type::NUM, "transactions", "The number of transactions with unspent outputs"},
+                        {RPCResult::Type::NUM, "height", "The block height (index) of the returned statistics"},
+                        {RPCResult::Type::STR_HEX, "bestblock", "The hash of the block at which these statistics are calculated"},
+                        {RPCResult::Type::NUM, "transactions", "The number of transactions with unspent outputs (not available when coinstatsindex is used)"},
                         {RPCResult::Type::NUM, "txouts", "The number of unspent transaction outputs"},
                         {RPCResult::Type::NUM, "bogosize", "A meaningless metric for UTXO set size"},
-                        {RPCResult::Type::STR_HEX, "hash_serialized_2", "The serialized hash"},
-                        {RPCResult::Type::NUM, "disk_size", "The estimated size of the chainstate on disk"},
+                        {RPCResult::Type::STR_HEX, "hash_serialized_2", "The serialized hash (only present if 'hash_serialized_2' hash_type is chosen)"},
+                        {RPCResult::Type::STR_HEX, "muhash", "The serialized hash (only present if 'muhash' hash_type is chosen)"},
+                        {RPCResult::Type::NUM, "disk_size", "The estimated size of the chainstate on disk (not available when coinstatsindex is used)"},
                         {RPCResult::Type::STR_AMOUNT, "total_amount", "The total amount"},
                     }},
                 RPCExamples{
                     HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", R"("none")")
+            + HelpExampleCli("gettxoutsetinfo", R"("none" 1000)")
+            + HelpExampleCli("gettxoutsetinfo", R"("muhash" '"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09"')")
             + HelpExampleRpc("gettxoutsetinfo", "")
+            + HelpExampleRpc("gettxoutsetinfo", R"("none")")
+            + HelpExampleRpc("gettxoutsetinfo", R"("muhash", 1000)")
                 },
             }.Check(request);
 
     UniValue ret(UniValue::VOBJ);
 
+    const CoinStatsHashType hash_type = request.params[0].isNull() ? CoinStatsHashType::HASH_SERIALIZED : ParseHashType(request.params[0].get_str());
     CCoinsStats stats;
-    ::ChainstateActive().ForceFlushStateToDisk();
 
-    CCoinsView* coins_view = WITH_LOCK(cs_main, return &ChainstateActive().CoinsDB());
-    if (GetUTXOStats(coins_view, stats)) {
-        ret.pushKV("height", (int64_t)stats.nHeight);
-        ret.pushKV("bestblock", stats.hashBlock.GetHex());
+    // hash_serialized_2 is defined over the set in key order and always needs
+    // a scan of the chainstate; everything else can come from the index.
+    const bool use_index = g_coin_stats_index && hash_type != CoinStatsHashType::HASH_SERIALIZED;
+    if (use_index) {
+        g_coin_stats_index->BlockUntilSyncedToCurrentChain();
+
+        const CBlockIndex* pindex;
+        {
+            LOCK(cs_main);
+            pindex = request.params[1].isNull() ? ::ChainActive().Tip() : ParseHashOrHeight(request.params[1]);
+        }
+        if (!g_coin_stats_index->LookUpStats(pindex, stats)) {
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+        }
+    } else {
+        if (!request.params[1].isNull()) {
+            if (!g_coin_stats_index) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Querying specific block heights requires coinstatsindex");
+            }
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "hash_serialized_2 hash type cannot be queried for a specific block");
+        }
+
+        const int n_threads = GetCoinsScanThreads(0);
+        CCoinsViewDB* coins_view;
+        std::unique_ptr<CCoinsViewDBRanges> ranges;
+        {
+            // Holding cs_main keeps a background coins write from starting
+            // between the flush and the snapshot the scan reads from.
+            LOCK(cs_main);
+            ::ChainstateActive().ForceFlushStateToDisk();
+            coins_view = &::ChainstateActive().CoinsDB();
+            ranges = MakeUnique<CCoinsViewDBRanges>(GetCoinsScanRanges(*coins_view, n_threads));
+        }
+        if (!GetUTXOStats(coins_view, *ranges, stats, hash_type, n_threads)) {
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+        }
+    }
+
+    ret.pushKV("height", (int64_t)stats.nHeight);
+    ret.pushKV("bestblock", stats.hashBlock.GetHex());
+    if (!use_index) {
         ret.pushKV("transactions", (int64_t)stats.nTransactions);
-        ret.pushKV("txouts", (int64_t)stats.nTransactionOutputs);
-        ret.pushKV("bogosize", (int64_t)stats.nBogoSize);
+    }
+    ret.pushKV("txouts", (int64_t)stats.nTransactionOutputs);
+    ret.pushKV("bogosize", (int64_t)stats.nBogoSize);
+    if (hash_type == CoinStatsHashType::HASH_SERIALIZED) {
         ret.pushKV("hash_serialized_2", stats.hashSerialized.GetHex());
+    }
+    if (hash_type == CoinStatsHashType::MUHASH) {
+        ret.pushKV("muhash", stats.hashSerialized.GetHex());
+    }
+    if (!use_index) {
         ret.pushKV("disk_size", stats.nDiskSize);
-        ret.pushKV("total_amount", ValueFromAmount(stats.nTotalAmount));
-    } else {
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
     }
+    ret.pushKV("total_amount", ValueFromAmount(stats.nTotalAmount));
     return ret;
 }
 
@@ -1728,29 +1822,7 @@ static UniValue getblockstats(const JSONRPCRequest& request)
 
     LOCK(cs_main);
 
-    CBlockIndex* pindex;
-    if (request.params[0].isNum()) {
-        const int height = request.params[0].get_int();
-        const int current_tip = ::ChainActive().Height();
-        if (height < 0) {
-            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Target block height %d is negative", height));
-        }
-        if (height > current_tip) {
-            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Target block height %d after current tip %d", height, current_tip));
-        }
-
-        pindex = ::ChainActive()[height];
-    } else {
-        const uint256 hash(ParseHashV(request.params[0], "hash_or_height"));
-        pindex = LookupBlockIndex(hash);
-        if (!pindex) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-        }
-        if (!::ChainActive().Contains(pindex)) {
-            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Block is not in chain %s", Params().NetworkIDString()));
-        }
-    }
-
+    CBlockIndex* pindex = ParseHashOrHeight(request.params[0]);
     CHECK_NONFATAL(pindex != nullptr);
 
     std::set<std::string> stats;
@@ -2279,19 +2351,19 @@ UniValue dumptxoutset(const JSONRPCRequest& request)
 
     FILE* file{fsbridge::fopen(temppath, "wb")};
     CAutoFile afile{file, SER_DISK, CLIENT_VERSION};
-    std::unique_ptr<CCoinsViewCursor> pcursor;
+    const int n_threads = GetCoinsScanThreads(0);
+    std::unique_ptr<CCoinsViewDBRanges> ranges;
     CCoinsStats stats;
     CBlockIndex* tip;
 
     {
         // We need to lock cs_main to ensure that the coinsdb isn't written to
         // between (i) flushing coins cache to disk (coinsdb), (ii) getting stats
-        // based upon the coinsdb, and (iii) constructing a cursor to the
-        // coinsdb for use below this block.
+        // based upon the coinsdb, and (iii) taking the snapshot of the coinsdb
+        // that is read below this block.
         //
-        // Cursors returned by leveldb iterate over snapshots, so the contents
-        // of the pcursor will not be affected by simultaneous writes during
-        // use below this block.
+        // The ranges read from a leveldb snapshot, so their contents will not
+        // be affected by simultaneous writes during use below this block.
         //
         // See discussion here:
         //   https://github.com/bitcoin/bitcoin/pull/15606#discussion_r274479369
@@ -2300,11 +2372,12 @@ UniValue dumptxoutset(const JSONRPCRequest& request)
 
         ::ChainstateActive().ForceFlushStateToDisk();
 
-        if (!GetUTXOStats(&::ChainstateActive().CoinsDB(), stats)) {
+        // Only the number of coins is needed for the metadata.
+        if (!GetUTXOStats(&::ChainstateActive().CoinsDB(), stats, CoinStatsHashType::NONE, n_threads)) {
             throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
         }
 
-        pcursor = std::unique_ptr<CCoinsViewCursor>(::ChainstateActive().CoinsDB().Cursor());
+        ranges = MakeUnique<CCoinsViewDBRanges>(GetCoinsScanRanges(::ChainstateActive().CoinsDB(), n_threads));
         tip = LookupBlockIndex(stats.hashBlock);
         CHECK_NONFATAL(tip);
     }
@@ -2313,28 +2386,123 @@ UniValue dumptxoutset(const JSONRPCRequest& request)
 
     afile << metadata;
 
-    COutPoint key;
-    Coin coin;
-    unsigned int iter{0};
+    // Coins are read and serialized (which compresses them) on the scan
+    // threads; only writing the chunks out happens here, in key order.
+    const bool read = ReadCoinsInOrder(*ranges, n_threads,
+        [](size_t, CCoinsViewCursor& cursor, const CoinsChunkSink& emit) {
+            CDataStream chunk(SER_DISK, CLIENT_VERSION);
+            COutPoint key;
+            Coin coin;
+            for (size_t n_coins = 1; cursor.Valid(); cursor.Next(), ++n_coins) {
+                if (n_coins % 5000 == 0 && !IsRPCRunning()) {
+                    throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+                }
+                if (cursor.GetKey(key) && cursor.GetValue(coin)) {
+                    chunk << key;
+                    chunk << coin;
+                }
+                if (n_coins % COINS_SCAN_CHUNK_COINS == 0) {
+                    if (!emit(std::move(chunk))) return false;
+                    chunk.clear();
+                }
+            }
+            return chunk.empty() || emit(std::move(chunk));
+        },
+        [&afile](const CDataStream& chunk) {
+            afile.write(chunk.data(), chunk.size());
+            return true;
+        });
 
-    while (pcursor->Valid()) {
-        if (iter % 5000 == 0 && !IsRPCRunning()) {
-            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
-        }
-        ++iter;
-        if (pcursor->GetKey(key) && pcursor->GetValue(coin)) {
-            afile << key;
-            afile << coin;
+    afile.fclose();
+    if (!read) {
+        fs::remove(temppath);
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+    }
+    fs::rename(temppath, path);
+
+    UniValue result(UniValue::VOBJ);
+    result.pushKV("coins_written", stats.coins_count);
+    result.pushKV("base_hash", tip->GetBlockHash().ToString());
+    result.pushKV("base_height", tip->nHeight);
+    result.pushKV("path", path.string());
+    return result;
+}
+
+/**
+ * Bootstrap the UTXO set from a file written by dumptxoutset.
+ *
+ * @see CChainState::LoadUTXOSnapshot
+ */
+UniValue loadtxoutset(const JSONRPCRequest& request)
+{
+    RPCHelpMan{
+        "loadtxoutset",
+        "\nLoad a UTXO set written by dumptxoutset and make its base block the chain tip.\n"
+        "The snapshot must match the hash this node trusts for the base height, the base block\n"
+        "header must already be known, and the node must not have downloaded any blocks yet.\n"
+        "Blocks up to the base are never downloaded or validated; they cannot be served to peers,\n"
+        "so the node stops signalling NODE_NETWORK, and the chain cannot be reorganized below the base.\n",
+        {
+            {"path",
+                RPCArg::Type::STR,
+                RPCArg::Optional::NO,
+                /* default_val */ "",
+                "path to the snapshot file. If relative, will be prefixed by datadir."},
+        },
+        RPCResult{
+            RPCResult::Type::OBJ, "", "",
+                {
+                    {RPCResult::Type::NUM, "coins_loaded", "the number of coins loaded from the snapshot"},
+                    {RPCResult::Type::STR_HEX, "base_hash", "the hash of the base of the snapshot"},
+                    {RPCResult::Type::NUM, "base_height", "the height of the base of the snapshot"},
+                    {RPCResult::Type::STR, "path", "the absolute path that the snapshot was read from"},
+                }
+        },
+        RPCExamples{
+            HelpExampleCli("loadtxoutset", "utxo.dat")
         }
+    }.Check(request);
 
-        pcursor->Next();
+    fs::path path = fs::absolute(request.params[0].get_str(), GetDataDir());
+
+    bool have_index = g_txindex != nullptr || g_coin_stats_index != nullptr;
+    ForEachBlockFilterIndex([&have_index](BlockFilterIndex&) { have_index = true; });
+    if (have_index) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Cannot load a snapshot while -txindex, -blockfilterindex or -coinstatsindex is enabled");
     }
 
-    afile.fclose();
-    fs::rename(temppath, path);
+    FILE* file{fsbridge::fopen(path, "rb")};
+    CAutoFile afile{file, SER_DISK, CLIENT_VERSION};
+    if (afile.IsNull()) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Couldn't open file " + path.string() + " for reading.");
+    }
+
+    SnapshotMetadata metadata;
+    try {
+        afile >> metadata;
+    } catch (const std::ios_base::failure& e) {
+        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, strprintf("Unable to parse snapshot metadata: %s", e.what()));
+    }
+
+    const CBlockIndex* tip;
+    {
+        LOCK(::cs_main);
+        std::string error;
+        if (!::ChainstateActive().LoadUTXOSnapshot(Params(), afile, metadata, error)) {
+            throw JSONRPCError(RPC_MISC_ERROR, "Unable to load snapshot: " + error);
+        }
+        tip = ::ChainActive().Tip();
+        GetMainSignals().UpdatedBlockTip(tip, ::ChainActive().Genesis(), ::ChainstateActive().IsInitialBlockDownload());
+    }
+    RPCNotifyBlockChange(false, tip);
+    // The blocks up to the base can not be served.
+    if (g_rpc_node && g_rpc_node->connman) {
+        LogPrintf("Unsetting NODE_NETWORK after loading a UTXO snapshot\n");
+        g_rpc_node->connman->RemoveLocalServices(NODE_NETWORK);
+    }
 
     UniValue result(UniValue::VOBJ);
-    result.pushKV("coins_written", stats.coins_count);
+    result.pushKV("coins_loaded", metadata.m_coins_count);
     result.pushKV("base_hash", tip->GetBlockHash().ToString());
     result.pushKV("base_height", tip->nHeight);
     result.pushKV("path", path.string());
@@ -2363,7 +2531,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         {} },
     { "blockchain",         "getrawmempool",          &getrawmempool,          {"verbose"} },
     { "blockchain",         "gettxout",               &gettxout,               {"txid","n","include_mempool"} },
-    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        {} },
+    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        {"hash_type", "hash_or_height"} },
     { "blockchain",         "pruneblockchain",        &pruneblockchain,        {"height"} },
     { "blockchain",         "savemempool",            &savemempool,            {} },
     { "blockchain",         "verifychain",            &verifychain,            {"checklevel","nblocks"} },
@@ -2380,6 +2548,7 @@ static const CRPCCommand commands[] =
     { "hidden",             "waitforblockheight",     &waitforblockheight,     {"height","timeout"} },
     { "hidden",             "syncwithvalidationinterfacequeue", &syncwithvalidationinterfacequeue, {} },
     { "hidden",             "dumptxoutset",           &dumptxoutset,           {"path"} },
+    { "hidden",             "loadtxoutset",           &loadtxoutset,           {"path"} },
 };
 // clang-format on
 
@@ -10,6 +10,7 @@
 #include <consensus/params.h>
 #include <consensus/validation.h>
 #include <core_io.h>
+#include <hash.h>
 #include <key_io.h>
 #include <miner.h>
 #include <net.h>
@@ -112,6 +113,7 @@ static UniValue generateBlocks(const CTxMemPool& mempool, const CScript& coinbas
         nHeightEnd = nHeight+nGenerate;
     }
     unsigned int nExtraNonce = 0;
+    const int n_threads = GetMinerThreads();
     UniValue blockHashes(UniValue::VARR);
     while (nHeight < nHeightEnd && !ShutdownRequested())
     {
@@ -123,14 +125,23 @@ static UniValue generateBlocks(const CTxMemPool& mempool, const CScript& coinbas
             LOCK(cs_main);
             IncrementExtraNonce(pblock, ::ChainActive().Tip(), nExtraNonce);
         }
-        while (nMaxTries > 0 && pblock->nNonce < std::numeric_limits<uint32_t>::max() && !CheckProofOfWork(pblock->GetPoWHash(), pblock->nBits, Params().GetConsensus()) && !ShutdownRequested()) {
-            ++pblock->nNonce;
-            --nMaxTries;
+        bool found = SearchNonce(*pblock, Params().GetConsensus(), n_threads, nMaxTries);
+        while (!found && nMaxTries > 0 && !ShutdownRequested()) {
+            // The nonce space is exhausted. Roll the time and extranonce and keep going on
+            // the same template (and matrix), unless the tip has moved on in the meantime.
+            {
+                LOCK(cs_main);
+                if (::ChainActive().Tip()->GetBlockHash() != pblock->hashPrevBlock) break;
+                UpdateTime(pblock, Params().GetConsensus(), ::ChainActive().Tip());
+                IncrementExtraNonce(pblock, ::ChainActive().Tip(), nExtraNonce);
+            }
+            pblock->nNonce = 0;
+            found = SearchNonce(*pblock, Params().GetConsensus(), n_threads, nMaxTries);
         }
         if (nMaxTries == 0 || ShutdownRequested()) {
             break;
         }
-        if (pblock->nNonce == std::numeric_limits<uint32_t>::max()) {
+        if (!found) {
             continue;
         }
         std::shared_ptr<const CBlock> shared_pblock = std::make_shared<const CBlock>(*pblock);
@@ -268,6 +279,36 @@ static UniValue getmininginfo(const JSONRPCRequest& request)
 }
 
 
+static UniValue getheavyhashcacheinfo(const JSONRPCRequest& request)
+{
+            RPCHelpMan{"getheavyhashcacheinfo",
+                "\nReturns statistics of the HeavyHash matrix cache shared by all proof-of-work hash computations.",
+                {},
+                RPCResult{
+                    RPCResult::Type::OBJ, "", "",
+                    {
+                        {RPCResult::Type::NUM, "entries", "The number of matrices currently cached"},
+                        {RPCResult::Type::NUM, "capacity", "The maximum number of matrices kept in the cache"},
+                        {RPCResult::Type::NUM, "hits", "The number of lookups served from the cache"},
+                        {RPCResult::Type::NUM, "misses", "The number of lookups that had to generate a matrix"},
+                    }},
+                RPCExamples{
+                    HelpExampleCli("getheavyhashcacheinfo", "")
+            + HelpExampleRpc("getheavyhashcacheinfo", "")
+                },
+            }.Check(request);
+
+    const HeavyHashMatrixCacheStats stats = GetHeavyHashMatrixCacheStats();
+
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("entries",          (uint64_t)stats.entries);
+    obj.pushKV("capacity",         (uint64_t)stats.capacity);
+    obj.pushKV("hits",             stats.hits);
+    obj.pushKV("misses",           stats.misses);
+    return obj;
+}
+
+
 // NOTE: Unlike wallet RPC (which use BTC values), mining RPCs follow GBT (BIP 22) in using satoshi amounts
 static UniValue prioritisetransaction(const JSONRPCRequest& request)
 {
@@ -566,7 +607,11 @@ static UniValue getblocktemplate(const JSONRPCRequest& request)
 
         // Create new block
         CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = BlockAssembler(mempool, Params()).CreateNewBlock(scriptDummy);
+        if (g_rpc_node->template_builder) {
+            pblocktemplate = g_rpc_node->template_builder->CreateNewBlock(scriptDummy);
+        } else {
+            pblocktemplate = BlockAssembler(mempool, Params()).CreateNewBlock(scriptDummy);
+        }
         if (!pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
@@ -726,24 +771,6 @@ static UniValue getblocktemplate(const JSONRPCRequest& request)
     return result;
 }
 
-class submitblock_StateCatcher final : public CValidationInterface
-{
-public:
-    uint256 hash;
-    bool found;
-    BlockValidationState state;
-
-    explicit submitblock_StateCatcher(const uint256 &hashIn) : hash(hashIn), found(false), state() {}
-
-protected:
-    void BlockChecked(const CBlock& block, const BlockValidationState& stateIn) override {
-        if (block.GetPoWHash() != hash)
-            return;
-        found = true;
-        state = stateIn;
-    }
-};
-
 static UniValue submitblock(const JSONRPCRequest& request)
 {
     // We allow 2 arguments for compliance with BIP22. Argument 2 is ignored.
@@ -771,40 +798,12 @@ static UniValue submitblock(const JSONRPCRequest& request)
         throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Block does not start with a coinbase");
     }
 
-    uint256 hash = block.GetPoWHash();
-    {
-        LOCK(cs_main);
-        const CBlockIndex* pindex = LookupBlockIndex(hash);
-        if (pindex) {
-            if (pindex->IsValid(BLOCK_VALID_SCRIPTS)) {
-                return "duplicate";
-            }
-            if (pindex->nStatus & BLOCK_FAILED_MASK) {
-                return "duplicate-invalid";
-            }
-        }
-    }
-
-    {
-        LOCK(cs_main);
-        const CBlockIndex* pindex = LookupBlockIndex(block.hashPrevBlock);
-        if (pindex) {
-            UpdateUncommittedBlockStructures(block, pindex, Params().GetConsensus());
-        }
-    }
-
-    bool new_block;
-    auto sc = std::make_shared<submitblock_StateCatcher>(block.GetPoWHash());
-    RegisterSharedValidationInterface(sc);
-    bool accepted = ProcessNewBlock(Params(), blockptr, /* fForceProcessing */ true, /* fNewBlock */ &new_block);
-    UnregisterSharedValidationInterface(sc);
-    if (!new_block && accepted) {
-        return "duplicate";
-    }
-    if (!sc->found) {
-        return "inconclusive";
+    BlockValidationState state;
+    const std::string result = SubmitBlock(blockptr, state);
+    if (!result.empty()) {
+        return result;
     }
-    return BIP22ValidationResult(sc->state);
+    return BIP22ValidationResult(state);
 }
 
 static UniValue submitheader(const JSONRPCRequest& request)
@@ -1032,6 +1031,7 @@ static const CRPCCommand commands[] =
   //  --------------------- ------------------------  -----------------------  ----------
     { "mining",             "getnetworkhashps",       &getnetworkhashps,       {"nblocks","height"} },
     { "mining",             "getmininginfo",          &getmininginfo,          {} },
+    { "mining",             "getheavyhashcacheinfo",  &getheavyhashcacheinfo,  {} },
     { "mining",             "prioritisetransaction",  &prioritisetransaction,  {"txid","dummy","fee_delta"} },
     { "mining",             "getblocktemplate",       &getblocktemplate,       {"template_request"} },
     { "mining",             "submitblock",            &submitblock,            {"hexdata","dummy"} },
@@ -0,0 +1,574 @@
+// Copyright (c) 2020-2021 The PoWx Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <stratum.h>
+
+#include <chain.h>
+#include <chainparams.h>
+#include <consensus/validation.h>
+#include <crypto/common.h>
+#include <crypto/sha3.h>
+#include <hash.h>
+#include <logging.h>
+#include <miner.h>
+#include <netbase.h>
+#include <node/context.h>
+#include <pow.h>
+#include <primitives/block.h>
+#include <script/script.h>
+#include <streams.h>
+#include <sync.h>
+#include <univalue.h>
+#include <util/memory.h>
+#include <util/strencodings.h>
+#include <util/system.h>
+#include <validation.h>
+#include <validationinterface.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+const std::string DEFAULT_STRATUM_BIND = "127.0.0.1";
+/** Seconds between jobs on the same tip, to pick up new transactions */
+static const int STRATUM_JOB_REFRESH_INTERVAL = 30;
+/** Number of recent jobs shares may be submitted against */
+static const size_t MAX_STRATUM_JOBS = 16;
+/** Maximum length of a request line */
+static const size_t MAX_STRATUM_LINE_LENGTH = 16 * 1024;
+/** Size of the per-connection part of the coinbase extranonce */
+static const size_t STRATUM_EXTRANONCE1_SIZE = 4;
+/** Size of the miner-chosen part of the coinbase extranonce */
+static const size_t STRATUM_EXTRANONCE2_SIZE = 4;
+
+namespace {
+
+/** A block template cut up for miners: they fill in the coinbase extranonce, nTime and nNonce. */
+struct StratumJob {
+    std::string id;
+    CBlock block;
+    //! Coinbase scriptSig in front of the extranonce
+    CScript script_sig_prefix;
+    //! Hashes to combine with the coinbase txid, bottom up, to get the merkle root
+    std::vector<uint256> merkle_branch;
+    //! Serialized coinbase (without witness) before and after the extranonce
+    std::string coinb1;
+    std::string coinb2;
+};
+
+class StratumServer;
+
+struct StratumClient {
+    StratumServer* server;
+    uint64_t id;
+    struct bufferevent* bev;
+    std::vector<unsigned char> extranonce1;
+    bool subscribed{false};
+};
+
+/** Wakes up the server's event loop on tip changes. Outlives the server if a callback is in flight. */
+class StratumTipListener final : public CValidationInterface
+{
+public:
+    explicit StratumTipListener(struct event* ev) : m_event(ev) {}
+
+    void Disconnect()
+    {
+        LOCK(m_mutex);
+        m_event = nullptr;
+    }
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex* pindexNew, const CBlockIndex* pindexFork, bool fInitialDownload) override
+    {
+        LOCK(m_mutex);
+        if (m_event) event_active(m_event, EV_TIMEOUT, 0);
+    }
+
+private:
+    Mutex m_mutex;
+    struct event* m_event GUARDED_BY(m_mutex);
+};
+
+UniValue StratumError(int code, const std::string& message)
+{
+    UniValue error(UniValue::VARR);
+    error.push_back(code);
+    error.push_back(message);
+    error.push_back(NullUniValue);
+    return error;
+}
+
+/** Parse 8 hex digits as a big-endian number, as stratum encodes nTime and nNonce */
+bool ParseHexUInt32(const std::string& str, uint32_t& out)
+{
+    if (str.size() != 8 || !IsHex(str)) return false;
+    out = ReadBE32(ParseHex(str).data());
+    return true;
+}
+
+std::vector<uint256> CoinbaseMerkleBranch(const CBlock& block)
+{
+    std::vector<uint256> level;
+    level.reserve(block.vtx.size());
+    for (const auto& tx : block.vtx) {
+        level.push_back(tx->GetHash());
+    }
+    std::vector<uint256> branch;
+    while (level.size() > 1) {
+        branch.push_back(level[1]);
+        if (level.size() & 1) level.push_back(level.back());
+        std::vector<uint256> next;
+        next.reserve(level.size() / 2);
+        for (size_t i = 0; i < level.size(); i += 2) {
+            next.push_back(Hash(level[i].begin(), level[i].end(), level[i + 1].begin(), level[i + 1].end()));
+        }
+        level = std::move(next);
+    }
+    return branch;
+}
+
+/**
+ * Serves jobs to connected miners. Apart from construction and destruction,
+ * everything runs on the thread dispatching the event base.
+ */
+class StratumServer
+{
+public:
+    StratumServer(struct event_base* base, NodeContext& node, const CScript& payout);
+    ~StratumServer();
+
+    bool Bind(const std::string& address, uint16_t port);
+
+private:
+    struct event_base* m_base;
+    NodeContext& m_node;
+    const CScript m_payout;
+    struct evconnlistener* m_listener{nullptr};
+    struct event* m_tip_event;
+    struct event* m_refresh_event;
+    std::shared_ptr<StratumTipListener> m_tip_listener;
+
+    std::map<uint64_t, std::unique_ptr<StratumClient>> m_clients;
+    uint64_t m_next_client_id{0};
+    uint32_t m_next_extranonce1{0};
+    //! Recent jobs, newest last; all on the current tip
+    std::deque<StratumJob> m_jobs;
+    uint64_t m_next_job_id{0};
+
+    /** Build a job from a fresh template and announce it if it differs from the last one */
+    void UpdateJob();
+    void Send(StratumClient& client, const UniValue& message);
+    void Notify(StratumClient& client, const StratumJob& job, bool clean);
+    bool ProcessLine(StratumClient& client, const std::string& line);
+    UniValue Subscribe(StratumClient& client);
+    UniValue Submit(StratumClient& client, const UniValue& params);
+    void Disconnect(StratumClient& client);
+
+    static void acceptcb(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* addr, int socklen, void* ctx);
+    static void readcb(struct bufferevent* bev, void* ctx);
+    static void eventcb(struct bufferevent* bev, short what, void* ctx);
+    static void updatecb(evutil_socket_t fd, short what, void* ctx);
+};
+
+StratumServer::StratumServer(struct event_base* base, NodeContext& node, const CScript& payout) :
+    m_base(base), m_node(node), m_payout(payout)
+{
+    m_tip_event = event_new(m_base, -1, 0, updatecb, this);
+    m_refresh_event = event_new(m_base, -1, EV_PERSIST, updatecb, this);
+    struct timeval refresh_interval = {STRATUM_JOB_REFRESH_INTERVAL, 0};
+    event_add(m_refresh_event, &refresh_interval);
+    // Build the first job once the event loop runs.
+    event_active(m_tip_event, EV_TIMEOUT, 0);
+
+    m_tip_listener = std::make_shared<StratumTipListener>(m_tip_event);
+    RegisterSharedValidationInterface(m_tip_listener);
+}
+
+StratumServer::~StratumServer()
+{
+    m_tip_listener->Disconnect();
+    UnregisterSharedValidationInterface(m_tip_listener);
+    for (auto& entry : m_clients) {
+        bufferevent_free(entry.second->bev);
+    }
+    m_clients.clear();
+    if (m_listener) evconnlistener_free(m_listener);
+    event_free(m_refresh_event);
+    event_free(m_tip_event);
+}
+
+bool StratumServer::Bind(const std::string& address, uint16_t port)
+{
+    const CService service = LookupNumeric(address, port);
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    if (!service.IsValid() || !service.GetSockAddr((struct sockaddr*)&sockaddr, &len)) {
+        LogPrintf("stratum: Invalid bind address %s\n", address);
+        return false;
+    }
+    m_listener = evconnlistener_new_bind(m_base, acceptcb, this, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1, (struct sockaddr*)&sockaddr, len);
+    if (!m_listener) {
+        LogPrintf("stratum: Unable to bind to %s\n", service.ToString());
+        return false;
+    }
+    LogPrintf("stratum: Listening on %s\n", service.ToString());
+    return true;
+}
+
+void StratumServer::UpdateJob()
+{
+    if (::ChainstateActive().IsInitialBlockDownload()) return;
+
+    // Build on the same template getblocktemplate is served from, so background
+    // prebuilds at tip changes are shared, and pay the coinbase to the payout script.
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    try {
+        pblocktemplate = m_node.template_builder->CreateNewBlock(CScript() << OP_TRUE);
+    } catch (const std::exception& e) {
+        LogPrint(BCLog::STRATUM, "stratum: Unable to create a block template: %s\n", e.what());
+        return;
+    } catch (...) {
+        LogPrint(BCLog::STRATUM, "stratum: Unable to create a block template: unknown exception\n");
+        return;
+    }
+    const CBlock& block = pblocktemplate->block;
+
+    // The merkle branch commits to all transactions but the coinbase.
+    std::vector<uint256> merkle_branch = CoinbaseMerkleBranch(block);
+    const bool clean = m_jobs.empty() || m_jobs.back().block.hashPrevBlock != block.hashPrevBlock;
+    if (!clean && m_jobs.back().merkle_branch == merkle_branch) {
+        // Nothing new to mine.
+        return;
+    }
+
+    int height;
+    {
+        LOCK(cs_main);
+        const CBlockIndex* pindexPrev = LookupBlockIndex(block.hashPrevBlock);
+        if (!pindexPrev) return;
+        height = pindexPrev->nHeight + 1;
+    }
+
+    StratumJob job;
+    job.id = strprintf("%x", ++m_next_job_id);
+    job.block = block;
+    job.script_sig_prefix = CScript() << height;
+
+    CMutableTransaction coinbase(*block.vtx[0]);
+    coinbase.vout[0].scriptPubKey = m_payout;
+    coinbase.vin[0].scriptSig = CScript(job.script_sig_prefix) << std::vector<unsigned char>(STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE);
+    assert(coinbase.vin[0].scriptSig.size() <= 100);
+
+    // The extranonce is the data of the last push in the scriptSig, which
+    // follows nVersion, the input count, the prevout and the scriptSig length.
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS);
+    ss << coinbase;
+    const size_t extranonce_pos = 4 + 1 + 36 + GetSizeOfCompactSize(coinbase.vin[0].scriptSig.size()) + job.script_sig_prefix.size() + 1;
+    const size_t extranonce_end = extranonce_pos + STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE;
+    assert(extranonce_end <= ss.size());
+    job.coinb1 = HexStr(ss.begin(), ss.begin() + extranonce_pos);
+    job.coinb2 = HexStr(ss.begin() + extranonce_end, ss.end());
+
+    job.block.vtx[0] = MakeTransactionRef(std::move(coinbase));
+    job.merkle_branch = std::move(merkle_branch);
+
+    if (clean) m_jobs.clear();
+    m_jobs.push_back(std::move(job));
+    if (m_jobs.size() > MAX_STRATUM_JOBS) m_jobs.pop_front();
+
+    LogPrint(BCLog::STRATUM, "stratum: New job %s at height %d with %u transactions%s\n",
+        m_jobs.back().id, height, block.vtx.size() - 1, clean ? ", clean" : "");
+    for (auto& entry : m_clients) {
+        if (entry.second->subscribed) Notify(*entry.second, m_jobs.back(), clean);
+    }
+}
+
+void StratumServer::Send(StratumClient& client, const UniValue& message)
+{
+    const std::string line = message.write() + "\n";
+    evbuffer_add(bufferevent_get_output(client.bev), line.data(), line.size());
+}
+
+void StratumServer::Notify(StratumClient& client, const StratumJob& job, bool clean)
+{
+    uint256 matrix_seed;
+    CSHA3_256().Write(job.block.hashPrevBlock.begin(), 32).Finalize(matrix_seed.begin());
+
+    UniValue branch(UniValue::VARR);
+    for (const uint256& hash : job.merkle_branch) {
+        branch.push_back(HexStr(hash));
+    }
+
+    UniValue params(UniValue::VARR);
+    params.push_back(job.id);
+    params.push_back(HexStr(job.block.hashPrevBlock));
+    params.push_back(job.coinb1);
+    params.push_back(job.coinb2);
+    params.push_back(branch);
+    params.push_back(strprintf("%08x", (uint32_t)job.block.nVersion));
+    params.push_back(strprintf("%08x", job.block.nBits));
+    params.push_back(strprintf("%08x", job.block.nTime));
+    params.push_back(clean);
+    params.push_back(HexStr(matrix_seed));
+
+    UniValue notify(UniValue::VOBJ);
+    notify.pushKV("id", NullUniValue);
+    notify.pushKV("method", "mining.notify");
+    notify.pushKV("params", params);
+    Send(client, notify);
+}
+
+bool StratumServer::ProcessLine(StratumClient& client, const std::string& line)
+{
+    UniValue request;
+    if (!request.read(line) || !request.isObject()) {
+        LogPrint(BCLog::STRATUM, "stratum: Disconnecting client %d sending invalid JSON\n", client.id);
+        return false;
+    }
+    const UniValue& id = find_value(request, "id");
+    const UniValue& method = find_value(request, "method");
+    const UniValue& params = find_value(request, "params");
+
+    UniValue result(UniValue::VNULL);
+    UniValue error(UniValue::VNULL);
+    try {
+        if (!method.isStr()) {
+            throw StratumError(20, "Missing method");
+        }
+        if (method.get_str() == "mining.subscribe") {
+            result = Subscribe(client);
+        } else if (method.get_str() == "mining.authorize") {
+            // Anyone who can connect may mine; the payout is set by the node.
+            result = UniValue(true);
+        } else if (method.get_str() == "mining.submit") {
+            result = Submit(client, params);
+        } else {
+            throw StratumError(20, "Method not found");
+        }
+    } catch (const UniValue& e) {
+        error = e;
+    } catch (const std::exception& e) {
+        error = StratumError(20, e.what());
+    }
+
+    UniValue reply(UniValue::VOBJ);
+    reply.pushKV("id", id);
+    reply.pushKV("result", result);
+    reply.pushKV("error", error);
+    Send(client, reply);
+
+    if (method.isStr() && method.get_str() == "mining.subscribe" && error.isNull() && !m_jobs.empty()) {
+        Notify(client, m_jobs.back(), true);
+    }
+    return true;
+}
+
+UniValue StratumServer::Subscribe(StratumClient& client)
+{
+    client.subscribed = true;
+
+    UniValue subscription(UniValue::VARR);
+    subscription.push_back("mining.notify");
+    subscription.push_back(strprintf("%x", client.id));
+    UniValue subscriptions(UniValue::VARR);
+    subscriptions.push_back(subscription);
+
+    UniValue result(UniValue::VARR);
+    result.push_back(subscriptions);
+    result.push_back(HexStr(client.extranonce1));
+    result.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+    return result;
+}
+
+UniValue StratumServer::Submit(StratumClient& client, const UniValue& params)
+{
+    // [worker, job_id, extranonce2, ntime, nonce]
+    if (!params.isArray() || params.size() < 5) {
+        throw StratumError(20, "Invalid parameters");
+    }
+    const std::string& job_id = params[1].get_str();
+    const std::string& extranonce2 = params[2].get_str();
+    uint32_t ntime, nonce;
+    if (extranonce2.size() != STRATUM_EXTRANONCE2_SIZE * 2 || !IsHex(extranonce2) ||
+        !ParseHexUInt32(params[3].get_str(), ntime) || !ParseHexUInt32(params[4].get_str(), nonce)) {
+        throw StratumError(20, "Invalid parameters");
+    }
+
+    auto job = std::find_if(m_jobs.begin(), m_jobs.end(), [&job_id](const StratumJob& j) { return j.id == job_id; });
+    if (job == m_jobs.end()) {
+        throw StratumError(21, "Job not found");
+    }
+
+    std::vector<unsigned char> extranonce = client.extranonce1;
+    const std::vector<unsigned char> extranonce2_bytes = ParseHex(extranonce2);
+    extranonce.insert(extranonce.end(), extranonce2_bytes.begin(), extranonce2_bytes.end());
+
+    CMutableTransaction coinbase(*job->block.vtx[0]);
+    coinbase.vin[0].scriptSig = CScript(job->script_sig_prefix) << extranonce;
+
+    std::shared_ptr<CBlock> blockptr = std::make_shared<CBlock>(job->block);
+    blockptr->vtx[0] = MakeTransactionRef(std::move(coinbase));
+    uint256 merkle_root = blockptr->vtx[0]->GetHash();
+    for (const uint256& hash : job->merkle_branch) {
+        merkle_root = Hash(merkle_root.begin(), merkle_root.end(), hash.begin(), hash.end());
+    }
+    blockptr->hashMerkleRoot = merkle_root;
+    blockptr->nTime = ntime;
+    blockptr->nNonce = nonce;
+
+    // There is no separate share target: only solved blocks are accepted.
+    if (!CheckProofOfWork(blockptr->GetPoWHash(), blockptr->nBits, Params().GetConsensus())) {
+        throw StratumError(23, "high-hash");
+    }
+
+    BlockValidationState state;
+    std::string result = SubmitBlock(blockptr, state);
+    if (result.empty()) {
+        if (state.IsValid()) {
+            LogPrintf("stratum: Block %s submitted by client %d accepted\n", blockptr->GetHash().ToString(), client.id);
+            return UniValue(true);
+        }
+        result = state.IsError() ? state.ToString() : state.GetRejectReason();
+        if (result.empty()) result = "rejected";
+    }
+    LogPrintf("stratum: Block %s submitted by client %d not accepted: %s\n", blockptr->GetHash().ToString(), client.id, result);
+    throw StratumError(20, result);
+}
+
+void StratumServer::Disconnect(StratumClient& client)
+{
+    LogPrint(BCLog::STRATUM, "stratum: Client %d disconnected\n", client.id);
+    bufferevent_free(client.bev);
+    m_clients.erase(client.id);
+}
+
+void StratumServer::acceptcb(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* addr, int socklen, void* ctx)
+{
+    StratumServer* self = static_cast<StratumServer*>(ctx);
+    struct bufferevent* bev = bufferevent_socket_new(self->m_base, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev) {
+        evutil_closesocket(fd);
+        return;
+    }
+
+    std::unique_ptr<StratumClient> client = MakeUnique<StratumClient>();
+    client->server = self;
+    client->id = self->m_next_client_id++;
+    client->bev = bev;
+    client->extranonce1.resize(STRATUM_EXTRANONCE1_SIZE);
+    WriteBE32(client->extranonce1.data(), self->m_next_extranonce1++);
+
+    CService peer;
+    peer.SetSockAddr(addr);
+    LogPrint(BCLog::STRATUM, "stratum: Client %d connected from %s\n", client->id, peer.ToString());
+
+    bufferevent_setcb(bev, readcb, nullptr, eventcb, client.get());
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+    self->m_clients.emplace(client->id, std::move(client));
+}
+
+void StratumServer::readcb(struct bufferevent* bev, void* ctx)
+{
+    StratumClient* client = static_cast<StratumClient*>(ctx);
+    StratumServer* self = client->server;
+    struct evbuffer* input = bufferevent_get_input(bev);
+    size_t n_read_out = 0;
+    char* line;
+    while ((line = evbuffer_readln(input, &n_read_out, EVBUFFER_EOL_CRLF)) != nullptr) {
+        std::string s(line, n_read_out);
+        free(line);
+        if (s.empty()) continue;
+        if (!self->ProcessLine(*client, s)) {
+            self->Disconnect(*client);
+            return;
+        }
+    }
+    // Whatever is left is an incomplete line; do not let it grow without bound.
+    if (evbuffer_get_length(input) > MAX_STRATUM_LINE_LENGTH) {
+        LogPrint(BCLog::STRATUM, "stratum: Disconnecting client %d because MAX_STRATUM_LINE_LENGTH exceeded\n", client->id);
+        self->Disconnect(*client);
+    }
+}
+
+void StratumServer::eventcb(struct bufferevent* bev, short what, void* ctx)
+{
+    StratumClient* client = static_cast<StratumClient*>(ctx);
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        client->server->Disconnect(*client);
+    }
+}
+
+void StratumServer::updatecb(evutil_socket_t fd, short what, void* ctx)
+{
+    static_cast<StratumServer*>(ctx)->UpdateJob();
+}
+
+} // namespace
+
+/****** Thread ********/
+static struct event_base* g_stratum_base;
+static std::unique_ptr<StratumServer> g_stratum_server;
+static std::thread g_stratum_thread;
+
+static void StratumThread()
+{
+    event_base_dispatch(g_stratum_base);
+}
+
+bool StartStratumServer(NodeContext& node, const CScript& payout)
+{
+    assert(!g_stratum_base);
+    assert(node.template_builder);
+#ifdef WIN32
+    evthread_use_windows_threads();
+#else
+    evthread_use_pthreads();
+#endif
+    g_stratum_base = event_base_new();
+    if (!g_stratum_base) {
+        LogPrintf("stratum: Unable to create event_base\n");
+        return false;
+    }
+
+    g_stratum_server = MakeUnique<StratumServer>(g_stratum_base, node, payout);
+    if (!g_stratum_server->Bind(gArgs.GetArg("-stratumbind", DEFAULT_STRATUM_BIND), (uint16_t)gArgs.GetArg("-stratumport", DEFAULT_STRATUM_PORT))) {
+        g_stratum_server.reset();
+        event_base_free(g_stratum_base);
+        g_stratum_base = nullptr;
+        return false;
+    }
+
+    g_stratum_thread = std::thread(std::bind(&TraceThread<void (*)()>, "stratum", &StratumThread));
+    return true;
+}
+
+void InterruptStratumServer()
+{
+    if (g_stratum_base) {
+        LogPrintf("stratum: Thread interrupt\n");
+        event_base_once(g_stratum_base, -1, EV_TIMEOUT, [](evutil_socket_t, short, void*) {
+            event_base_loopbreak(g_stratum_base);
+        }, nullptr, nullptr);
+    }
+}
+
+void StopStratumServer()
+{
+    if (g_stratum_base) {
+        g_stratum_thread.join();
+        g_stratum_server.reset();
+        event_base_free(g_stratum_base);
+        g_stratum_base = nullptr;
+    }
+}
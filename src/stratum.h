@@ -0,0 +1,34 @@
+// Copyright (c) 2020-2021 The PoWx Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+/**
+ * A stratum-style work server for local miners.
+ */
+#ifndef BITCOIN_STRATUM_H
+#define BITCOIN_STRATUM_H
+
+#include <stdint.h>
+#include <string>
+
+class CScript;
+struct NodeContext;
+
+/** Default for -stratum */
+static const bool DEFAULT_STRATUM = false;
+/** Default for -stratumport */
+static const uint16_t DEFAULT_STRATUM_PORT = 3333;
+extern const std::string DEFAULT_STRATUM_BIND;
+
+/**
+ * Start serving mining jobs built from node.template_builder, paying to
+ * payout. Miners connect with newline-delimited JSON (mining.subscribe,
+ * mining.authorize, mining.submit) and are pushed a mining.notify for
+ * every new job; solved blocks are processed as by submitblock.
+ * @returns false if the listening socket could not be set up.
+ */
+bool StartStratumServer(NodeContext& node, const CScript& payout);
+void InterruptStratumServer();
+void StopStratumServer();
+
+#endif // BITCOIN_STRATUM_H
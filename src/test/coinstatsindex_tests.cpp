@@ -0,0 +1,108 @@
+// Copyright (c) 2020-2021 The PoWx Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <consensus/validation.h>
+#include <index/coinstatsindex.h>
+#include <key.h>
+#include <node/coinstats.h>
+#include <script/interpreter.h>
+#include <script/standard.h>
+#include <test/util/setup_common.h>
+#include <util/time.h>
+#include <validation.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(coinstatsindex_tests)
+
+static void CheckIndexMatchesChainstate(const CoinStatsIndex& index)
+{
+    BOOST_REQUIRE(index.BlockUntilSyncedToCurrentChain());
+
+    CCoinsStats expected;
+    ::ChainstateActive().ForceFlushStateToDisk();
+    CCoinsViewDB* coins_view = WITH_LOCK(cs_main, return &::ChainstateActive().CoinsDB());
+    BOOST_REQUIRE(GetUTXOStats(coins_view, expected, CoinStatsHashType::MUHASH));
+
+    const CBlockIndex* tip = WITH_LOCK(cs_main, return ::ChainActive().Tip());
+    BOOST_CHECK_EQUAL(expected.hashBlock, tip->GetBlockHash());
+
+    CCoinsStats stats;
+    BOOST_REQUIRE(index.LookUpStats(tip, stats));
+    BOOST_CHECK_EQUAL(stats.nHeight, tip->nHeight);
+    BOOST_CHECK_EQUAL(stats.hashSerialized, expected.hashSerialized);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, expected.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(stats.nBogoSize, expected.nBogoSize);
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, expected.nTotalAmount);
+}
+
+BOOST_FIXTURE_TEST_CASE(coinstatsindex_initial_sync, TestChain100Setup)
+{
+    CoinStatsIndex coin_stats_index{1 << 20, true};
+
+    const CBlockIndex* tip = WITH_LOCK(cs_main, return ::ChainActive().Tip());
+    CCoinsStats stats;
+
+    // Stats should not be found in the index before it is started.
+    BOOST_CHECK(!coin_stats_index.LookUpStats(tip, stats));
+
+    // BlockUntilSyncedToCurrentChain should return false before index is started.
+    BOOST_CHECK(!coin_stats_index.BlockUntilSyncedToCurrentChain());
+
+    coin_stats_index.Start();
+
+    // Allow the index to catch up with the block index.
+    constexpr int64_t timeout_ms = 10 * 1000;
+    int64_t time_start = GetTimeMillis();
+    while (!coin_stats_index.BlockUntilSyncedToCurrentChain()) {
+        BOOST_REQUIRE(time_start + timeout_ms > GetTimeMillis());
+        UninterruptibleSleep(std::chrono::milliseconds{100});
+    }
+
+    CheckIndexMatchesChainstate(coin_stats_index);
+
+    // Spend a mature coinbase so the block both creates and removes coins.
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = m_coinbase_txns[0]->GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(2);
+    spend.vout[0].nValue = 11 * CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    spend.vout[1].nValue = 0;
+    spend.vout[1].scriptPubKey = CScript() << OP_RETURN;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SigVersion::BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+
+    const CBlock block = CreateAndProcessBlock({spend}, scriptPubKey);
+    BOOST_REQUIRE_EQUAL(WITH_LOCK(cs_main, return ::ChainActive().Tip()->GetBlockHash()), block.GetHash());
+    CheckIndexMatchesChainstate(coin_stats_index);
+
+    // The stats of the block are kept when it is reorganized away, and the
+    // index rewinds its running set hash to the fork point.
+    CCoinsStats stale_stats;
+    const CBlockIndex* stale_tip = WITH_LOCK(cs_main, return ::ChainActive().Tip());
+    BOOST_REQUIRE(coin_stats_index.LookUpStats(stale_tip, stale_stats));
+    {
+        BlockValidationState state;
+        BOOST_REQUIRE(InvalidateBlock(state, Params(), const_cast<CBlockIndex*>(stale_tip)));
+    }
+    CreateAndProcessBlock({}, CScript() << OP_TRUE);
+    CheckIndexMatchesChainstate(coin_stats_index);
+
+    CCoinsStats stats_after;
+    BOOST_REQUIRE(coin_stats_index.LookUpStats(stale_tip, stats_after));
+    BOOST_CHECK_EQUAL(stats_after.hashSerialized, stale_stats.hashSerialized);
+
+    coin_stats_index.Stop();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
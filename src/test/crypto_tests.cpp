@@ -9,14 +9,19 @@
 #include <crypto/hkdf_sha256_32.h>
 #include <crypto/hmac_sha256.h>
 #include <crypto/hmac_sha512.h>
+#include <crypto/muhash.h>
 #include <crypto/ripemd160.h>
 #include <crypto/sha1.h>
 #include <crypto/sha256.h>
+#include <crypto/sha3.h>
 #include <crypto/sha512.h>
+#include <crypto/tiny_sha3/sha3.h>
 #include <crypto/heavyhash.h>
 #include <crypto/heavyhash_dummyArray.h>
 #include <crypto/xoshiro256pp.h>
 #include <hash.h>
+#include <primitives/block.h>
+#include <streams.h>
 #include <random.h>
 #include <util/strencodings.h>
 #include <test/util/setup_common.h>
@@ -81,7 +86,8 @@ static void TestSHA3_256(const std::string &in, const std::string &out){TestVect
 static void TestHeavyHashSingular(const std::string &in, const std::string &out) {
     uint64_t matrix[64*64];
     GenerateReferenceCheckMatrixSingular(matrix);
-    CHeavyHash ctx(matrix);
+    const HeavyHashMatrix packed(matrix);
+    CHeavyHash ctx(packed);
     TestVector(ctx, in, ParseHex(out));
 };
 
@@ -237,12 +243,151 @@ const std::string test1 = LongTestString();
 // Testing examples for CSHA3_256
 BOOST_AUTO_TEST_CASE(sha3_testvectors){
     TestSHA3_256("", "a7ffc6f8bf1ed76651c14756a061d662f580ff4de43b49fa82d80a4b80f8434a");
+    TestSHA3_256("abc", "3a985da74fe225b2045c172d6bd390bd855f086e3e9d525b46bfe24511431532");
+    TestSHA3_256(std::string(200, '\xa3'), "79f38adec5c20307a98ef76e8324afbfd46cfd81b22e3973c65fa1bd9de31787");
+
+    // Multi-block input, written in random chunks, against the tiny_sha3 reference
+    std::vector<unsigned char> expected(32);
+    sha3(test1.data(), test1.size(), expected.data(), expected.size());
+    TestVector(CSHA3_256(), test1, expected);
+}
+
+BOOST_AUTO_TEST_CASE(sha3_matches_reference)
+{
+    // Lengths around the 136-byte rate and the word boundaries matter most.
+    for (int i = 0; i < 300; ++i) {
+        std::vector<unsigned char> in(i);
+        for (unsigned char& c : in) c = InsecureRandBits(8);
+        unsigned char expected[32], out[32];
+        sha3(in.data(), in.size(), expected, sizeof(expected));
+        CSHA3_256().Write(in.data(), in.size()).Finalize(out);
+        BOOST_CHECK(memcmp(expected, out, 32) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha3_multiway)
+{
+    for (int i = 0; i <= 9; ++i) {
+        unsigned char in[80 * 9];
+        unsigned char out1[32 * 9], out2[32 * 9];
+        for (int j = 0; j < 80 * i; ++j) {
+            in[j] = InsecureRandBits(8);
+        }
+        for (int j = 0; j < i; ++j) {
+            CSHA3_256().Write(in + 80 * j, 80).Finalize(out1 + 32 * j);
+        }
+        SHA3_256_80(out2, in, i);
+        BOOST_CHECK(memcmp(out1, out2, 32 * i) == 0);
+        for (int j = 0; j < i; ++j) {
+            CSHA3_256().Write(in + 32 * j, 32).Finalize(out1 + 32 * j);
+        }
+        SHA3_256_32(out2, in, i);
+        BOOST_CHECK(memcmp(out1, out2, 32 * i) == 0);
+    }
 }
 
 BOOST_AUTO_TEST_CASE(heavyhash_testvectors_singular_matrix){
         TestHeavyHashSingular("\xC1\xEC\xFD\xFC", "39387f2e64e7c08d3ce0da8c491b4fcf2c862798dedb4690d819de7926aa4ecb");
 }
 
+BOOST_AUTO_TEST_CASE(heavyhash_batch)
+{
+    CBlockHeader header;
+    header.nVersion = InsecureRand32();
+    header.hashPrevBlock = InsecureRand256();
+    header.hashMerkleRoot = InsecureRand256();
+    header.nTime = InsecureRand32();
+    header.nBits = InsecureRand32();
+    const auto matrix = header.GetPoWMatrix();
+
+    // Cover empty batches, partial multi-way groups and more than one internal chunk.
+    for (int n = 0; n <= 40; ++n) {
+        std::vector<CBlockHeader> headers(n, header);
+        for (int i = 0; i < n; ++i) {
+            headers[i].nNonce = InsecureRand32();
+        }
+        std::vector<uint256> hashes(n);
+        HeavyHashBatch(*matrix, MakeSpan(static_cast<const std::vector<CBlockHeader>&>(headers)), MakeSpan(hashes));
+        for (int i = 0; i < n; ++i) {
+            BOOST_CHECK(hashes[i] == headers[i].GetPoWHash());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(heavyhash_matrix_cache)
+{
+    const uint256 seed = InsecureRand256();
+    const HeavyHashMatrixCacheStats before = GetHeavyHashMatrixCacheStats();
+
+    const auto first = GetHeavyHashMatrix(seed);
+    const auto second = GetHeavyHashMatrix(seed);
+    BOOST_CHECK(first == second);
+
+    HeavyHashMatrix expected;
+    GenerateHeavyHashMatrix(seed, expected);
+    BOOST_CHECK(*first == expected);
+
+    const HeavyHashMatrixCacheStats after = GetHeavyHashMatrixCacheStats();
+    BOOST_CHECK_EQUAL(after.misses - before.misses, 1U);
+    BOOST_CHECK_EQUAL(after.hits - before.hits, 1U);
+    BOOST_CHECK(after.entries <= after.capacity);
+
+    // Cached and uncached proof-of-work hashes must agree.
+    CBlockHeader header;
+    header.hashPrevBlock = InsecureRand256();
+    header.nNonce = InsecureRand32();
+    uint256 matrix_seed;
+    CSHA3_256().Write(header.hashPrevBlock.begin(), 32).Finalize(matrix_seed.begin());
+    GenerateHeavyHashMatrix(matrix_seed, expected);
+    BOOST_CHECK(header.GetPoWHash() == SerializeHeavyHash(header, expected));
+    BOOST_CHECK(header.GetPoWHash() == SerializeHeavyHash(header, expected));
+}
+
+BOOST_AUTO_TEST_CASE(heavyhash_packed_kernel)
+{
+    uint64_t matrix[64*64];
+    GenerateReferenceCheckMatrixSingular(matrix);
+    for (int round = 0; round < 100; ++round) {
+        if (round > 0) {
+            for (int i = 0; i < 64*64; ++i) {
+                matrix[i] = InsecureRandBits(4);
+            }
+        }
+        const uint256 hash = InsecureRand256();
+        BOOST_CHECK(MultiplyUsing4bitPrecision(HeavyHashMatrix(matrix), hash) == MultiplyUsing4bitPrecision(matrix, hash));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(heavyhash_matrix_packing)
+{
+    uint64_t matrix[64*64];
+    GenerateReferenceCheckMatrixSingular(matrix);
+    HeavyHashMatrix packed(matrix);
+    static_assert(sizeof(HeavyHashMatrix) == 2048, "HeavyHashMatrix must stay packed");
+
+    uint64_t unpacked[64*64];
+    packed.Unpack(unpacked);
+    BOOST_CHECK(std::equal(unpacked, unpacked + 64*64, matrix));
+    for (int i = 0; i < 64; ++i) {
+        for (int j = 0; j < 64; ++j) {
+            BOOST_CHECK_EQUAL(packed.Get(i, j), matrix[64*i + j]);
+        }
+    }
+
+    HeavyHashMatrix copy;
+    BOOST_CHECK(copy != packed);
+    for (int i = 0; i < 64; ++i) {
+        for (int j = 0; j < 64; ++j) {
+            copy.Set(i, j, packed.Get(i, j));
+        }
+    }
+    BOOST_CHECK(copy == packed);
+    copy.Set(17, 33, packed.Get(17, 33) ^ 1);
+    BOOST_CHECK(copy != packed);
+    BOOST_CHECK_EQUAL(copy.Get(17, 32), packed.Get(17, 32));
+    BOOST_CHECK_EQUAL(copy.Get(17, 34), packed.Get(17, 34));
+}
+
 BOOST_AUTO_TEST_CASE(ripemd160_testvectors) {
     TestRIPEMD160("", "9c1185a5c5e9fc54612808977ee8f548b2258d31");
     TestRIPEMD160("abc", "8eb208f7e05d987a9b044a8e98c6b087f15a0bfc");
@@ -792,4 +937,86 @@ BOOST_AUTO_TEST_CASE(sha256d64)
     }
 }
 
+static MuHash3072 FromInt(unsigned char i) {
+    unsigned char tmp[32] = {i, 0};
+    return MuHash3072(Span<const unsigned char>(tmp, sizeof(tmp)));
+}
+
+BOOST_AUTO_TEST_CASE(muhash_tests)
+{
+    uint256 out;
+
+    for (int iter = 0; iter < 10; ++iter) {
+        uint256 res;
+        int table[4];
+        for (int i = 0; i < 4; ++i) {
+            table[i] = InsecureRandBits(3);
+        }
+        for (int order = 0; order < 4; ++order) {
+            MuHash3072 acc;
+            for (int i = 0; i < 4; ++i) {
+                int t = table[i ^ order];
+                if (t & 4) {
+                    acc /= FromInt(t & 3);
+                } else {
+                    acc *= FromInt(t & 3);
+                }
+            }
+            acc.Finalize(out);
+            if (order == 0) {
+                res = out;
+            } else {
+                BOOST_CHECK(res == out);
+            }
+        }
+
+        MuHash3072 x = FromInt(InsecureRandBits(4)); // x=X
+        MuHash3072 y = FromInt(InsecureRandBits(4)); // x=X, y=Y
+        MuHash3072 z;                                // x=X, y=Y, z=1
+        z *= x;                                      // x=X, y=Y, z=X
+        z *= y;                                      // x=X, y=Y, z=X*Y
+        y *= x;                                      // x=X, y=Y*X, z=X*Y
+        z /= y;                                      // x=X, y=Y*X, z=1
+        z.Finalize(out);
+
+        uint256 out2;
+        MuHash3072 a;
+        a.Finalize(out2);
+
+        BOOST_CHECK_EQUAL(out, out2);
+    }
+
+    MuHash3072 acc = FromInt(0);
+    acc *= FromInt(1);
+    acc /= FromInt(2);
+    acc.Finalize(out);
+    BOOST_CHECK_EQUAL(out, uint256S("10d312b100cbd32ada024a6646e40d3482fcff103668d2625f10002a607d5863"));
+
+    MuHash3072 acc2 = FromInt(0);
+    unsigned char tmp[32] = {1, 0};
+    acc2.Insert(Span<const unsigned char>(tmp, sizeof(tmp)));
+    unsigned char tmp2[32] = {2, 0};
+    acc2.Remove(Span<const unsigned char>(tmp2, sizeof(tmp2)));
+    acc2.Finalize(out);
+    BOOST_CHECK_EQUAL(out, uint256S("10d312b100cbd32ada024a6646e40d3482fcff103668d2625f10002a607d5863"));
+
+    // The unfinalized state survives a serialization roundtrip.
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    MuHash3072 acc3 = FromInt(0);
+    acc3.Insert(Span<const unsigned char>(tmp, sizeof(tmp)));
+    acc3.Remove(Span<const unsigned char>(tmp2, sizeof(tmp2)));
+    ss << acc3;
+    MuHash3072 acc4;
+    ss >> acc4;
+    acc4.Finalize(out);
+    BOOST_CHECK_EQUAL(out, uint256S("10d312b100cbd32ada024a6646e40d3482fcff103668d2625f10002a607d5863"));
+
+    // Inverse of a value that needs reduction: x * x^-1 == 1.
+    Num3072 num;
+    for (int i = 0; i < Num3072::LIMBS; ++i) num.limbs[i] = std::numeric_limits<Num3072::limb_t>::max() - i;
+    Num3072 inv = num.GetInverse();
+    num.Multiply(inv);
+    BOOST_CHECK(num.IsOne());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
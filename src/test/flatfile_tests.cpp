@@ -123,4 +123,84 @@ BOOST_AUTO_TEST_CASE(flatfile_flush)
     BOOST_CHECK_EQUAL(fs::file_size(seq.FileName(FlatFilePos(0, 1))), 1);
 }
 
+BOOST_AUTO_TEST_CASE(flatfile_map)
+{
+    const auto data_dir = GetDataDir();
+    FlatFileSeq seq(data_dir, "b", 16 * 1024);
+    FlatFileMapCache maps(2);
+
+    const std::string line1("It is well enough that people of the nation do not understand our banking and monetary system.");
+    const std::string line2("If they did, I believe there would be a revolution before tomorrow morning.");
+    const size_t size1 = GetSerializeSize(line1, CLIENT_VERSION);
+    const size_t size2 = GetSerializeSize(line2, CLIENT_VERSION);
+    for (int n = 0; n < 3; ++n) {
+        CAutoFile file(seq.Open(FlatFilePos(n, 0)), SER_DISK, CLIENT_VERSION);
+        file << line1;
+    }
+
+    // Mapping a missing file or a range past the end of a file fails.
+    BOOST_CHECK(!maps.Map(seq, FlatFilePos(3, 0), 1));
+    BOOST_CHECK(!maps.Map(seq, FlatFilePos(0, size1), 1));
+
+    std::shared_ptr<const MappedFile> map0 = maps.Map(seq, FlatFilePos(0, 0), size1);
+#if defined(WIN32)
+    BOOST_CHECK(!map0);
+#else
+    if (sizeof(void*) < 8) {
+        BOOST_CHECK(!map0);
+        return;
+    }
+    BOOST_REQUIRE(map0);
+    std::string text;
+    SpanReader(SER_DISK, CLIENT_VERSION, map0->Data()) >> text;
+    BOOST_CHECK_EQUAL(text, line1);
+    BOOST_CHECK(maps.Map(seq, FlatFilePos(0, 0), size1) == map0);
+
+    // A range past the end of the mapping maps the grown file again.
+    {
+        CAutoFile file(seq.Open(FlatFilePos(0, size1)), SER_DISK, CLIENT_VERSION);
+        file << line2;
+    }
+    std::shared_ptr<const MappedFile> grown = maps.Map(seq, FlatFilePos(0, size1), size2);
+    BOOST_REQUIRE(grown);
+    BOOST_CHECK(grown != map0);
+    SpanReader(SER_DISK, CLIENT_VERSION, grown->Data().subspan(size1)) >> text;
+    BOOST_CHECK_EQUAL(text, line2);
+    // The old mapping stays usable while it is held.
+    SpanReader(SER_DISK, CLIENT_VERSION, map0->Data()) >> text;
+    BOOST_CHECK_EQUAL(text, line1);
+
+    // Only the two most recently used files stay mapped.
+    std::shared_ptr<const MappedFile> map1 = maps.Map(seq, FlatFilePos(1, 0), size1);
+    BOOST_REQUIRE(map1);
+    BOOST_CHECK(maps.Map(seq, FlatFilePos(0, 0), size1) == grown);
+    BOOST_REQUIRE(maps.Map(seq, FlatFilePos(2, 0), size1));
+    BOOST_CHECK(maps.Map(seq, FlatFilePos(0, 0), size1) == grown);
+    BOOST_CHECK(maps.Map(seq, FlatFilePos(1, 0), size1) != map1);
+
+    maps.Release(seq.FileName(FlatFilePos(0, 0)));
+    std::shared_ptr<const MappedFile> released = maps.Map(seq, FlatFilePos(0, 0), size1);
+    BOOST_CHECK(released != grown);
+
+    // The same file number in another directory is never served from the first one's mapping.
+    fs::create_directories(data_dir / "other");
+    FlatFileSeq other_seq(data_dir / "other", "b", 16 * 1024);
+    {
+        CAutoFile file(other_seq.Open(FlatFilePos(0, 0)), SER_DISK, CLIENT_VERSION);
+        file << line2;
+    }
+    std::shared_ptr<const MappedFile> other = maps.Map(other_seq, FlatFilePos(0, 0), size2);
+    BOOST_REQUIRE(other);
+    BOOST_CHECK(other != released);
+    SpanReader(SER_DISK, CLIENT_VERSION, other->Data()) >> text;
+    BOOST_CHECK_EQUAL(text, line2);
+
+    maps.Clear();
+    BOOST_CHECK(maps.Map(other_seq, FlatFilePos(0, 0), size2) != other);
+
+    maps.SetMaxFiles(0);
+    BOOST_CHECK(!maps.Map(seq, FlatFilePos(0, 0), size1));
+#endif
+}
+
 BOOST_AUTO_TEST_SUITE_END()
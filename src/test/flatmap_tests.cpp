@@ -0,0 +1,142 @@
+// Copyright (c) 2020-2021 The PoWx Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <flatmap.h>
+#include <memusage.h>
+#include <test/util/setup_common.h>
+
+#include <map>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(flatmap_tests, BasicTestingSetup)
+
+namespace {
+
+/** A hash with few distinct values, so that probe sequences collide and control bytes match falsely. */
+struct PoorHasher {
+    size_t operator()(uint32_t key) const { return (key % 61) * 0x9e3779b97f4a7c15ULL; }
+};
+
+struct SpreadHasher {
+    size_t operator()(uint32_t key) const { return key * 0x9e3779b97f4a7c15ULL; }
+};
+
+template <typename Hash>
+void CheckEqual(const flatmap<uint32_t, std::string, Hash>& map, const std::map<uint32_t, std::string>& expected)
+{
+    BOOST_CHECK_EQUAL(map.size(), expected.size());
+    size_t count = 0;
+    for (const auto& entry : map) {
+        auto it = expected.find(entry.first);
+        BOOST_REQUIRE(it != expected.end());
+        BOOST_CHECK_EQUAL(entry.second, it->second);
+        ++count;
+    }
+    BOOST_CHECK_EQUAL(count, expected.size());
+    for (const auto& entry : expected) {
+        auto it = map.find(entry.first);
+        BOOST_REQUIRE(it != map.end());
+        BOOST_CHECK_EQUAL(it->second, entry.second);
+    }
+}
+
+template <typename Hash>
+void RandomOperations(FastRandomContext& rng)
+{
+    flatmap<uint32_t, std::string, Hash> map;
+    std::map<uint32_t, std::string> expected;
+    std::map<uint32_t, const std::string*> addresses;
+
+    for (int i = 0; i < 20000; ++i) {
+        const uint32_t key = rng.randrange(2000);
+        switch (rng.randrange(4)) {
+        case 0:
+        case 1: {
+            const std::string value = std::to_string(rng.rand32());
+            auto res = map.try_emplace(key, value);
+            BOOST_CHECK_EQUAL(res.second, expected.emplace(key, value).second);
+            if (res.second) addresses[key] = &res.first->second;
+            break;
+        }
+        case 2: {
+            BOOST_CHECK_EQUAL(map.erase(key), expected.erase(key));
+            addresses.erase(key);
+            break;
+        }
+        case 3: {
+            auto it = map.find(key);
+            BOOST_CHECK_EQUAL(it != map.end(), expected.count(key) == 1);
+            BOOST_CHECK_EQUAL(map.count(key), expected.count(key));
+            break;
+        }
+        }
+    }
+    CheckEqual(map, expected);
+
+    // Elements did not move while the table grew and was rebuilt.
+    for (const auto& entry : addresses) {
+        BOOST_CHECK(&map.find(entry.first)->second == entry.second);
+    }
+
+    // Drain while iterating, as BatchWrite does.
+    size_t drained = 0;
+    for (auto it = map.begin(); it != map.end();) {
+        BOOST_CHECK_EQUAL(expected.erase(it->first), 1U);
+        it = map.erase(it);
+        ++drained;
+    }
+    BOOST_CHECK_EQUAL(drained, addresses.size());
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(expected.empty());
+    BOOST_CHECK(map.find(0) == map.end());
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(flatmap_random_operations)
+{
+    FastRandomContext rng(true);
+    RandomOperations<SpreadHasher>(rng);
+    RandomOperations<PoorHasher>(rng);
+}
+
+BOOST_AUTO_TEST_CASE(flatmap_memory_usage)
+{
+    flatmap<uint32_t, uint64_t, SpreadHasher> map;
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), 0U);
+    BOOST_CHECK_EQUAL(map.capacity(), 0U);
+
+    for (uint32_t i = 0; i < 10000; ++i) {
+        map[i] = i;
+    }
+    BOOST_CHECK_EQUAL(map.size(), 10000U);
+    // The table holds at most 7/8 elements per slot, and doubles as it grows.
+    BOOST_CHECK(map.capacity() * 7 / 8 >= map.size());
+    BOOST_CHECK(map.capacity() / 2 * 7 / 8 < map.size());
+
+    size_t allocated = 0;
+    map.for_each_allocation([&allocated](size_t bytes) { allocated += bytes; });
+    BOOST_CHECK(allocated >= map.capacity() * (sizeof(void*) + 1) + map.size() * sizeof(std::pair<const uint32_t, uint64_t>));
+    const size_t usage = memusage::DynamicUsage(map);
+    BOOST_CHECK(usage >= allocated);
+
+    // Erased nodes are reused without growing the pool.
+    for (uint32_t i = 0; i < 5000; ++i) {
+        map.erase(i);
+    }
+    for (uint32_t i = 20000; i < 25000; ++i) {
+        map[i] = i;
+    }
+    BOOST_CHECK_EQUAL(map.size(), 10000U);
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), usage);
+
+    map.clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.begin() == map.end());
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,46 @@
+// Copyright (c) 2020-2021 The PoWx Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// FuzzedDataProvider.h uses std::numeric_limits without including <limits>,
+// and nothing included before it here pulls that in.
+#include <limits>
+
+#include <crypto/heavyhash_dummyArray.h>
+#include <test/fuzz/FuzzedDataProvider.h>
+#include <test/fuzz/fuzz.h>
+#include <util/matrixchecks.h>
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+void test_one_input(const std::vector<uint8_t>& buffer)
+{
+    FuzzedDataProvider fuzzed_data_provider(buffer.data(), buffer.size());
+    uint64_t matrix[64*64];
+    const bool start_from_reference = fuzzed_data_provider.ConsumeBool();
+    for (int i = 0; i < 64; ++i) {
+        for (int j = 0; j < 64; ++j) {
+            matrix[64*i + j] = start_from_reference ? reference_matrix[i][j] : 0;
+        }
+    }
+
+    // Overwrite entries, then optionally force linear dependencies between rows so that
+    // the singular path of both implementations is exercised as well.
+    const size_t entries = fuzzed_data_provider.ConsumeIntegralInRange<size_t>(0, 64*64);
+    for (size_t k = 0; k < entries && fuzzed_data_provider.remaining_bytes() > 0; ++k) {
+        const uint8_t byte = fuzzed_data_provider.ConsumeIntegral<uint8_t>();
+        matrix[(start_from_reference ? fuzzed_data_provider.ConsumeIntegralInRange<size_t>(0, 64*64 - 1) : k)] = byte & 0xF;
+    }
+    while (fuzzed_data_provider.remaining_bytes() > 0) {
+        const int dst = fuzzed_data_provider.ConsumeIntegralInRange<int>(0, 63);
+        const int src = fuzzed_data_provider.ConsumeIntegralInRange<int>(0, 63);
+        for (int j = 0; j < 64; ++j) {
+            matrix[64*dst + j] = matrix[64*src + j];
+        }
+    }
+
+    assert(heavyhash::checks::Is4BitPrecision(matrix));
+    assert(heavyhash::checks::IsFullRank(matrix) == heavyhash::checks::IsFullRankSVD(matrix));
+}
@@ -9,9 +9,11 @@
 
 #include <test/util/setup_common.h>
 
-#include <boost/test/unit_test.hpp>
+#include <thread>
 #include <vector>
 
+#include <boost/test/unit_test.hpp>
+
 BOOST_FIXTURE_TEST_SUITE(mempool_tests, TestingSetup)
 
 static constexpr auto REMOVAL_REASON_DUMMY = MemPoolRemovalReason::REPLACED;
@@ -788,4 +790,131 @@ BOOST_AUTO_TEST_CASE(MempoolAncestryTests)
     BOOST_CHECK_EQUAL(descendants, 4ULL);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolClusterTest)
+{
+    CTxMemPool pool;
+    LOCK2(cs_main, pool.cs);
+    TestMemPoolEntryHelper entry;
+
+    // a has two children: b pays for it, d pays next to nothing.
+    // c is on its own.
+    CTransactionRef a = make_tx(/* output_values */ {10 * COIN, 10 * COIN});
+    CTransactionRef b = make_tx(/* output_values */ {10 * COIN}, /* inputs */ {a}, /* input_indices */ {0});
+    CTransactionRef c = make_tx(/* output_values */ {10 * COIN});
+    CTransactionRef d = make_tx(/* output_values */ {10 * COIN}, /* inputs */ {a}, /* input_indices */ {1});
+    pool.addUnchecked(entry.Fee(1000LL).FromTx(a));
+    pool.addUnchecked(entry.Fee(20000LL).FromTx(b));
+    pool.addUnchecked(entry.Fee(10000LL).FromTx(c));
+    pool.addUnchecked(entry.Fee(100LL).FromTx(d));
+
+    const CTxMemPool::txiter a_it = *pool.GetIter(a->GetHash());
+    const CTxMemPool::txiter b_it = *pool.GetIter(b->GetHash());
+    const CTxMemPool::txiter c_it = *pool.GetIter(c->GetHash());
+    const CTxMemPool::txiter d_it = *pool.GetIter(d->GetHash());
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 2U);
+    BOOST_CHECK(a_it->m_cluster == b_it->m_cluster);
+    BOOST_CHECK(a_it->m_cluster == d_it->m_cluster);
+    BOOST_CHECK(a_it->m_cluster != c_it->m_cluster);
+    BOOST_CHECK_EQUAL(pool.CalculateClusterSize({a_it, b_it}), 4U);
+    BOOST_CHECK_EQUAL(pool.CalculateClusterSize({c_it}), 2U);
+    // Transactions to be replaced are not counted, nor what only they connect.
+    BOOST_CHECK_EQUAL(pool.CalculateClusterSize({a_it}, {d_it}), 3U);
+    BOOST_CHECK_EQUAL(pool.CalculateClusterSize({b_it}, {a_it, d_it}), 2U);
+
+    // b is linearized right after a, and the two form the first chunk.
+    pool.LinearizeClusters();
+    const TxMemPoolCluster& cluster = *a_it->m_cluster;
+    BOOST_CHECK_EQUAL(cluster.txs.size(), 3U);
+    BOOST_CHECK(cluster.txs[0] == a_it);
+    BOOST_CHECK(cluster.txs[1] == b_it);
+    BOOST_CHECK(cluster.txs[2] == d_it);
+    BOOST_CHECK_EQUAL(cluster.chunks.size(), 2U);
+    BOOST_CHECK_EQUAL(cluster.chunks[0].end, 2U);
+    BOOST_CHECK_EQUAL(cluster.chunks[0].fee, 21000);
+    BOOST_CHECK_EQUAL(cluster.chunks[0].size, a_it->GetTxSize() + b_it->GetTxSize());
+    BOOST_CHECK_EQUAL(cluster.chunks[1].fee, 100);
+
+    // Prioritising d above b moves it ahead in the linearization.
+    pool.PrioritiseTransaction(d->GetHash(), 100000LL);
+    pool.LinearizeClusters();
+    BOOST_CHECK(a_it->m_cluster->txs[1] == d_it);
+    pool.PrioritiseTransaction(d->GetHash(), -100000LL);
+
+    // Eviction starts with the end of the cluster with the lowest feerate last chunk.
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.exists(a->GetHash()));
+    BOOST_CHECK(pool.exists(b->GetHash()));
+    BOOST_CHECK(pool.exists(c->GetHash()));
+    BOOST_CHECK(!pool.exists(d->GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), CFeeRate(100, GetVirtualTransactionSize(*d)).GetFeePerK() + 1000);
+
+    // Once a is mined, its children are split into clusters of their own.
+    pool.addUnchecked(entry.Fee(100LL).FromTx(d));
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 2U);
+    pool.removeForBlock({a}, 1);
+    // A child of b only joins b, not d, which is no longer connected to b.
+    BOOST_CHECK_EQUAL(pool.CalculateClusterSize({b_it}), 2U);
+    pool.LinearizeClusters();
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 3U);
+    for (const auto& split : pool.GetClusters()) {
+        BOOST_CHECK_EQUAL(split->txs.size(), 1U);
+        BOOST_CHECK_EQUAL(split->chunks.size(), 1U);
+        BOOST_CHECK(split->txs[0]->m_cluster == split.get());
+    }
+
+    pool.clear();
+    BOOST_CHECK(pool.GetClusters().empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSharedQueryTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+
+    CTransactionRef a = make_tx(/* output_values */ {10 * COIN});
+    CTransactionRef b = make_tx(/* output_values */ {10 * COIN}, /* inputs */ {a});
+    CTransactionRef c = make_tx(/* output_values */ {5 * COIN});
+    {
+        LOCK2(cs_main, pool.cs);
+        pool.addUnchecked(entry.Fee(1000LL).FromTx(a));
+        pool.addUnchecked(entry.Fee(2000LL).FromTx(b));
+    }
+
+    // Queries are answered while another thread holds cs.
+    LOCK(pool.cs);
+    bool exists_a{false}, exists_c{true}, spent{false};
+    CTransactionRef get_b;
+    TxMempoolInfo info_b;
+    std::vector<uint256> hashes;
+    std::thread reader([&] {
+        exists_a = pool.exists(a->GetHash());
+        exists_c = pool.exists(c->GetHash());
+        spent = pool.isSpent(COutPoint(a->GetHash(), 0));
+        get_b = pool.get(b->GetHash());
+        info_b = pool.info(b->GetHash());
+        pool.queryHashes(hashes);
+    });
+    reader.join();
+
+    BOOST_CHECK(exists_a);
+    BOOST_CHECK(!exists_c);
+    BOOST_CHECK(spent);
+    BOOST_CHECK(get_b == b);
+    BOOST_CHECK(info_b.tx == b);
+    BOOST_CHECK_EQUAL(info_b.fee, 2000);
+    BOOST_CHECK_EQUAL(hashes.size(), 2U);
+    BOOST_CHECK(hashes[0] == a->GetHash());
+
+    // Changes made under cs are seen by the next query.
+    pool.removeRecursive(*a, REMOVAL_REASON_DUMMY);
+    std::thread reader_after([&] {
+        exists_a = pool.exists(a->GetHash());
+        hashes.clear();
+        pool.queryHashes(hashes);
+    });
+    reader_after.join();
+    BOOST_CHECK(!exists_a);
+    BOOST_CHECK(hashes.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,11 +4,15 @@
 
 #include <chainparams.h>
 #include <coins.h>
+#include <consensus/validation.h>
+#include <hash.h>
 #include <consensus/consensus.h>
 #include <consensus/merkle.h>
 #include <consensus/tx_verify.h>
 #include <miner.h>
 #include <policy/policy.h>
+#include <pow.h>
+#include <script/interpreter.h>
 #include <script/standard.h>
 #include <txmempool.h>
 #include <uint256.h>
@@ -16,6 +20,7 @@
 #include <util/system.h>
 #include <util/time.h>
 #include <validation.h>
+#include <validationinterface.h>
 
 #include <test/util/setup_common.h>
 
@@ -526,4 +531,274 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+BOOST_AUTO_TEST_CASE(search_nonce)
+{
+    const auto chain_params = CreateChainParams(CBaseChainParams::REGTEST);
+    const Consensus::Params& params = chain_params->GetConsensus();
+
+    CBlockHeader header;
+    header.nVersion = 4;
+    header.hashPrevBlock = InsecureRand256();
+    header.hashMerkleRoot = InsecureRand256();
+    header.nTime = 1600000000;
+    // About 2^16 expected hashes, enough for the search to use its worker threads.
+    header.nBits = 0x1f00ffff;
+
+    CBlockHeader single = header;
+    uint64_t single_tries = 1000000;
+    BOOST_REQUIRE(SearchNonce(single, params, 1, single_tries));
+    BOOST_CHECK(CheckProofOfWork(single.GetPoWHash(), single.nBits, params));
+    BOOST_CHECK_EQUAL(single_tries, 1000000 - uint64_t{single.nNonce});
+
+    // Threads split the work but must settle on the same, lowest, nonce.
+    CBlockHeader threaded = header;
+    uint64_t threaded_tries = 1000000;
+    BOOST_REQUIRE(SearchNonce(threaded, params, 4, threaded_tries));
+    BOOST_CHECK_EQUAL(threaded.nNonce, single.nNonce);
+    BOOST_CHECK_EQUAL(threaded_tries, single_tries);
+
+    // Running out of tries leaves max_tries at zero.
+    CBlockHeader limited = header;
+    uint64_t limited_tries = single.nNonce;
+    BOOST_CHECK(!SearchNonce(limited, params, 4, limited_tries));
+    BOOST_CHECK_EQUAL(limited_tries, 0U);
+
+    // The last nonce is never tried, so the search ends there when the space runs out.
+    CBlockHeader exhausted = header;
+    exhausted.nNonce = std::numeric_limits<uint32_t>::max() - 3;
+    exhausted.nBits = 0x1d00ffff;
+    uint64_t exhausted_tries = 1000000;
+    BOOST_CHECK(!SearchNonce(exhausted, params, 1, exhausted_tries));
+    BOOST_CHECK_EQUAL(exhausted.nNonce, std::numeric_limits<uint32_t>::max());
+    BOOST_CHECK_EQUAL(exhausted_tries, 1000000U - 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(cluster_chunks, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    const CScript scriptPubKey = CScript() << OP_TRUE;
+    CTxMemPool& mempool = *m_node.mempool;
+
+    // Mature two more coinbases.
+    CreateAndProcessBlock({}, scriptPubKey);
+    CreateAndProcessBlock({}, scriptPubKey);
+
+    // Spend the first output of prev to num_outputs outputs the coinbase key can spend.
+    const CScript p2pk = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const auto spend = [&](const CTransactionRef& prev, CAmount fee, size_t num_outputs) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(prev->GetHash(), 0);
+        tx.vout.resize(num_outputs);
+        for (CTxOut& out : tx.vout) {
+            out.nValue = (prev->vout[0].nValue - fee) / num_outputs;
+            out.scriptPubKey = p2pk;
+        }
+        tx.vout[0].nValue += prev->vout[0].nValue - fee - tx.vout[0].nValue * num_outputs;
+        std::vector<unsigned char> vchSig;
+        const uint256 hash = SignatureHash(prev->vout[0].scriptPubKey, tx, 0, SIGHASH_ALL, 0, SigVersion::BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        tx.vin[0].scriptSig << vchSig;
+        return MakeTransactionRef(tx);
+    };
+    const auto submit = [&](const CTransactionRef& tx) {
+        LOCK(cs_main);
+        TxValidationState state;
+        const bool accepted = AcceptToMemoryPool(mempool, state, tx, nullptr, false, 0);
+        BOOST_CHECK_MESSAGE(accepted, state.ToString());
+    };
+
+    // A child paying for its parent is merged into one chunk with it, which
+    // goes ahead of a transaction paying more than the parent alone.
+    const CTransactionRef parent = spend(m_coinbase_txns[0], 1000, 2);
+    const CTransactionRef child = spend(parent, 100000, 2);
+    const CTransactionRef other = spend(m_coinbase_txns[1], 20000, 2);
+    submit(parent);
+    submit(child);
+    submit(other);
+    {
+        LOCK(mempool.cs);
+        mempool.LinearizeClusters();
+        const TxMemPoolCluster* cluster = mempool.mapTx.find(parent->GetHash())->m_cluster;
+        BOOST_REQUIRE_EQUAL(cluster->chunks.size(), 1U);
+        BOOST_CHECK_EQUAL(cluster->chunks[0].fee, 101000);
+    }
+    std::unique_ptr<CBlockTemplate> pblocktemplate = BlockAssembler(mempool, chainparams).CreateNewBlock(scriptPubKey);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 4U);
+    BOOST_CHECK(*pblocktemplate->block.vtx[1] == *parent);
+    BOOST_CHECK(*pblocktemplate->block.vtx[2] == *child);
+    BOOST_CHECK(*pblocktemplate->block.vtx[3] == *other);
+    WITH_LOCK(mempool.cs, mempool.clear());
+
+    // A chain whose feerate drops at every step is a chunk per transaction.
+    // When one chunk does not fit, the chunks after it in its cluster are
+    // left out, while a lower feerate chunk of another cluster still fits.
+    const CTransactionRef first = spend(m_coinbase_txns[0], 50000, 2);
+    const CTransactionRef large = spend(first, 35000, 100);
+    const CTransactionRef last = spend(large, 1000, 2);
+    const CTransactionRef small = spend(m_coinbase_txns[2], 600, 2);
+    submit(first);
+    submit(large);
+    submit(last);
+    submit(small);
+    {
+        LOCK(mempool.cs);
+        mempool.LinearizeClusters();
+        BOOST_CHECK_EQUAL(mempool.mapTx.find(first->GetHash())->m_cluster->chunks.size(), 3U);
+    }
+    BlockAssembler::Options options;
+    // Room for all but the large transaction, on top of the coinbase reserve.
+    options.nBlockMaxWeight = 4000 + WITNESS_SCALE_FACTOR * (GetVirtualTransactionSize(*first) +
+        GetVirtualTransactionSize(*last) + GetVirtualTransactionSize(*small) + 1);
+    BOOST_REQUIRE(WITNESS_SCALE_FACTOR * GetVirtualTransactionSize(*large) > int64_t(options.nBlockMaxWeight) - 4000);
+    pblocktemplate = BlockAssembler(mempool, chainparams, options).CreateNewBlock(scriptPubKey);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 3U);
+    BOOST_CHECK(*pblocktemplate->block.vtx[1] == *first);
+    BOOST_CHECK(*pblocktemplate->block.vtx[2] == *small);
+}
+
+BOOST_FIXTURE_TEST_CASE(template_builder, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    const CScript scriptPubKey = CScript() << OP_TRUE;
+    BlockTemplateBuilder builder(*m_node.mempool, chainparams);
+    RegisterValidationInterface(&builder);
+
+    // Mature a second coinbase.
+    CreateAndProcessBlock({}, scriptPubKey);
+
+    // Spend the first output of prev to num_outputs outputs the coinbase key can spend.
+    const CScript p2pk = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const auto spend = [&](const CTransactionRef& prev, CAmount fee, size_t num_outputs) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(prev->GetHash(), 0);
+        tx.vout.resize(num_outputs);
+        for (CTxOut& out : tx.vout) {
+            out.nValue = (prev->vout[0].nValue - fee) / num_outputs;
+            out.scriptPubKey = p2pk;
+        }
+        tx.vout[0].nValue += prev->vout[0].nValue - fee - tx.vout[0].nValue * num_outputs;
+        std::vector<unsigned char> vchSig;
+        const uint256 hash = SignatureHash(prev->vout[0].scriptPubKey, tx, 0, SIGHASH_ALL, 0, SigVersion::BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        tx.vin[0].scriptSig << vchSig;
+        return MakeTransactionRef(tx);
+    };
+    const auto submit = [&](const CTransactionRef& tx) {
+        LOCK(cs_main);
+        TxValidationState state;
+        const bool accepted = AcceptToMemoryPool(*m_node.mempool, state, tx, nullptr, false, 0);
+        BOOST_CHECK_MESSAGE(accepted, state.ToString());
+    };
+
+    const CTransactionRef parent = spend(m_coinbase_txns[0], 1000, 2);
+    submit(parent);
+    SyncWithValidationInterfaceQueue();
+    std::unique_ptr<CBlockTemplate> pblocktemplate = builder.CreateNewBlock(scriptPubKey);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+    BOOST_CHECK(*pblocktemplate->block.vtx[1] == *parent);
+
+    // New transactions are added after the previous selection, even when they
+    // pay more than it; a template from the whole mempool puts them first.
+    const CTransactionRef rich = spend(m_coinbase_txns[1], 100000, 2);
+    const CTransactionRef child = spend(parent, 1000, 2);
+    submit(rich);
+    submit(child);
+    SyncWithValidationInterfaceQueue();
+    pblocktemplate = builder.CreateNewBlock(scriptPubKey);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 4U);
+    BOOST_CHECK(*pblocktemplate->block.vtx[1] == *parent);
+    BOOST_CHECK(*pblocktemplate->block.vtx[2] == *rich);
+    BOOST_CHECK(*pblocktemplate->block.vtx[3] == *child);
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[2], 100000);
+    std::unique_ptr<CBlockTemplate> full_template = BlockAssembler(*m_node.mempool, chainparams).CreateNewBlock(scriptPubKey);
+    BOOST_REQUIRE_EQUAL(full_template->block.vtx.size(), 4U);
+    BOOST_CHECK(*full_template->block.vtx[1] == *rich);
+
+    // Transactions that left the mempool are dropped with their descendants.
+    WITH_LOCK(m_node.mempool->cs, m_node.mempool->removeRecursive(*parent, MemPoolRemovalReason::CONFLICT));
+    SyncWithValidationInterfaceQueue();
+    pblocktemplate = builder.CreateNewBlock(scriptPubKey);
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+    BOOST_CHECK(*pblocktemplate->block.vtx[1] == *rich);
+
+    // A new tip starts over from the whole mempool.
+    const CBlock block = CreateAndProcessBlock({CMutableTransaction(*rich)}, scriptPubKey);
+    BOOST_REQUIRE(WITH_LOCK(cs_main, return ::ChainActive().Tip()->GetBlockHash()) == block.GetHash());
+    submit(parent);
+    pblocktemplate = builder.CreateNewBlock(scriptPubKey);
+    BOOST_CHECK(pblocktemplate->block.hashPrevBlock == block.GetHash());
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+    BOOST_CHECK(*pblocktemplate->block.vtx[1] == *parent);
+
+    // A new transaction that pays more than a kept one, and only fits in its
+    // place, makes the template select from the whole mempool again.
+    const CTransactionRef large = spend(m_coinbase_txns[2], 100000, 100);
+    gArgs.ForceSetArg("-blockmaxweight", ToString(4000 + WITNESS_SCALE_FACTOR * (GetVirtualTransactionSize(*parent) + GetVirtualTransactionSize(*large))));
+    submit(large);
+    SyncWithValidationInterfaceQueue();
+    pblocktemplate = builder.CreateNewBlock(scriptPubKey);
+    gArgs.ForceSetArg("-blockmaxweight", ToString(DEFAULT_BLOCK_MAX_WEIGHT));
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+    BOOST_CHECK(*pblocktemplate->block.vtx[1] == *large);
+
+    SyncWithValidationInterfaceQueue();
+    UnregisterValidationInterface(&builder);
+}
+
+BOOST_FIXTURE_TEST_CASE(template_prebuild, TestChain100Setup)
+{
+    struct TemplateListener : public CValidationInterface {
+        Mutex m_mutex;
+        std::vector<std::shared_ptr<const CBlock>> m_templates GUARDED_BY(m_mutex);
+        void NewBlockTemplate(const std::shared_ptr<const CBlock>& block) override
+        {
+            LOCK(m_mutex);
+            m_templates.push_back(block);
+        }
+    };
+
+    const CChainParams& chainparams = Params();
+    const CScript scriptPubKey = CScript() << OP_TRUE;
+    BlockTemplateBuilder builder(*m_node.mempool, chainparams);
+    TemplateListener listener;
+    RegisterValidationInterface(&builder);
+    RegisterValidationInterface(&listener);
+    builder.Start();
+
+    // Nothing is prebuilt for a node nobody asks for templates.
+    CreateAndProcessBlock({}, scriptPubKey);
+    SyncWithValidationInterfaceQueue();
+    BOOST_CHECK(WITH_LOCK(listener.m_mutex, return listener.m_templates.empty()));
+
+    builder.CreateNewBlock(scriptPubKey);
+    const CBlock block = CreateAndProcessBlock({}, scriptPubKey);
+    std::shared_ptr<const CBlock> prebuilt;
+    for (int i = 0; i < 1000 && !prebuilt; ++i) {
+        SyncWithValidationInterfaceQueue();
+        LOCK(listener.m_mutex);
+        BOOST_REQUIRE(listener.m_templates.size() <= 1);
+        if (!listener.m_templates.empty()) prebuilt = listener.m_templates.back();
+        if (!prebuilt) UninterruptibleSleep(std::chrono::milliseconds{10});
+    }
+    BOOST_REQUIRE(prebuilt);
+    BOOST_CHECK(prebuilt->hashPrevBlock == block.GetHash());
+
+    // The next block's matrix was generated along with the template.
+    const HeavyHashMatrixCacheStats stats = GetHeavyHashMatrixCacheStats();
+    BOOST_CHECK(prebuilt->GetPoWMatrix());
+    BOOST_CHECK_EQUAL(GetHeavyHashMatrixCacheStats().misses, stats.misses);
+
+    // getblocktemplate gets the prebuilt template.
+    std::unique_ptr<CBlockTemplate> pblocktemplate = builder.CreateNewBlock(scriptPubKey);
+    BOOST_CHECK(pblocktemplate->block.GetHash() == prebuilt->GetHash());
+
+    builder.Stop();
+    UnregisterValidationInterface(&listener);
+    UnregisterValidationInterface(&builder);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
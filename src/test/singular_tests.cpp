@@ -1,9 +1,15 @@
 // Copyright (c) 2020-2021 The PoWx Core developers
 
+#include <chainparams.h>
+#include <chainparamsbase.h>
 #include <crypto/heavyhash_dummyArray.h>
+#include <crypto/sha3.h>
+#include <crypto/xoshiro256pp.h>
+#include <hash.h>
 
 #include <matrix-utils/singular/Svd.h>
 #include <test/util/setup_common.h>
+#include <util/matrixchecks.h>
 #include <boost/test/unit_test.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(singular_tests, BasicTestingSetup)
@@ -91,4 +97,110 @@ BOOST_AUTO_TEST_CASE(check_full_rank_for_64x64) {
         assert(CheckMatrixRank64x64(matrix));
 }
 
+static void ConvertReferenceArrayToIntegers(uint64_t* matrix) {
+    for (int i = 0; i < 64; ++i) {
+        for (int j = 0; j < 64; ++j) {
+            matrix[64*i + j] = reference_matrix[i][j];
+        }
+    }
+}
+
+static void FillRandom4Bit(uint64_t* matrix) {
+    for (int i = 0; i < 64*64; ++i) {
+        matrix[i] = InsecureRandBits(4);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(exact_rank_matches_svd_reference) {
+    uint64_t matrix[64*64];
+    ConvertReferenceArrayToIntegers(matrix);
+    BOOST_CHECK(heavyhash::checks::IsFullRank(matrix));
+    BOOST_CHECK(heavyhash::checks::IsFullRankSVD(matrix));
+
+    for (int round = 0; round < 20; ++round) {
+        FillRandom4Bit(matrix);
+        BOOST_CHECK_EQUAL(heavyhash::checks::IsFullRank(matrix), heavyhash::checks::IsFullRankSVD(matrix));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(exact_rank_matches_svd_on_chain_seeds) {
+    // A block's matrix is the first candidate drawn from SHA3(hashPrevBlock) that
+    // passes the rank check. Replay the draws for the first two blocks of every
+    // chain and for a chain of further prevhashes: the exact check has to agree
+    // with the SVD rule it replaced on every candidate, so both pick the same matrix.
+    std::vector<uint256> prev_hashes{uint256()};
+    for (const std::string& chain : {CBaseChainParams::MAIN, CBaseChainParams::TESTNET, CBaseChainParams::REGTEST}) {
+        prev_hashes.push_back(CreateChainParams(chain)->GenesisBlock().GetHash());
+    }
+    for (int i = 0; i < 256; ++i) {
+        uint256 next;
+        CSHA3_256().Write(prev_hashes.back().begin(), 32).Finalize(next.begin());
+        prev_hashes.push_back(next);
+    }
+
+    for (const uint256& prev_hash : prev_hashes) {
+        uint256 seed;
+        CSHA3_256().Write(prev_hash.begin(), 32).Finalize(seed.begin());
+        XoShiRo256PlusPlus generator(seed);
+        uint64_t matrix[64*64];
+        bool full_rank;
+        do {
+            // Same draws as GenerateHeavyHashMatrix.
+            for (int i = 0; i < 64; ++i) {
+                for (int j = 0; j < 64; j += 16) {
+                    const uint64_t value = generator();
+                    for (int shift = 0; shift < 16; ++shift) {
+                        matrix[64*i + j + shift] = (value >> (4 * shift)) & 0xF;
+                    }
+                }
+            }
+            full_rank = heavyhash::checks::IsFullRank(matrix);
+            BOOST_CHECK_EQUAL(full_rank, heavyhash::checks::IsFullRankSVD(matrix));
+        } while (!full_rank);
+
+        HeavyHashMatrix generated;
+        GenerateHeavyHashMatrix(seed, generated);
+        BOOST_CHECK(generated == HeavyHashMatrix(matrix));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(exact_rank_detects_singular_matrices) {
+    uint64_t matrix[64*64];
+
+    // all-zero and all-equal matrices
+    std::fill(matrix, matrix + 64*64, 0);
+    BOOST_CHECK(!heavyhash::checks::IsFullRank(matrix));
+    std::fill(matrix, matrix + 64*64, 15);
+    BOOST_CHECK(!heavyhash::checks::IsFullRank(matrix));
+
+    // identity is trivially regular
+    std::fill(matrix, matrix + 64*64, 0);
+    for (int i = 0; i < 64; ++i) matrix[64*i + i] = 1;
+    BOOST_CHECK(heavyhash::checks::IsFullRank(matrix));
+
+    // 2 * identity is singular over GF(2) but regular over the rationals
+    for (int i = 0; i < 64; ++i) matrix[64*i + i] = 2;
+    BOOST_CHECK(heavyhash::checks::IsFullRank(matrix));
+
+    for (int round = 0; round < 20; ++round) {
+        // duplicated row
+        FillRandom4Bit(matrix);
+        const int src = InsecureRandRange(64);
+        const int dst = (src + 1 + InsecureRandRange(63)) % 64;
+        std::copy(matrix + 64*src, matrix + 64*src + 64, matrix + 64*dst);
+        BOOST_CHECK(!heavyhash::checks::IsFullRank(matrix));
+        BOOST_CHECK(!heavyhash::checks::IsFullRankSVD(matrix));
+
+        // a row that is the sum of two other rows
+        FillRandom4Bit(matrix);
+        for (int j = 0; j < 64; ++j) {
+            matrix[j] = InsecureRandBits(3);
+            matrix[64 + j] = InsecureRandBits(3);
+            matrix[128 + j] = matrix[j] + matrix[64 + j];
+        }
+        BOOST_CHECK(!heavyhash::checks::IsFullRank(matrix));
+        BOOST_CHECK(!heavyhash::checks::IsFullRankSVD(matrix));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
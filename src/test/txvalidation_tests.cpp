@@ -5,8 +5,12 @@
 #include <validation.h>
 #include <consensus/validation.h>
 #include <primitives/transaction.h>
+#include <script/interpreter.h>
 #include <script/script.h>
 #include <test/util/setup_common.h>
+#include <util/rbf.h>
+#include <util/string.h>
+#include <util/system.h>
 
 #include <boost/test/unit_test.hpp>
 
@@ -52,4 +56,62 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_reject_coinbase, TestChain100Setup)
     BOOST_CHECK(state.GetResult() == TxValidationResult::TX_CONSENSUS);
 }
 
+/**
+ * Ensure that a replacement is not rejected for the size of a cluster
+ * that only reaches the limit with the transactions it replaces.
+ */
+BOOST_FIXTURE_TEST_CASE(tx_mempool_cluster_limit_replacement, TestChain100Setup)
+{
+    gArgs.ForceSetArg("-limitclustercount", "3");
+    CTxMemPool& mempool = *m_node.mempool;
+
+    // Spend output n of prev to num_outputs outputs the coinbase key can
+    // spend, signalling replaceability.
+    const CScript p2pk = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const auto spend = [&](const CTransactionRef& prev, uint32_t n, CAmount fee, size_t num_outputs) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(prev->GetHash(), n);
+        tx.vin[0].nSequence = MAX_BIP125_RBF_SEQUENCE;
+        tx.vout.resize(num_outputs);
+        for (CTxOut& out : tx.vout) {
+            out.nValue = (prev->vout[n].nValue - fee) / num_outputs;
+            out.scriptPubKey = p2pk;
+        }
+        std::vector<unsigned char> vchSig;
+        const uint256 hash = SignatureHash(prev->vout[n].scriptPubKey, tx, 0, SIGHASH_ALL, 0, SigVersion::BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        tx.vin[0].scriptSig << vchSig;
+        return MakeTransactionRef(tx);
+    };
+    const auto submit = [&](const CTransactionRef& tx, TxValidationState& state) {
+        LOCK(cs_main);
+        return AcceptToMemoryPool(mempool, state, tx, nullptr, false, 0);
+    };
+    TxValidationState state;
+
+    // parent has two children, which fill its cluster.
+    const CTransactionRef parent = spend(m_coinbase_txns[0], 0, 1000, 2);
+    const CTransactionRef child = spend(parent, 0, 1000, 1);
+    const CTransactionRef sibling = spend(parent, 1, 1000, 1);
+    BOOST_CHECK_MESSAGE(submit(parent, state), state.ToString());
+    BOOST_CHECK_MESSAGE(submit(child, state), state.ToString());
+    BOOST_CHECK_MESSAGE(submit(sibling, state), state.ToString());
+
+    // Another transaction can not join it.
+    BOOST_CHECK(!submit(spend(sibling, 0, 1000, 1), state));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "too-large-cluster");
+
+    // A replacement of the child leaves it at the limit.
+    state = TxValidationState();
+    const CTransactionRef replacement = spend(parent, 0, 10000, 1);
+    BOOST_CHECK_MESSAGE(submit(replacement, state), state.ToString());
+    BOOST_CHECK(mempool.exists(replacement->GetHash()));
+    BOOST_CHECK(!mempool.exists(child->GetHash()));
+    BOOST_CHECK_EQUAL(mempool.size(), 3U);
+
+    gArgs.ForceSetArg("-limitclustercount", ToString(DEFAULT_CLUSTER_LIMIT));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
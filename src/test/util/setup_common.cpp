@@ -9,7 +9,9 @@
 #include <consensus/consensus.h>
 #include <consensus/params.h>
 #include <consensus/validation.h>
+#include <crypto/heavyhash.h>
 #include <crypto/sha256.h>
+#include <crypto/sha3.h>
 #include <init.h>
 #include <miner.h>
 #include <net.h>
@@ -76,6 +78,8 @@ BasicTestingSetup::BasicTestingSetup(const std::string& chainName)
     InitLogging();
     LogInstance().StartLogging();
     SHA256AutoDetect();
+    SHA3AutoDetect();
+    HeavyHashAutoDetect();
     ECC_Start();
     SetupEnvironment();
     SetupNetworking();
@@ -127,10 +131,13 @@ TestingSetup::TestingSetup(const std::string& chainName) : BasicTestingSetup(cha
         throw std::runtime_error(strprintf("ActivateBestChain failed. (%s)", state.ToString()));
     }
 
-    // Start script-checking threads. Set g_parallel_script_checks to true so they are used.
+    // Start script-checking, header hashing, coin prefetch and block preload threads. Set g_parallel_script_checks to true so they are used.
     constexpr int script_check_threads = 2;
     for (int i = 0; i < script_check_threads; ++i) {
         threadGroup.create_thread([i]() { return ThreadScriptCheck(i); });
+        threadGroup.create_thread([i]() { return ThreadHeaderHashCheck(i); });
+        threadGroup.create_thread([i]() { return ThreadCoinPrefetch(i); });
+        threadGroup.create_thread([i]() { return ThreadBlockPreload(i); });
     }
     g_parallel_script_checks = true;
 
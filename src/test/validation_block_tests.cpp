@@ -340,4 +340,34 @@ BOOST_AUTO_TEST_CASE(mempool_locks_reorg)
         rpc_thread.join();
     }
 }
+
+BOOST_AUTO_TEST_CASE(processnewblockheaders_parallel_hashing)
+{
+    std::vector<CBlockHeader> headers;
+    uint256 prev = Params().GenesisBlock().GetHash();
+    for (int i = 0; i < 20; ++i) {
+        const auto block = GoodBlock(prev);
+        headers.push_back(block->GetBlockHeader());
+        prev = block->GetHash();
+    }
+
+    // Break the proof of work of a header in the middle: the headers before it are
+    // accepted, and the failure is attributed to the right one.
+    std::vector<CBlockHeader> bad_headers = headers;
+    while (CheckProofOfWork(bad_headers[10].GetPoWHash(), bad_headers[10].nBits, Params().GetConsensus())) {
+        ++bad_headers[10].nNonce;
+    }
+    BlockValidationState state;
+    const CBlockIndex* pindex = nullptr;
+    BOOST_CHECK(!ProcessNewBlockHeaders(bad_headers, state, Params(), &pindex));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "high-hash");
+    BOOST_REQUIRE(pindex != nullptr);
+    BOOST_CHECK(pindex->GetBlockHash() == headers[9].GetHash());
+
+    state = BlockValidationState();
+    BOOST_CHECK(ProcessNewBlockHeaders(headers, state, Params(), &pindex));
+    BOOST_CHECK(pindex->GetBlockHash() == headers.back().GetHash());
+    BOOST_CHECK_EQUAL(pindex->nHeight, 20);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -52,17 +52,27 @@ BOOST_AUTO_TEST_CASE(getcoinscachesizestate)
         BOOST_TEST_MESSAGE("CCoinsViewCache memory usage: " << view.DynamicMemoryUsage());
     };
 
-    constexpr size_t MAX_COINS_CACHE_BYTES = 1024;
+    // Sized so that on 64 bit hosts COINS_UNTIL_CRITICAL coins fit in the
+    // cache with room to spare, and a few more do not; see below.
+    constexpr size_t MAX_COINS_CACHE_BYTES = 2250;
 
     // Without any coins in the cache, we shouldn't need to flush.
     BOOST_CHECK_EQUAL(
         chainstate.GetCoinsCacheSizeState(tx_pool, MAX_COINS_CACHE_BYTES, /*max_mempool_size_bytes*/ 0),
         CoinsCacheSizeState::OK);
 
-    // If the initial memory allocations of cacheCoins don't match these common
-    // cases, we can't really continue to make assertions about memory usage.
-    // End the test early.
-    if (view.DynamicMemoryUsage() != 32 && view.DynamicMemoryUsage() != 16) {
+    // cacheCoins allocates nothing until the first coin is added.
+    BOOST_CHECK_EQUAL(view.DynamicMemoryUsage(), 0U);
+
+    // The first coin allocates the table of cacheCoins (16 slots: 176 bytes)
+    // and the first chunk of its node pool (16 nodes: 1552 bytes, plus 32 for
+    // the chunk list). Both have room for more coins than this test adds
+    // before the flush limits are reached, so every further coin only adds
+    // its COIN_SIZE. If these allocations don't match, we can't really
+    // continue to make assertions about memory usage. End the test early.
+    COutPoint first = add_coin(view);
+    BOOST_CHECK_EQUAL(view.AccessCoin(first).DynamicMemoryUsage(), COIN_SIZE);
+    if (!is_64_bit || view.DynamicMemoryUsage() != 176 + 1552 + 32 + COIN_SIZE) {
         // Add a bunch of coins to see that we at least flip over to CRITICAL.
 
         for (int i{0}; i < 1000; ++i) {
@@ -79,15 +89,14 @@ BOOST_AUTO_TEST_CASE(getcoinscachesizestate)
     }
 
     print_view_mem_usage(view);
-    BOOST_CHECK_EQUAL(view.DynamicMemoryUsage(), is_64_bit ? 32 : 16);
 
     // We should be able to add COINS_UNTIL_CRITICAL coins to the cache before going CRITICAL.
     // This is contingent not only on the dynamic memory usage of the Coins
     // that we're adding (COIN_SIZE bytes per), but also on how much memory the
-    // cacheCoins (unordered_map) preallocates.
+    // cacheCoins table and node pool preallocate.
     constexpr int COINS_UNTIL_CRITICAL{3};
 
-    for (int i{0}; i < COINS_UNTIL_CRITICAL; ++i) {
+    for (int i{1}; i < COINS_UNTIL_CRITICAL; ++i) {
         COutPoint res = add_coin(view);
         print_view_mem_usage(view);
         BOOST_CHECK_EQUAL(view.AccessCoin(res).DynamicMemoryUsage(), COIN_SIZE);
@@ -111,15 +120,16 @@ BOOST_AUTO_TEST_CASE(getcoinscachesizestate)
         CoinsCacheSizeState::CRITICAL);
 
     // Passing non-zero max mempool usage should allow us more headroom.
+    constexpr size_t MEMPOOL_HEADROOM = 640;
     BOOST_CHECK_EQUAL(
-        chainstate.GetCoinsCacheSizeState(tx_pool, MAX_COINS_CACHE_BYTES, /*max_mempool_size_bytes*/ 1 << 10),
+        chainstate.GetCoinsCacheSizeState(tx_pool, MAX_COINS_CACHE_BYTES, /*max_mempool_size_bytes*/ MEMPOOL_HEADROOM),
         CoinsCacheSizeState::OK);
 
     for (int i{0}; i < 3; ++i) {
         add_coin(view);
         print_view_mem_usage(view);
         BOOST_CHECK_EQUAL(
-            chainstate.GetCoinsCacheSizeState(tx_pool, MAX_COINS_CACHE_BYTES, /*max_mempool_size_bytes*/ 1 << 10),
+            chainstate.GetCoinsCacheSizeState(tx_pool, MAX_COINS_CACHE_BYTES, /*max_mempool_size_bytes*/ MEMPOOL_HEADROOM),
             CoinsCacheSizeState::OK);
     }
 
@@ -128,16 +138,13 @@ BOOST_AUTO_TEST_CASE(getcoinscachesizestate)
     add_coin(view);
     print_view_mem_usage(view);
 
-    // Only perform these checks on 64 bit hosts; I haven't done the math for 32.
-    if (is_64_bit) {
-        float usage_percentage = (float)view.DynamicMemoryUsage() / (MAX_COINS_CACHE_BYTES + (1 << 10));
-        BOOST_TEST_MESSAGE("CoinsTip usage percentage: " << usage_percentage);
-        BOOST_CHECK(usage_percentage >= 0.9);
-        BOOST_CHECK(usage_percentage < 1);
-        BOOST_CHECK_EQUAL(
-            chainstate.GetCoinsCacheSizeState(tx_pool, MAX_COINS_CACHE_BYTES, 1 << 10),
-            CoinsCacheSizeState::LARGE);
-    }
+    float usage_percentage = (float)view.DynamicMemoryUsage() / (MAX_COINS_CACHE_BYTES + MEMPOOL_HEADROOM);
+    BOOST_TEST_MESSAGE("CoinsTip usage percentage: " << usage_percentage);
+    BOOST_CHECK(usage_percentage >= 0.9);
+    BOOST_CHECK(usage_percentage < 1);
+    BOOST_CHECK_EQUAL(
+        chainstate.GetCoinsCacheSizeState(tx_pool, MAX_COINS_CACHE_BYTES, MEMPOOL_HEADROOM),
+        CoinsCacheSizeState::LARGE);
 
     // Using the default max_* values permits way more coins to be added.
     for (int i{0}; i < 1000; ++i) {
@@ -147,20 +154,77 @@ BOOST_AUTO_TEST_CASE(getcoinscachesizestate)
             CoinsCacheSizeState::OK);
     }
 
-    // Flushing the view doesn't take us back to OK because cacheCoins has
-    // preallocated memory that doesn't get reclaimed even after flush.
-
     BOOST_CHECK_EQUAL(
         chainstate.GetCoinsCacheSizeState(tx_pool, MAX_COINS_CACHE_BYTES, 0),
         CoinsCacheSizeState::CRITICAL);
 
+    // Flushing the view takes us back to OK, as cacheCoins releases its
+    // table and node pool when it is cleared.
     view.SetBestBlock(InsecureRand256());
     BOOST_CHECK(view.Flush());
     print_view_mem_usage(view);
+    BOOST_CHECK_EQUAL(view.DynamicMemoryUsage(), 0U);
 
     BOOST_CHECK_EQUAL(
         chainstate.GetCoinsCacheSizeState(tx_pool, MAX_COINS_CACHE_BYTES, 0),
-        CoinsCacheSizeState::CRITICAL);
+        CoinsCacheSizeState::OK);
+}
+
+//! Blocks can be connected on top of a flush that is still being written:
+//! its coins stay visible, and later flushes apply in order.
+BOOST_AUTO_TEST_CASE(background_flush)
+{
+    CCoinsViewDB db{GetDataDir() / "background_flush", 1 << 20, /*fMemory*/ true, /*fWipe*/ false};
+    CCoinsViewBackgroundFlush flush_view{&db};
+    CCoinsViewCache cache{&flush_view};
+
+    auto add_coins = [&cache](size_t count) {
+        std::vector<COutPoint> outpoints;
+        for (size_t i = 0; i < count; ++i) {
+            Coin coin;
+            coin.nHeight = 1;
+            coin.out.nValue = 1 + InsecureRandRange(1000);
+            coin.out.scriptPubKey.assign((uint32_t)56, 1);
+            outpoints.emplace_back(InsecureRand256(), 0);
+            cache.AddCoin(outpoints.back(), std::move(coin), false);
+        }
+        return outpoints;
+    };
+
+    const std::vector<COutPoint> first = add_coins(100);
+    const uint256 block1 = InsecureRand256();
+    cache.SetBestBlock(block1);
+    BOOST_CHECK(flush_view.FlushInBackground(cache));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), 0U);
+
+    // Whether or not the write has completed, the coins are there.
+    BOOST_CHECK(cache.GetBestBlock() == block1);
+    for (const COutPoint& outpoint : first) {
+        BOOST_CHECK(cache.HaveCoin(outpoint));
+    }
+
+    for (size_t i = 0; i < 50; ++i) {
+        BOOST_CHECK(cache.SpendCoin(first[i]));
+    }
+    const std::vector<COutPoint> second = add_coins(50);
+    const uint256 block2 = InsecureRand256();
+    cache.SetBestBlock(block2);
+    BOOST_CHECK(flush_view.FlushInBackground(cache));
+
+    BOOST_CHECK(flush_view.Sync());
+    // Only the last completed write is reported, and only once.
+    BOOST_CHECK(flush_view.TakeWrittenBlock() == block2);
+    BOOST_CHECK(flush_view.TakeWrittenBlock().IsNull());
+    BOOST_CHECK(db.GetBestBlock() == block2);
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+    for (size_t i = 0; i < first.size(); ++i) {
+        BOOST_CHECK_EQUAL(db.HaveCoin(first[i]), i >= 50);
+    }
+    for (const COutPoint& outpoint : second) {
+        BOOST_CHECK(db.HaveCoin(outpoint));
+    }
+    BOOST_CHECK(cache.GetBestBlock() == block2);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,7 +3,12 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <chainparams.h>
+#include <consensus/validation.h>
 #include <net.h>
+#include <node/coinstats.h>
+#include <node/utxo_snapshot.h>
+#include <streams.h>
+#include <txdb.h>
 #include <validation.h>
 
 #include <test/util/setup_common.h>
@@ -74,4 +79,295 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+
+BOOST_FIXTURE_TEST_CASE(block_index_pow, TestChain100Setup)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    BOOST_CHECK(CheckBlockIndexPoW(params, 1));
+    BOOST_CHECK(CheckBlockIndexPoW(params, 4));
+
+    CBlockIndex* pindex = WITH_LOCK(cs_main, return ::ChainActive()[50]);
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pindex, params));
+    BOOST_CHECK(block.GetHash() == pindex->GetBlockHash());
+
+    // Reads compare the header with the index entry instead of rehashing it, and the
+    // background check rehashes it; both must notice a corrupted entry.
+    WITH_LOCK(cs_main, ++pindex->nNonce);
+    BOOST_CHECK(!ReadBlockFromDisk(block, pindex, params));
+    BOOST_CHECK(!CheckBlockIndexPoW(params, 4));
+    WITH_LOCK(cs_main, --pindex->nNonce);
+    BOOST_CHECK(ReadBlockFromDisk(block, pindex, params));
+}
+
+namespace {
+//! Regtest parameters that trust one additional UTXO snapshot.
+struct AssumeutxoTestParams : public CChainParams {
+    AssumeutxoTestParams(const CChainParams& params, int height, const AssumeutxoData& data) : CChainParams(params)
+    {
+        m_assumeutxo_data[height] = data;
+    }
+};
+} // namespace
+
+BOOST_FIXTURE_TEST_CASE(load_utxo_snapshot, TestChain100Setup)
+{
+    CChainState& chainstate = ::ChainstateActive();
+    const fs::path snapshot_path = GetDataDir() / "utxo.dat";
+    CCoinsStats stats;
+    CBlockIndex* base;
+
+    // Write a snapshot the way dumptxoutset does.
+    {
+        LOCK(cs_main);
+        chainstate.ForceFlushStateToDisk();
+        BOOST_REQUIRE(GetUTXOStats(&chainstate.CoinsDB(), stats));
+        base = chainstate.m_chain.Tip();
+        BOOST_CHECK_EQUAL(stats.hashBlock, base->GetBlockHash());
+
+        CAutoFile afile{fsbridge::fopen(snapshot_path, "wb"), SER_DISK, CLIENT_VERSION};
+        afile << SnapshotMetadata{base->GetBlockHash(), stats.coins_count, base->nChainTx};
+        std::unique_ptr<CCoinsViewCursor> pcursor(chainstate.CoinsDB().Cursor());
+        COutPoint key;
+        Coin coin;
+        for (; pcursor->Valid(); pcursor->Next()) {
+            BOOST_REQUIRE(pcursor->GetKey(key) && pcursor->GetValue(coin));
+            afile << key;
+            afile << coin;
+        }
+    }
+    const unsigned int base_nchaintx = base->nChainTx;
+
+    // Turn the node into one that has synced headers only.
+    {
+        LOCK(cs_main);
+        chainstate.ResetCoinsViews();
+        chainstate.InitCoinsDB(1 << 23, true, true);
+        chainstate.InitCoinsCache();
+        chainstate.m_chain.SetTip(chainstate.m_chain.Genesis());
+        chainstate.CoinsTip().SetBestBlock(chainstate.m_chain.Tip()->GetBlockHash());
+        chainstate.CoinsTip().Flush();
+        for (const auto& entry : ::BlockIndex()) {
+            CBlockIndex* pindex = entry.second;
+            if (pindex->nHeight == 0) continue;
+            pindex->nTx = 0;
+            pindex->nChainTx = 0;
+            pindex->nSequenceId = 0;
+            pindex->nStatus = BLOCK_VALID_TREE;
+            pindex->nFile = pindex->nDataPos = pindex->nUndoPos = 0;
+        }
+        chainstate.setBlockIndexCandidates.clear();
+        chainstate.setBlockIndexCandidates.insert(chainstate.m_chain.Tip());
+        chainstate.CheckBlockIndex(Params().GetConsensus());
+    }
+
+    const auto load = [&](const CChainParams& params, std::string& error) {
+        LOCK(cs_main);
+        CAutoFile afile{fsbridge::fopen(snapshot_path, "rb"), SER_DISK, CLIENT_VERSION};
+        SnapshotMetadata metadata;
+        afile >> metadata;
+        return chainstate.LoadUTXOSnapshot(params, afile, metadata, error);
+    };
+    std::string error;
+
+    // Only snapshots with a trusted hash are accepted.
+    BOOST_CHECK(!load(Params(), error));
+    BOOST_CHECK_EQUAL(error, "No snapshot is trusted at height 100");
+    uint256 bad_hash = stats.hashSerialized;
+    *bad_hash.begin() ^= 1;
+    BOOST_CHECK(!load(AssumeutxoTestParams(Params(), 100, {bad_hash, base_nchaintx}), error));
+    BOOST_CHECK(error.find("does not match") != std::string::npos);
+    BOOST_CHECK(!load(AssumeutxoTestParams(Params(), 100, {stats.hashSerialized, base_nchaintx + 1}), error));
+    BOOST_CHECK(WITH_LOCK(cs_main, return !std::unique_ptr<CCoinsViewCursor>(chainstate.CoinsDB().Cursor())->Valid()));
+
+    const AssumeutxoTestParams params(Params(), 100, {stats.hashSerialized, base_nchaintx});
+    BOOST_CHECK_MESSAGE(load(params, error), error);
+    {
+        LOCK(cs_main);
+        BOOST_CHECK_EQUAL(chainstate.m_chain.Tip(), base);
+        BOOST_CHECK_EQUAL(base->nChainTx, base_nchaintx);
+        BOOST_CHECK(base->nStatus & BLOCK_ASSUMED_VALID);
+        BOOST_CHECK(base->IsValid(BLOCK_VALID_SCRIPTS));
+        BOOST_CHECK(IsBlockPruned(base->pprev));
+        BOOST_CHECK(chainstate.CoinsDB().GetHeadBlocks().empty());
+        CCoinsStats loaded;
+        BOOST_REQUIRE(GetUTXOStats(&chainstate.CoinsDB(), loaded));
+        BOOST_CHECK_EQUAL(loaded.hashSerialized, stats.hashSerialized);
+        BOOST_CHECK_EQUAL(loaded.coins_count, stats.coins_count);
+    }
+    // A second load is refused now that the chain has moved past genesis.
+    BOOST_CHECK(!load(params, error));
+
+    // Blocks after the base connect on top of the loaded coins.
+    CreateAndProcessBlock({}, CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG);
+    BOOST_CHECK_EQUAL(WITH_LOCK(cs_main, return chainstate.m_chain.Height()), 101);
+    BOOST_CHECK_EQUAL(WITH_LOCK(cs_main, return chainstate.SnapshotBase()), base);
+
+    // The chain can not be reorganized below the base.
+    BlockValidationState state;
+    BOOST_CHECK(!InvalidateBlock(state, Params(), base));
+    BOOST_CHECK(state.GetRejectReason().find("loaded UTXO snapshot") != std::string::npos);
+    BOOST_CHECK_EQUAL(WITH_LOCK(cs_main, return chainstate.m_chain.Height()), 101);
+}
+
+BOOST_AUTO_TEST_CASE(write_snapshot_coins)
+{
+    CCoinsViewDB db{GetDataDir() / "snapshot_coins", 1 << 20, /*fMemory*/ true, /*fWipe*/ false};
+    const uint256 base = InsecureRand256();
+    Coin coin;
+    coin.nHeight = 1;
+    coin.out.nValue = 1;
+    coin.out.scriptPubKey.assign((uint32_t)25, 1);
+    std::vector<std::pair<COutPoint, Coin>> coins{{COutPoint{InsecureRand256(), 0}, coin}, {COutPoint{InsecureRand256(), 0}, Coin{}}};
+
+    // A spent coin fails the whole batch instead of aborting.
+    BOOST_CHECK(!db.WriteSnapshotCoins(coins, base));
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+    BOOST_CHECK(!db.HaveCoin(coins[0].first));
+
+    coins.pop_back();
+    BOOST_CHECK(db.WriteSnapshotCoins(coins, base));
+    BOOST_CHECK(db.HaveCoin(coins[0].first));
+    BOOST_CHECK(db.GetHeadBlocks().size() == 2 && db.GetHeadBlocks()[0] == base);
+}
+
+BOOST_FIXTURE_TEST_CASE(parallel_utxo_scan, TestChain100Setup)
+{
+    CChainState& chainstate = ::ChainstateActive();
+    WITH_LOCK(cs_main, chainstate.ForceFlushStateToDisk());
+    CCoinsViewDB& coins_db = *WITH_LOCK(cs_main, return &chainstate.CoinsDB());
+
+    // The stats do not depend on the number of threads.
+    for (const CoinStatsHashType hash_type : {CoinStatsHashType::HASH_SERIALIZED, CoinStatsHashType::MUHASH, CoinStatsHashType::NONE}) {
+        CCoinsStats expected;
+        BOOST_REQUIRE(GetUTXOStats(&coins_db, expected, hash_type, 1));
+        BOOST_CHECK_EQUAL(expected.coins_count, 100U);
+        for (const int n_threads : {2, 3, 16}) {
+            CCoinsStats stats;
+            BOOST_REQUIRE(GetUTXOStats(&coins_db, stats, hash_type, n_threads));
+            BOOST_CHECK_EQUAL(stats.hashBlock, expected.hashBlock);
+            BOOST_CHECK_EQUAL(stats.hashSerialized, expected.hashSerialized);
+            BOOST_CHECK_EQUAL(stats.nTransactions, expected.nTransactions);
+            BOOST_CHECK_EQUAL(stats.nTransactionOutputs, expected.nTransactionOutputs);
+            BOOST_CHECK_EQUAL(stats.nBogoSize, expected.nBogoSize);
+            BOOST_CHECK_EQUAL(stats.nTotalAmount, expected.nTotalAmount);
+            BOOST_CHECK_EQUAL(stats.coins_count, expected.coins_count);
+        }
+    }
+
+    // The chunks arrive in the order of a single cursor.
+    std::vector<COutPoint> expected_order;
+    std::unique_ptr<CCoinsViewCursor> pcursor(coins_db.Cursor());
+    for (COutPoint key; pcursor->Valid(); pcursor->Next()) {
+        BOOST_REQUIRE(pcursor->GetKey(key));
+        expected_order.push_back(key);
+    }
+    const auto read_keys = [](size_t, CCoinsViewCursor& cursor, const CoinsChunkSink& emit) {
+        for (COutPoint key; cursor.Valid(); cursor.Next()) {
+            CDataStream chunk(SER_DISK, CLIENT_VERSION);
+            if (!cursor.GetKey(key)) return false;
+            chunk << key;
+            if (!emit(std::move(chunk))) return false;
+        }
+        return true;
+    };
+    for (const int n_threads : {1, 4}) {
+        std::vector<COutPoint> order;
+        BOOST_CHECK(ReadCoinsInOrder(GetCoinsScanRanges(coins_db, n_threads), n_threads, read_keys,
+            [&order](const CDataStream& chunk) {
+                CDataStream ss(chunk);
+                COutPoint key;
+                ss >> key;
+                order.push_back(key);
+                return true;
+            }));
+        BOOST_CHECK(order == expected_order);
+    }
+
+    // A consumer can stop the scan, and exceptions from the readers reach the caller.
+    int n_consumed = 0;
+    BOOST_CHECK(!ReadCoinsInOrder(GetCoinsScanRanges(coins_db, 4), 4, read_keys,
+        [&n_consumed](const CDataStream&) { return ++n_consumed < 10; }));
+    BOOST_CHECK_EQUAL(n_consumed, 10);
+    BOOST_CHECK_THROW(ReadCoinsInOrder(GetCoinsScanRanges(coins_db, 4), 4,
+        [](size_t range, CCoinsViewCursor&, const CoinsChunkSink&) -> bool {
+            if (range == 7) throw std::runtime_error("read failed");
+            return true;
+        },
+        [](const CDataStream&) { return true; }), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(prefetch_block_inputs)
+{
+    CCoinsViewDB db{GetDataDir() / "prefetch", 1 << 20, /*fMemory*/ true, /*fWipe*/ false};
+    std::vector<COutPoint> on_disk;
+    {
+        CCoinsViewCache writer{&db};
+        for (int i = 0; i < 20; ++i) {
+            Coin coin;
+            coin.nHeight = 1 + i;
+            coin.out.nValue = 1 + InsecureRandRange(1000);
+            coin.out.scriptPubKey.assign((uint32_t)25, 1);
+            on_disk.emplace_back(InsecureRand256(), i);
+            writer.AddCoin(on_disk.back(), std::move(coin), false);
+        }
+        writer.SetBestBlock(InsecureRand256());
+        BOOST_REQUIRE(writer.Flush());
+    }
+
+    CCoinsViewCache cache{&db};
+    // An unflushed change in the cache must survive the prefetch.
+    BOOST_CHECK(cache.SpendCoin(on_disk[0]));
+
+    CMutableTransaction parent;
+    for (const COutPoint& outpoint : on_disk) {
+        parent.vin.emplace_back(outpoint);
+    }
+    const COutPoint missing{InsecureRand256(), 0};
+    parent.vin.emplace_back(missing);
+    parent.vout.resize(1);
+    CMutableTransaction child;
+    child.vin.emplace_back(parent.GetHash(), 0);
+    child.vout.resize(1);
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(1);
+
+    CBlock block;
+    block.vtx = {MakeTransactionRef(coinbase), MakeTransactionRef(parent), MakeTransactionRef(child)};
+    PrefetchBlockInputs(block, cache, db);
+
+    BOOST_CHECK(!cache.HaveCoinInCache(on_disk[0]));
+    for (size_t i = 1; i < on_disk.size(); ++i) {
+        BOOST_CHECK(cache.HaveCoinInCache(on_disk[i]));
+        Coin coin;
+        BOOST_REQUIRE(db.GetCoin(on_disk[i], coin));
+        BOOST_CHECK(cache.AccessCoin(on_disk[i]).out == coin.out);
+    }
+    BOOST_CHECK(!cache.HaveCoinInCache(missing));
+    BOOST_CHECK(!cache.HaveCoinInCache(child.vin[0].prevout));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), on_disk.size());
+
+    // Prefetched coins are clean, so only the spend reaches the database.
+    cache.SetBestBlock(InsecureRand256());
+    BOOST_REQUIRE(cache.Flush());
+    BOOST_CHECK(!db.HaveCoin(on_disk[0]));
+    BOOST_CHECK(db.HaveCoin(on_disk[1]));
+}
+
+BOOST_FIXTURE_TEST_CASE(reconnect_blocks_from_disk, TestChain100Setup)
+{
+    const CBlockIndex* tip = WITH_LOCK(cs_main, return ::ChainActive().Tip());
+    CBlockIndex* fork = WITH_LOCK(cs_main, return ::ChainActive()[50]);
+    BlockValidationState state;
+    BOOST_REQUIRE(InvalidateBlock(state, Params(), fork));
+    BOOST_CHECK_EQUAL(WITH_LOCK(cs_main, return ::ChainActive().Height()), 49);
+
+    // The blocks are read back from disk, several at a time, and connected in order.
+    WITH_LOCK(cs_main, ResetBlockFailureFlags(fork));
+    BOOST_REQUIRE(ActivateBestChain(state, Params()));
+    BOOST_CHECK(state.IsValid());
+    BOOST_CHECK_EQUAL(WITH_LOCK(cs_main, return ::ChainActive().Tip()), tip);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
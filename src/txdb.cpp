@@ -11,6 +11,8 @@
 #include <ui_interface.h>
 #include <uint256.h>
 #include <util/system.h>
+#include <util/threadnames.h>
+#include <util/time.h>
 #include <util/translation.h>
 #include <util/vector.h>
 
@@ -105,7 +107,7 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     batch.Erase(DB_BEST_BLOCK);
     batch.Write(DB_HEAD_BLOCKS, Vector(hashBlock, old_tip));
 
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
             CoinEntry entry(&it->first);
             if (it->second.coin.IsSpent())
@@ -115,8 +117,6 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
         if (batch.SizeEstimate() > batch_size) {
             LogPrint(BCLog::COINDB, "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
             db.WriteBatch(batch);
@@ -141,11 +141,146 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     return ret;
 }
 
+bool CCoinsViewDB::WriteSnapshotCoins(const std::vector<std::pair<COutPoint, Coin>>& coins, const uint256& hashBlock)
+{
+    CDBBatch batch(db);
+    assert(!hashBlock.IsNull());
+
+    std::vector<uint256> old_heads = GetHeadBlocks();
+    if (old_heads.empty()) {
+        batch.Erase(DB_BEST_BLOCK);
+        batch.Write(DB_HEAD_BLOCKS, Vector(hashBlock, GetBestBlock()));
+    } else {
+        assert(old_heads.size() == 2 && old_heads[0] == hashBlock);
+    }
+
+    for (const auto& entry : coins) {
+        if (entry.second.IsSpent()) return false;
+        batch.Write(CoinEntry(&entry.first), entry.second);
+    }
+
+    LogPrint(BCLog::COINDB, "Writing snapshot batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
+    return db.WriteBatch(batch);
+}
+
 size_t CCoinsViewDB::EstimateSize() const
 {
     return db.EstimateSize(DB_COIN, (char)(DB_COIN+1));
 }
 
+CCoinsViewBackgroundFlush::~CCoinsViewBackgroundFlush()
+{
+    Sync();
+}
+
+bool CCoinsViewBackgroundFlush::GetCoin(const COutPoint& outpoint, Coin& coin) const
+{
+    {
+        LOCK(m_mutex);
+        if (m_writing) {
+            CCoinsMap::const_iterator it = m_entries.find(outpoint);
+            if (it != m_entries.end()) {
+                coin = it->second.coin;
+                return !coin.IsSpent();
+            }
+        }
+    }
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewBackgroundFlush::HaveCoin(const COutPoint& outpoint) const
+{
+    {
+        LOCK(m_mutex);
+        if (m_writing) {
+            CCoinsMap::const_iterator it = m_entries.find(outpoint);
+            if (it != m_entries.end()) return !it->second.coin.IsSpent();
+        }
+    }
+    return base->HaveCoin(outpoint);
+}
+
+uint256 CCoinsViewBackgroundFlush::GetBestBlock() const
+{
+    {
+        LOCK(m_mutex);
+        if (m_writing) return m_block;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewBackgroundFlush::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    if (!Sync()) return false;
+    return base->BatchWrite(mapCoins, hashBlock);
+}
+
+bool CCoinsViewBackgroundFlush::FlushInBackground(CCoinsViewCache& cache)
+{
+    if (!Sync()) return false;
+    const uint256 block = cache.GetBestBlock();
+    assert(!block.IsNull());
+    {
+        LOCK(m_mutex);
+        cache.MoveEntries(m_entries);
+        m_block = block;
+        m_writing = true;
+    }
+    try {
+        m_thread = std::thread(&CCoinsViewBackgroundFlush::ThreadWrite, this);
+    } catch (...) {
+        // The entries stay readable here, but will not be written.
+        m_failed = true;
+        throw;
+    }
+    return true;
+}
+
+void CCoinsViewBackgroundFlush::ThreadWrite()
+{
+    util::ThreadRename("coinsflush");
+    const uint256 block = WITH_LOCK(m_mutex, return m_block);
+    const int64_t start = GetTimeMicros();
+    bool written = false;
+    try {
+        // The base view writes the entries without modifying them, so
+        // lookups can keep reading them concurrently.
+        written = base->BatchWrite(m_entries, block);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+    if (!written) {
+        // Keep serving the entries: they are the only copy of these changes.
+        LogPrintf("%s: failed to write coins for %s\n", __func__, block.ToString());
+        m_failed = true;
+        return;
+    }
+    LogPrint(BCLog::COINDB, "Background flush for %s written in %.2fs\n", block.ToString(), (GetTimeMicros() - start) * 0.000001);
+
+    CCoinsMap written_entries;
+    {
+        LOCK(m_mutex);
+        m_entries.swap(written_entries);
+        m_written = block;
+        m_writing = false;
+    }
+    // written_entries is released here, off the validation thread.
+}
+
+bool CCoinsViewBackgroundFlush::Sync()
+{
+    if (m_thread.joinable()) m_thread.join();
+    return !m_failed;
+}
+
+uint256 CCoinsViewBackgroundFlush::TakeWrittenBlock()
+{
+    LOCK(m_mutex);
+    uint256 written;
+    std::swap(written, m_written);
+    return written;
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -176,13 +311,41 @@ CCoinsViewCursor *CCoinsViewDB::Cursor() const
        that restriction.  */
     i->pcursor->Seek(DB_COIN);
     // Cache key of first record
-    if (i->pcursor->Valid()) {
-        CoinEntry entry(&i->keyTmp.second);
-        i->pcursor->GetKey(entry);
-        i->keyTmp.first = entry.key;
-    } else {
-        i->keyTmp.first = 0; // Make sure Valid() and GetKey() return false
+    i->ReadKey();
+    return i;
+}
+
+CCoinsViewDBRanges CCoinsViewDB::Ranges(size_t n_ranges) const
+{
+    return CCoinsViewDBRanges(db, n_ranges);
+}
+
+CCoinsViewDBRanges::CCoinsViewDBRanges(const CDBWrapper& db, size_t count)
+    : m_db(db), m_snapshot(db.GetSnapshot()), m_count(count)
+{
+    assert(count >= 1 && count <= PREFIXES);
+
+    // Read the best block from the snapshot as well, so it matches the coins.
+    std::unique_ptr<CDBIterator> it(m_db.NewIterator(m_snapshot));
+    it->Seek(DB_BEST_BLOCK);
+    char key;
+    if (!it->Valid() || !it->GetKey(key) || key != DB_BEST_BLOCK || !it->GetValue(m_best_block)) {
+        m_best_block.SetNull();
     }
+}
+
+std::unique_ptr<CCoinsViewCursor> CCoinsViewDBRanges::Cursor(size_t range) const
+{
+    assert(range < m_count);
+    const uint32_t begin = PREFIXES * range / m_count;
+    const uint32_t end = PREFIXES * (range + 1) / m_count;
+    std::unique_ptr<CCoinsViewDBCursor> i(new CCoinsViewDBCursor(m_db.NewIterator(m_snapshot), m_best_block, end));
+    COutPoint first;
+    first.hash.begin()[0] = begin >> 8;
+    first.hash.begin()[1] = begin & 0xff;
+    first.n = 0;
+    i->pcursor->Seek(CoinEntry(&first));
+    i->ReadKey();
     return i;
 }
 
@@ -214,8 +377,14 @@ bool CCoinsViewDBCursor::Valid() const
 void CCoinsViewDBCursor::Next()
 {
     pcursor->Next();
+    ReadKey();
+}
+
+void CCoinsViewDBCursor::ReadKey()
+{
     CoinEntry entry(&keyTmp.second);
-    if (!pcursor->Valid() || !pcursor->GetKey(entry)) {
+    if (!pcursor->Valid() || !pcursor->GetKey(entry) ||
+        ((uint32_t{keyTmp.second.hash.begin()[0]} << 8) | keyTmp.second.hash.begin()[1]) >= m_end_prefix) {
         keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
     } else {
         keyTmp.first = entry.key;
@@ -260,8 +429,10 @@ bool CBlockTreeDB::LoadBlockIndexGuts(const Consensus::Params& consensusParams,
         if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
             CDiskBlockIndex diskindex;
             if (pcursor->GetValue(diskindex)) {
-                // Construct block index object
-                CBlockIndex* pindexNew = insertBlockIndex(diskindex.GetBlockHash());
+                // Construct block index object. Entries are keyed by their hash, which passed
+                // CheckProofOfWork when the header was first accepted; use it rather than
+                // recomputing a HeavyHash for every header on startup.
+                CBlockIndex* pindexNew = insertBlockIndex(key.second);
                 pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
                 pindexNew->nHeight        = diskindex.nHeight;
                 pindexNew->nFile          = diskindex.nFile;
@@ -275,11 +446,10 @@ bool CBlockTreeDB::LoadBlockIndexGuts(const Consensus::Params& consensusParams,
                 pindexNew->nStatus        = diskindex.nStatus;
                 pindexNew->nTx            = diskindex.nTx;
 
-
-                // Disable PoW Sanity check while loading block index from disk. 
-                // Rationale: doc/obtc-audit.md
-                // if (!CheckProofOfWork(pindexNew->GetBlockHeader().GetPoWHash(), pindexNew->nBits, consensusParams))
-                //     return error("%s: CheckProofOfWork failed: %s", __func__, pindexNew->ToString());
+                // Cheap sanity check of the stored hash against nBits. Rehashing the headers
+                // themselves is left to -checkblockindexpow. Rationale: doc/obtc-audit.md
+                if (!CheckProofOfWork(key.second, pindexNew->nBits, consensusParams))
+                    return error("%s: CheckProofOfWork failed: %s", __func__, pindexNew->ToString());
 
                 pcursor->Next();
             } else {
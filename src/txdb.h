@@ -10,14 +10,18 @@
 #include <dbwrapper.h>
 #include <chain.h>
 #include <primitives/block.h>
+#include <sync.h>
 
+#include <atomic>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 class CBlockIndex;
 class CCoinsViewDBCursor;
+class CCoinsViewDBRanges;
 class uint256;
 
 //! -dbcache default (MiB)
@@ -57,11 +61,54 @@ public:
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
     CCoinsViewCursor *Cursor() const override;
 
+    /** Split the coins into n_ranges ranges for reading in parallel. @see CCoinsViewDBRanges */
+    CCoinsViewDBRanges Ranges(size_t n_ranges) const;
+
+    /**
+     * Write a run of unspent coins straight to the database, bypassing any cache,
+     * as part of a transition to hashBlock (used when loading a UTXO snapshot).
+     * The database is left marked as being in the middle of that transition, so an
+     * interrupted load is caught by ReplayBlocks; a BatchWrite for hashBlock completes it.
+     * Writes nothing and returns false if any of the coins is spent.
+     */
+    bool WriteSnapshotCoins(const std::vector<std::pair<COutPoint, Coin>>& coins, const uint256& hashBlock);
+
     //! Attempt to update from an older database format. Returns whether an error occurred.
     bool Upgrade();
     size_t EstimateSize() const override;
 };
 
+/**
+ * The coins of a CCoinsViewDB split into consecutive ranges by the first two
+ * bytes of the txid, which is the order the database keeps them in. Reading
+ * the cursors of all ranges one after the other visits the same coins in the
+ * same order as CCoinsViewDB::Cursor().
+ *
+ * All cursors read the snapshot of the database taken when the ranges were
+ * made, so they see one state even while the database is being written, and
+ * they can be made and read on any thread.
+ */
+class CCoinsViewDBRanges
+{
+public:
+    //! Number of distinct txid prefixes the ranges are cut at.
+    static constexpr uint32_t PREFIXES = 1 << 16;
+
+    size_t Count() const { return m_count; }
+    uint256 GetBestBlock() const { return m_best_block; }
+    std::unique_ptr<CCoinsViewCursor> Cursor(size_t range) const;
+
+private:
+    CCoinsViewDBRanges(const CDBWrapper& db, size_t count);
+
+    const CDBWrapper& m_db;
+    std::shared_ptr<const leveldb::Snapshot> m_snapshot;
+    uint256 m_best_block;
+    size_t m_count;
+
+    friend class CCoinsViewDB;
+};
+
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
 class CCoinsViewDBCursor: public CCoinsViewCursor
 {
@@ -76,12 +123,81 @@ public:
     void Next() override;
 
 private:
-    CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
-        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
+    CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn, uint32_t end_prefix = CCoinsViewDBRanges::PREFIXES):
+        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn), m_end_prefix(end_prefix) {}
     std::unique_ptr<CDBIterator> pcursor;
     std::pair<char, COutPoint> keyTmp;
+    //! The cursor ends before the first coin whose txid prefix is this.
+    const uint32_t m_end_prefix;
+
+    //! Cache the key under pcursor, or mark the cursor as ended.
+    void ReadKey();
 
     friend class CCoinsViewDB;
+    friend class CCoinsViewDBRanges;
+};
+
+/**
+ * A layer between the coins cache and the coin database that lets the cache
+ * be flushed without waiting for the database write.
+ *
+ * FlushInBackground() takes over all entries of the cache above, which is
+ * left empty, and writes them to the base view on a background thread. The
+ * base view writes in bounded batches and marks the database as being in
+ * transition until the last one is written, so a crash in the middle is
+ * recovered by ReplayBlocks as for a synchronous flush. Until the write
+ * completes the entries stay readable here, ahead of the base view: the
+ * entries are the newer state, and the base view is only changed for
+ * outpoints that have an entry. Once written they are released on the
+ * background thread and reads go straight to the base view again.
+ *
+ * At most one flush is in flight. Any other write through this view, and
+ * the next FlushInBackground(), first wait for it. The base view must not
+ * modify the entries passed to its BatchWrite, which holds for CCoinsViewDB.
+ */
+class CCoinsViewBackgroundFlush final : public CCoinsViewBacked
+{
+private:
+    mutable Mutex m_mutex;
+    //! Entries being written. Only read while m_writing, by the writer
+    //! thread and by lookups that hold m_mutex.
+    CCoinsMap m_entries;
+    uint256 m_block GUARDED_BY(m_mutex);
+    bool m_writing GUARDED_BY(m_mutex){false};
+    //! Best block of the last background write that completed, until taken.
+    uint256 m_written GUARDED_BY(m_mutex);
+    //! Whether a background write failed. Set by the writer thread.
+    std::atomic<bool> m_failed{false};
+    std::thread m_thread;
+
+    void ThreadWrite();
+
+public:
+    explicit CCoinsViewBackgroundFlush(CCoinsView* view) : CCoinsViewBacked(view) {}
+    ~CCoinsViewBackgroundFlush();
+
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const override;
+    bool HaveCoin(const COutPoint& outpoint) const override;
+    uint256 GetBestBlock() const override;
+    //! Write synchronously, after any flush in flight.
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) override;
+
+    /**
+     * Move the entries of \p cache into this view and write them to the base
+     * view in the background, as of the best block of \p cache. Returns false
+     * if an earlier background write failed.
+     */
+    bool FlushInBackground(CCoinsViewCache& cache);
+
+    /** Wait until no write is in flight. Returns false if a background write failed. */
+    bool Sync();
+
+    /**
+     * Return the best block of the last background write that has completed
+     * since the previous call, or null. The coins as of that block are on
+     * disk once it is returned.
+     */
+    uint256 TakeWrittenBlock();
 };
 
 /** Access to the block database (blocks/index/) */
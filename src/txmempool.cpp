@@ -107,6 +107,7 @@ void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendan
 void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate)
 {
     AssertLockHeld(cs);
+    ExclusiveLock query_lock(cs_query);
     // For each entry in vHashesToUpdate, store the set of in-mempool, but not
     // in-vHashesToUpdate transactions, so that we don't have to recalculate
     // descendants when we come across a previously seen entry.
@@ -339,8 +340,8 @@ CTxMemPool::CTxMemPool(CBlockPolicyEstimator* estimator)
 
 bool CTxMemPool::isSpent(const COutPoint& outpoint) const
 {
-    LOCK(cs);
-    return mapNextTx.count(outpoint);
+    SharedLock lock(cs_query);
+    return QueryMapNextTx().count(outpoint);
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -358,8 +359,10 @@ void CTxMemPool::addUnchecked(const CTxMemPoolEntry &entry, setEntries &setAnces
     // Add to memory pool without checking anything.
     // Used by AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
+    ExclusiveLock query_lock(cs_query);
     indexed_transaction_set::iterator newit = mapTx.insert(entry).first;
     mapLinks.insert(make_pair(newit, TxLinks()));
+    CreateCluster(newit);
 
     // Update transaction for any feeDelta created by PrioritiseTransaction
     // TODO: refactor so that the fee delta is calculated before inserting
@@ -426,6 +429,16 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
     } else
         vTxHashes.clear();
 
+    TxMemPoolCluster* cluster = it->m_cluster;
+    cluster->txs[it->m_cluster_idx] = cluster->txs.back();
+    cluster->txs[it->m_cluster_idx]->m_cluster_idx = it->m_cluster_idx;
+    cluster->txs.pop_back();
+    if (cluster->txs.empty()) {
+        DeleteCluster(cluster);
+    } else {
+        m_dirty_clusters.insert(cluster);
+    }
+
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
     cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
@@ -521,6 +534,7 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
             }
         }
         if (!validLP) {
+            ExclusiveLock query_lock(cs_query);
             mapTx.modify(it, update_lock_points(lp));
         }
     }
@@ -582,6 +596,9 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
 
 void CTxMemPool::_clear()
 {
+    ExclusiveLock query_lock(cs_query);
+    m_clusters.clear();
+    m_dirty_clusters.clear();
     mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
@@ -656,6 +673,11 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             i++;
         }
         assert(setParentCheck == GetMemPoolParents(it));
+        // Parents are in the same cluster.
+        assert(it->m_cluster->txs[it->m_cluster_idx] == it);
+        for (txiter parentIt : setParentCheck) {
+            assert(parentIt->m_cluster == it->m_cluster);
+        }
         // Verify ancestor state is correct.
         setEntries setAncestors;
         uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -720,17 +742,50 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         assert(&tx == it->second);
     }
 
+    size_t nClusterTxs = 0;
+    for (size_t i = 0; i < m_clusters.size(); ++i) {
+        TxMemPoolCluster* cluster = m_clusters[i].get();
+        assert(cluster->idx == i);
+        assert(!cluster->txs.empty());
+        nClusterTxs += cluster->txs.size();
+        if (m_dirty_clusters.count(cluster)) continue;
+        // A linearized cluster is in a valid order, and its chunks cover it in
+        // order of non-increasing feerate.
+        assert(!cluster->chunks.empty() && cluster->chunks.back().end == cluster->txs.size());
+        size_t pos = 0;
+        for (size_t j = 0; j < cluster->chunks.size(); ++j) {
+            const TxMemPoolChunk& chunk = cluster->chunks[j];
+            CAmount nFeesCheck = 0;
+            uint64_t nSizeCheck = 0;
+            for (; pos < chunk.end; ++pos) {
+                txiter txit = cluster->txs[pos];
+                for (txiter parentIt : GetMemPoolParents(txit)) {
+                    assert(parentIt->m_cluster_idx < pos);
+                }
+                nFeesCheck += txit->GetModifiedFee();
+                nSizeCheck += txit->GetTxSize();
+            }
+            assert(chunk.fee == nFeesCheck && chunk.size == nSizeCheck);
+            if (j > 0) {
+                const TxMemPoolChunk& prev = cluster->chunks[j - 1];
+                assert((double)chunk.fee * prev.size <= (double)prev.fee * chunk.size);
+            }
+        }
+    }
+    assert(nClusterTxs == mapTx.size());
+
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
 }
 
 bool CTxMemPool::CompareDepthAndScore(const uint256& hasha, const uint256& hashb)
 {
-    LOCK(cs);
-    indexed_transaction_set::const_iterator i = mapTx.find(hasha);
-    if (i == mapTx.end()) return false;
-    indexed_transaction_set::const_iterator j = mapTx.find(hashb);
-    if (j == mapTx.end()) return true;
+    SharedLock lock(cs_query);
+    const indexed_transaction_set& txs = QueryMapTx();
+    indexed_transaction_set::const_iterator i = txs.find(hasha);
+    if (i == txs.end()) return false;
+    indexed_transaction_set::const_iterator j = txs.find(hashb);
+    if (j == txs.end()) return true;
     uint64_t counta = i->GetCountWithAncestors();
     uint64_t countb = j->GetCountWithAncestors();
     if (counta == countb) {
@@ -757,12 +812,12 @@ public:
 
 std::vector<CTxMemPool::indexed_transaction_set::const_iterator> CTxMemPool::GetSortedDepthAndScore() const
 {
+    const indexed_transaction_set& txs = QueryMapTx();
     std::vector<indexed_transaction_set::const_iterator> iters;
-    AssertLockHeld(cs);
 
-    iters.reserve(mapTx.size());
+    iters.reserve(txs.size());
 
-    for (indexed_transaction_set::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi) {
+    for (indexed_transaction_set::iterator mi = txs.begin(); mi != txs.end(); ++mi) {
         iters.push_back(mi);
     }
     std::sort(iters.begin(), iters.end(), DepthAndScoreComparator());
@@ -771,11 +826,11 @@ std::vector<CTxMemPool::indexed_transaction_set::const_iterator> CTxMemPool::Get
 
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid) const
 {
-    LOCK(cs);
+    SharedLock lock(cs_query);
     auto iters = GetSortedDepthAndScore();
 
     vtxid.clear();
-    vtxid.reserve(mapTx.size());
+    vtxid.reserve(iters.size());
 
     for (auto it : iters) {
         vtxid.push_back(it->GetTx().GetHash());
@@ -788,11 +843,11 @@ static TxMempoolInfo GetInfo(CTxMemPool::indexed_transaction_set::const_iterator
 
 std::vector<TxMempoolInfo> CTxMemPool::infoAll() const
 {
-    LOCK(cs);
+    SharedLock lock(cs_query);
     auto iters = GetSortedDepthAndScore();
 
     std::vector<TxMempoolInfo> ret;
-    ret.reserve(mapTx.size());
+    ret.reserve(iters.size());
     for (auto it : iters) {
         ret.push_back(GetInfo(it));
     }
@@ -802,18 +857,18 @@ std::vector<TxMempoolInfo> CTxMemPool::infoAll() const
 
 CTransactionRef CTxMemPool::get(const uint256& hash) const
 {
-    LOCK(cs);
-    indexed_transaction_set::const_iterator i = mapTx.find(hash);
-    if (i == mapTx.end())
+    SharedLock lock(cs_query);
+    indexed_transaction_set::const_iterator i = QueryMapTx().find(hash);
+    if (i == QueryMapTx().end())
         return nullptr;
     return i->GetSharedTx();
 }
 
 TxMempoolInfo CTxMemPool::info(const uint256& hash) const
 {
-    LOCK(cs);
-    indexed_transaction_set::const_iterator i = mapTx.find(hash);
-    if (i == mapTx.end())
+    SharedLock lock(cs_query);
+    indexed_transaction_set::const_iterator i = QueryMapTx().find(hash);
+    if (i == QueryMapTx().end())
         return TxMempoolInfo();
     return GetInfo(i);
 }
@@ -826,7 +881,9 @@ void CTxMemPool::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeD
         delta += nFeeDelta;
         txiter it = mapTx.find(hash);
         if (it != mapTx.end()) {
+            ExclusiveLock query_lock(cs_query);
             mapTx.modify(it, update_fee_delta(delta));
+            m_dirty_clusters.insert(it->m_cluster);
             // Now update all ancestors' modified fees with descendants
             setEntries setAncestors;
             uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -916,11 +973,14 @@ bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
     // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    // Clusters are estimated to hold one txiter and one chunk per transaction.
+    const size_t cluster_usage = memusage::DynamicUsage(m_clusters) + memusage::MallocUsage(sizeof(TxMemPoolCluster)) * m_clusters.size() + (sizeof(txiter) + sizeof(TxMemPoolChunk)) * mapTx.size();
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cluster_usage + cachedInnerUsage;
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPoolRemovalReason reason) {
     AssertLockHeld(cs);
+    ExclusiveLock query_lock(cs_query);
     UpdateForRemoveFromMempool(stage, updateDescendants);
     for (txiter it : stage) {
         removeUnchecked(it, reason);
@@ -968,6 +1028,7 @@ void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
     setEntries s;
     if (add && mapLinks[entry].parents.insert(parent).second) {
         cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
+        MergeClusters(entry, parent);
     } else if (!add && mapLinks[entry].parents.erase(parent)) {
         cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
     }
@@ -1024,37 +1085,60 @@ void CTxMemPool::trackPackageRemoved(const CFeeRate& rate) {
 void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining) {
     AssertLockHeld(cs);
 
+    if (mapTx.empty() || DynamicMemoryUsage() <= sizelimit) return;
+
+    // Evict from the end of the cluster whose last chunk has the lowest
+    // feerate, which is the last one block assembly would get to.
+    LinearizeClusters();
+    auto compare = [](const TxMemPoolCluster* a, const TxMemPoolCluster* b) {
+        const TxMemPoolChunk& a_tail = a->chunks.back();
+        const TxMemPoolChunk& b_tail = b->chunks.back();
+        return (double)a_tail.fee * b_tail.size > (double)b_tail.fee * a_tail.size;
+    };
+    std::vector<TxMemPoolCluster*> heap;
+    heap.reserve(m_clusters.size());
+    for (const auto& cluster : m_clusters) {
+        heap.push_back(cluster.get());
+    }
+    std::make_heap(heap.begin(), heap.end(), compare);
+
     unsigned nTxnRemoved = 0;
     CFeeRate maxFeeRateRemoved(0);
-    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
-        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+    while (!heap.empty() && DynamicMemoryUsage() > sizelimit) {
+        std::pop_heap(heap.begin(), heap.end(), compare);
+        TxMemPoolCluster* cluster = heap.back();
+        heap.pop_back();
 
-        // We set the new mempool min fee to the feerate of the removed set, plus the
+        // We set the new mempool min fee to the feerate of the removed chunk, plus the
         // "minimum reasonable fee rate" (ie some value under which we consider txn
         // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
         // equal to txn which were removed with no block in between.
-        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+        CFeeRate removed = cluster->chunks.back().GetFeeRate();
         removed += incrementalRelayFee;
         trackPackageRemoved(removed);
         maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
 
-        setEntries stage;
-        CalculateDescendants(mapTx.project<0>(it), stage);
-        nTxnRemoved += stage.size();
-
-        std::vector<CTransaction> txn;
-        if (pvNoSpendsRemaining) {
-            txn.reserve(stage.size());
-            for (txiter iter : stage)
-                txn.push_back(iter->GetTx());
-        }
+        // The last transaction of a linearization has no descendants left in
+        // the mempool. Only remove that one, and linearize what is left of the
+        // cluster again before looking at it next.
+        txiter it = cluster->txs.back();
+        const Optional<txiter> keep = cluster->txs.size() > 1 ? cluster->txs.front() : Optional<txiter>{};
+        const CTransactionRef tx = it->GetSharedTx();
+        setEntries stage{it};
         RemoveStaged(stage, false, MemPoolRemovalReason::SIZELIMIT);
+        ++nTxnRemoved;
         if (pvNoSpendsRemaining) {
-            for (const CTransaction& tx : txn) {
-                for (const CTxIn& txin : tx.vin) {
-                    if (exists(txin.prevout.hash)) continue;
-                    pvNoSpendsRemaining->push_back(txin.prevout);
-                }
+            for (const CTxIn& txin : tx->vin) {
+                if (exists(txin.prevout.hash)) continue;
+                pvNoSpendsRemaining->push_back(txin.prevout);
+            }
+        }
+        if (keep) {
+            std::vector<TxMemPoolCluster*> result;
+            LinearizeCluster((*keep)->m_cluster, result);
+            for (TxMemPoolCluster* split : result) {
+                heap.push_back(split);
+                std::push_heap(heap.begin(), heap.end(), compare);
             }
         }
     }
@@ -1109,6 +1193,211 @@ void CTxMemPool::SetIsLoaded(bool loaded)
 }
 
 
+void CTxMemPool::CreateCluster(txiter entry)
+{
+    m_clusters.push_back(MakeUnique<TxMemPoolCluster>());
+    TxMemPoolCluster* cluster = m_clusters.back().get();
+    cluster->idx = m_clusters.size() - 1;
+    cluster->txs.push_back(entry);
+    entry->m_cluster = cluster;
+    entry->m_cluster_idx = 0;
+    m_dirty_clusters.insert(cluster);
+}
+
+void CTxMemPool::MergeClusters(txiter entry, txiter other)
+{
+    TxMemPoolCluster* to = entry->m_cluster;
+    TxMemPoolCluster* from = other->m_cluster;
+    if (to == from) return;
+    if (to->txs.size() < from->txs.size()) std::swap(to, from);
+    for (txiter it : from->txs) {
+        it->m_cluster = to;
+        it->m_cluster_idx = to->txs.size();
+        to->txs.push_back(it);
+    }
+    from->txs.clear();
+    DeleteCluster(from);
+    m_dirty_clusters.insert(to);
+}
+
+void CTxMemPool::DeleteCluster(TxMemPoolCluster* cluster)
+{
+    assert(cluster->txs.empty());
+    m_dirty_clusters.erase(cluster);
+    const size_t idx = cluster->idx;
+    if (idx + 1 != m_clusters.size()) {
+        m_clusters[idx] = std::move(m_clusters.back());
+        m_clusters[idx]->idx = idx;
+    }
+    m_clusters.pop_back();
+}
+
+void CTxMemPool::LinearizeClusters() const
+{
+    AssertLockHeld(cs);
+    std::vector<TxMemPoolCluster*> result;
+    while (!m_dirty_clusters.empty()) {
+        result.clear();
+        LinearizeCluster(*m_dirty_clusters.begin(), result);
+    }
+}
+
+void CTxMemPool::LinearizeCluster(TxMemPoolCluster* cluster, std::vector<TxMemPoolCluster*>& result) const
+{
+    AssertLockHeld(cs);
+    m_dirty_clusters.erase(cluster);
+
+    // Transactions leaving the mempool may have split the cluster: find its
+    // connected components.
+    std::vector<std::vector<txiter>> components;
+    {
+        const auto epoch = GetFreshEpoch();
+        for (txiter root : cluster->txs) {
+            if (visited(root)) continue;
+            components.emplace_back(1, root);
+            std::vector<txiter>& component = components.back();
+            for (size_t i = 0; i < component.size(); ++i) {
+                for (txiter parent : GetMemPoolParents(component[i])) {
+                    if (!visited(parent)) component.push_back(parent);
+                }
+                for (txiter child : GetMemPoolChildren(component[i])) {
+                    if (!visited(child)) component.push_back(child);
+                }
+            }
+        }
+    }
+
+    for (size_t c = 0; c < components.size(); ++c) {
+        TxMemPoolCluster* target = cluster;
+        if (c > 0) {
+            m_clusters.push_back(MakeUnique<TxMemPoolCluster>());
+            target = m_clusters.back().get();
+            target->idx = m_clusters.size() - 1;
+        }
+        result.push_back(target);
+
+        // Sort topologically, and from there on use m_cluster_idx as the
+        // position in that order.
+        const std::vector<txiter>& txs = components[c];
+        const size_t n = txs.size();
+        std::vector<size_t> missing(n);
+        std::vector<txiter> topo;
+        topo.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            txs[i]->m_cluster = target;
+            txs[i]->m_cluster_idx = i;
+            missing[i] = GetMemPoolParents(txs[i]).size();
+            if (missing[i] == 0) topo.push_back(txs[i]);
+        }
+        for (size_t i = 0; i < topo.size(); ++i) {
+            for (txiter child : GetMemPoolChildren(topo[i])) {
+                if (--missing[child->m_cluster_idx] == 0) topo.push_back(child);
+            }
+        }
+        assert(topo.size() == n);
+
+        // Ancestor sets as bitsets over the topological order, with their fees and sizes.
+        const size_t words = (n + 63) / 64;
+        std::vector<uint64_t> anc(n * words);
+        std::vector<CAmount> fee(n), anc_fee(n);
+        std::vector<int64_t> size(n), anc_size(n);
+        auto has = [&](size_t i, size_t j) { return (anc[i * words + j / 64] >> (j % 64)) & 1; };
+        for (size_t i = 0; i < n; ++i) {
+            topo[i]->m_cluster_idx = i;
+            fee[i] = topo[i]->GetModifiedFee();
+            size[i] = topo[i]->GetTxSize();
+            anc[i * words + i / 64] |= uint64_t{1} << (i % 64);
+            for (txiter parent : GetMemPoolParents(topo[i])) {
+                const size_t p = parent->m_cluster_idx;
+                for (size_t w = 0; w < words; ++w) {
+                    anc[i * words + w] |= anc[p * words + w];
+                }
+            }
+            for (size_t j = 0; j <= i; ++j) {
+                if (!has(i, j)) continue;
+                anc_fee[i] += fee[j];
+                anc_size[i] += size[j];
+            }
+        }
+
+        // Repeatedly pick the remaining transaction with the highest feerate
+        // including its remaining ancestors, and append that ancestor set.
+        std::vector<bool> done(n);
+        std::vector<txiter>& order = target->txs;
+        order.clear();
+        while (order.size() < n) {
+            size_t best = n;
+            for (size_t i = 0; i < n; ++i) {
+                if (done[i]) continue;
+                if (best == n || (double)anc_fee[i] * anc_size[best] > (double)anc_fee[best] * anc_size[i]) best = i;
+            }
+            for (size_t j = 0; j <= best; ++j) {
+                if (done[j] || !has(best, j)) continue;
+                done[j] = true;
+                order.push_back(topo[j]);
+                for (size_t k = j + 1; k < n; ++k) {
+                    if (done[k] || !has(k, j)) continue;
+                    anc_fee[k] -= fee[j];
+                    anc_size[k] -= size[j];
+                }
+            }
+        }
+
+        // Chunk the linearization: a transaction paying a higher feerate than
+        // the chunk before it is merged into that chunk.
+        target->chunks.clear();
+        for (size_t i = 0; i < n; ++i) {
+            order[i]->m_cluster_idx = i;
+            TxMemPoolChunk chunk{i + 1, order[i]->GetModifiedFee(), order[i]->GetTxSize(), order[i]->GetSigOpCost()};
+            while (!target->chunks.empty() && (double)chunk.fee * target->chunks.back().size > (double)target->chunks.back().fee * chunk.size) {
+                chunk.fee += target->chunks.back().fee;
+                chunk.size += target->chunks.back().size;
+                chunk.sigops += target->chunks.back().sigops;
+                target->chunks.pop_back();
+            }
+            target->chunks.push_back(chunk);
+        }
+    }
+}
+
+size_t CTxMemPool::CalculateClusterSize(const setEntries& ancestors, const setEntries& removed) const
+{
+    AssertLockHeld(cs);
+    if (!removed.empty()) {
+        setEntries reached;
+        std::vector<txiter> todo;
+        for (txiter it : ancestors) {
+            if (!removed.count(it) && reached.insert(it).second) todo.push_back(it);
+        }
+        while (!todo.empty()) {
+            const txiter it = todo.back();
+            todo.pop_back();
+            for (const setEntries* linked : {&GetMemPoolParents(it), &GetMemPoolChildren(it)}) {
+                for (txiter link : *linked) {
+                    if (!removed.count(link) && reached.insert(link).second) todo.push_back(link);
+                }
+            }
+        }
+        return reached.size() + 1;
+    }
+
+    std::set<TxMemPoolCluster*> dirty;
+    for (txiter it : ancestors) {
+        if (m_dirty_clusters.count(it->m_cluster)) dirty.insert(it->m_cluster);
+    }
+    std::vector<TxMemPoolCluster*> result;
+    for (TxMemPoolCluster* cluster : dirty) {
+        LinearizeCluster(cluster, result);
+    }
+
+    std::set<const TxMemPoolCluster*> clusters;
+    size_t count = 1;
+    for (txiter it : ancestors) {
+        if (clusters.insert(it->m_cluster).second) count += it->m_cluster->txs.size();
+    }
+    return count;
+}
+
 CTxMemPool::EpochGuard CTxMemPool::GetFreshEpoch() const
 {
     return EpochGuard(*this);
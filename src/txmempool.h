@@ -8,6 +8,7 @@
 
 #include <atomic>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
 #include <utility>
@@ -27,8 +28,10 @@
 #include <boost/multi_index/hashed_index.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/sequenced_index.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 class CBlockIndex;
+struct TxMemPoolCluster;
 extern RecursiveMutex cs_main;
 
 /** Fake height value used in Coin to signify they are only in the memory pool (since 0.8) */
@@ -129,6 +132,8 @@ public:
 
     mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
     mutable uint64_t m_epoch; //!< epoch when last touched, useful for graph algorithms
+    mutable TxMemPoolCluster* m_cluster{nullptr}; //!< Cluster of connected transactions this one belongs to
+    mutable size_t m_cluster_idx{0}; //!< Index in the cluster's txs
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -368,6 +373,45 @@ public:
     }
 };
 
+/** boost::shared_mutex with -Wthread-safety annotations for shared and exclusive locking */
+class LOCKABLE SharedMutex
+{
+public:
+    void lock() EXCLUSIVE_LOCK_FUNCTION() { m_mutex.lock(); }
+    void unlock() UNLOCK_FUNCTION() { m_mutex.unlock(); }
+    void lock_shared() SHARED_LOCK_FUNCTION() { m_mutex.lock_shared(); }
+    void unlock_shared() UNLOCK_FUNCTION() { m_mutex.unlock_shared(); }
+
+private:
+    boost::shared_mutex m_mutex;
+};
+
+/** Holds a shared lock on a SharedMutex for its lifetime. Not reentrant. */
+class SCOPED_LOCKABLE SharedLock
+{
+public:
+    explicit SharedLock(SharedMutex& mutex) SHARED_LOCK_FUNCTION(mutex) : m_mutex(mutex) { m_mutex.lock_shared(); }
+    ~SharedLock() UNLOCK_FUNCTION() { m_mutex.unlock_shared(); }
+    SharedLock(const SharedLock&) = delete;
+    SharedLock& operator=(const SharedLock&) = delete;
+
+private:
+    SharedMutex& m_mutex;
+};
+
+/** Holds an exclusive lock on a SharedMutex for its lifetime. Not reentrant. */
+class SCOPED_LOCKABLE ExclusiveLock
+{
+public:
+    explicit ExclusiveLock(SharedMutex& mutex) EXCLUSIVE_LOCK_FUNCTION(mutex) : m_mutex(mutex) { m_mutex.lock(); }
+    ~ExclusiveLock() UNLOCK_FUNCTION() { m_mutex.unlock(); }
+    ExclusiveLock(const ExclusiveLock&) = delete;
+    ExclusiveLock& operator=(const ExclusiveLock&) = delete;
+
+private:
+    SharedMutex& m_mutex;
+};
+
 /**
  * CTxMemPool stores valid-according-to-the-current-best-chain transactions
  * that may be included in the next block.
@@ -439,6 +483,22 @@ public:
  * CalculateMemPoolAncestors() takes configurable limits that are designed to
  * prevent these calculations from being too CPU intensive.
  *
+ * Clusters:
+ *
+ * Transactions connected through in-mempool parent/child links are grouped in
+ * clusters (TxMemPoolCluster). Adding a transaction merges the clusters of its
+ * parents; removing one only marks its cluster as dirty. LinearizeClusters()
+ * brings every dirty cluster back into shape: split into its connected
+ * components, each ordered in a topologically valid linearization with high
+ * feerate ancestor sets first, and cut into chunks of non-increasing feerate.
+ * Block assembly merges the chunks of all clusters by feerate, and TrimToSize()
+ * evicts from the end of the cluster whose last chunk has the lowest feerate,
+ * so that both follow the same order. Linearizing a cluster is cubic in its
+ * size in the worst case, which is bounded in AcceptToMemoryPool by
+ * -limitclustercount. It happens on every block assembly from the whole
+ * mempool, and once per eviction in TrimToSize(). The per-entry ancestor and
+ * descendant state is still maintained alongside, for the package limits.
+ *
  */
 class CTxMemPool
 {
@@ -456,6 +516,11 @@ private:
     mutable uint64_t m_epoch;
     mutable bool m_has_epoch_guard;
 
+    //! All clusters, each knowing its index in here
+    mutable std::vector<std::unique_ptr<TxMemPoolCluster>> m_clusters GUARDED_BY(cs);
+    //! Clusters whose linearization is out of date
+    mutable std::set<TxMemPoolCluster*> m_dirty_clusters GUARDED_BY(cs);
+
     void trackPackageRemoved(const CFeeRate& rate) EXCLUSIVE_LOCKS_REQUIRED(cs);
 
     bool m_is_loaded GUARDED_BY(cs){false};
@@ -518,6 +583,20 @@ public:
      * the mempool is consistent with the new chain tip and fully populated.
      */
     mutable RecursiveMutex cs;
+
+    /**
+     * Lets read-only queries run without `cs`. Code changing `mapTx`,
+     * `mapNextTx` or `totalTxSize` holds `cs` and an exclusive lock on this
+     * mutex while it does, so a shared lock on it alone gives a consistent
+     * view of those. size(), GetTotalTxSize(), exists(), get(), info(),
+     * infoAll(), queryHashes(), isSpent() and CompareDepthAndScore() take that
+     * shared lock, so that RPC and relay lookups neither wait for nor hold up
+     * AcceptToMemoryPool and block assembly.
+     *
+     * The lock is not reentrant, and must not be held while locking `cs`.
+     */
+    mutable SharedMutex cs_query ACQUIRED_AFTER(cs);
+
     indexed_transaction_set mapTx GUARDED_BY(cs);
 
     using txiter = indexed_transaction_set::nth_index<0>::type::const_iterator;
@@ -547,7 +626,25 @@ private:
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
-    std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /**
+     * mapTx and mapNextTx for readers holding only a shared lock on cs_query.
+     * Both are GUARDED_BY(cs), but everything changing them also holds
+     * cs_query exclusively, which the annotations cannot express.
+     */
+    const indexed_transaction_set& QueryMapTx() const SHARED_LOCKS_REQUIRED(cs_query) NO_THREAD_SAFETY_ANALYSIS { return mapTx; }
+    const indirectmap<COutPoint, const CTransaction*>& QueryMapNextTx() const SHARED_LOCKS_REQUIRED(cs_query) NO_THREAD_SAFETY_ANALYSIS { return mapNextTx; }
+
+    std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const SHARED_LOCKS_REQUIRED(cs_query);
+
+    /** Create a new cluster holding only entry */
+    void CreateCluster(txiter entry) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /** Merge the clusters of entry and other, relabelling the smaller one */
+    void MergeClusters(txiter entry, txiter other) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /** Delete an empty cluster */
+    void DeleteCluster(TxMemPoolCluster* cluster) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /** Split a dirty cluster into its connected components and linearize
+     *  each of them. The resulting clusters are appended to result. */
+    void LinearizeCluster(TxMemPoolCluster* cluster, std::vector<TxMemPoolCluster*>& result) const EXCLUSIVE_LOCKS_REQUIRED(cs);
 
 public:
     indirectmap<COutPoint, const CTransaction*> mapNextTx GUARDED_BY(cs);
@@ -583,9 +680,9 @@ public:
 
     void clear();
     void _clear() EXCLUSIVE_LOCKS_REQUIRED(cs); //lock free
-    bool CompareDepthAndScore(const uint256& hasha, const uint256& hashb);
-    void queryHashes(std::vector<uint256>& vtxid) const;
-    bool isSpent(const COutPoint& outpoint) const;
+    bool CompareDepthAndScore(const uint256& hasha, const uint256& hashb) LOCKS_EXCLUDED(cs_query);
+    void queryHashes(std::vector<uint256>& vtxid) const LOCKS_EXCLUDED(cs_query);
+    bool isSpent(const COutPoint& outpoint) const LOCKS_EXCLUDED(cs_query);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
     /**
@@ -659,6 +756,20 @@ public:
       */
     void TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining = nullptr) EXCLUSIVE_LOCKS_REQUIRED(cs);
 
+    /** Bring the linearization and chunks of every cluster up to date. */
+    void LinearizeClusters() const EXCLUSIVE_LOCKS_REQUIRED(cs);
+
+    /** The clusters of the mempool. Only linearized after LinearizeClusters(). */
+    const std::vector<std::unique_ptr<TxMemPoolCluster>>& GetClusters() const EXCLUSIVE_LOCKS_REQUIRED(cs) { return m_clusters; }
+
+    /** Number of transactions in the cluster a new transaction with the given
+     *  in-mempool ancestors would join, including itself. Dirty clusters among
+     *  them are split first, so that transactions no longer connected to the
+     *  ancestors are not counted. With removed, the transactions it would
+     *  replace, the cluster is walked without them instead, as it could split
+     *  once they are gone. */
+    size_t CalculateClusterSize(const setEntries& ancestors, const setEntries& removed = {}) const EXCLUSIVE_LOCKS_REQUIRED(cs);
+
     /** Expire all transaction (and their dependencies) in the mempool older than time. Return the number of removed transactions. */
     int Expire(std::chrono::seconds time) EXCLUSIVE_LOCKS_REQUIRED(cs);
 
@@ -674,27 +785,28 @@ public:
     /** Sets the current loaded state */
     void SetIsLoaded(bool loaded);
 
-    unsigned long size() const
+    // Queries served under a shared lock on cs_query instead of cs.
+    unsigned long size() const LOCKS_EXCLUDED(cs_query)
     {
-        LOCK(cs);
-        return mapTx.size();
+        SharedLock lock(cs_query);
+        return QueryMapTx().size();
     }
 
-    uint64_t GetTotalTxSize() const
+    uint64_t GetTotalTxSize() const LOCKS_EXCLUDED(cs_query)
     {
-        LOCK(cs);
+        SharedLock lock(cs_query);
         return totalTxSize;
     }
 
-    bool exists(const uint256& hash) const
+    bool exists(const uint256& hash) const LOCKS_EXCLUDED(cs_query)
     {
-        LOCK(cs);
-        return (mapTx.count(hash) != 0);
+        SharedLock lock(cs_query);
+        return (QueryMapTx().count(hash) != 0);
     }
 
-    CTransactionRef get(const uint256& hash) const;
-    TxMempoolInfo info(const uint256& hash) const;
-    std::vector<TxMempoolInfo> infoAll() const;
+    CTransactionRef get(const uint256& hash) const LOCKS_EXCLUDED(cs_query);
+    TxMempoolInfo info(const uint256& hash) const LOCKS_EXCLUDED(cs_query);
+    std::vector<TxMempoolInfo> infoAll() const LOCKS_EXCLUDED(cs_query);
 
     size_t DynamicMemoryUsage() const;
 
@@ -714,15 +826,15 @@ private:
      */
     void UpdateForDescendants(txiter updateIt,
             cacheMap &cachedDescendants,
-            const std::set<uint256> &setExclude) EXCLUSIVE_LOCKS_REQUIRED(cs);
+            const std::set<uint256> &setExclude) EXCLUSIVE_LOCKS_REQUIRED(cs, cs_query);
     /** Update ancestors of hash to add/remove it as a descendant transaction. */
-    void UpdateAncestorsOf(bool add, txiter hash, setEntries &setAncestors) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    void UpdateAncestorsOf(bool add, txiter hash, setEntries &setAncestors) EXCLUSIVE_LOCKS_REQUIRED(cs, cs_query);
     /** Set ancestor state for an entry */
-    void UpdateEntryForAncestors(txiter it, const setEntries &setAncestors) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    void UpdateEntryForAncestors(txiter it, const setEntries &setAncestors) EXCLUSIVE_LOCKS_REQUIRED(cs, cs_query);
     /** For each transaction being removed, update ancestors and any direct children.
       * If updateDescendants is true, then also update in-mempool descendants'
       * ancestor state. */
-    void UpdateForRemoveFromMempool(const setEntries &entriesToRemove, bool updateDescendants) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    void UpdateForRemoveFromMempool(const setEntries &entriesToRemove, bool updateDescendants) EXCLUSIVE_LOCKS_REQUIRED(cs, cs_query);
     /** Sever link between specified transaction and direct children. */
     void UpdateChildrenForRemoval(txiter entry) EXCLUSIVE_LOCKS_REQUIRED(cs);
 
@@ -734,7 +846,7 @@ private:
      *  transactions in a chain before we've updated all the state for the
      *  removal.
      */
-    void removeUnchecked(txiter entry, MemPoolRemovalReason reason) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    void removeUnchecked(txiter entry, MemPoolRemovalReason reason) EXCLUSIVE_LOCKS_REQUIRED(cs, cs_query);
 public:
     /** EpochGuard: RAII-style guard for using epoch-based graph traversal algorithms.
      *     When walking ancestors or descendants, we generally want to avoid
@@ -786,6 +898,33 @@ public:
     }
 };
 
+/** A prefix of a cluster's linearization with a higher feerate than what follows it */
+struct TxMemPoolChunk
+{
+    //! Index in the cluster's txs one past the last transaction of the chunk
+    size_t end;
+    //! Modified fees, virtual size and sigop cost of the chunk's transactions
+    CAmount fee;
+    uint64_t size;
+    int64_t sigops;
+
+    CFeeRate GetFeeRate() const { return CFeeRate(fee, size); }
+};
+
+/**
+ * A set of mempool transactions connected through in-mempool parent/child links.
+ * Once linearized (see CTxMemPool::LinearizeClusters), txs is in an order that
+ * is valid to appear in a block and chunks partitions it in order of
+ * non-increasing feerate.
+ */
+struct TxMemPoolCluster
+{
+    std::vector<CTxMemPool::txiter> txs;
+    std::vector<TxMemPoolChunk> chunks;
+    //! Index in the mempool's clusters
+    size_t idx;
+};
+
 /**
  * CCoinsView that brings transactions from a mempool into view.
  * It does not check for spendings by memory pool transactions.
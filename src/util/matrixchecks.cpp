@@ -1,9 +1,96 @@
+#include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 #include <util/matrixchecks.h>
 #include <matrix-utils/singular/Svd.h>
 
+#include <utility>
+
+namespace {
+
+/** Rank check over GF(2). An odd determinant is non-zero, so success here already proves full rank. */
+bool IsFullRankMod2(const HeavyHashMatrix& matrix)
+{
+    uint64_t rows[64];
+    for (int i = 0; i < 64; ++i) {
+        rows[i] = 0;
+        for (int j = 0; j < 64; ++j) {
+            rows[i] |= uint64_t{matrix.Get(i, j) & 1u} << j;
+        }
+    }
+    for (int col = 0; col < 64; ++col) {
+        const uint64_t bit = uint64_t{1} << col;
+        int pivot = col;
+        while (pivot < 64 && !(rows[pivot] & bit)) ++pivot;
+        if (pivot == 64) return false;
+        std::swap(rows[col], rows[pivot]);
+        for (int i = col + 1; i < 64; ++i) {
+            if (rows[i] & bit) rows[i] ^= rows[col];
+        }
+    }
+    return true;
+}
+
+template<uint32_t P>
+uint32_t InverseModP(uint32_t a)
+{
+    // Fermat: a^(P-2) is the inverse of a in GF(P)
+    uint64_t result = 1, base = a;
+    for (uint32_t e = P - 2; e; e >>= 1) {
+        if (e & 1) result = result * base % P;
+        base = base * base % P;
+    }
+    return result;
+}
+
+/** Rank check over GF(P). A non-zero determinant modulo P implies a non-zero determinant. */
+template<uint32_t P>
+bool IsFullRankModP(const HeavyHashMatrix& matrix)
+{
+    uint32_t m[64][64];
+    for (int i = 0; i < 64; ++i) {
+        for (int j = 0; j < 64; ++j) {
+            m[i][j] = matrix.Get(i, j);
+        }
+    }
+    for (int col = 0; col < 64; ++col) {
+        int pivot = col;
+        while (pivot < 64 && m[pivot][col] == 0) ++pivot;
+        if (pivot == 64) return false;
+        if (pivot != col) {
+            for (int j = col; j < 64; ++j) std::swap(m[col][j], m[pivot][j]);
+        }
+        const uint64_t inv = InverseModP<P>(m[col][col]);
+        for (int j = col + 1; j < 64; ++j) {
+            m[col][j] = m[col][j] * inv % P;
+        }
+        for (int i = col + 1; i < 64; ++i) {
+            const uint64_t factor = P - m[i][col];
+            if (factor == P) continue;
+            for (int j = col + 1; j < 64; ++j) {
+                m[i][j] = (m[i][j] + factor * m[col][j]) % P;
+            }
+        }
+    }
+    return true;
+}
+
+typedef bool (*RankCheck)(const HeavyHashMatrix& matrix);
+
+/** The fifteen largest primes below 2^31. Their product exceeds 2^464, while Hadamard's bound
+ * limits the determinant of a 64x64 matrix with entries in [0, 15] to (8 * 15)^64 < 2^443.
+ * A determinant divisible by all of them is therefore exactly zero. */
+const RankCheck PRIME_RANK_CHECKS[] = {
+    IsFullRankModP<2147483647>, IsFullRankModP<2147483629>, IsFullRankModP<2147483587>,
+    IsFullRankModP<2147483579>, IsFullRankModP<2147483563>, IsFullRankModP<2147483549>,
+    IsFullRankModP<2147483543>, IsFullRankModP<2147483497>, IsFullRankModP<2147483489>,
+    IsFullRankModP<2147483477>, IsFullRankModP<2147483423>, IsFullRankModP<2147483399>,
+    IsFullRankModP<2147483353>, IsFullRankModP<2147483323>, IsFullRankModP<2147483269>,
+};
+
+} // namespace
+
 bool heavyhash::checks::Is4BitPrecision(const uint64_t matrix[64*64]){
     for (int i = 0; i < 64; ++i) {
         for (int j = 0; j < 64; ++j) {
@@ -14,7 +101,23 @@ bool heavyhash::checks::Is4BitPrecision(const uint64_t matrix[64*64]){
     return true;
 }
 
-bool heavyhash::checks::IsFullRank(const uint64_t matrix_[64*64]){
+bool heavyhash::checks::IsFullRank(const uint64_t matrix[64*64]){
+    // Packing keeps only the low 4 bits of every entry.
+    assert(Is4BitPrecision(matrix));
+    return IsFullRank(HeavyHashMatrix(matrix));
+}
+
+bool heavyhash::checks::IsFullRank(const HeavyHashMatrix& matrix){
+    // Cheap bit-sliced pass first; it settles a large share of random matrices on its own.
+    if (IsFullRankMod2(matrix)) return true;
+    // A singular matrix has to fail every prime; a regular one almost always passes the first.
+    for (const RankCheck check : PRIME_RANK_CHECKS) {
+        if (check(matrix)) return true;
+    }
+    return false;
+}
+
+bool heavyhash::checks::IsFullRankSVD(const uint64_t matrix_[64*64]){
     double matrix__ [64*64];
     singular::Matrix<64, 64> matrix;
     for (int i = 0; i < 64; ++i) {
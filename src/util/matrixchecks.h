@@ -4,11 +4,20 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <crypto/heavyhash.h>
+
 namespace heavyhash {
 namespace checks {
     /** Checks whether matrix contains 4 bit values and is suitable for HeavyHash*/
     bool Is4BitPrecision(const uint64_t matrix[64*64]);
+    /** Checks whether the matrix has full rank over the rationals. The check is exact: it runs
+     * integer Gaussian elimination over GF(2) and over prime fields, so its result does not
+     * depend on floating-point rounding.
+     * @pre matrix must satisfy Is4BitPrecision, which is asserted */
     bool IsFullRank(const uint64_t matrix[64*64]);
+    bool IsFullRank(const HeavyHashMatrix& matrix);
+    /** Floating-point reference for IsFullRank based on a full SVD. Only kept for differential testing. */
+    bool IsFullRankSVD(const uint64_t matrix[64*64]);
 }
 }
 
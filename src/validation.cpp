@@ -20,6 +20,8 @@
 #include <index/txindex.h>
 #include <logging.h>
 #include <logging/timer.h>
+#include <node/coinstats.h>
+#include <node/utxo_snapshot.h>
 #include <policy/fees.h>
 #include <policy/policy.h>
 #include <policy/settings.h>
@@ -46,7 +48,10 @@
 #include <validationinterface.h>
 #include <warnings.h>
 
+#include <atomic>
+#include <deque>
 #include <string>
+#include <thread>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/thread.hpp>
@@ -184,6 +189,9 @@ static FILE* OpenUndoFile(const FlatFilePos &pos, bool fReadOnly = false);
 static FlatFileSeq BlockFileSeq();
 static FlatFileSeq UndoFileSeq();
 
+/** Mappings of the block files that blocks were recently read from */
+static FlatFileMapCache g_block_file_maps(DEFAULT_MAPPED_BLOCK_FILES);
+
 bool CheckFinalTx(const CTransaction &tx, int flags)
 {
     AssertLockHeld(cs_main);
@@ -433,7 +441,8 @@ public:
         m_limit_ancestors(gArgs.GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT)),
         m_limit_ancestor_size(gArgs.GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000),
         m_limit_descendants(gArgs.GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT)),
-        m_limit_descendant_size(gArgs.GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000) {}
+        m_limit_descendant_size(gArgs.GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000),
+        m_limit_cluster(gArgs.GetArg("-limitclustercount", DEFAULT_CLUSTER_LIMIT)) {}
 
     // We put the arguments we're handed into a struct, so we can pass them
     // around easier.
@@ -525,6 +534,7 @@ private:
     // in-mempool conflicts; see below).
     size_t m_limit_descendants;
     size_t m_limit_descendant_size;
+    const size_t m_limit_cluster;
 };
 
 bool MemPoolAccept::PreChecks(ATMPArgs& args, Workspace& ws)
@@ -894,6 +904,14 @@ bool MemPoolAccept::PreChecks(ATMPArgs& args, Workspace& ws)
                         FormatMoney(::incrementalRelayFee.GetFee(nSize))));
         }
     }
+
+    // Block selection and eviction linearize whole clusters, so bound their
+    // size. The transactions this one replaces are not counted.
+    const size_t nClusterSize = m_pool.CalculateClusterSize(setAncestors, allConflicting);
+    if (nClusterSize > m_limit_cluster) {
+        return state.Invalid(TxValidationResult::TX_MEMPOOL_POLICY, "too-large-cluster",
+                strprintf("cluster of %u transactions [limit: %u]", nClusterSize, m_limit_cluster));
+    }
     return true;
 }
 
@@ -1130,10 +1148,47 @@ static bool WriteBlockToDisk(const CBlock& block, FlatFilePos& pos, const CMessa
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const FlatFilePos& pos, const Consensus::Params& consensusParams)
+void SetMappedBlockFiles(size_t max_files)
+{
+    g_block_file_maps.SetMaxFiles(max_files);
+}
+
+/**
+ * Find the serialized block stored at pos in a mapping of its block file, which file keeps
+ * alive. Returns an empty span if the file cannot be mapped or the record before pos does
+ * not hold message_start and a plausible size.
+ */
+static Span<const uint8_t> MapBlockFromDisk(const FlatFilePos& pos, const CMessageHeader::MessageStartChars& message_start, std::shared_ptr<const MappedFile>& file)
+{
+    if (pos.IsNull() || pos.nPos < 8) return Span<const uint8_t>();
+    const FlatFilePos hpos(pos.nFile, pos.nPos - 8);
+    file = g_block_file_maps.Map(BlockFileSeq(), hpos, 8);
+    if (!file) return Span<const uint8_t>();
+    const uint8_t* header = file->Data().data() + hpos.nPos;
+    if (memcmp(header, message_start, CMessageHeader::MESSAGE_START_SIZE)) return Span<const uint8_t>();
+    const uint32_t size = ReadLE32(header + CMessageHeader::MESSAGE_START_SIZE);
+    if (size > MAX_SIZE) return Span<const uint8_t>();
+    file = g_block_file_maps.Map(BlockFileSeq(), hpos, 8 + size);
+    if (!file) return Span<const uint8_t>();
+    return file->Data().subspan(pos.nPos, size);
+}
+
+static bool ReadBlockFromDiskUnchecked(CBlock& block, const FlatFilePos& pos)
 {
     block.SetNull();
 
+    // Deserialize straight from the mapped file if possible.
+    std::shared_ptr<const MappedFile> mapped;
+    const Span<const uint8_t> data = MapBlockFromDisk(pos, Params().MessageStart(), mapped);
+    if (data.size()) {
+        try {
+            SpanReader(SER_DISK, CLIENT_VERSION, data) >> block;
+        } catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+        return true;
+    }
+
     // Open history file to read
     CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
@@ -1147,6 +1202,14 @@ bool ReadBlockFromDisk(CBlock& block, const FlatFilePos& pos, const Consensus::P
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
     }
 
+    return true;
+}
+
+bool ReadBlockFromDisk(CBlock& block, const FlatFilePos& pos, const Consensus::Params& consensusParams)
+{
+    if (!ReadBlockFromDiskUnchecked(block, pos))
+        return false;
+
     // Check the header
     if (!CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
         return error("ReadBlockFromDisk: Errors in block header at %s", pos.ToString());
@@ -1154,6 +1217,22 @@ bool ReadBlockFromDisk(CBlock& block, const FlatFilePos& pos, const Consensus::P
     return true;
 }
 
+/** Read the block of pindex, stored at blockPos, without taking cs_main. */
+static bool ReadIndexedBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const FlatFilePos& blockPos)
+{
+    if (!ReadBlockFromDiskUnchecked(block, blockPos))
+        return false;
+    // The index entry's hash passed CheckProofOfWork when its header was accepted. A header
+    // equal to the entry's fields has that same hash, so there is no need to rehash it.
+    const CBlockHeader indexed = pindex->GetBlockHeader();
+    if (block.nVersion != indexed.nVersion || block.hashPrevBlock != indexed.hashPrevBlock ||
+        block.hashMerkleRoot != indexed.hashMerkleRoot || block.nTime != indexed.nTime ||
+        block.nBits != indexed.nBits || block.nNonce != indexed.nNonce)
+        return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): block header doesn't match index for %s at %s",
+                pindex->ToString(), blockPos.ToString());
+    return true;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
 {
     FlatFilePos blockPos;
@@ -1161,13 +1240,7 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
         LOCK(cs_main);
         blockPos = pindex->GetBlockPos();
     }
-
-    if (!ReadBlockFromDisk(block, blockPos, consensusParams))
-        return false;
-    if (block.GetHash() != pindex->GetBlockHash())
-        return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
-                pindex->ToString(), pindex->GetBlockPos().ToString());
-    return true;
+    return ReadIndexedBlockFromDisk(block, pindex, blockPos);
 }
 
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const FlatFilePos& pos, const CMessageHeader::MessageStartChars& message_start)
@@ -1216,6 +1289,17 @@ bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex
     return ReadRawBlockFromDisk(block, block_pos, message_start);
 }
 
+Span<const uint8_t> MapRawBlockFromDisk(std::shared_ptr<const MappedFile>& file, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start)
+{
+    FlatFilePos block_pos;
+    {
+        LOCK(cs_main);
+        block_pos = pindex->GetBlockPos();
+    }
+
+    return MapBlockFromDisk(block_pos, message_start, file);
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     int halvings = nHeight / consensusParams.nSubsidyHalvingInterval;
@@ -1235,11 +1319,12 @@ CoinsViews::CoinsViews(
     bool in_memory,
     bool should_wipe) : m_dbview(
                             GetDataDir() / ldb_name, cache_size_bytes, in_memory, should_wipe),
-                        m_catcherview(&m_dbview) {}
+                        m_catcherview(&m_dbview),
+                        m_flushview(&m_catcherview) {}
 
 void CoinsViews::InitCache()
 {
-    m_cacheview = MakeUnique<CCoinsViewCache>(&m_catcherview);
+    m_cacheview = MakeUnique<CCoinsViewCache>(&m_flushview);
 }
 
 // NOTE: for now m_blockman is set to a global, but this will be changed
@@ -1744,6 +1829,8 @@ void static FlushBlockFile(bool fFinalize = false)
     FlatFilePos undo_pos_old(nLastBlockFile, vinfoBlockFile[nLastBlockFile].nUndoSize);
 
     bool status = true;
+    // A mapping must not reach past the end of a truncated file.
+    if (fFinalize) g_block_file_maps.Release(BlockFileSeq().FileName(block_pos_old));
     status &= BlockFileSeq().Flush(block_pos_old, fFinalize);
     status &= UndoFileSeq().Flush(undo_pos_old, fFinalize);
     if (!status) {
@@ -1779,6 +1866,282 @@ void ThreadScriptCheck(int worker_num) {
     scriptcheckqueue.Thread();
 }
 
+namespace {
+/**
+ * Closure computing the proof-of-work hash of one header, so a headers message can be
+ * hashed on the header check threads before cs_main is taken. The hash is only checked
+ * against the target later, under the lock, so the check itself always succeeds.
+ *
+ * Given a full block, it also runs CheckBlock with that hash. Only the fChecked flag
+ * is kept; a block that fails is checked again, and rejected, under the lock.
+ */
+class CHeaderHashCheck
+{
+private:
+    const CBlockHeader* m_header{nullptr};
+    uint256* m_hash{nullptr};
+    const CBlock* m_block{nullptr};
+    const Consensus::Params* m_params{nullptr};
+
+public:
+    CHeaderHashCheck() {}
+    CHeaderHashCheck(const CBlockHeader& header, uint256& hash) : m_header(&header), m_hash(&hash) {}
+    CHeaderHashCheck(const CBlock& block, uint256& hash, const Consensus::Params& params) : m_header(&block), m_hash(&hash), m_block(&block), m_params(&params) {}
+
+    bool operator()()
+    {
+        *m_hash = m_header->GetPoWHash();
+        if (m_block) {
+            BlockValidationState state;
+            CheckBlock(*m_block, state, *m_params, true, true, m_hash);
+        }
+        return true;
+    }
+
+    void swap(CHeaderHashCheck& check)
+    {
+        std::swap(m_header, check.m_header);
+        std::swap(m_hash, check.m_hash);
+        std::swap(m_block, check.m_block);
+        std::swap(m_params, check.m_params);
+    }
+};
+} // namespace
+
+static CCheckQueue<CHeaderHashCheck> headerhashcheckqueue(8);
+
+void ThreadHeaderHashCheck(int worker_num) {
+    util::ThreadRename(strprintf("headerch.%i", worker_num));
+    headerhashcheckqueue.Thread();
+}
+
+namespace {
+/**
+ * Closure looking up one coin in the view below the coins tip, so the inputs of a block
+ * can be read from disk on the prefetch threads before ConnectBlock asks for them one by
+ * one. A missing coin is left spent; the lookup itself always succeeds.
+ */
+class CCoinPrefetchCheck
+{
+private:
+    const CCoinsView* m_view{nullptr};
+    const COutPoint* m_outpoint{nullptr};
+    Coin* m_coin{nullptr};
+
+public:
+    CCoinPrefetchCheck() {}
+    CCoinPrefetchCheck(const CCoinsView& view, const COutPoint& outpoint, Coin& coin) : m_view(&view), m_outpoint(&outpoint), m_coin(&coin) {}
+
+    bool operator()()
+    {
+        if (!m_view->GetCoin(*m_outpoint, *m_coin)) m_coin->Clear();
+        return true;
+    }
+
+    void swap(CCoinPrefetchCheck& check)
+    {
+        std::swap(m_view, check.m_view);
+        std::swap(m_outpoint, check.m_outpoint);
+        std::swap(m_coin, check.m_coin);
+    }
+};
+} // namespace
+
+static CCheckQueue<CCoinPrefetchCheck> coinprefetchqueue(16);
+
+void ThreadCoinPrefetch(int worker_num) {
+    util::ThreadRename(strprintf("coinpref.%i", worker_num));
+    coinprefetchqueue.Thread();
+}
+
+void PrefetchBlockInputs(const CBlock& block, CCoinsViewCache& cache, const CCoinsView& base)
+{
+    if (!g_parallel_script_checks) return;
+
+    std::set<uint256> created;
+    std::vector<COutPoint> outpoints;
+    for (const auto& tx : block.vtx) {
+        if (!tx->IsCoinBase()) {
+            for (const CTxIn& txin : tx->vin) {
+                // Outputs of earlier transactions in the block are never on disk.
+                if (!created.count(txin.prevout.hash) && !cache.HaveCoinInCache(txin.prevout)) {
+                    outpoints.push_back(txin.prevout);
+                }
+            }
+        }
+        created.insert(tx->GetHash());
+    }
+    if (outpoints.size() < 2) return;
+
+    std::vector<Coin> coins(outpoints.size());
+    std::vector<CCoinPrefetchCheck> checks;
+    checks.reserve(outpoints.size());
+    for (size_t i = 0; i < outpoints.size(); ++i) {
+        checks.emplace_back(base, outpoints[i], coins[i]);
+    }
+    CCheckQueueControl<CCoinPrefetchCheck> control(&coinprefetchqueue);
+    control.Add(checks);
+    control.Wait();
+
+    for (size_t i = 0; i < outpoints.size(); ++i) {
+        if (!coins[i].IsSpent()) cache.CacheCoin(outpoints[i], std::move(coins[i]));
+    }
+}
+
+namespace {
+/**
+ * A block the block preload threads read ahead of ConnectTip. Either a preload thread or
+ * the validation thread claims it: a preload thread to read it, the validation thread to
+ * give up on it because it is no longer wanted or has to be connected before its read
+ * started. So the validation thread never waits for a read that has not started.
+ */
+class BlockPreload
+{
+private:
+    const CBlockIndex* const m_pindex;
+    const FlatFilePos m_pos;
+    std::atomic<bool> m_claimed{false};
+    Mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_done GUARDED_BY(m_mutex){false};
+    std::shared_ptr<const CBlock> m_block GUARDED_BY(m_mutex);
+
+public:
+    BlockPreload(const CBlockIndex* pindex, const FlatFilePos& pos) : m_pindex(pindex), m_pos(pos) {}
+
+    const CBlockIndex* Index() const { return m_pindex; }
+
+    /** Read and check the block unless it was claimed already. Runs on a preload thread. */
+    void Load(const Consensus::Params& params)
+    {
+        if (m_claimed.exchange(true)) return;
+        std::shared_ptr<CBlock> block = std::make_shared<CBlock>();
+        if (ReadIndexedBlockFromDisk(*block, m_pindex, m_pos)) {
+            // Only sets fChecked; ConnectBlock runs the checks again and reports any failure.
+            BlockValidationState state;
+            CheckBlock(*block, state, params);
+        } else {
+            block.reset();
+        }
+        {
+            LOCK(m_mutex);
+            m_block = std::move(block);
+            m_done = true;
+        }
+        m_cond.notify_all();
+    }
+
+    /** Give up on the block, unless its read already started. @returns whether it had. */
+    bool Drop() { return m_claimed.exchange(true); }
+
+    /** The block, waiting for its read to finish if it started, or nullptr if it did not or failed. */
+    std::shared_ptr<const CBlock> Take()
+    {
+        if (!Drop()) return nullptr;
+        WAIT_LOCK(m_mutex, lock);
+        m_cond.wait(lock, [&]() EXCLUSIVE_LOCKS_REQUIRED(m_mutex) { return m_done; });
+        return m_block;
+    }
+};
+
+/** Closure running one BlockPreload on the block preload threads. It always succeeds. */
+class CBlockPreloadCheck
+{
+private:
+    std::shared_ptr<BlockPreload> m_preload;
+    const Consensus::Params* m_params{nullptr};
+
+public:
+    CBlockPreloadCheck() {}
+    CBlockPreloadCheck(std::shared_ptr<BlockPreload> preload, const Consensus::Params& params) : m_preload(std::move(preload)), m_params(&params) {}
+
+    bool operator()()
+    {
+        m_preload->Load(*m_params);
+        return true;
+    }
+
+    void swap(CBlockPreloadCheck& check)
+    {
+        std::swap(m_preload, check.m_preload);
+        std::swap(m_params, check.m_params);
+    }
+};
+} // namespace
+
+static CCheckQueue<CBlockPreloadCheck> blockpreloadqueue(1);
+
+void ThreadBlockPreload(int worker_num) {
+    util::ThreadRename(strprintf("blkpreload.%i", worker_num));
+    blockpreloadqueue.Thread();
+}
+
+bool CheckBlockIndexPoW(const Consensus::Params& consensusParams, int n_threads)
+{
+    std::vector<std::pair<uint256, CBlockHeader>> entries;
+    {
+        LOCK(cs_main);
+        entries.reserve(g_blockman.m_block_index.size());
+        for (const auto& entry : g_blockman.m_block_index) {
+            entries.emplace_back(entry.first, entry.second->GetBlockHeader());
+        }
+    }
+    // Visit siblings together so each worker generates their shared matrix once. Workers keep
+    // their own matrix rather than going through the matrix cache, which serves the live chain.
+    std::sort(entries.begin(), entries.end(), [](const std::pair<uint256, CBlockHeader>& a, const std::pair<uint256, CBlockHeader>& b) {
+        return a.second.hashPrevBlock < b.second.hashPrevBlock;
+    });
+
+    const int64_t start = GetTimeMillis();
+    static const size_t CHUNK = 64;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> failures{0};
+    auto work = [&]() {
+        HeavyHashMatrix matrix;
+        uint256 matrix_prev;
+        bool have_matrix = false;
+        while (!ShutdownRequested()) {
+            const size_t begin = next.fetch_add(CHUNK);
+            if (begin >= entries.size()) break;
+            for (size_t i = begin; i < std::min(begin + CHUNK, entries.size()); ++i) {
+                const CBlockHeader& header = entries[i].second;
+                if (!have_matrix || header.hashPrevBlock != matrix_prev) {
+                    uint256 seed;
+                    CSHA3_256().Write(header.hashPrevBlock.begin(), 32).Finalize(seed.begin());
+                    GenerateHeavyHashMatrix(seed, matrix);
+                    matrix_prev = header.hashPrevBlock;
+                    have_matrix = true;
+                }
+                const uint256 hash = SerializeHeavyHash(header, matrix);
+                if (hash != entries[i].first || !CheckProofOfWork(hash, header.nBits, consensusParams)) {
+                    LogPrintf("ERROR: %s: block index entry %s does not match its header (hash %s)\n", __func__, entries[i].first.ToString(), hash.ToString());
+                    ++failures;
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    if (ShutdownRequested()) return failures == 0;
+    LogPrintf("Verified proof of work of %u block index entries using %d threads in %dms\n", entries.size(), std::max(n_threads, 1), GetTimeMillis() - start);
+    return failures == 0;
+}
+
+void ThreadCheckBlockIndexPoW()
+{
+    if (!CheckBlockIndexPoW(Params().GetConsensus(), GetNumCores())) {
+        AbortNode("Block index proof of work check failed", _("Corrupted block database detected").translated + ". " + _("Please restart with -reindex or -reindex-chainstate to recover.").translated);
+    }
+}
+
 VersionBitsCache versionbitscache GUARDED_BY(cs_main);
 
 int32_t ComputeBlockVersion(const CBlockIndex* pindexPrev, const Consensus::Params& params)
@@ -2242,6 +2605,11 @@ bool CChainState::FlushStateToDisk(
 
     try {
     {
+        // A forced flush waits for any coins write in flight first, so the
+        // coins database is complete when it returns, even on failure.
+        if (mode == FlushStateMode::ALWAYS && !m_coins_views->m_flushview.Sync()) {
+            return AbortNode(state, "Failed to write to coin database");
+        }
         bool fFlushForPrune = false;
         bool fDoFullFlush = false;
         CoinsCacheSizeState cache_state = GetCoinsCacheSizeState(::mempool);
@@ -2320,6 +2688,11 @@ bool CChainState::FlushStateToDisk(
             if (fFlushForPrune) {
                 LOG_TIME_MILLIS("unlink pruned files", BCLog::BENCH);
 
+                // A coins write in flight may still need the undo data of
+                // these files to be replayed after a crash.
+                if (!m_coins_views->m_flushview.Sync()) {
+                    return AbortNode(state, "Failed to write to coin database");
+                }
                 UnlinkPrunedFiles(setFilesToPrune);
             }
             nLastWrite = nNow;
@@ -2338,15 +2711,24 @@ bool CChainState::FlushStateToDisk(
                 return AbortNode(state, "Disk space is too low!", _("Error: Disk space is too low!").translated, CClientUIInterface::MSG_NOPREFIX);
             }
             // Flush the chainstate (which may refer to block index entries).
-            if (!CoinsTip().Flush())
+            // Flushes for the cache size or age hand the coins to a
+            // background write and continue on an empty cache; the
+            // database is marked as in transition until the write is
+            // complete. Forced and pruning flushes write synchronously.
+            const bool background = mode != FlushStateMode::ALWAYS && !fFlushForPrune;
+            if (background ? !m_coins_views->m_flushview.FlushInBackground(CoinsTip()) : !CoinsTip().Flush())
                 return AbortNode(state, "Failed to write to coin database");
             nLastFlush = nNow;
-            full_flush_completed = true;
+            full_flush_completed = !background;
         }
     }
-    if (full_flush_completed) {
+    // A background write is only reported once it is on disk, from the
+    // first flush check after it completed.
+    const uint256 written_block = m_coins_views->m_flushview.TakeWrittenBlock();
+    const CBlockIndex* flushed_index = full_flush_completed ? m_chain.Tip() : LookupBlockIndex(written_block);
+    if (flushed_index) {
         // Update best block in wallet (so we can detect restored wallets).
-        GetMainSignals().ChainStateFlushed(m_chain.GetLocator());
+        GetMainSignals().ChainStateFlushed(m_chain.GetLocator(flushed_index));
     }
     } catch (const std::runtime_error& e) {
         return AbortNode(state, std::string("System error while flushing: ") + e.what());
@@ -2496,6 +2878,7 @@ bool CChainState::DisconnectTip(BlockValidationState& state, const CChainParams&
 }
 
 static int64_t nTimeReadFromDisk = 0;
+static int64_t nTimePrefetch = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
@@ -2566,6 +2949,9 @@ bool CChainState::ConnectTip(BlockValidationState& state, const CChainParams& ch
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint(BCLog::BENCH, "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * MILLI, nTimeReadFromDisk * MICRO);
+    PrefetchBlockInputs(blockConnecting, CoinsTip(), m_coins_views->m_flushview);
+    int64_t nTimePrefetched = GetTimeMicros(); nTimePrefetch += nTimePrefetched - nTime2;
+    LogPrint(BCLog::BENCH, "  - Prefetch inputs: %.2fms [%.2fs]\n", (nTimePrefetched - nTime2) * MILLI, nTimePrefetch * MICRO);
     {
         CCoinsViewCache view(&CoinsTip());
         bool rv = ConnectBlock(blockConnecting, state, pindexNew, view, chainparams);
@@ -2608,6 +2994,7 @@ bool CChainState::ConnectTip(BlockValidationState& state, const CChainParams& ch
  * known to be invalid (it's however far from certain to be valid).
  */
 CBlockIndex* CChainState::FindMostWorkChain() {
+    const CBlockIndex* snapshot_base = SnapshotBase();
     do {
         CBlockIndex *pindexNew = nullptr;
 
@@ -2619,6 +3006,15 @@ CBlockIndex* CChainState::FindMostWorkChain() {
             pindexNew = *it;
         }
 
+        // The blocks up to a loaded UTXO snapshot can not be disconnected, so
+        // chains that fork below its base are no candidates.
+        if (snapshot_base && pindexNew->GetAncestor(snapshot_base->nHeight) != snapshot_base) {
+            LogPrint(BCLog::VALIDATION, "%s: ignoring %s, which forks below the snapshot base %s\n", __func__,
+                pindexNew->GetBlockHash().ToString(), snapshot_base->GetBlockHash().ToString());
+            setBlockIndexCandidates.erase(pindexNew);
+            continue;
+        }
+
         // Check whether all blocks on the path between the currently active chain and the candidate are valid.
         // Just going until the active chain is an optimization, as we know all blocks in it are valid already.
         CBlockIndex *pindexTest = pindexNew;
@@ -2674,13 +3070,106 @@ void CChainState::PruneBlockIndexCandidates() {
     assert(!setBlockIndexCandidates.empty());
 }
 
+/**
+ * Reads the blocks that ActivateBestChain is about to connect from disk on the block
+ * preload threads, deserializing them, hashing their transactions and running CheckBlock,
+ * so that the next blocks are ready by the time the current one has been connected. Up to
+ * MAX_BLOCKS_PRELOADING blocks are queued at a time, in the order they will be connected.
+ *
+ * Blocks that are no longer going to be connected are dropped without waiting: a queued
+ * read is skipped and a running one is left to finish. The preloader waits for those only
+ * when it is destroyed, after ActivateBestChain has released cs_main.
+ */
+class CChainState::BlockPreloader
+{
+private:
+    const Consensus::Params& m_params;
+    //! Held for the life of the preloader, which takes it before cs_main
+    CCheckQueueControl<CBlockPreloadCheck> m_control;
+    //! Blocks to queue once a queued block is taken, in connect order
+    std::deque<const CBlockIndex*> m_pending;
+    //! Blocks queued, in connect order
+    std::deque<std::shared_ptr<BlockPreload>> m_loading;
+
+    void Launch() EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+    {
+        std::vector<CBlockPreloadCheck> checks;
+        while (m_loading.size() < MAX_BLOCKS_PRELOADING && !m_pending.empty()) {
+            const CBlockIndex* pindex = m_pending.front();
+            m_pending.pop_front();
+            m_loading.push_back(std::make_shared<BlockPreload>(pindex, pindex->GetBlockPos()));
+            checks.emplace_back(m_loading.back(), m_params);
+        }
+        // The queue runs the last check added first.
+        std::reverse(checks.begin(), checks.end());
+        m_control.Add(checks);
+    }
+
+    bool IsLoading(const CBlockIndex* pindex) const
+    {
+        for (const auto& preload : m_loading) {
+            if (preload->Index() == pindex) return true;
+        }
+        return false;
+    }
+
+public:
+    explicit BlockPreloader(const Consensus::Params& params) :
+        m_params(params), m_control(g_parallel_script_checks ? &blockpreloadqueue : nullptr) {}
+
+    ~BlockPreloader()
+    {
+        AssertLockNotHeld(cs_main);
+        for (const auto& preload : m_loading) {
+            preload->Drop();
+        }
+    }
+
+    /** Read the given blocks, in the order they are going to be connected. This replaces the blocks of an earlier call. */
+    void Schedule(const std::vector<const CBlockIndex*>& blocks) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+    {
+        if (!g_parallel_script_checks) return;
+        std::deque<std::shared_ptr<BlockPreload>> loading;
+        for (auto& preload : m_loading) {
+            if (std::find(blocks.begin(), blocks.end(), preload->Index()) != blocks.end()) {
+                loading.push_back(std::move(preload));
+            } else {
+                preload->Drop();
+            }
+        }
+        m_loading.swap(loading);
+        m_pending.clear();
+        for (const CBlockIndex* pindex : blocks) {
+            if (!IsLoading(pindex)) m_pending.push_back(pindex);
+        }
+        Launch();
+    }
+
+    /**
+     * Return the block of pindex if it was read ahead, or nullptr, waiting for the read to
+     * finish if it started. Reads of blocks before pindex are dropped.
+     */
+    std::shared_ptr<const CBlock> Take(const CBlockIndex* pindex) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+    {
+        if (!IsLoading(pindex)) return nullptr;
+        while (m_loading.front()->Index() != pindex) {
+            m_loading.front()->Drop();
+            m_loading.pop_front();
+        }
+        std::shared_ptr<const CBlock> block = m_loading.front()->Take();
+        m_loading.pop_front();
+        Launch();
+        return block;
+    }
+};
+
 /**
  * Try to make some progress towards making pindexMostWork the active block.
  * pblock is either nullptr or a pointer to a CBlock corresponding to pindexMostWork.
  *
  * @returns true unless a system error occurred
  */
-bool CChainState::ActivateBestChainStep(BlockValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, bool& fInvalidFound, ConnectTrace& connectTrace)
+bool CChainState::ActivateBestChainStep(BlockValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, bool& fInvalidFound, ConnectTrace& connectTrace, BlockPreloader& preloader)
 {
     AssertLockHeld(cs_main);
 
@@ -2722,9 +3211,18 @@ bool CChainState::ActivateBestChainStep(BlockValidationState& state, const CChai
         }
         nHeight = nTargetHeight;
 
+        // Read the blocks that are not in memory yet ahead of connecting them.
+        std::vector<const CBlockIndex*> vpindexToRead;
+        for (const CBlockIndex *pindexRead : reverse_iterate(vpindexToConnect)) {
+            if (pindexRead != pindexMostWork || !pblock) vpindexToRead.push_back(pindexRead);
+        }
+        preloader.Schedule(vpindexToRead);
+
         // Connect new blocks.
         for (CBlockIndex *pindexConnect : reverse_iterate(vpindexToConnect)) {
-            if (!ConnectTip(state, chainparams, pindexConnect, pindexConnect == pindexMostWork ? pblock : std::shared_ptr<const CBlock>(), connectTrace, disconnectpool)) {
+            std::shared_ptr<const CBlock> pblockConnect = pindexConnect == pindexMostWork ? pblock : nullptr;
+            if (!pblockConnect) pblockConnect = preloader.Take(pindexConnect);
+            if (!ConnectTip(state, chainparams, pindexConnect, pblockConnect, connectTrace, disconnectpool)) {
                 if (state.IsInvalid()) {
                     // The block violates a consensus rule.
                     if (state.GetResult() != BlockValidationResult::BLOCK_MUTATED) {
@@ -2814,6 +3312,8 @@ bool CChainState::ActivateBestChain(BlockValidationState &state, const CChainPar
     CBlockIndex *pindexMostWork = nullptr;
     CBlockIndex *pindexNewTip = nullptr;
     int nStopAtHeight = gArgs.GetArg("-stopatheight", DEFAULT_STOPATHEIGHT);
+    // Kept across steps, so blocks keep being read while cs_main is released.
+    BlockPreloader preloader(chainparams.GetConsensus());
     do {
         boost::this_thread::interruption_point();
 
@@ -2845,7 +3345,7 @@ bool CChainState::ActivateBestChain(BlockValidationState &state, const CChainPar
 
                 bool fInvalidFound = false;
                 std::shared_ptr<const CBlock> nullBlockPtr;
-                if (!ActivateBestChainStep(state, chainparams, pindexMostWork, pblock && pblock->GetHash() == pindexMostWork->GetBlockHash() ? pblock : nullBlockPtr, fInvalidFound, connectTrace)) {
+                if (!ActivateBestChainStep(state, chainparams, pindexMostWork, pblock && pblock->GetHash() == pindexMostWork->GetBlockHash() ? pblock : nullBlockPtr, fInvalidFound, connectTrace, preloader)) {
                     // A system error occurred
                     return false;
                 }
@@ -2945,6 +3445,10 @@ bool CChainState::InvalidateBlock(BlockValidationState& state, const CChainParam
     // blocks.
     LOCK(m_cs_chainstate);
 
+    if (WITH_LOCK(cs_main, return pindex->nStatus & BLOCK_ASSUMED_VALID)) {
+        return state.Error(strprintf("%s is part of a loaded UTXO snapshot and can not be invalidated", pindex->GetBlockHash().ToString()));
+    }
+
     // We'll be acquiring and releasing cs_main below, to allow the validation
     // callbacks to run. However, we should keep the block index in a
     // consistent state as we disconnect blocks -- in particular we need to
@@ -3266,16 +3770,16 @@ static bool FindUndoPos(BlockValidationState &state, int nFile, FlatFilePos &pos
     return true;
 }
 
-static bool CheckBlockHeader(const CBlockHeader& block, BlockValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true)
+static bool CheckBlockHeader(const CBlockHeader& block, const uint256& pow_hash, BlockValidationState& state, const Consensus::Params& consensusParams)
 {
     // Check proof of work matches claimed amount
-    if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
+    if (!CheckProofOfWork(pow_hash, block.nBits, consensusParams))
         return state.Invalid(BlockValidationResult::BLOCK_INVALID_HEADER, "high-hash", "proof of work failed");
 
     return true;
 }
 
-bool CheckBlock(const CBlock& block, BlockValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW, bool fCheckMerkleRoot)
+bool CheckBlock(const CBlock& block, BlockValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW, bool fCheckMerkleRoot, const uint256* pow_hash)
 {
     // These are checks that are independent of context.
 
@@ -3284,7 +3788,7 @@ bool CheckBlock(const CBlock& block, BlockValidationState& state, const Consensu
 
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
-    if (!CheckBlockHeader(block, state, consensusParams, fCheckPOW))
+    if (fCheckPOW && !CheckBlockHeader(block, pow_hash ? *pow_hash : block.GetPoWHash(), state, consensusParams))
         return false;
 
     // Check the merkle root.
@@ -3558,11 +4062,11 @@ static bool ContextualCheckBlock(const CBlock& block, BlockValidationState& stat
     return true;
 }
 
-bool BlockManager::AcceptBlockHeader(const CBlockHeader& block, BlockValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
+bool BlockManager::AcceptBlockHeader(const CBlockHeader& block, BlockValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, const uint256* pow_hash)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
-    uint256 hash = block.GetHash();
+    uint256 hash = pow_hash ? *pow_hash : block.GetHash();
     BlockMap::iterator miSelf = m_block_index.find(hash);
     CBlockIndex *pindex = nullptr;
     if (hash != chainparams.GetConsensus().hashGenesisBlock) {
@@ -3578,7 +4082,7 @@ bool BlockManager::AcceptBlockHeader(const CBlockHeader& block, BlockValidationS
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus()))
+        if (!CheckBlockHeader(block, hash, state, chainparams.GetConsensus()))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), state.ToString());
 
         // Get prev block index
@@ -3647,11 +4151,30 @@ bool BlockManager::AcceptBlockHeader(const CBlockHeader& block, BlockValidationS
 // Exposed wrapper for AcceptBlockHeader
 bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, BlockValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex)
 {
+    // Hash the headers before taking cs_main. Each header normally has its own matrix, which
+    // makes hashing the bulk of the work, and none of it depends on chain state.
+    std::vector<uint256> hashes(headers.size());
+    if (g_parallel_script_checks && headers.size() > 1) {
+        std::vector<CHeaderHashCheck> checks;
+        checks.reserve(headers.size());
+        for (size_t i = 0; i < headers.size(); ++i) {
+            checks.emplace_back(headers[i], hashes[i]);
+        }
+        CCheckQueueControl<CHeaderHashCheck> control(&headerhashcheckqueue);
+        control.Add(checks);
+        control.Wait();
+    } else {
+        for (size_t i = 0; i < headers.size(); ++i) {
+            hashes[i] = headers[i].GetPoWHash();
+        }
+    }
+
     {
         LOCK(cs_main);
-        for (const CBlockHeader& header : headers) {
+        for (size_t i = 0; i < headers.size(); ++i) {
+            const CBlockHeader& header = headers[i];
             CBlockIndex *pindex = nullptr; // Use a temp pindex instead of ppindex to avoid a const_cast
-            bool accepted = g_blockman.AcceptBlockHeader(header, state, chainparams, &pindex);
+            bool accepted = g_blockman.AcceptBlockHeader(header, state, chainparams, &pindex, &hashes[i]);
             ::ChainstateActive().CheckBlockIndex(chainparams.GetConsensus());
 
             if (!accepted) {
@@ -3690,7 +4213,7 @@ static FlatFilePos SaveBlockToDisk(const CBlock& block, int nHeight, const CChai
 }
 
 /** Store block on disk. If dbp is non-nullptr, the file is known to already reside on disk */
-bool CChainState::AcceptBlock(const std::shared_ptr<const CBlock>& pblock, BlockValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const FlatFilePos* dbp, bool* fNewBlock)
+bool CChainState::AcceptBlock(const std::shared_ptr<const CBlock>& pblock, BlockValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const FlatFilePos* dbp, bool* fNewBlock, const uint256* pow_hash)
 {
     const CBlock& block = *pblock;
 
@@ -3700,7 +4223,7 @@ bool CChainState::AcceptBlock(const std::shared_ptr<const CBlock>& pblock, Block
     CBlockIndex *pindexDummy = nullptr;
     CBlockIndex *&pindex = ppindex ? *ppindex : pindexDummy;
 
-    bool accepted_header = m_blockman.AcceptBlockHeader(block, state, chainparams, &pindex);
+    bool accepted_header = m_blockman.AcceptBlockHeader(block, state, chainparams, &pindex, pow_hash);
     CheckBlockIndex(chainparams.GetConsensus());
 
     if (!accepted_header)
@@ -3738,7 +4261,7 @@ bool CChainState::AcceptBlock(const std::shared_ptr<const CBlock>& pblock, Block
         if (pindex->nChainWork < nMinimumChainWork) return true;
     }
 
-    if (!CheckBlock(block, state, chainparams.GetConsensus()) ||
+    if (!CheckBlock(block, state, chainparams.GetConsensus(), true, true, pow_hash) ||
         !ContextualCheckBlock(block, state, chainparams.GetConsensus(), pindex->pprev)) {
         if (state.IsInvalid() && state.GetResult() != BlockValidationResult::BLOCK_MUTATED) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
@@ -3887,6 +4410,7 @@ void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
 {
     for (std::set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         FlatFilePos pos(*it, 0);
+        g_block_file_maps.Release(BlockFileSeq().FileName(pos));
         fs::remove(BlockFileSeq().FileName(pos));
         fs::remove(UndoFileSeq().FileName(pos));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -4189,6 +4713,190 @@ bool CChainState::LoadChainTip(const CChainParams& chainparams)
     return true;
 }
 
+/**
+ * Read the next coin of a snapshot taken at base.
+ * @returns false, with error set, if the coin can not be in the UTXO set at base.
+ */
+static bool ReadSnapshotCoin(CAutoFile& coins_file, const CBlockIndex* base, COutPoint& outpoint, Coin& coin, std::string& error)
+{
+    coins_file >> outpoint;
+    coins_file >> coin;
+    if (coin.IsSpent() || coin.nHeight > (uint32_t)base->nHeight) {
+        error = strprintf("Snapshot contains an invalid coin %s", outpoint.ToString());
+        return false;
+    }
+    return true;
+}
+
+bool CChainState::LoadUTXOSnapshot(const CChainParams& chainparams, CAutoFile& coins_file, const SnapshotMetadata& metadata, std::string& error)
+{
+    AssertLockHeld(cs_main);
+
+    CBlockIndex* base = LookupBlockIndex(metadata.m_base_blockhash);
+    if (!base) {
+        error = strprintf("Snapshot base block %s is not in the block index; sync its header first", metadata.m_base_blockhash.ToString());
+        return false;
+    }
+    if (!base->IsValid(BLOCK_VALID_TREE)) {
+        error = strprintf("Snapshot base block %s is invalid", base->GetBlockHash().ToString());
+        return false;
+    }
+    const AssumeutxoData* au_data = chainparams.AssumeutxoForHeight(base->nHeight);
+    if (!au_data) {
+        error = strprintf("No snapshot is trusted at height %d", base->nHeight);
+        return false;
+    }
+    // The base's own nTx is derived from nChainTx and must be positive.
+    if (metadata.m_nchaintx != au_data->nChainTx || au_data->nChainTx <= (unsigned int)base->nHeight) {
+        error = strprintf("Snapshot nChainTx %u does not match the expected %u", metadata.m_nchaintx, au_data->nChainTx);
+        return false;
+    }
+    if (m_chain.Height() != 0) {
+        error = "A snapshot can only be loaded while the active chain is at the genesis block";
+        return false;
+    }
+    for (const std::pair<const uint256, CBlockIndex*>& entry : m_blockman.m_block_index) {
+        if (entry.second->nHeight > 0 && entry.second->nTx > 0) {
+            error = "A snapshot can only be loaded before any block data has been downloaded";
+            return false;
+        }
+    }
+    if (!m_coins_views->m_flushview.Sync()) {
+        error = "Failed to write to coin database";
+        return false;
+    }
+    if (CoinsTip().GetCacheSize() > 0 || std::unique_ptr<CCoinsViewCursor>(CoinsDB().Cursor())->Valid()) {
+        error = "A snapshot can only be loaded into an empty coins database";
+        return false;
+    }
+
+    const long coins_start = std::ftell(coins_file.Get());
+    if (coins_start < 0) {
+        error = "Unable to determine the snapshot file position";
+        return false;
+    }
+
+    // First pass: check the snapshot hashes to the trusted value before the
+    // coins database is touched.
+    CCoinsStats stats;
+    try {
+        CoinsStatsHasher hasher(base->GetBlockHash());
+        COutPoint outpoint;
+        Coin coin;
+        for (uint64_t i = 0; i < metadata.m_coins_count; ++i) {
+            if (!ReadSnapshotCoin(coins_file, base, outpoint, coin, error)) return false;
+            hasher.Add(outpoint, std::move(coin));
+            if (i % 100000 == 0 && ShutdownRequested()) {
+                error = "Shutting down";
+                return false;
+            }
+        }
+        hasher.Finalize(stats);
+    } catch (const std::ios_base::failure& e) {
+        error = strprintf("Snapshot is truncated or malformed (%s)", e.what());
+        return false;
+    }
+    if (std::fgetc(coins_file.Get()) != EOF) {
+        error = "Snapshot contains more coins than its metadata declares";
+        return false;
+    }
+    if (stats.hashSerialized != au_data->hash_serialized) {
+        error = strprintf("Snapshot hash %s does not match the expected %s", stats.hashSerialized.ToString(), au_data->hash_serialized.ToString());
+        return false;
+    }
+    LogPrintf("%s: verified %u coins for block %s (height %d)\n", __func__, stats.coins_count, base->GetBlockHash().ToString(), base->nHeight);
+
+    // Second pass: write the coins in database key order, one batch per
+    // -dbbatchsize. Until the final flush below the coins database is marked
+    // as mid-transition, so an interrupted load is caught by ReplayBlocks.
+    // The file is read again, so what is written is hashed and checked again.
+    if (std::fseek(coins_file.Get(), coins_start, SEEK_SET) != 0) {
+        error = "Unable to rewind the snapshot file";
+        return false;
+    }
+    const std::string changed_error = "Snapshot changed while it was being loaded; restart with -reindex-chainstate";
+    const size_t batch_size = (size_t)gArgs.GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    std::vector<std::pair<COutPoint, Coin>> coins;
+    size_t coins_usage = 0;
+    CCoinsStats written;
+    try {
+        CoinsStatsHasher hasher(base->GetBlockHash());
+        for (uint64_t i = 0; i < metadata.m_coins_count; ++i) {
+            coins.emplace_back();
+            if (!ReadSnapshotCoin(coins_file, base, coins.back().first, coins.back().second, error)) {
+                error = changed_error;
+                return false;
+            }
+            hasher.Add(coins.back().first, Coin(coins.back().second));
+            coins_usage += sizeof(coins.back()) + coins.back().second.DynamicMemoryUsage();
+            if (coins_usage > batch_size || i + 1 == metadata.m_coins_count) {
+                if (!CoinsDB().WriteSnapshotCoins(coins, base->GetBlockHash())) {
+                    error = "Failed to write to coins database";
+                    return false;
+                }
+                coins.clear();
+                coins_usage = 0;
+            }
+        }
+        hasher.Finalize(written);
+    } catch (const std::ios_base::failure& e) {
+        error = strprintf("Snapshot changed while it was being loaded (%s); restart with -reindex-chainstate", e.what());
+        return false;
+    }
+    if (written.hashSerialized != au_data->hash_serialized) {
+        error = changed_error;
+        return false;
+    }
+
+    // The snapshot vouches for everything up to its base. Give those blocks
+    // the validity they would have had after a full sync, so that nChainTx
+    // survives a restart and the base can be the tip. Only the base's
+    // nChainTx is known: each ancestor counts as one transaction, which is
+    // just a placeholder for nTx > 0, and the base takes the remainder.
+    for (CBlockIndex* pindex = base; pindex->pprev; pindex = pindex->pprev) {
+        pindex->nTx = pindex == base ? au_data->nChainTx - base->nHeight : 1;
+        pindex->nStatus |= BLOCK_ASSUMED_VALID | BLOCK_OPT_WITNESS;
+        pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        setDirtyBlockIndex.insert(pindex);
+    }
+    for (int height = 1; height <= base->nHeight; ++height) {
+        CBlockIndex* pindex = base->GetAncestor(height);
+        pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
+    }
+    assert(base->nChainTx == au_data->nChainTx);
+
+    m_chain.SetTip(base);
+    setBlockIndexCandidates.insert(base);
+    PruneBlockIndexCandidates();
+    CoinsTip().SetBestBlock(base->GetBlockHash());
+
+    BlockValidationState state;
+    if (!FlushStateToDisk(chainparams, state, FlushStateMode::ALWAYS)) {
+        error = strprintf("Failed to flush the snapshot chainstate (%s)", state.ToString());
+        return false;
+    }
+    LogPrintf("%s: loaded %u coins, new tip %s (height %d)\n", __func__, stats.coins_count, base->GetBlockHash().ToString(), base->nHeight);
+    CheckBlockIndex(chainparams.GetConsensus());
+    return true;
+}
+
+const CBlockIndex* CChainState::SnapshotBase() const
+{
+    AssertLockHeld(cs_main);
+    // The blocks taken from a snapshot are a prefix of the active chain.
+    if (m_chain.Height() < 1 || !(m_chain[1]->nStatus & BLOCK_ASSUMED_VALID)) return nullptr;
+    int low = 1, high = m_chain.Height();
+    while (low < high) {
+        const int mid = low + (high - low + 1) / 2;
+        if (m_chain[mid]->nStatus & BLOCK_ASSUMED_VALID) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return m_chain[low];
+}
+
 CVerifyDB::CVerifyDB()
 {
     uiInterface.ShowProgress(_("Verifying blocks...").translated, 0, false);
@@ -4233,6 +4941,11 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
             LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
             break;
         }
+        if (pindex->nStatus & BLOCK_ASSUMED_VALID) {
+            // Blocks below a loaded UTXO snapshot were never downloaded.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (snapshot base)\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
@@ -4554,6 +5267,7 @@ void UnloadBlockIndex()
     ResetASERTAnchorBlockCache();
     mempool.clear();
     vinfoBlockFile.clear();
+    g_block_file_maps.Clear();
     nLastBlockFile = 0;
     setDirtyBlockIndex.clear();
     setDirtyFileInfo.clear();
@@ -4618,6 +5332,9 @@ bool LoadGenesisBlock(const CChainParams& chainparams)
     return ::ChainstateActive().LoadGenesisBlock(chainparams);
 }
 
+/** How many blocks LoadExternalBlockFile reads before hashing and checking them together. */
+static constexpr size_t BLOCK_IMPORT_BATCH_SIZE = 16;
+
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, FlatFilePos *dbp)
 {
     // Map of disk positions for blocks with unknown parent (only used for reindex)
@@ -4629,107 +5346,147 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, FlatFi
         // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
+        // Blocks are read in batches. Computing the block hash is the bulk of the work, so a
+        // batch is hashed and checked on the header check threads before it is processed in
+        // file order.
+        std::vector<std::shared_ptr<CBlock>> vBlocks;
+        std::vector<FlatFilePos> vBlockPos;
+        bool fEnd = false;
+        bool fStop = false;
+        while (!fEnd && !fStop && !blkdat.eof()) {
+            vBlocks.clear();
+            vBlockPos.clear();
+            while (vBlocks.size() < BLOCK_IMPORT_BATCH_SIZE && !blkdat.eof()) {
+                boost::this_thread::interruption_point();
+
+                blkdat.SetPos(nRewind);
+                nRewind++; // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[CMessageHeader::MESSAGE_START_SIZE];
+                    blkdat.FindByte(chainparams.MessageStart()[0]);
+                    nRewind = blkdat.GetPos()+1;
+                    blkdat >> buf;
+                    if (memcmp(buf, chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
+                        continue;
+                } catch (const std::exception&) {
+                    // no valid block header found; don't complain
+                    fEnd = true;
+                    break;
+                }
+                try {
+                    // read block
+                    uint64_t nBlockPos = blkdat.GetPos();
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    blkdat.SetPos(nBlockPos);
+                    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+                    blkdat >> *pblock;
+                    nRewind = blkdat.GetPos();
+                    vBlocks.push_back(std::move(pblock));
+                    vBlockPos.push_back(dbp ? FlatFilePos(dbp->nFile, nBlockPos) : FlatFilePos());
+                } catch (const std::exception& e) {
+                    LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+                }
+            }
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[CMessageHeader::MESSAGE_START_SIZE];
-                blkdat.FindByte(chainparams.MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> buf;
-                if (memcmp(buf, chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
+            std::vector<uint256> vHashes(vBlocks.size());
+            std::vector<CHeaderHashCheck> vChecks;
+            vChecks.reserve(vBlocks.size());
+            for (size_t i = 0; i < vBlocks.size(); ++i) {
+                vChecks.emplace_back(*vBlocks[i], vHashes[i], chainparams.GetConsensus());
+            }
+            if (g_parallel_script_checks && vChecks.size() > 1) {
+                CCheckQueueControl<CHeaderHashCheck> control(&headerhashcheckqueue);
+                control.Add(vChecks);
+                control.Wait();
+            } else {
+                for (CHeaderHashCheck& check : vChecks) {
+                    check();
+                }
             }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
-                CBlock& block = *pblock;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                uint256 hash = block.GetHash();
-                {
-                    LOCK(cs_main);
-                    // detect out of order blocks, and store them for later
-                    if (hash != chainparams.GetConsensus().hashGenesisBlock && !LookupBlockIndex(block.hashPrevBlock)) {
-                        LogPrint(BCLog::REINDEX, "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                                block.hashPrevBlock.ToString());
-                        if (dbp)
-                            mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                        continue;
-                    }
 
-                    // process in case the block isn't known yet
-                    CBlockIndex* pindex = LookupBlockIndex(hash);
-                    if (!pindex || (pindex->nStatus & BLOCK_HAVE_DATA) == 0) {
-                      BlockValidationState state;
-                      if (::ChainstateActive().AcceptBlock(pblock, state, chainparams, nullptr, true, dbp, nullptr)) {
-                          nLoaded++;
-                      }
-                      if (state.IsError()) {
-                          break;
-                      }
-                    } else if (hash != chainparams.GetConsensus().hashGenesisBlock && pindex->nHeight % 1000 == 0) {
-                      LogPrint(BCLog::REINDEX, "Block Import: already had block %s at height %d\n", hash.ToString(), pindex->nHeight);
+            for (size_t i = 0; i < vBlocks.size() && !fStop; ++i) {
+                const std::shared_ptr<const CBlock> pblock = vBlocks[i];
+                const CBlock& block = *pblock;
+                const uint256& hash = vHashes[i];
+                FlatFilePos* pos = dbp ? &vBlockPos[i] : nullptr;
+                try {
+                    {
+                        LOCK(cs_main);
+                        // detect out of order blocks, and store them for later
+                        if (hash != chainparams.GetConsensus().hashGenesisBlock && !LookupBlockIndex(block.hashPrevBlock)) {
+                            LogPrint(BCLog::REINDEX, "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                                    block.hashPrevBlock.ToString());
+                            if (pos)
+                                mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *pos));
+                            continue;
+                        }
+
+                        // process in case the block isn't known yet
+                        CBlockIndex* pindex = LookupBlockIndex(hash);
+                        if (!pindex || (pindex->nStatus & BLOCK_HAVE_DATA) == 0) {
+                          BlockValidationState state;
+                          if (::ChainstateActive().AcceptBlock(pblock, state, chainparams, nullptr, true, pos, nullptr, &hash)) {
+                              nLoaded++;
+                          }
+                          if (state.IsError()) {
+                              fStop = true;
+                              break;
+                          }
+                        } else if (hash != chainparams.GetConsensus().hashGenesisBlock && pindex->nHeight % 1000 == 0) {
+                          LogPrint(BCLog::REINDEX, "Block Import: already had block %s at height %d\n", hash.ToString(), pindex->nHeight);
+                        }
                     }
-                }
 
-                // Activate the genesis block so normal node progress can continue
-                if (hash == chainparams.GetConsensus().hashGenesisBlock) {
-                    BlockValidationState state;
-                    if (!ActivateBestChain(state, chainparams)) {
-                        break;
+                    // Activate the genesis block so normal node progress can continue
+                    if (hash == chainparams.GetConsensus().hashGenesisBlock) {
+                        BlockValidationState state;
+                        if (!ActivateBestChain(state, chainparams)) {
+                            fStop = true;
+                            break;
+                        }
                     }
-                }
 
-                NotifyHeaderTip();
-
-                // Recursively process earlier encountered successors of this block
-                std::deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, FlatFilePos>::iterator, std::multimap<uint256, FlatFilePos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, FlatFilePos>::iterator it = range.first;
-                        std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
-                        if (ReadBlockFromDisk(*pblockrecursive, it->second, chainparams.GetConsensus()))
-                        {
-                            LogPrint(BCLog::REINDEX, "%s: Processing out of order child %s of %s\n", __func__, pblockrecursive->GetHash().ToString(),
-                                    head.ToString());
-                            LOCK(cs_main);
-                            BlockValidationState dummy;
-                            if (::ChainstateActive().AcceptBlock(pblockrecursive, dummy, chainparams, nullptr, true, &it->second, nullptr))
+                    NotifyHeaderTip();
+
+                    // Recursively process earlier encountered successors of this block
+                    std::deque<uint256> queue;
+                    queue.push_back(hash);
+                    while (!queue.empty()) {
+                        uint256 head = queue.front();
+                        queue.pop_front();
+                        std::pair<std::multimap<uint256, FlatFilePos>::iterator, std::multimap<uint256, FlatFilePos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                        while (range.first != range.second) {
+                            std::multimap<uint256, FlatFilePos>::iterator it = range.first;
+                            std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
+                            // The proof of work is checked by AcceptBlock, with the hash computed here.
+                            if (ReadBlockFromDiskUnchecked(*pblockrecursive, it->second))
                             {
-                                nLoaded++;
-                                queue.push_back(pblockrecursive->GetHash());
+                                const uint256 hashrecursive = pblockrecursive->GetPoWHash();
+                                LogPrint(BCLog::REINDEX, "%s: Processing out of order child %s of %s\n", __func__, hashrecursive.ToString(),
+                                        head.ToString());
+                                LOCK(cs_main);
+                                BlockValidationState dummy;
+                                if (::ChainstateActive().AcceptBlock(pblockrecursive, dummy, chainparams, nullptr, true, &it->second, nullptr, &hashrecursive))
+                                {
+                                    nLoaded++;
+                                    queue.push_back(hashrecursive);
+                                }
                             }
+                            range.first++;
+                            mapBlocksUnknownParent.erase(it);
+                            NotifyHeaderTip();
                         }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                        NotifyHeaderTip();
                     }
+                } catch (const std::exception& e) {
+                    LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
                 }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
             }
         }
     } catch (const std::runtime_error& e) {
@@ -4764,6 +5521,8 @@ void CChainState::CheckBlockIndex(const Consensus::Params& consensusParams)
 
     assert(forward.size() == m_blockman.m_block_index.size());
 
+    const CBlockIndex* snapshot_base = SnapshotBase();
+
     std::pair<std::multimap<CBlockIndex*,CBlockIndex*>::iterator,std::multimap<CBlockIndex*,CBlockIndex*>::iterator> rangeGenesis = forward.equal_range(nullptr);
     CBlockIndex *pindex = rangeGenesis.first->second;
     rangeGenesis.first++;
@@ -4775,7 +5534,7 @@ void CChainState::CheckBlockIndex(const Consensus::Params& consensusParams)
     size_t nNodes = 0;
     int nHeight = 0;
     CBlockIndex* pindexFirstInvalid = nullptr; // Oldest ancestor of pindex which is invalid.
-    CBlockIndex* pindexFirstMissing = nullptr; // Oldest ancestor of pindex which does not have BLOCK_HAVE_DATA.
+    CBlockIndex* pindexFirstMissing = nullptr; // Oldest ancestor of pindex which does not have BLOCK_HAVE_DATA (or BLOCK_ASSUMED_VALID).
     CBlockIndex* pindexFirstNeverProcessed = nullptr; // Oldest ancestor of pindex for which nTx == 0.
     CBlockIndex* pindexFirstNotTreeValid = nullptr; // Oldest ancestor of pindex which does not have BLOCK_VALID_TREE (regardless of being valid or not).
     CBlockIndex* pindexFirstNotTransactionsValid = nullptr; // Oldest ancestor of pindex which does not have BLOCK_VALID_TRANSACTIONS (regardless of being valid or not).
@@ -4784,7 +5543,7 @@ void CChainState::CheckBlockIndex(const Consensus::Params& consensusParams)
     while (pindex != nullptr) {
         nNodes++;
         if (pindexFirstInvalid == nullptr && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
-        if (pindexFirstMissing == nullptr && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
+        if (pindexFirstMissing == nullptr && !(pindex->nStatus & (BLOCK_HAVE_DATA | BLOCK_ASSUMED_VALID))) pindexFirstMissing = pindex;
         if (pindexFirstNeverProcessed == nullptr && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != nullptr && pindexFirstNotTreeValid == nullptr && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
         if (pindex->pprev != nullptr && pindexFirstNotTransactionsValid == nullptr && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TRANSACTIONS) pindexFirstNotTransactionsValid = pindex;
@@ -4801,8 +5560,9 @@ void CChainState::CheckBlockIndex(const Consensus::Params& consensusParams)
         // VALID_TRANSACTIONS is equivalent to nTx > 0 for all nodes (whether or not pruning has occurred).
         // HAVE_DATA is only equivalent to nTx > 0 (or VALID_TRANSACTIONS) if no pruning has occurred.
         if (!fHavePruned) {
-            // If we've never pruned, then HAVE_DATA should be equivalent to nTx > 0
-            assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+            // If we've never pruned, then HAVE_DATA should be equivalent to nTx > 0,
+            // except below a loaded UTXO snapshot where nTx was assumed.
+            assert(!(pindex->nStatus & (BLOCK_HAVE_DATA | BLOCK_ASSUMED_VALID)) == (pindex->nTx == 0));
             assert(pindexFirstMissing == pindexFirstNeverProcessed);
         } else {
             // If we have pruned, then we can only say that HAVE_DATA implies nTx > 0
@@ -4830,7 +5590,10 @@ void CChainState::CheckBlockIndex(const Consensus::Params& consensusParams)
                 // is valid and we have all data for its parents, it must be in
                 // setBlockIndexCandidates.  m_chain.Tip() must also be there
                 // even if some data has been pruned.
-                if (pindexFirstMissing == nullptr || pindex == m_chain.Tip()) {
+                // Chains that fork below a loaded UTXO snapshot are never
+                // candidates.
+                if ((pindexFirstMissing == nullptr || pindex == m_chain.Tip()) &&
+                    (!snapshot_base || pindex->GetAncestor(snapshot_base->nHeight) == snapshot_base)) {
                     assert(setBlockIndexCandidates.count(pindex));
                 }
                 // If some parent is missing, then it could be that this block was in
@@ -13,6 +13,7 @@
 #include <amount.h>
 #include <coins.h>
 #include <crypto/common.h> // for ReadLE64
+#include <flatfile.h>
 #include <fs.h>
 #include <policy/feerate.h>
 #include <protocol.h> // For CMessageHeader::MessageStartChars
@@ -42,6 +43,8 @@ class CConnman;
 class CScriptCheck;
 class CBlockPolicyEstimator;
 class CTxMemPool;
+class CAutoFile;
+class SnapshotMetadata;
 class TxValidationState;
 struct ChainTxData;
 
@@ -59,6 +62,8 @@ static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
 static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 /** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -limitclustercount, max number of transactions in a cluster of connected in-mempool transactions */
+static const unsigned int DEFAULT_CLUSTER_LIMIT = 250;
 /**
  * An extra transaction can be added to a package, as long as it only has one
  * ancestor and is no larger than this. Not really any reason to make this
@@ -80,6 +85,8 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 15;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** How many blocks ahead of the one being connected are read and checked at once. */
+static const unsigned int MAX_BLOCKS_PRELOADING = 8;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -118,6 +125,10 @@ static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 static const bool DEFAULT_PERSIST_MEMPOOL = true;
 /** Default for using fee filter */
 static const bool DEFAULT_FEEFILTER = true;
+/** Default for -checkblockindexpow */
+static const bool DEFAULT_CHECKBLOCKINDEXPOW = false;
+/** Default for -mmapblockfiles */
+static const unsigned int DEFAULT_MAPPED_BLOCK_FILES = 0;
 
 /** Maximum number of headers to announce when relaying blocks with headers message.*/
 static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
@@ -242,6 +253,27 @@ bool LoadBlockIndex(const CChainParams& chainparams) EXCLUSIVE_LOCKS_REQUIRED(cs
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck(int worker_num);
+/** Run an instance of the header hashing thread */
+void ThreadHeaderHashCheck(int worker_num);
+/** Run an instance of the coin prefetch thread */
+void ThreadCoinPrefetch(int worker_num);
+/** Run an instance of the block preload thread */
+void ThreadBlockPreload(int worker_num);
+/**
+ * Read the coins spent by a block that are not in cache yet from base, in parallel on the
+ * coin prefetch threads, and add them to cache as if it had looked them up itself. Does
+ * nothing unless g_parallel_script_checks is set.
+ */
+void PrefetchBlockInputs(const CBlock& block, CCoinsViewCache& cache, const CCoinsView& base);
+/**
+ * Rehash every block index header on n_threads threads and check that it matches the hash
+ * the entry is stored under and meets its target. Block reads and startup trust the stored
+ * hash; this is the slow check behind it.
+ * @returns false if any entry fails
+ */
+bool CheckBlockIndexPoW(const Consensus::Params& consensusParams, int n_threads);
+/** Run CheckBlockIndexPoW on all cores, shutting down if the block index is corrupt */
+void ThreadCheckBlockIndexPoW();
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
 bool GetTransaction(const uint256& hash, CTransactionRef& tx, const Consensus::Params& params, uint256& hashBlock, const CBlockIndex* const blockIndex = nullptr);
 /**
@@ -364,13 +396,21 @@ bool ReadBlockFromDisk(CBlock& block, const FlatFilePos& pos, const Consensus::P
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const FlatFilePos& pos, const CMessageHeader::MessageStartChars& message_start);
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start);
+/**
+ * Get the serialized block of pindex from a memory mapping of its block file, without
+ * copying it. file keeps the mapping alive for as long as the span is used. Returns an
+ * empty span if the block file cannot be mapped; use ReadRawBlockFromDisk then.
+ */
+Span<const uint8_t> MapRawBlockFromDisk(std::shared_ptr<const MappedFile>& file, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start);
+/** Read blocks through memory mappings of up to max_files block files, or never if 0. */
+void SetMappedBlockFiles(size_t max_files);
 
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex);
 
 /** Functions for validating blocks and updating the block tree */
 
-/** Context-independent validity checks */
-bool CheckBlock(const CBlock& block, BlockValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+/** Context-independent validity checks. If pow_hash is given it must be block.GetPoWHash(), computed by the caller. */
+bool CheckBlock(const CBlock& block, BlockValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true, bool fCheckMerkleRoot = true, const uint256* pow_hash = nullptr);
 
 /** Check a block is completely valid from start to finish (only works on top of our current best block) */
 bool TestBlockValidity(BlockValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
@@ -487,12 +527,14 @@ public:
     /**
      * If a block header hasn't already been seen, call CheckBlockHeader on it, ensure
      * that it doesn't descend from an invalid block, and then add it to m_block_index.
+     * If pow_hash is given it must be block.GetPoWHash(), computed by the caller.
      */
     bool AcceptBlockHeader(
         const CBlockHeader& block,
         BlockValidationState& state,
         const CChainParams& chainparams,
-        CBlockIndex** ppindex) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+        CBlockIndex** ppindex,
+        const uint256* pow_hash = nullptr) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 };
 
 /**
@@ -514,6 +556,10 @@ public:
     //! This view wraps access to the leveldb instance and handles read errors gracefully.
     CCoinsViewErrorCatcher m_catcherview GUARDED_BY(cs_main);
 
+    //! This view holds the coins of a flush while they are written to the
+    //! database in the background.
+    CCoinsViewBackgroundFlush m_flushview GUARDED_BY(cs_main);
+
     //! This is the top layer of the cache hierarchy - it keeps as many coins in memory as
     //! can fit per the dbcache setting.
     std::unique_ptr<CCoinsViewCache> m_cacheview GUARDED_BY(cs_main);
@@ -693,7 +739,8 @@ public:
         const CChainParams& chainparams,
         std::shared_ptr<const CBlock> pblock) LOCKS_EXCLUDED(cs_main);
 
-    bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, BlockValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const FlatFilePos* dbp, bool* fNewBlock) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+    /** Store a block and add it to the block index. If pow_hash is given it must be pblock->GetPoWHash(). */
+    bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, BlockValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const FlatFilePos* dbp, bool* fNewBlock, const uint256* pow_hash = nullptr) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
     // Block (dis)connection on a given view:
     DisconnectResult DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view);
@@ -730,8 +777,31 @@ public:
     /** Update the chain tip based on database information, i.e. CoinsTip()'s best block. */
     bool LoadChainTip(const CChainParams& chainparams) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
+    /**
+     * Populate the empty UTXO set from a dumptxoutset snapshot and make its base block
+     * the tip. The snapshot must hash to the AssumeutxoData chainparams holds for the
+     * base height. The base and its ancestors are marked BLOCK_ASSUMED_VALID and their
+     * block data is never fetched; blocks after the base are validated as usual.
+     *
+     * @param[in] coins_file  positioned just past \p metadata
+     * @returns false, with the reason in \p error, if the snapshot was rejected
+     */
+    bool LoadUTXOSnapshot(const CChainParams& chainparams, CAutoFile& coins_file, const SnapshotMetadata& metadata, std::string& error) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+
+    /**
+     * The base block of the UTXO snapshot the active chain was loaded from, or
+     * nullptr. The chain can not be reorganized below it, as the blocks up to
+     * the base were never downloaded.
+     */
+    const CBlockIndex* SnapshotBase() const EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+
     //! Dictates whether we need to flush the cache to disk or not.
     //!
+    //! Only the coins cache itself is counted. The coins of a flush that is
+    //! still being written in the background are held in addition, so until
+    //! the write completes memory use can reach twice the cache size; a flush
+    //! that becomes due in the meantime waits for it.
+    //!
     //! @return the state of the size of the coins cache.
     CoinsCacheSizeState GetCoinsCacheSizeState(const CTxMemPool& tx_pool)
         EXCLUSIVE_LOCKS_REQUIRED(::cs_main);
@@ -742,7 +812,9 @@ public:
         size_t max_mempool_size_bytes) EXCLUSIVE_LOCKS_REQUIRED(::cs_main);
 
 private:
-    bool ActivateBestChainStep(BlockValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, bool& fInvalidFound, ConnectTrace& connectTrace) EXCLUSIVE_LOCKS_REQUIRED(cs_main, ::mempool.cs);
+    class BlockPreloader;
+
+    bool ActivateBestChainStep(BlockValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, bool& fInvalidFound, ConnectTrace& connectTrace, BlockPreloader& preloader) EXCLUSIVE_LOCKS_REQUIRED(cs_main, ::mempool.cs);
     bool ConnectTip(BlockValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexNew, const std::shared_ptr<const CBlock>& pblock, ConnectTrace& connectTrace, DisconnectedBlockTransactions& disconnectpool) EXCLUSIVE_LOCKS_REQUIRED(cs_main, ::mempool.cs);
 
     void InvalidBlockFound(CBlockIndex *pindex, const BlockValidationState &state) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
@@ -811,7 +883,7 @@ bool LoadMempool(CTxMemPool& pool);
 //! Check whether the block associated with this index entry is pruned or not.
 inline bool IsBlockPruned(const CBlockIndex* pblockindex)
 {
-    return (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0);
+    return ((fHavePruned || (pblockindex->nStatus & BLOCK_ASSUMED_VALID)) && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0);
 }
 
 #endif // BITCOIN_VALIDATION_H
@@ -235,6 +235,14 @@ void CMainSignals::ChainStateFlushed(const CBlockLocator &locator) {
                           locator.IsNull() ? "null" : locator.vHave.front().ToString());
 }
 
+void CMainSignals::NewBlockTemplate(const std::shared_ptr<const CBlock>& block) {
+    auto event = [block, this] {
+        m_internals->Iterate([&](CValidationInterface& callbacks) { callbacks.NewBlockTemplate(block); });
+    };
+    ENQUEUE_AND_LOG_EVENT(event, "%s: prev block hash=%s", __func__,
+                          block->hashPrevBlock.ToString());
+}
+
 void CMainSignals::BlockChecked(const CBlock& block, const BlockValidationState& state) {
     LOG_EVENT("%s: block hash=%s state=%s", __func__,
               block.GetHash().ToString(), state.ToString());
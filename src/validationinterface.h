@@ -172,6 +172,14 @@ protected:
      * Notifies listeners that a block which builds directly on our current tip
      * has been received and connected to the headers tree, though not validated yet */
     virtual void NewPoWValidBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& block) {};
+    /**
+     * Notifies listeners that a template for the next block was built right
+     * after a tip change. The block has a placeholder coinbase and no valid
+     * proof of work.
+     *
+     * Called on a background thread.
+     */
+    virtual void NewBlockTemplate(const std::shared_ptr<const CBlock>& block) {}
     friend class CMainSignals;
 };
 
@@ -204,6 +212,7 @@ public:
     void ChainStateFlushed(const CBlockLocator &);
     void BlockChecked(const CBlock&, const BlockValidationState&);
     void NewPoWValidBlock(const CBlockIndex *, const std::shared_ptr<const CBlock>&);
+    void NewBlockTemplate(const std::shared_ptr<const CBlock>&);
 };
 
 CMainSignals& GetMainSignals();
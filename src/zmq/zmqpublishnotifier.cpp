@@ -16,6 +16,7 @@ static const char *MSG_HASHBLOCK = "hashblock";
 static const char *MSG_HASHTX    = "hashtx";
 static const char *MSG_RAWBLOCK  = "rawblock";
 static const char *MSG_RAWTX     = "rawtx";
+static const char *MSG_RAWBLOCKTEMPLATE = "rawblocktemplate";
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -207,3 +208,11 @@ bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &tr
     ss << transaction;
     return SendMessage(MSG_RAWTX, &(*ss.begin()), ss.size());
 }
+
+bool CZMQPublishRawBlockTemplateNotifier::NotifyBlockTemplate(const CBlock &block)
+{
+    LogPrint(BCLog::ZMQ, "zmq: Publish rawblocktemplate on %s\n", block.hashPrevBlock.GetHex());
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
+    ss << block;
+    return SendMessage(MSG_RAWBLOCKTEMPLATE, &(*ss.begin()), ss.size());
+}
@@ -7,10 +7,15 @@
 - Start a single node and generate 3 blocks.
 - Stop the node and restart it with -reindex. Verify that the node has reindexed up to block 3.
 - Stop the node and restart it with -reindex-chainstate. Verify that the node has reindexed up to block 3.
+- Reverse the order of the blocks in the first block file and verify that -reindex still connects all of them.
 """
 
+import os
+import struct
+
+from test_framework.mininode import MAGIC_BYTES
 from test_framework.test_framework import BitcoinTestFramework
-from test_framework.util import wait_until
+from test_framework.util import assert_equal, wait_until
 
 class ReindexTest(BitcoinTestFramework):
 
@@ -27,11 +32,42 @@ class ReindexTest(BitcoinTestFramework):
         wait_until(lambda: self.nodes[0].getblockcount() == blockcount)
         self.log.info("Success")
 
+    def out_of_order(self):
+        blockcount = self.nodes[0].getblockcount()
+        self.stop_nodes()
+
+        # Blocks are always stored in order here, so write them back in reverse
+        # order, keeping the genesis block first.
+        blk0 = os.path.join(self.nodes[0].datadir, self.chain, 'blocks', 'blk00000.dat')
+        with open(blk0, 'r+b') as f:
+            data = f.read()
+            records = []
+            pos = data.find(MAGIC_BYTES[self.chain])
+            while pos != -1:
+                size = struct.unpack('<I', data[pos + 4:pos + 8])[0]
+                records.append(data[pos:pos + 8 + size])
+                end = pos + 8 + size
+                pos = data.find(MAGIC_BYTES[self.chain], end)
+            assert_equal(len(records), blockcount + 1)
+            # Records may be separated by gaps; zero the rest of the span.
+            reordered = b''.join(records[:1] + records[:0:-1])
+            f.seek(0)
+            f.write(reordered + bytes(end - len(reordered)))
+
+        with self.nodes[0].assert_debug_log([
+            'LoadExternalBlockFile: Out of order block',
+            'LoadExternalBlockFile: Processing out of order child',
+        ]):
+            self.start_nodes([["-reindex", "-debug=reindex"]])
+            wait_until(lambda: self.nodes[0].getblockcount() == blockcount)
+        self.log.info("Success")
+
     def run_test(self):
         self.reindex(False)
         self.reindex(True)
         self.reindex(False)
         self.reindex(True)
+        self.out_of_order()
 
 if __name__ == '__main__':
     ReindexTest().main()
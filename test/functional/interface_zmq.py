@@ -7,7 +7,7 @@ import struct
 
 from test_framework.address import ADDRESS_BCRT1_UNSPENDABLE
 from test_framework.test_framework import BitcoinTestFramework
-from test_framework.messages import CTransaction, hash256
+from test_framework.messages import CBlock, CTransaction, hash256
 from test_framework.util import assert_equal, connect_nodes
 from io import BytesIO
 from time import sleep
@@ -48,6 +48,7 @@ class ZMQTest (BitcoinTestFramework):
         try:
             self.test_basic()
             self.test_reorg()
+            self.test_block_template()
         finally:
             # Destroy the ZMQ context.
             self.log.debug("Destroying ZMQ context")
@@ -156,5 +157,31 @@ class ZMQTest (BitcoinTestFramework):
         # Should receive nodes[1] tip
         assert_equal(self.nodes[1].getbestblockhash(), hashblock.receive().hex())
 
+    def test_block_template(self):
+        import zmq
+        address = 'tcp://127.0.0.1:28334'
+        socket = self.ctx.socket(zmq.SUB)
+        socket.set(zmq.RCVTIMEO, 60000)
+        rawblocktemplate = ZMQSubscriber(socket, b'rawblocktemplate')
+
+        self.restart_node(0, ['-zmqpub%s=%s' % (rawblocktemplate.topic.decode(), address)])
+        socket.connect(address)
+        # Relax so that the subscriber is ready before publishing zmq messages
+        sleep(0.2)
+
+        self.log.info("Templates are built ahead on a new tip once one was requested")
+        self.nodes[0].getblocktemplate({'rules': ['segwit']})
+        tip = self.nodes[0].generatetoaddress(1, ADDRESS_BCRT1_UNSPENDABLE)[0]
+
+        # Should receive the template for the block on top of the new tip.
+        template = CBlock()
+        template.deserialize(BytesIO(rawblocktemplate.receive()))
+        assert_equal(template.hashPrevBlock, int(tip, 16))
+        assert_equal(self.nodes[0].getblocktemplate({'rules': ['segwit']})['previousblockhash'], tip)
+
+        assert_equal(self.nodes[0].getzmqnotifications(), [
+            {"type": "pubrawblocktemplate", "address": address, "hwm": 1000},
+        ])
+
 if __name__ == '__main__':
     ZMQTest().main()
@@ -5,6 +5,7 @@
 """Test mining RPCs
 
 - getmininginfo
+- getheavyhashcacheinfo
 - getblocktemplate proposal mode
 - submitblock"""
 
@@ -77,6 +78,12 @@ class MiningTest(BitcoinTestFramework):
         assert_equal(mining_info['networkhashps'], Decimal('0.003333333333333334'))
         assert_equal(mining_info['pooledtx'], 0)
 
+        self.log.info('getheavyhashcacheinfo')
+        cache_info = node.getheavyhashcacheinfo()
+        assert 0 < cache_info['entries'] <= cache_info['capacity']
+        assert cache_info['hits'] > 0
+        assert cache_info['misses'] > 0
+
         # Mine a block to leave initial block download
         node.generatetoaddress(1, node.get_deterministic_priv_key().address)
         tmpl = node.getblocktemplate({'rules': ['segwit']})
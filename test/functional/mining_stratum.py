@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+# Copyright (c) 2020-2021 The PoWx Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Test the stratum work server.
+
+Connect as a miner, check the jobs against the template and mine a block
+with mempool transactions through mining.submit.
+"""
+
+from decimal import Decimal
+import json
+import socket
+
+from test_framework.address import (
+    ADDRESS_BCRT1_P2WSH_OP_TRUE,
+    ADDRESS_BCRT1_UNSPENDABLE,
+)
+from test_framework.messages import (
+    CTransaction,
+    CTxInWitness,
+    FromHex,
+    hash256,
+)
+from test_framework.script import (
+    CScript,
+    OP_TRUE,
+)
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import (
+    assert_equal,
+    p2p_port,
+)
+
+
+class StratumClient:
+    def __init__(self, port):
+        self.sock = socket.create_connection(('127.0.0.1', port), timeout=60)
+        self.buf = b''
+        self.next_id = 0
+        self.notifications = []
+
+    def recv(self):
+        while b'\n' not in self.buf:
+            data = self.sock.recv(4096)
+            assert data, "stratum server closed the connection"
+            self.buf += data
+        line, self.buf = self.buf.split(b'\n', 1)
+        return json.loads(line.decode())
+
+    def call(self, method, params):
+        self.next_id += 1
+        self.sock.sendall((json.dumps({'id': self.next_id, 'method': method, 'params': params}) + '\n').encode())
+        while True:
+            message = self.recv()
+            if message['id'] == self.next_id:
+                return message
+            self.notifications.append(message)
+
+    def wait_for_notify(self):
+        while not self.notifications:
+            self.notifications.append(self.recv())
+        message = self.notifications.pop(0)
+        assert_equal(message['method'], 'mining.notify')
+        return message['params']
+
+
+class MiningStratumTest(BitcoinTestFramework):
+    def set_test_params(self):
+        self.num_nodes = 1
+        self.setup_clean_chain = True
+
+    def setup_network(self):
+        self.stratum_port = p2p_port(1)
+        self.extra_args = [['-stratum', '-stratumport={}'.format(self.stratum_port), '-stratumpayout={}'.format(ADDRESS_BCRT1_UNSPENDABLE)]]
+        self.setup_nodes()
+
+    def run_test(self):
+        node = self.nodes[0]
+
+        self.log.info("Leave initial block download so jobs are served")
+        blocks = node.generatetoaddress(101, ADDRESS_BCRT1_P2WSH_OP_TRUE)
+
+        client = StratumClient(self.stratum_port)
+        response = client.call('mining.subscribe', ['test'])
+        assert_equal(response['error'], None)
+        extranonce1 = response['result'][1]
+        assert_equal(len(extranonce1), 8)
+        assert_equal(response['result'][2], 4)
+        assert_equal(client.call('mining.authorize', ['test', ''])['result'], True)
+
+        # Skip jobs for earlier tips announced while the tip notifications drain.
+        while True:
+            job_id, prevhash, coinb1, coinb2, branch, version, nbits, ntime, clean, seed = client.wait_for_notify()
+            assert clean
+            if bytes.fromhex(prevhash)[::-1].hex() == blocks[-1]:
+                break
+        assert_equal(branch, [])
+
+        self.log.info("Pick up new transactions in a refreshed job")
+        txids = []
+        for blockhash in blocks[:2]:
+            coinbase_txid = node.getblock(blockhash)['tx'][0]
+            value = node.gettxout(coinbase_txid, 0)['value'] - Decimal('0.001')
+            tx = FromHex(CTransaction(), node.createrawtransaction(
+                inputs=[{'txid': coinbase_txid, 'vout': 0}],
+                outputs=[{ADDRESS_BCRT1_P2WSH_OP_TRUE: value}],
+            ))
+            tx.wit.vtxinwit = [CTxInWitness()]
+            tx.wit.vtxinwit[0].scriptWitness.stack = [CScript([OP_TRUE])]
+            txids.append(node.sendrawtransaction(tx.serialize().hex()))
+
+        job_id, prevhash, coinb1, coinb2, branch, version, nbits, ntime, clean, seed = client.wait_for_notify()
+        assert not clean
+        assert_equal(len(branch), 2)
+        assert_equal(bytes.fromhex(prevhash)[::-1].hex(), blocks[-1])
+        assert_equal(nbits, node.getblockheader(blocks[-1])['bits'])
+        assert_equal(len(seed), 64)
+
+        self.log.info("Reject unknown jobs and malformed shares")
+        response = client.call('mining.submit', ['test', 'ffff', '00000000', ntime, '00000000'])
+        assert_equal(response['error'][0], 21)
+        response = client.call('mining.submit', ['test', job_id, '00', ntime, '00000000'])
+        assert_equal(response['error'][0], 20)
+
+        self.log.info("Mine a block through mining.submit")
+        tip = node.getbestblockhash()
+        extranonce2 = '00000001'
+        for nonce in range(1000):
+            response = client.call('mining.submit', ['test', job_id, extranonce2, ntime, '{:08x}'.format(nonce)])
+            if response['result']:
+                break
+            assert_equal(response['error'][1], 'high-hash')
+        assert_equal(response['result'], True)
+        assert_equal(response['error'], None)
+
+        block = node.getblock(node.getbestblockhash())
+        assert_equal(block['previousblockhash'], tip)
+        assert_equal(block['height'], 102)
+        assert_equal(sorted(block['tx'][1:]), sorted(txids))
+        coinbase = node.getrawtransaction(block['tx'][0], True, block['hash'])
+        assert_equal(coinbase['vout'][0]['scriptPubKey']['addresses'], [ADDRESS_BCRT1_UNSPENDABLE])
+
+        # The coinbase and merkle branch of the job hash to the block's merkle root.
+        root = hash256(bytes.fromhex(coinb1 + extranonce1 + extranonce2 + coinb2))
+        assert_equal(root[::-1].hex(), block['tx'][0])
+        for h in branch:
+            root = hash256(root + bytes.fromhex(h))
+        assert_equal(root[::-1].hex(), block['merkleroot'])
+
+        self.log.info("A new tip cleans the previous jobs")
+        params = client.wait_for_notify()
+        assert params[8]
+        assert_equal(bytes.fromhex(params[1])[::-1].hex(), block['hash'])
+        response = client.call('mining.submit', ['test', job_id, extranonce2, ntime, '00000000'])
+        assert_equal(response['error'][0], 21)
+
+
+if __name__ == '__main__':
+    MiningStratumTest().main()
@@ -89,6 +89,7 @@ BASE_SCRIPTS = [
     'wallet_labels.py',
     'p2p_segwit.py',
     'p2p_timeouts.py',
+    'mining_stratum.py',
     'p2p_tx_download.py',
     'wallet_dump.py',
     'wallet_listtransactions.py',